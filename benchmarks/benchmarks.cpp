@@ -0,0 +1,573 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <imagealign/imagealign.h>
+#include <imagealign/warp_image.h>
+#include <opencv2/video/video.hpp>
+#include <iostream>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+
+/**
+    Performance suite of aligners, samplers and warps.
+ 
+    Each case is run repeatedly until a minimum time has passed. Results are printed 
+    as a table and optionally written as JSON, laid out like the output of Google 
+    Benchmark, so existing tooling can compare runs.
+ 
+    Usage: benchmarks [--filter <substring>] [--min-time <seconds>] [--out <file.json>]
+ */
+
+namespace ia = imagealign;
+
+namespace {
+    
+    /** A single benchmark case. */
+    class Benchmark {
+    public:
+        explicit Benchmark(const std::string &name)
+            : _name(name)
+        {}
+        
+        virtual ~Benchmark() {}
+        
+        const std::string &name() const {
+            return _name;
+        }
+        
+        /** Untimed preparation. */
+        virtual void setUp() {}
+        
+        /** Timed body. */
+        virtual void run() = 0;
+        
+        /** Items processed per run, such as pixels or samples. Zero when not meaningful. */
+        virtual double items() const {
+            return 0;
+        }
+        
+    private:
+        std::string _name;
+    };
+    
+    struct Result {
+        std::string name;
+        long iterations;
+        double secondsPerIteration;
+        double cpuSecondsPerIteration;
+        double itemsPerSecond;
+    };
+    
+    /** Keeps results alive so the optimizer cannot drop benchmarked work. */
+    volatile double g_sink = 0;
+    
+    cv::Mat randomImage(cv::Size s) {
+        cv::Mat img(s, CV_8UC1);
+        cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+        cv::blur(img, img, cv::Size(5, 5));
+        return img;
+    }
+    
+    const cv::Size TARGET_SIZE(640, 480);
+    
+    template<int SampleMethod>
+    class SamplerBenchmark : public Benchmark {
+    public:
+        SamplerBenchmark(const std::string &name)
+            : Benchmark(name)
+        {}
+        
+        void setUp() {
+            randomImage(TARGET_SIZE).convertTo(_img, CV_32F);
+            
+            const int n = 1 << 16;
+            _xs.resize(n);
+            _ys.resize(n);
+            _dst.resize(n);
+            
+            cv::RNG rng(42);
+            for (int i = 0; i < n; ++i) {
+                _xs[i] = rng.uniform(0.f, float(_img.cols - 1));
+                _ys[i] = rng.uniform(0.f, float(_img.rows - 1));
+            }
+            
+            // Rows of samples along a scanline, as visited by aligners
+            for (int i = 0; i < n / 2; ++i) {
+                _xs[i] = 1.f + float(i % (_img.cols - 2)) + 0.3f;
+                _ys[i] = 1.f + float((i / (_img.cols - 2)) % (_img.rows - 2)) + 0.6f;
+            }
+        }
+        
+        void run() {
+            _sampler.template sample<float>(_img, &_xs[0], &_ys[0], (int)_xs.size(), &_dst[0]);
+            g_sink = g_sink + _dst[_dst.size() / 2];
+        }
+        
+        double items() const {
+            return double(_xs.size());
+        }
+        
+    private:
+        cv::Mat _img;
+        std::vector<float> _xs, _ys, _dst;
+        ia::Sampler<SampleMethod> _sampler;
+    };
+    
+    class WarpImageBenchmark : public Benchmark {
+    public:
+        WarpImageBenchmark(const std::string &name)
+            : Benchmark(name)
+        {}
+        
+        void setUp() {
+            _img = randomImage(TARGET_SIZE);
+            _w.setParametersInCanonicalRepresentation(ia::WarpSimilarityF::Traits::ParamType(200.f, 100.f, 0.1f, 1.1f));
+        }
+        
+        void run() {
+            ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(_img, _dst, cv::Size(320, 240), _w);
+            g_sink = g_sink + _dst.at<uchar>(120, 160);
+        }
+        
+        double items() const {
+            return 320. * 240.;
+        }
+        
+    private:
+        cv::Mat _img, _dst;
+        ia::WarpSimilarityF _w;
+    };
+    
+    class PyramidBenchmark : public Benchmark {
+    public:
+        PyramidBenchmark(const std::string &name, int levels)
+            : Benchmark(name), _levels(levels)
+        {}
+        
+        void setUp() {
+            _img = randomImage(TARGET_SIZE);
+        }
+        
+        void run() {
+            _pyr.create(_img, _levels);
+            g_sink = g_sink + _pyr[_levels - 1].at<float>(0, 0);
+        }
+        
+        double items() const {
+            return double(_img.total());
+        }
+        
+    private:
+        cv::Mat _img;
+        ia::ImagePyramid _pyr;
+        int _levels;
+    };
+    
+    /** Template cut from target at a known offset, with a perturbed initial warp. */
+    template<class W>
+    struct AlignProblem {
+        cv::Mat target;
+        ia::ImagePyramid targetPyramid;
+        cv::Mat tmpl;
+        W initial;
+        
+        void create(int templateSize, int levels) {
+            target = randomImage(TARGET_SIZE);
+            targetPyramid.create(target, levels);
+            
+            typedef typename W::Traits::ParamType ParamType;
+            typedef typename W::Traits::ScalarType ScalarType;
+            
+            W truth;
+            truth.setIdentity();
+            ParamType p = truth.parameters();
+            p(0, 0) = ScalarType(200);
+            p(1, 0) = ScalarType(150);
+            truth.setParameters(p);
+            
+            ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(templateSize, templateSize), truth);
+            
+            p(0, 0) += ScalarType(1.5);
+            p(1, 0) -= ScalarType(1.5);
+            initial.setParameters(p);
+        }
+    };
+    
+    template<class A>
+    class PrepareBenchmark : public Benchmark {
+    public:
+        PrepareBenchmark(const std::string &name, int templateSize, int levels)
+            : Benchmark(name), _templateSize(templateSize), _levels(levels)
+        {}
+        
+        void setUp() {
+            _problem.create(_templateSize, _levels);
+        }
+        
+        void run() {
+            typename A::WarpType w = _problem.initial;
+            
+            // Coarser levels are prepared lazily, so a single iteration per level forces them
+            _aligner.prepare(_problem.tmpl, _problem.targetPyramid, w, _levels);
+            _aligner.align(w, _levels, 0);
+            g_sink = g_sink + double(_aligner.lastError());
+        }
+        
+        double items() const {
+            return double(_templateSize * _templateSize);
+        }
+        
+    private:
+        AlignProblem<typename A::WarpType> _problem;
+        A _aligner;
+        int _templateSize, _levels;
+    };
+    
+    template<class A>
+    class AlignBenchmark : public Benchmark {
+    public:
+        AlignBenchmark(const std::string &name, int templateSize, int levels)
+            : Benchmark(name), _templateSize(templateSize), _levels(levels)
+        {}
+        
+        void setUp() {
+            _problem.create(_templateSize, _levels);
+            
+            typename A::WarpType w = _problem.initial;
+            _aligner.prepare(_problem.tmpl, _problem.targetPyramid, w, _levels);
+            _aligner.align(w, 30, 0);
+        }
+        
+        void run() {
+            typename A::WarpType w = _problem.initial;
+            _aligner.align(w, 30, 0);
+            g_sink = g_sink + double(_aligner.lastError());
+        }
+        
+        double items() const {
+            return double(_templateSize * _templateSize);
+        }
+        
+    private:
+        AlignProblem<typename A::WarpType> _problem;
+        A _aligner;
+        int _templateSize, _levels;
+    };
+    
+    /** Many 31x31 feature windows of a frame moved by a small translation. */
+    struct TrackingProblem {
+        cv::Mat prev, next;
+        ia::ImagePyramid nextPyramid;
+        std::vector<cv::Point2f> points;
+        std::vector<cv::Rect> rois;
+        
+        void create(int levels) {
+            prev = randomImage(TARGET_SIZE);
+            
+            ia::WarpTranslationF motion;
+            motion.setParameters(ia::WarpTranslationF::Traits::ParamType(1.3f, -0.8f));
+            ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(prev, next, prev.size(), motion);
+            nextPyramid.create(next, levels);
+            
+            for (int y = 40; y < prev.rows - 40; y += 25) {
+                for (int x = 40; x < prev.cols - 40; x += 25) {
+                    points.push_back(cv::Point2f(float(x), float(y)));
+                    rois.push_back(cv::Rect(x - 15, y - 15, 31, 31));
+                }
+            }
+        }
+    };
+    
+    template<class A>
+    class TrackerBenchmark : public Benchmark {
+    public:
+        TrackerBenchmark(const std::string &name, int levels)
+            : Benchmark(name), _levels(levels)
+        {}
+        
+        void setUp() {
+            _problem.create(_levels);
+            _tracker.setExecutor(_serial);
+        }
+        
+        void run() {
+            std::vector<typename A::WarpType> warps(_problem.rois.size());
+            for (size_t i = 0; i < warps.size(); ++i) {
+                warps[i].setParameters(typename A::WarpType::Traits::ParamType(float(_problem.rois[i].x), float(_problem.rois[i].y)));
+            }
+            
+            _tracker.track(_problem.prev, _problem.rois, _problem.nextPyramid, warps, _levels, 20, 0.03f);
+            g_sink = g_sink + double(_tracker.error(0));
+        }
+        
+        double items() const {
+            return double(_problem.rois.size());
+        }
+        
+    private:
+        TrackingProblem _problem;
+        ia::MultiTemplateTracker<A> _tracker;
+        ia::SerialExecutor _serial;
+        int _levels;
+    };
+    
+    /** Reference of sparse feature tracking through OpenCV. */
+    class PyrLKBenchmark : public Benchmark {
+    public:
+        PyrLKBenchmark(const std::string &name, int levels)
+            : Benchmark(name), _levels(levels)
+        {}
+        
+        void setUp() {
+            _problem.create(_levels);
+        }
+        
+        void run() {
+            std::vector<cv::Point2f> next;
+            std::vector<uchar> status;
+            std::vector<float> err;
+            
+            cv::TermCriteria criteria(cv::TermCriteria::COUNT | cv::TermCriteria::EPS, 20, 0.03);
+            cv::calcOpticalFlowPyrLK(_problem.prev, _problem.next, _problem.points, next, status, err, cv::Size(31, 31), _levels - 1, criteria);
+            g_sink = g_sink + double(next[0].x);
+        }
+        
+        double items() const {
+            return double(_problem.points.size());
+        }
+        
+    private:
+        TrackingProblem _problem;
+        int _levels;
+    };
+    
+    class DenseFlowBenchmark : public Benchmark {
+    public:
+        DenseFlowBenchmark(const std::string &name, int step, int levels)
+            : Benchmark(name), _step(step), _levels(levels)
+        {}
+        
+        void setUp() {
+            _problem.create(_levels);
+            _flow.setExecutor(_serial);
+        }
+        
+        void run() {
+            _flow.prepare(_problem.prev, _step, 7, _levels);
+            
+            cv::Mat f;
+            _flow.align(_problem.nextPyramid, f, 20, 0.03f);
+            g_sink = g_sink + double(f.at<cv::Point2f>(0, 0).x);
+        }
+        
+        double items() const {
+            return double((_problem.prev.cols / _step) * (_problem.prev.rows / _step));
+        }
+        
+    private:
+        TrackingProblem _problem;
+        ia::DenseFlow _flow;
+        ia::SerialExecutor _serial;
+        int _step, _levels;
+    };
+    
+    std::string caseName(const char *kind, const char *aligner, const char *warp, int templateSize, int levels) {
+        std::ostringstream str;
+        str << kind << "/" << aligner << "/" << warp << "/" << templateSize << "px/" << levels << "lv";
+        return str.str();
+    }
+    
+    template<class W>
+    void addAlignerCases(std::vector<Benchmark*> &cases, const char *warpName) {
+        const int templateSizes[] = {32, 64, 128};
+        const int levels[] = {1, 3};
+        
+        for (int s = 0; s < 3; ++s) {
+            for (int l = 0; l < 2; ++l) {
+                const int ts = templateSizes[s];
+                const int lv = levels[l];
+                
+                cases.push_back(new PrepareBenchmark< ia::AlignForwardAdditive<W> >(caseName("prepare", "FA", warpName, ts, lv), ts, lv));
+                cases.push_back(new PrepareBenchmark< ia::AlignForwardCompositional<W> >(caseName("prepare", "FC", warpName, ts, lv), ts, lv));
+                cases.push_back(new PrepareBenchmark< ia::AlignInverseCompositional<W> >(caseName("prepare", "IC", warpName, ts, lv), ts, lv));
+                
+                cases.push_back(new AlignBenchmark< ia::AlignForwardAdditive<W> >(caseName("align", "FA", warpName, ts, lv), ts, lv));
+                cases.push_back(new AlignBenchmark< ia::AlignForwardCompositional<W> >(caseName("align", "FC", warpName, ts, lv), ts, lv));
+                cases.push_back(new AlignBenchmark< ia::AlignInverseCompositional<W> >(caseName("align", "IC", warpName, ts, lv), ts, lv));
+                
+                if (ts == 32) {
+                    cases.push_back(new PrepareBenchmark< ia::AlignInverseCompositionalPatch<W, 32> >(caseName("prepare", "ICPatch", warpName, ts, lv), ts, lv));
+                    cases.push_back(new AlignBenchmark< ia::AlignInverseCompositionalPatch<W, 32> >(caseName("align", "ICPatch", warpName, ts, lv), ts, lv));
+                }
+            }
+        }
+    }
+    
+    Result measure(Benchmark &b, double minTime) {
+        b.setUp();
+        b.run(); // Warm up
+        
+        Result r;
+        r.name = b.name();
+        r.iterations = 0;
+        
+        const double freq = cv::getTickFrequency();
+        const int64 start = cv::getTickCount();
+        const std::clock_t cpuStart = std::clock();
+        double elapsed = 0;
+        
+        long batch = 1;
+        while (elapsed < minTime) {
+            for (long i = 0; i < batch; ++i) {
+                b.run();
+            }
+            r.iterations += batch;
+            elapsed = double(cv::getTickCount() - start) / freq;
+            batch *= 2;
+        }
+        
+        r.secondsPerIteration = elapsed / double(r.iterations);
+        r.cpuSecondsPerIteration = double(std::clock() - cpuStart) / double(CLOCKS_PER_SEC) / double(r.iterations);
+        r.itemsPerSecond = b.items() > 0 ? b.items() / r.secondsPerIteration : 0;
+        
+        return r;
+    }
+    
+    std::string jsonEscape(const std::string &s) {
+        std::string e;
+        for (size_t i = 0; i < s.size(); ++i) {
+            if (s[i] == '"' || s[i] == '\\')
+                e += '\\';
+            e += s[i];
+        }
+        return e;
+    }
+    
+    void writeJson(std::ostream &os, const std::vector<Result> &results, double minTime) {
+        os << "{\n"
+           << "  \"context\": {\n"
+           << "    \"executable\": \"benchmarks\",\n"
+           << "    \"min_time\": " << minTime << ",\n"
+#if defined(IA_SIMD_AVX2)
+           << "    \"simd\": \"avx2\",\n"
+#elif defined(IA_SIMD_SSE2)
+           << "    \"simd\": \"sse2\",\n"
+#elif defined(IA_SIMD_NEON)
+           << "    \"simd\": \"neon\",\n"
+#else
+           << "    \"simd\": \"none\",\n"
+#endif
+#if defined(_OPENMP)
+           << "    \"openmp\": true\n"
+#else
+           << "    \"openmp\": false\n"
+#endif
+           << "  },\n"
+           << "  \"benchmarks\": [\n";
+        
+        for (size_t i = 0; i < results.size(); ++i) {
+            const Result &r = results[i];
+            os << "    {\n"
+               << "      \"name\": \"" << jsonEscape(r.name) << "\",\n"
+               << "      \"run_type\": \"iteration\",\n"
+               << "      \"iterations\": " << r.iterations << ",\n"
+               << "      \"real_time\": " << r.secondsPerIteration * 1e6 << ",\n"
+               << "      \"cpu_time\": " << r.cpuSecondsPerIteration * 1e6 << ",\n"
+               << "      \"time_unit\": \"us\"";
+            
+            if (r.itemsPerSecond > 0)
+                os << ",\n      \"items_per_second\": " << r.itemsPerSecond;
+            
+            os << "\n    }" << (i + 1 < results.size() ? "," : "") << "\n";
+        }
+        
+        os << "  ]\n"
+           << "}\n";
+    }
+}
+
+int main(int argc, char **argv)
+{
+    std::string filter, out;
+    double minTime = 0.2;
+    
+    for (int i = 1; i < argc; ++i) {
+        if (!std::strcmp(argv[i], "--filter") && i + 1 < argc) {
+            filter = argv[++i];
+        } else if (!std::strcmp(argv[i], "--min-time") && i + 1 < argc) {
+            minTime = std::atof(argv[++i]);
+        } else if (!std::strcmp(argv[i], "--out") && i + 1 < argc) {
+            out = argv[++i];
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--filter <substring>] [--min-time <seconds>] [--out <file.json>]" << std::endl;
+            return 1;
+        }
+    }
+    
+    std::vector<Benchmark*> cases;
+    cases.push_back(new SamplerBenchmark<ia::SAMPLE_BILINEAR>("sampler/bilinear"));
+    cases.push_back(new SamplerBenchmark<ia::SAMPLE_NEAREST>("sampler/nearest"));
+    cases.push_back(new WarpImageBenchmark("warp_image/similarity/320x240"));
+    cases.push_back(new PyramidBenchmark("pyramid/create/640x480/1lv", 1));
+    cases.push_back(new PyramidBenchmark("pyramid/create/640x480/4lv", 4));
+    
+    addAlignerCases<ia::WarpTranslationF>(cases, "translation");
+    addAlignerCases<ia::WarpEuclideanF>(cases, "euclidean");
+    addAlignerCases<ia::WarpSimilarityF>(cases, "similarity");
+    addAlignerCases<ia::WarpAffineF>(cases, "affine");
+    addAlignerCases<ia::WarpPerspectiveF>(cases, "perspective");
+    
+    cases.push_back(new TrackerBenchmark< ia::AlignInverseCompositional<ia::WarpTranslationF> >("track/IC/translation/31px/2lv", 2));
+    cases.push_back(new TrackerBenchmark< ia::AlignInverseCompositionalPatch<ia::WarpTranslationF, 31> >("track/ICPatch/translation/31px/2lv", 2));
+    cases.push_back(new PyrLKBenchmark("track/pyrlk/31px/2lv", 2));
+    cases.push_back(new DenseFlowBenchmark("dense_flow/640x480/8px/3lv", 8, 3));
+    
+    std::vector<Result> results;
+    
+    for (size_t i = 0; i < cases.size(); ++i) {
+        if (filter.empty() || cases[i]->name().find(filter) != std::string::npos) {
+            cv::theRNG().state = 0x12345678;
+            
+            const Result r = measure(*cases[i], minTime);
+            results.push_back(r);
+            
+            std::cout << std::left << std::setw(44) << r.name << std::right
+                      << std::setw(14) << std::fixed << std::setprecision(2) << r.secondsPerIteration * 1e6 << " us"
+                      << std::setw(12) << r.iterations;
+            if (r.itemsPerSecond > 0)
+                std::cout << std::setw(12) << std::setprecision(2) << r.itemsPerSecond * 1e-6 << " M/s";
+            std::cout << std::endl;
+        }
+        
+        delete cases[i];
+    }
+    
+    if (!out.empty()) {
+        std::ofstream os(out.c_str());
+        writeJson(os, results, minTime);
+    }
+    
+    return 0;
+}
@@ -56,7 +56,17 @@ void drawRectOfTemplate(cv::Mat &img, const ia::Warp<WarpType, Scalar> &w, cv::S
     cv::line(img, toP(c3), toP(c0), color, 1, CV_AA);
 }
 
-void opticalFlowIA(cv::Mat &prevGray,
+// Will be using pure translational motion
+typedef ia::WarpTranslationF WarpType;
+
+// In conjunction with inverse compositional algorithm
+typedef ia::AlignInverseCompositional< WarpType > AlignType;
+
+// Tracks all features in one pass. Reused across frames.
+typedef ia::MultiTemplateTracker< AlignType > TrackerType;
+
+void opticalFlowIA(TrackerType &tracker,
+                   cv::Mat &prevGray,
                    cv::Mat &gray,
                    std::vector<cv::Point2f> &prevPoints,
                    std::vector<cv::Point2f> &points,
@@ -64,32 +74,20 @@ void opticalFlowIA(cv::Mat &prevGray,
                    std::vector<float> &err)
 {
     const int LEVELS = 3;
-
-    // Will be using pure translational motion
-    typedef ia::WarpTranslationF WarpType;
     
-    // In conjunction with inverse compositional algorithm
-    typedef ia::AlignInverseCompositional< WarpType > AlignType;
-    
-    // We will also make use of the face, that we can share gray among all aligners
+    // We will also make use of the face, that we can share gray among all trackers
     ia::ImagePyramid target;
     target.create(gray, LEVELS);
     
-    // Create an aligner for each point
-    std::vector<AlignType> aligners(prevPoints.size());
+    // The template will be a rectangular region around each point.
+    std::vector<cv::Rect> rois(prevPoints.size());
+    std::vector<cv::Point2f> offsets(prevPoints.size());
     
-    // Create a warp for each point. Note we use identity transform here.
+    // Create a warp for each point.
     std::vector<WarpType> warps(prevPoints.size());
     
-    // Prepare outputs
-    points.resize(prevPoints.size());
-    status.resize(prevPoints.size());
-    err.resize(prevPoints.size());
-    
-    #pragma omp parallel for
-    for (int i = 0; i < (int)aligners.size(); ++i) {
+    for (size_t i = 0; i < prevPoints.size(); ++i) {
         
-        // The template will be a rectangular region around the point
         const int windowOff = 15;
         const cv::Point2f p = prevPoints[i];
         
@@ -103,33 +101,31 @@ void opticalFlowIA(cv::Mat &prevGray,
         t = std::min<int>(gray.rows - 1, std::max<int>(0, t));
         r = std::min<int>(gray.cols - 1, std::max<int>(0, r));
         b = std::min<int>(gray.rows - 1, std::max<int>(0, b));
-        cv::Rect roi(l, t, r - l, b - t);
-
-        if (roi.area() < 10) {
-            status[i] = 0;
-            continue;
-        }
+        rois[i] = cv::Rect(l, t, r - l, b - t);
         
         // Move corner to top left
-        float offsetX = (float)l - p.x;
-        float offsetY = (float)t - p.y;
+        offsets[i] = cv::Point2f((float)l - p.x, (float)t - p.y);
         
         // Initialize warp
-        ia::WarpTranslationF::Traits::ParamType wp(p.x + offsetX, p.y + offsetY);
-        warps[i].setParameters(wp);
-
-        // Initialize aligner
-        aligners[i].prepare(prevGray(roi), target, warps[i], LEVELS);
-        aligners[i].align(warps[i], 20, 0.03f);
-
-        // Extract result
-        wp = warps[i].parameters();
-        points[i].x = wp(0) - offsetX;
-        points[i].y = wp(1) - offsetY;
-        err[i] = aligners[i].lastError();
-        status[i] = err[i] < 40*40;
+        warps[i].setParameters(WarpType::Traits::ParamType(p.x + offsets[i].x, p.y + offsets[i].y));
     }
     
+    // Align all templates
+    tracker.setMaxError(40*40);
+    tracker.track(prevGray, rois, target, warps, LEVELS, 20, 0.03f);
+    
+    // Prepare outputs
+    points.resize(prevPoints.size());
+    status.resize(prevPoints.size());
+    err.resize(prevPoints.size());
+    
+    for (size_t i = 0; i < prevPoints.size(); ++i) {
+        const WarpType::Traits::ParamType wp = warps[i].parameters();
+        points[i].x = wp(0) - offsets[i].x;
+        points[i].y = wp(1) - offsets[i].y;
+        err[i] = tracker.error((int)i);
+        status[i] = tracker.status((int)i) == ia::TRACK_OK;
+    }
 }
 
 void opticalFlowCV(cv::Mat &prevGray,
@@ -183,6 +179,16 @@ int main(int argc, char **argv)
     
     cv::Mat gray, prevGray, image, frame;
     std::vector<cv::Point2f> points[2];
+    TrackerType tracker;
+    
+    // Predict feature motion from the previous frame, skipping coarse levels when possible.
+    tracker.setPrediction(ia::Prediction(true));
+    
+#ifdef IA_HAS_CXX11
+    // Alignment costs differ a lot between features, balance them across cores.
+    ia::WorkStealingExecutor executor;
+    tracker.setExecutor(executor);
+#endif
     
     bool init = false;
     bool done = false;
@@ -204,6 +210,7 @@ int main(int argc, char **argv)
             // Shi-Thomasi corner features.
             cv::goodFeaturesToTrack(gray, points[1], MAX_FEATURES, 0.01, 10, cv::Mat(), 3, 0, 0.04);
             cv::cornerSubPix(gray, points[1], subPixWinSize, cv::Size(-1,-1), termcrit);
+            tracker.resetPrediction();
             
             init = false;
             
@@ -215,7 +222,7 @@ int main(int argc, char **argv)
             std::vector<float> err;
             
             // Perform optical flow
-            opticalFlowIA(prevGray, gray, points[0], points[1], status, err);
+            opticalFlowIA(tracker, prevGray, gray, points[0], points[1], status, err);
             //opticalFlowCV(prevGray, gray, points[0], points[1], status, err);
             drawOpticalFlow(image, points[0], points[1], status);
             
@@ -229,6 +236,9 @@ int main(int argc, char **argv)
             }
             points[1].resize(k);
             
+            // Keep motion of surviving features aligned with their new index.
+            tracker.keepTracks(status);
+            
         }
         
         cv::imshow("Optical Flow", image);
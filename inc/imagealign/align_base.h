@@ -23,21 +23,133 @@
 #include <imagealign/warp.h>
 #include <imagealign/config.h>
 #include <imagealign/image_pyramid.h>
+#include <imagealign/parallel.h>
+#include <imagealign/linalg.h>
+#include <imagealign/storage.h>
+#include <imagealign/align_stats.h>
+#include <imagealign/mask.h>
+#include <imagealign/pixel_selection.h>
+#include <imagealign/phase_correlation.h>
+#include <imagealign/serialization.h>
 
 #include <limits>
 
 
 namespace imagealign {
     
+    /**
+        Levenberg-Marquardt damping of alignment steps.
+     
+        Undamped Gauss-Newton steps may overshoot for large motions, which ends a level at the 
+        first increase of error. With damping, steps solve (H + lambda * diag(H)) delta = b and 
+        are only accepted when they decrease the error. Rejected steps are retried with lambda 
+        increased, accepted steps decrease lambda back towards its initial value. Scaling the 
+        diagonal of H keeps lambda independent of the units of parameters and intensities.
+     */
+    struct Damping {
+        /** Initial value of lambda at each level. Zero disables damping. */
+        float lambda;
+        
+        /** Factor lambda is multiplied with after a rejected step. */
+        float increase;
+        
+        /** Factor lambda is divided by after an accepted step. */
+        float decrease;
+        
+        /** Number of consecutive rejected steps after which a level ends. */
+        int maxRejections;
+        
+        Damping(float lambda_ = 0.f, float increase_ = 10.f, float decrease_ = 10.f, int maxRejections_ = 2)
+            : lambda(lambda_), increase(increase_), decrease(decrease_), maxRejections(maxRejections_)
+        {}
+        
+        /** True when steps are damped at all. */
+        bool enabled() const {
+            return lambda > 0.f;
+        }
+    };
+    
     template<class W>
     struct SingleStepResult {
         typename W::Traits::ParamType delta;
         typename W::Traits::ScalarType sumErrors;
         int numConstraints;
         
+        /** 
+            Conditioning estimate of the system solved in [0, 1], see detail::factorizeLDLT. 
+            Steps of systems too poorly conditioned are rejected.
+         */
+        typename W::Traits::ScalarType conditioning;
+        
+        /**
+            Upper triangle of the Hessian and right hand side delta was solved from. 
+         
+            Only filled when damping is enabled, see AlignBase::exportSystem.
+         */
+        typename W::Traits::HessianType hessian;
+        typename W::Traits::ParamType b;
+        
         SingleStepResult()
-         : numConstraints(0)
+         : numConstraints(0), conditioning(1)
+        {}
+    };
+    
+    /**
+        Partial sums of the normal equations accumulated over a set of template pixels.
+     
+        Accumulators are retained by the aligner and reset between iterations, so their
+        storage as well as the scratch memory handed out is only allocated once.
+     */
+    template<class W>
+    struct StepAccumulator {
+        typename W::Traits::HessianType hessian;
+        typename W::Traits::ParamType b;
+        typename W::Traits::ScalarType sumErrors;
+        int numConstraints;
+    
+        explicit StepAccumulator(int numParameters)
+         : hessian(W::Traits::zeroHessian(numParameters)),
+           b(W::Traits::zeroParam(numParameters)),
+           sumErrors(0),
+           numConstraints(0)
         {}
+        
+        /** Zero partial sums in place. */
+        void reset() {
+            detail::setZero(hessian);
+            detail::setZero(b);
+            sumErrors = 0;
+            numConstraints = 0;
+        }
+        
+        /** Add partial sums of other accumulator. */
+        void merge(const StepAccumulator &other) {
+            hessian += other.hessian;
+            b += other.b;
+            sumErrors += other.sumErrors;
+            numConstraints += other.numConstraints;
+        }
+        
+        /**
+            Access scratch memory for at least count elements of type T.
+         
+            Each slot is an independent buffer that only grows. Scratch memory is private 
+            to the accumulator and not affected by reset or merge.
+         */
+        template<class T>
+        T *scratch(int slot, int count) {
+            if ((int)_scratch.size() <= slot)
+                _scratch.resize(slot + 1);
+            
+            const int bytes = std::max<int>(1, count) * (int)sizeof(T);
+            if ((int)_scratch[slot].total() < bytes)
+                _scratch[slot].create(1, bytes, CV_8UC1);
+            
+            return reinterpret_cast<T*>(_scratch[slot].data);
+        }
+        
+    private:
+        std::vector<cv::Mat> _scratch;
     };
    
     /**
@@ -67,38 +179,276 @@ namespace imagealign {
     public:
         
         typedef AlignBase<D, W> SelfType;
+        typedef W WarpType;
         typedef typename W::Traits::ScalarType ScalarType;
         
-        /** 
-            Prepare for alignment.
+        AlignBase()
+            : _ownsTemplatePyramid(false), _ownsTargetPyramid(false), _templateLevels(0), _levels(0), _level(0), _error(std::numeric_limits<ScalarType>::max()), _conditioning(0), _executor(&defaultExecutor()), _startLevel(-1), _stats(0)
+        {}
+        
+        /**
+            Set the executor used to parallelize per-pixel computations.
          
-            This function takes the template and target image and performs
-            necessary pre-calculations to speed up the alignment process.
+            Template rows are split into fixed tiles whose partial sums are merged in order,
+            so results do not depend on the executor chosen. The executor must outlive
+            this object. Defaults to defaultExecutor().
+         */
+        SelfType &setExecutor(const Executor &e) {
+            _executor = &e;
+            return *this;
+        }
+        
+        /**
+            Access the executor in use.
+         */
+        const Executor &executor() const {
+            return *_executor;
+        }
+        
+        /**
+            Set storage precision of template data.
+         
+            Takes effect with the next call to prepare. Reduced precision shrinks the template 
+            pyramid and precomputed tables, while arithmetic remains in at least single precision.
+            Tables whose values exceed the half precision range are kept in single precision. 
+            Target pyramids are always single precision. Defaults to single precision throughout.
+         */
+        SelfType &setStoragePolicy(const StoragePolicy &p) {
+            CV_Assert(p.tables == STORAGE_FLOAT32 || p.tables == STORAGE_FLOAT16);
+            _storagePolicy = p;
+            return *this;
+        }
+        
+        /**
+            Access storage precision of template data.
+         */
+        const StoragePolicy &storagePolicy() const {
+            return _storagePolicy;
+        }
+        
+        /**
+            Set mask of template pixels taking part in alignment.
+         
+            Takes effect with the next call to prepare. Non-zero pixels are used, and the mask 
+            needs to be of template size. Masked pixels are removed from the iterated pixel set 
+            once per level, so they cost nothing during alignment. Pixels whose finite 
+            differences would read masked pixels are removed as well. Pass an empty mask to use 
+            all pixels, which is the default.
+         */
+        SelfType &setTemplateMask(cv::InputArray mask) {
+            CV_Assert(mask.empty() || mask.type() == CV_8UC1);
+            _templateMask = mask.empty() ? cv::Mat() : mask.getMat().clone();
+            return *this;
+        }
+        
+        /**
+            Set mask of valid target pixels.
+         
+            Non-zero pixels are valid. Template pixels warped onto invalid target pixels, or 
+            close enough to them that sampling reads invalid pixels, do not take part in the 
+            current iteration. The mask applies to all targets bound, which need to be of mask 
+            size. Its pyramid is built once here, so a fixed mask costs nothing per target. 
+            Pass an empty mask to treat all target pixels as valid, which is the default.
+         */
+        SelfType &setTargetMask(cv::InputArray mask) {
+            CV_Assert(mask.empty() || mask.type() == CV_8UC1);
+            CV_Assert(mask.empty() || _targetPyramid.numLevels() == 0 || _targetPyramid[0].size() == mask.size());
+            
+            std::vector<cv::Mat> levels;
+            if (!mask.empty())
+                detail::buildMaskLevels(mask, ImagePyramid::maxLevelsForImageSize(mask.size()), 2, levels);
+            
+            _targetMasks.swap(levels);
+            return *this;
+        }
+        
+        /**
+            Set damping of alignment steps, see Damping. Disabled by default.
+         */
+        SelfType &setDamping(const Damping &d) {
+            CV_Assert(!d.enabled() || (d.increase > 1.f && d.decrease >= 1.f && d.maxRejections >= 0));
+            _damping = d;
+            return *this;
+        }
+        
+        /**
+            Access damping of alignment steps.
+         */
+        const Damping &damping() const {
+            return _damping;
+        }
+        
+        /**
+            Set the coarsest pyramid level align starts at, or -1 to start at the coarsest level.
+         
+            Coarser levels are skipped and never materialized. Useful when a good initial warp, 
+            for example a prediction from previous frames, makes coarse levels unnecessary. 
+            Levels beyond numLevels() start at the coarsest level.
+         */
+        SelfType &setStartLevel(int level) {
+            CV_Assert(level >= -1);
+            _startLevel = level;
+            return *this;
+        }
+        
+        /**
+            Access the coarsest pyramid level align starts at, -1 for the coarsest level.
+         */
+        int startLevel() const {
+            return _startLevel;
+        }
+        
+        /**
+            Attach statistics to record into, or 0 to stop recording.
+         
+            Recording costs a few timer reads per iteration, and nothing when no statistics 
+            are attached. Defining IA_DISABLE_STATS compiles recording out entirely. The 
+            statistics must outlive this object or be detached.
+         */
+        SelfType &setStats(AlignStats *s) {
+            _stats = s;
+            return *this;
+        }
+        
+        /**
+            Access attached statistics.
+         */
+        AlignStats *stats() const {
+            return _stats;
+        }
+        
+        /**
+            Prepare template for alignment.
+         
+            This function takes the template image and performs necessary pre-calculations 
+            that depend on the template only. Bind a target through setTarget before aligning.
+         
+            Splitting template preparation from target binding comes in handy when a fixed 
+            template is aligned with many target images, such as consecutive video frames. 
+            The template is then prepared once, and only setTarget is invoked per frame.
          
-            \param tmpl Single channel template image
-            \param target Single channel target image to align template with.
+            Only the finest level is computed here. Coarser template levels and their per-level
+            data are materialized when align first visits them.
+         
+            \param tmpl Template image. Multi-channel templates with interleaved channels are
+                   supported by AlignInverseCompositional.
             \param w The warp.
             \param pyramidLevels Maximum number of pyramid levels to generate.
          */
-        void prepare(cv::InputArray tmpl, cv::InputArray target, const W &w, int pyramidLevels)
+        void prepare(cv::InputArray tmpl, const W &w, int pyramidLevels)
         {
             // Do the basic thing everyone needs
-            CV_Assert(tmpl.channels() == 1);
-            CV_Assert(target.channels() == 1);
+            CV_Assert(D::supportsChannels(tmpl.channels()));
+            CV_Assert(D::supportsTemplateSize(tmpl.size()));
+            
+            const int64 start = tick();
             
             // Sanitize levels
-            int maxLevels = std::min<int>(ImagePyramid::maxLevelsForImageSize(tmpl.size()),
-                                          ImagePyramid::maxLevelsForImageSize(target.size()));
+            int maxLevels = ImagePyramid::maxLevelsForImageSize(tmpl.size());
             
-            _levels = std::max<int>(1, std::min<int>(pyramidLevels, maxLevels));
+            _templateLevels = std::max<int>(1, std::min<int>(pyramidLevels, maxLevels));
+            _levels = _templateLevels;
             
-            _templatePyramid.create(tmpl, _levels);
-            _targetPyramid.create(target, _levels);            
+            // Reuse buffers of a previous template, but never write into deserialized state.
+            if (!_ownsTemplatePyramid)
+                _templatePyramid = ImagePyramid();
+            
+            _templatePyramid.setStorage(_storagePolicy.pyramid);
+            _templatePyramid.create(tmpl, 1, executor());
+            _ownsTemplatePyramid = true;
+            prepareTemplateMask(tmpl.size());
+            _targetPyramid = ImagePyramid();
+            _ownsTargetPyramid = false;
+            
+            _identity.assign(1, w);
+            _identity[0].setIdentity();
+            _levelPrepared.assign(_templateLevels, 0);
             
             setLevel(0);
+            _partials.clear();
             
             // Invoke prepare of derived
             static_cast<D*>(this)->prepareImpl(w);
+            
+            if (recording())
+                _stats->prepareSeconds = secondsSince(start);
+        }
+        
+        /**
+            Bind target image.
+         
+            Builds the target pyramid for the levels of the prepared template. The number of 
+            levels used during alignment is further limited by the size of the target. Levels 
+            coarser than the first one are materialized when align first visits them.
+         
+            \param target Target image to align template with, with the channels of the template.
+         */
+        void setTarget(cv::InputArray target)
+        {
+            CV_Assert(_templateLevels > 0);
+            CV_Assert(target.channels() == channels());
+            CV_Assert(targetMatchesMask(target.size()));
+            
+            _levels = std::max<int>(1, std::min<int>(_templateLevels, ImagePyramid::maxLevelsForImageSize(target.size())));
+            
+            // Reuse buffers of a previous target, but never write into a shared pyramid.
+            if (!_ownsTargetPyramid)
+                _targetPyramid = ImagePyramid();
+            
+            _targetPyramid.create(target, std::min<int>(_levels, 2), executor());
+            _ownsTargetPyramid = true;
+            
+            setLevel(0);
+            
+            static_cast<D*>(this)->setTargetImpl();
+        }
+        
+        /**
+            Bind pre-built target image pyramid.
+         
+            The target pyramid is shared, not copied. The number of levels used during alignment 
+            is the minimum of template and target levels.
+         
+            \param target Pre-built image pyramid of target image.
+         */
+        void setTarget(const ImagePyramid &target)
+        {
+            CV_Assert(_templateLevels > 0);
+            CV_Assert(target.numLevels() > 0);
+            CV_Assert(target[0].type() == CV_MAKETYPE(CV_32F, channels()));
+            CV_Assert(targetMatchesMask(target[0].size()));
+            
+            _levels = std::min<int>(_templateLevels, target.numLevels());
+            
+            if (target.numLevels() > _levels) {
+                _targetPyramid = target.slice(0, _levels);
+            } else {
+                _targetPyramid = target;
+            }
+            _ownsTargetPyramid = false;
+            
+            setLevel(0);
+            
+            static_cast<D*>(this)->setTargetImpl();
+        }
+        
+        /** 
+            Prepare for alignment.
+         
+            This function takes the template and target image and performs
+            necessary pre-calculations to speed up the alignment process.
+         
+            \param tmpl Template image.
+            \param target Target image to align template with, with the channels of the template.
+            \param w The warp.
+            \param pyramidLevels Maximum number of pyramid levels to generate.
+         */
+        void prepare(cv::InputArray tmpl, cv::InputArray target, const W &w, int pyramidLevels)
+        {
+            CV_Assert(target.channels() == tmpl.channels());
+            
+            prepare(tmpl, w, std::min<int>(pyramidLevels, ImagePyramid::maxLevelsForImageSize(target.size())));
+            setTarget(target);
         }
         
         /**
@@ -111,36 +461,201 @@ namespace imagealign {
             target image. Then, the target image pyramid can be built once, and shared among all
             alignment objects.
          
-            \param tmpl Single channel template image
+            \param tmpl Template image.
             \param target Pre-built image pyramid of target image.
             \param w The warp.
             \param pyramidLevels Maximum number of pyramid levels to generate.
          */
         void prepare(cv::InputArray tmpl, const ImagePyramid &target, const W &w, int pyramidLevels)
         {
-            // Do the basic thing everyone needs
             CV_Assert(target.numLevels() > 0);
-            CV_Assert(tmpl.channels() == 1);
-            CV_Assert(target[0].channels() == 1);
             
+            prepare(tmpl, w, std::min<int>(pyramidLevels, target.numLevels()));
+            setTarget(target);
+        }
+        
+        /**
+            Append prepared template state to a buffer.
+         
+            Records the template pyramid, template masks and the per-level data of the derived 
+            algorithm, so a template catalog prepared once can be loaded by deserialize without 
+            repeating preparation. All levels are materialized before writing. Records start and 
+            end at detail::STATE_ALIGNMENT boundaries relative to the start of dst, so several 
+            records may be written to one buffer back to back.
+         
+            The record uses native byte order and scalar types. It is only read back by the same 
+            algorithm and warp type, and is rejected when the format version changes.
+         
+            \param dst Buffer to append record to.
+         */
+        void serialize(std::vector<uchar> &dst)
+        {
+            CV_Assert(_templateLevels > 0);
             
-            // Sanitize levels
-            int maxLevels = std::min<int>(ImagePyramid::maxLevelsForImageSize(tmpl.size()),
-                                          target.numLevels());
-
-            _levels = std::max<int>(1, std::min<int>(pyramidLevels, maxLevels));
-            _templatePyramid.create(tmpl, _levels);
-
-            if (target.numLevels() > _levels) {
-                _targetPyramid = target.slice(0, _levels);
-            } else {
-                _targetPyramid = target;
+            for (int i = 0; i < _templateLevels; ++i)
+                materializeLevel(i);
+            
+            detail::StateWriter out(dst);
+            out.align();
+            
+            const size_t start = out.offset();
+            out.value<unsigned int>(detail::STATE_MAGIC);
+            out.value<int>(STATE_FORMAT_VERSION);
+            out.value<int>(D::stateTag());
+            out.value<int>(W::Traits::WarpMode);
+            out.value<int>(numParameters());
+            out.value<int>((int)sizeof(ScalarType));
+            
+            const size_t sizeOffset = out.offset();
+            out.value<unsigned long long>(0);
+            
+            out.value<int>(_templateLevels);
+            out.value<int>(_storagePolicy.pyramid);
+            out.value<int>(_storagePolicy.tables);
+            
+            for (int i = 0; i < _templateLevels; ++i)
+                out.mat(_templatePyramid[i]);
+            
+            out.value<int>(_templateMasks.empty() ? 0 : 1);
+            if (!_templateMasks.empty())
+                out.mat(_templateMask);
+            
+            for (size_t i = 0; i < _templateMasks.size(); ++i) {
+                out.mat(_templateMasks[i]);
+                out.array(_templatePixels[i].rowOffsets());
+                out.array(_templatePixels[i].columns());
+            }
+            
+            static_cast<const D*>(this)->serializeImpl(out);
+            
+            out.align();
+            out.patch<unsigned long long>(sizeOffset, out.offset() - start);
+        }
+        
+        /**
+            Restore prepared template state written by serialize.
+         
+            Replaces any template prepared before, while executor, statistics, damping and 
+            target mask are kept. Large tables such as the template pyramid are not copied but 
+            referenced in place, so data needs to stay valid and unchanged for as long as this 
+            aligner uses the state. This allows many aligners to share a single read-only
+            mapping of a template catalog, see MappedFile in mapped_file.h. Bind a target 
+            through setTarget before aligning.
+         
+            \param data Start of record, at an offset serialize started the record at.
+            \param size Number of bytes available at data.
+            \param w The warp, used like the warp passed to prepare.
+            \return Number of bytes of the record, which is where the next record starts.
+         */
+        size_t deserialize(const void *data, size_t size, const W &w = W())
+        {
+            detail::StateReader in(data, size);
+            
+            if (in.value<unsigned int>() != detail::STATE_MAGIC)
+                CV_Error(cv::Error::StsBadArg, "Not a prepared aligner state.");
+            if (in.value<int>() != STATE_FORMAT_VERSION)
+                CV_Error(cv::Error::StsBadArg, "Unsupported version of prepared aligner state.");
+            
+            const int tag = in.value<int>();
+            const int warpMode = in.value<int>();
+            const int np = in.value<int>();
+            const int scalarSize = in.value<int>();
+            if (tag != D::stateTag() || warpMode != W::Traits::WarpMode || np != w.numParameters() || scalarSize != (int)sizeof(ScalarType))
+                CV_Error(cv::Error::StsBadArg, "Prepared aligner state does not match algorithm or warp.");
+            
+            const unsigned long long recordSize = in.value<unsigned long long>();
+            CV_Assert(recordSize <= size);
+            
+            const int levels = in.value<int>();
+            CV_Assert(levels > 0);
+            
+            StoragePolicy policy;
+            policy.pyramid = in.value<int>();
+            policy.tables = in.value<int>();
+            
+            std::vector<cv::Mat> pyramid(levels);
+            for (int i = 0; i < levels; ++i)
+                pyramid[i] = in.mat();
+            
+            cv::Mat mask;
+            std::vector<cv::Mat> masks;
+            std::vector<SelectedPixels> pixels;
+            if (in.value<int>() != 0) {
+                mask = in.mat();
+                masks.resize(levels);
+                pixels.resize(levels);
+                
+                std::vector<int> rowOffsets, columns;
+                for (int i = 0; i < levels; ++i) {
+                    masks[i] = in.mat();
+                    in.array(rowOffsets);
+                    in.array(columns);
+                    pixels[i].assign(rowOffsets, columns);
+                }
             }
             
+            _storagePolicy = policy;
+            _templateLevels = levels;
+            _levels = levels;
+            _templatePyramid = ImagePyramid(pyramid);
+            _templatePyramid.setStorage(policy.pyramid);
+            _ownsTemplatePyramid = false;
+            _templateMask = mask.clone();
+            _templateMasks.swap(masks);
+            _templatePixels.swap(pixels);
+            _targetPyramid = ImagePyramid();
+            _ownsTargetPyramid = false;
+            
+            _identity.assign(1, w);
+            _identity[0].setIdentity();
+            _levelPrepared.assign(_templateLevels, 1);
+            
             setLevel(0);
+            _partials.clear();
             
-            // Invoke prepare of derived
+            // Reset derived state as prepare would, then restore it
             static_cast<D*>(this)->prepareImpl(w);
+            static_cast<D*>(this)->deserializeImpl(in);
+            
+            in.align();
+            CV_Assert(in.offset() == recordSize);
+            
+            return (size_t)recordSize;
+        }
+        
+        /**
+            Initialize warp globally by phase correlation on the coarsest pyramid level.
+         
+            Lucas-Kanade converges only when started close to the solution, which requires 
+            either a good initial warp or many pyramid levels and iterations for large 
+            displacements. This method estimates translation, and optionally rotation and scale,
+            between the coarsest template and target levels with phaseCorrelation, regardless 
+            of the warp passed. The estimate replaces w, so align continues from it. Parts of the 
+            similarity the warp cannot represent are dropped, such as rotation for translations.
+         
+            A target needs to be bound. Only the coarsest pyramid levels are materialized.
+         
+            \param w Warp to initialize. Left unchanged when the estimate is rejected.
+            \param estimateRotationScale Whether to estimate rotation and scale as well.
+            \param minResponse Correlation response at or below which the estimate is rejected.
+            \return True when w was replaced by the estimate.
+         */
+        bool initialize(W &w, bool estimateRotationScale = false, double minResponse = 0)
+        {
+            CV_Assert(_targetPyramid.numLevels() > 0);
+            
+            const int coarsest = numLevels() - 1;
+            materializePyramids(coarsest);
+            
+            const PhaseCorrelationResult r = phaseCorrelation(_templatePyramid[coarsest], _targetPyramid[coarsest], estimateRotationScale);
+            if (!(r.response > minResponse))
+                return false;
+            
+            W wc(w);
+            detail::assignSimilarity(wc, r);
+            w = wc.scaled(coarsest);
+            
+            return true;
         }
         
         /**
@@ -152,11 +667,25 @@ namespace imagealign {
             Iterations are performed on all levels of the pyramid. The algorithm starts at the 
             coarsest pyramid and iterates a stopping criterium of the current level is matched. 
             Once a stopping criterium is met, the algorithm breaks to the next finer pyramid level.
+         
+            Iterations are budgeted adaptively. Each level may use the iterations remaining divided 
+            by the number of levels left, so iterations not used by levels converging early are 
+            passed on to finer levels. Levels receiving no iterations are skipped and never 
+            materialized, as are levels coarser than the one set through setStartLevel.
 
             Currently the iteration is stopped when
-                - the number of iterations exceeds the number of iterations per level.
+                - the number of iterations exceeds the budget of the current level.
                 - the length of delta parameter vector estimated is less than eps
                 - an increase of error is observed (with exception between two pyramid layers)
+                - the system to solve is degenerate, for example for textureless templates
+         
+            With damping enabled through setDamping, a step increasing the error is rejected and 
+            retried with stronger damping instead, and the level ends after too many consecutive 
+            rejections. The warp then always holds the estimate of lowest error found. Each 
+            evaluation of the error, whether its step is accepted or not, counts as one iteration.
+         
+            When statistics are attached through setStats, iteration counts, timings and the 
+            reason for leaving each level are recorded.
          
             \param w Current state of warp estimation. Will be modified to hold result.
             \param maxIterations Maximum number of iterations in all levels.
@@ -165,33 +694,74 @@ namespace imagealign {
          */
         SelfType &align(W &w, int maxIterations, ScalarType eps, std::vector<W> *steps = 0)
         {
-            int iterationsPerLevel = maxIterations / numLevels();
+            CV_Assert(_targetPyramid.numLevels() > 0);
+            
+            const int64 start = tick();
+            if (recording())
+                _stats->resetLevels(numLevels());
+            
+            int remainingIterations = std::max<int>(0, maxIterations);
             
             // Start at the coarsest level + 1
             W ws = w.scaled(-numLevels());
 
+            const int firstLevel = (_startLevel < 0) ? numLevels() - 1 : std::min<int>(_startLevel, numLevels() - 1);
+            
             for (int lev = numLevels() - 1; lev >= 0; --lev) {
-                setLevel(lev);
                 ws = ws.scaled(1); // Scale up
+                
+                const int iterationsForLevel = remainingIterations / (lev + 1);
+                if (iterationsForLevel == 0 || lev > firstLevel)
+                    continue;
+                
+                LevelStats *ls = recording() ? &_stats->levels[lev] : 0;
+                
+                int64 t = tick();
+                materializeLevel(lev);
+                setLevel(lev);
+                
+                if (ls) {
+                    ls->prepareSeconds = secondsSince(t);
+                    ls->templatePixels = channels() * (templatePixels() ? templatePixels()->size() : std::max<int>(0, templateImage().rows - 2) * std::max<int>(0, templateImage().cols - 2));
+                    ls->stopReason = STOP_BUDGET;
+                }
 
-                for (int iter = 0; iter < iterationsPerLevel; ++iter) {
+                if (_damping.enabled()) {
+                    remainingIterations -= alignLevelDamped(ws, iterationsForLevel, eps, ls, steps);
+                    continue;
+                }
+                
+                for (int iter = 0; iter < iterationsForLevel; ++iter) {
+                    
+                    --remainingIterations;
                     
-                    SingleStepResult<W> s = static_cast<D*>(this)->alignImpl(ws);
+                    SingleStepResult<W> s = evaluate(ws, ls);
                     
                     const ScalarType newError = s.sumErrors / ScalarType(s.numConstraints);
                     const ScalarType errorChange = lastError() - newError;
+                    _conditioning = s.conditioning;
+                   
+                    int stop = -1;
+                    if (s.numConstraints <= 0) {
+                        stop = STOP_NO_CONSTRAINTS;
+                    } else if (!(s.conditioning > minConditioning())) {
+                        stop = STOP_DEGENERATE;
+                    } else if (!(errorChange >= ScalarType(0))) {
+                        stop = STOP_ERROR_INCREASE;
+                    } else if (iter > 0 && !((ScalarType)cv::norm(s.delta) >= eps)) {
+                        stop = STOP_EPS;
+                    }
                    
-                    if (s.numConstraints > 0 &&
-                        errorChange >= ScalarType(0) &&
-                        (iter == 0 || (ScalarType)cv::norm(s.delta) >= eps))
-                    {
+                    if (stop < 0) {
                         static_cast<D*>(this)->applyStep(ws, s);
                         _error = newError;
                         
+                        if (ls) ls->acceptedSteps += 1;
                         if (steps) steps->push_back(ws.scaled(lev));
                         
                     } else {
                         // Next level
+                        if (ls) ls->stopReason = stop;
                         break;
                     }
                 }
@@ -200,11 +770,29 @@ namespace imagealign {
             }
             w = ws;
             
+            if (recording())
+                _stats->alignSeconds = secondsSince(start);
             
             return *this;
         }
     
         
+        /** 
+            Return the number of interleaved channels of the prepared template.
+         */
+        int channels() const {
+            return _templatePyramid.numLevels() > 0 ? _templatePyramid[0].channels() : 0;
+        }
+        
+        /**
+            Whether templates of the given size can be prepared. Defaults to any size, algorithms 
+            specialized to a fixed template size accept only that size.
+         */
+        static bool supportsTemplateSize(cv::Size s) {
+            (void)s;
+            return true;
+        }
+        
         /** 
             Return the total number of levels.
          */
@@ -221,14 +809,48 @@ namespace imagealign {
             return _error;
         }
         
+        /**
+            Access the conditioning estimate of the system solved in the last iteration.
+         
+            Values are in [0, 1]. Values close to zero indicate the template does not constrain
+            all parameters of the warp, in which case alignment stops early.
+         */
+        ScalarType lastConditioning() const {
+            return _conditioning;
+        }
+        
+        /**
+            Conditioning below which steps are rejected.
+         */
+        static ScalarType minConditioning() {
+            return std::sqrt(std::numeric_limits<ScalarType>::epsilon());
+        }
+        
     protected:
         
         typedef typename W::Traits::PointType PointType;
+        typedef typename W::Traits::ParamType ParamType;
+        typedef typename W::Traits::HessianType HessianType;
     
         int level() const {
             return _level;
         }
 
+        /** Number of levels of the prepared template, at least numLevels(). */
+        int templateLevels() const {
+            return _templateLevels;
+        }
+        
+        /** Number of parameters of the warp prepared for. */
+        int numParameters() const {
+            return _identity[0].numParameters();
+        }
+        
+        /** Identity warp of given level, as passed to prepareLevelImpl. */
+        W identityWarp(int level) const {
+            return _identity[0].scaled(-level);
+        }
+        
         SelfType &setLevel(int level) {
             
             level = std::max<int>(0, std::min<int>(level, numLevels() - 1));
@@ -240,11 +862,12 @@ namespace imagealign {
             return *this;
         }
         
-        cv::Mat templateImage() {
+        /** Template of current level, possibly at reduced precision. Read rows through detail::loadRow. */
+        cv::Mat templateImage() const {
             return _templatePyramid[_level];
         }
         
-        cv::Mat targetImage() {
+        cv::Mat targetImage() const {
             return _targetPyramid[_level];
         }
         
@@ -252,10 +875,105 @@ namespace imagealign {
             return _templatePyramid;
         }
         
+        /**
+            Template pixels taking part at the current level, or 0 when all inner pixels do.
+         
+            Rows and columns are relative to the inner template region, that is row y - 1 
+            holds pixels of template row y.
+         */
+        const SelectedPixels *templatePixels() const {
+            return _templateMasks.empty() ? 0 : &_templatePixels[_level];
+        }
+        
+        /**
+            Mask of template pixels taking part at given level, or empty when unmasked.
+         */
+        cv::Mat templateMask(int level) const {
+            return _templateMasks.empty() ? cv::Mat() : _templateMasks[level];
+        }
+        
+        /**
+            Mask of valid target pixels at the current level, or empty when unmasked.
+         */
+        cv::Mat targetMask() const {
+            return _targetMasks.empty() ? cv::Mat() : _targetMasks[_level];
+        }
+        
         ImagePyramid &targetImagePyramid() {
             return _targetPyramid;
         }
         
+        /**
+            Per-level preparation hook.
+         
+            Invoked once per template level on first use, after the template pyramid holds the 
+            level. Derived classes precomputing per-level data override this method.
+         
+            \param w0 Identity warp scaled to level.
+            \param level Pyramid level to prepare.
+         */
+        void prepareLevelImpl(const W &w0, int level) 
+        {
+            (void)w0;
+            (void)level;
+        }
+        
+        /**
+            Target binding hook.
+         
+            Invoked after a new target has been bound. Derived classes caching data derived 
+            from the target override this method to invalidate it.
+         */
+        void setTargetImpl()
+        {}
+        
+        /**
+            State serialization hooks.
+            
+            serializeImpl writes the per-level data of the derived algorithm after all levels
+            have been prepared. deserializeImpl reads it back in the same order, invoked after
+            prepareImpl on the restored base state. Algorithms
+            without precomputed template data keep the defaults. stateTag identifies the
+            algorithm, records of other algorithms are rejected.
+         */
+        void serializeImpl(detail::StateWriter &out) const
+        {
+            (void)out;
+        }
+        
+        void deserializeImpl(detail::StateReader &in)
+        {
+            (void)in;
+        }
+        
+        static int stateTag() {
+            return 0;
+        }
+        
+        /**
+            Whether templates and targets with cn interleaved channels are supported.
+         
+            Algorithms supporting multi-channel images stack the error terms of all channels
+            into a single system. Defaults to single channel images.
+         */
+        static bool supportsChannels(int cn) {
+            return cn == 1;
+        }
+        
+        /**
+            Hand the linear system of a step to the damped solver.
+         
+            Derived classes invoke this from alignImpl with the upper triangle of the Hessian 
+            and the right hand side the step was solved from. Copies only when damping is enabled.
+         */
+        void exportSystem(SingleStepResult<W> &s, const HessianType &hessian, const ParamType &b) const {
+            if (!_damping.enabled())
+                return;
+            
+            detail::copyTo(hessian, s.hessian);
+            detail::copyTo(b, s.b);
+        }
+        
         /**
             Test if coordinates are in image.
             
@@ -274,14 +992,260 @@ namespace imagealign {
         }
 
         
+        /**
+            Test if coordinates are in image and on a valid pixel of mask.
+         
+            \param p Image coordinates
+            \param imgSize Size of image
+            \param mask Mask of valid pixels as returned by targetMask, or empty.
+         */
+        inline bool isInTarget(const PointType &p, cv::Size imgSize, const cv::Mat &mask) const {
+            if (!isInImage(p, imgSize, 1))
+                return false;
+            
+            return mask.empty() || mask.at<uchar>((int)std::floor(p(1)), (int)std::floor(p(0))) != 0;
+        }
+        
+        /**
+            Accumulate normal equations over all inner template rows of the current level.
+         
+            Rows are handed out in tiles to the executor. Each tile invokes 
+            D::accumulateRows(w, rowBegin, rowEnd, acc), which needs to be thread-safe.
+            The returned accumulator is owned by this object and valid until the next call.
+         
+            \param w Current state of warp estimation.
+         */
+        StepAccumulator<W> &accumulateSteps(const W &w) {
+            const int64 start = tick();
+            
+            StepKernel k(static_cast<const D*>(this), w);
+            StepAccumulator<W> &acc = parallelReduce(1, templateImage().rows - 1, REDUCTION_TILE_ROWS, k, executor(), _partials);
+            
+            if (recording() && _level < (int)_stats->levels.size())
+                _stats->levels[_level].accumulateSeconds += secondsSince(start);
+            
+            return acc;
+        }
+        
     private:
         
+        /** True when statistics are recorded. Constant false when compiled out. */
+        bool recording() const {
+#if defined(IA_DISABLE_STATS)
+            return false;
+#else
+            return _stats != 0;
+#endif
+        }
+        
+        /** Read timer if recording. */
+        int64 tick() const {
+            return recording() ? cv::getTickCount() : 0;
+        }
+        
+        static double secondsSince(int64 t) {
+            return double(cv::getTickCount() - t) / cv::getTickFrequency();
+        }
+        
+        /** Invoke alignImpl at w and record the iteration. */
+        SingleStepResult<W> evaluate(W &w, LevelStats *ls) {
+            const int64 t = tick();
+            const double accumulateSeconds = ls ? ls->accumulateSeconds : 0;
+            
+            SingleStepResult<W> s = static_cast<D*>(this)->alignImpl(w);
+            
+            if (ls) {
+                ls->solveSeconds += secondsSince(t) - (ls->accumulateSeconds - accumulateSeconds);
+                ls->minConstraints = (ls->iterations == 0) ? s.numConstraints : std::min<int>(ls->minConstraints, s.numConstraints);
+                ls->lastConstraints = s.numConstraints;
+                ls->iterations += 1;
+                _stats->iterations += 1;
+            }
+            
+            return s;
+        }
+        
+        /**
+            Perform damped iterations on the current level.
+         
+            Only the damped system needs to be well conditioned, ill-conditioned undamped 
+            systems are what damping is for. The conditioning of the damped system is 
+            reported through lastConditioning.
+         
+            \return Number of iterations used.
+         */
+        int alignLevelDamped(W &ws, int iterations, ScalarType eps, LevelStats *ls, std::vector<W> *steps) {
+            ScalarType lambda = ScalarType(_damping.lambda);
+            int rejections = 0;
+            
+            SingleStepResult<W> current = evaluate(ws, ls);
+            int used = 1;
+            
+            _conditioning = current.conditioning;
+            
+            int stop = -1;
+            if (current.numConstraints <= 0) {
+                stop = STOP_NO_CONSTRAINTS;
+            } else {
+                _error = current.sumErrors / ScalarType(current.numConstraints);
+            }
+            
+            while (stop < 0) {
+                const int64 t = tick();
+                const ScalarType conditioning = solveDamped(current, lambda, current.delta);
+                if (ls) 
+                    ls->solveSeconds += secondsSince(t);
+                
+                _conditioning = conditioning;
+                
+                if (!(conditioning > minConditioning())) {
+                    stop = STOP_DEGENERATE;
+                } else if (used > 1 && !((ScalarType)cv::norm(current.delta) >= eps)) {
+                    stop = STOP_EPS;
+                } else if (used >= iterations) {
+                    stop = STOP_BUDGET;
+                }
+                
+                if (stop >= 0)
+                    break;
+                
+                W candidate(ws);
+                static_cast<D*>(this)->applyStep(candidate, current);
+                
+                SingleStepResult<W> next = evaluate(candidate, ls);
+                ++used;
+                
+                const ScalarType nextError = next.sumErrors / ScalarType(next.numConstraints);
+                
+                if (next.numConstraints > 0 && nextError < _error) {
+                    ws = candidate;
+                    current = next;
+                    _error = nextError;
+                    
+                    lambda = std::max<ScalarType>(lambda / ScalarType(_damping.decrease), ScalarType(_damping.lambda));
+                    rejections = 0;
+                    
+                    if (ls) ls->acceptedSteps += 1;
+                    if (steps) steps->push_back(ws.scaled(_level));
+                } else {
+                    lambda *= ScalarType(_damping.increase);
+                    
+                    if (++rejections > _damping.maxRejections)
+                        stop = STOP_ERROR_INCREASE;
+                }
+            }
+            
+            if (ls) 
+                ls->stopReason = stop;
+            
+            return used;
+        }
+        
+        /**
+            Solve the system exported by s with the diagonal scaled by (1 + lambda).
+         
+            \return Conditioning estimate of the damped system.
+         */
+        ScalarType solveDamped(const SingleStepResult<W> &s, ScalarType lambda, ParamType &delta) {
+            detail::copyTo(s.hessian, _dampedHessian);
+            detail::scaleDiagonal(detail::rowPtr<ScalarType>(_dampedHessian, 0), s.b.rows, ScalarType(1) + lambda);
+            
+            const ScalarType conditioning = detail::factorizeLDLT<ScalarType>(_dampedHessian, _dampedHessian);
+            detail::solveLDLT<ScalarType>(_dampedHessian, s.b, delta);
+            
+            return conditioning;
+        }
+        
+        /** True when images of size s can be bound as target along with the target mask. */
+        bool targetMatchesMask(cv::Size s) const {
+            return _targetMasks.empty() || _targetMasks[0].size() == s;
+        }
+        
+        /** Build masks and pixel sets of all template levels from the template mask. */
+        void prepareTemplateMask(cv::Size s) {
+            _templateMasks.clear();
+            _templatePixels.clear();
+            
+            if (_templateMask.empty())
+                return;
+            
+            CV_Assert(_templateMask.size() == s);
+            
+            detail::buildMaskLevels(_templateMask, _templateLevels, 1, _templateMasks);
+            
+            _templatePixels.resize(_templateLevels);
+            for (int i = 0; i < _templateLevels; ++i) {
+                const cv::Mat &m = _templateMasks[i];
+                _templatePixels[i].create(m(cv::Rect(1, 1, std::max<int>(0, m.cols - 2), std::max<int>(0, m.rows - 2))));
+            }
+        }
+        
+        /** Make sure template and target pyramids hold given level. */
+        void materializePyramids(int level) {
+            if (_templatePyramid.numLevels() <= level)
+                _templatePyramid.extend(level + 1, executor());
+            
+            if (_ownsTargetPyramid && _targetPyramid.numLevels() <= level)
+                _targetPyramid.extend(level + 1, executor());
+        }
+        
+        /** Make sure pyramids and derived data of given level are available. */
+        void materializeLevel(int level) {
+            materializePyramids(level);
+            
+            if (!_levelPrepared[level]) {
+                static_cast<D*>(this)->prepareLevelImpl(identityWarp(level), level);
+                _levelPrepared[level] = 1;
+            }
+        }
+        
+        static void invokeAccumulateRows(const D *d, const W &w, int rowBegin, int rowEnd, StepAccumulator<W> &acc) {
+            d->accumulateRows(w, rowBegin, rowEnd, acc);
+        }
+        
+        /** Adapts D::accumulateRows to the kernel interface of parallelReduce. */
+        struct StepKernel {
+            typedef StepAccumulator<W> AccumulatorType;
+            
+            StepKernel(const D *d, const W &w)
+                : _d(d), _w(w)
+            {}
+            
+            AccumulatorType accumulator() const {
+                return AccumulatorType(_w.numParameters());
+            }
+            
+            void operator()(int rowBegin, int rowEnd, AccumulatorType &acc) const {
+                SelfType::invokeAccumulateRows(_d, _w, rowBegin, rowEnd, acc);
+            }
+            
+            const D *_d;
+            const W &_w;
+        };
+        
         ImagePyramid _templatePyramid;
         ImagePyramid _targetPyramid;
+        bool _ownsTemplatePyramid;
+        bool _ownsTargetPyramid;
         
+        int _templateLevels;
         int _levels;
         int _level;
         ScalarType _error;
+        ScalarType _conditioning;
+        const Executor *_executor;
+        StoragePolicy _storagePolicy;
+        Damping _damping;
+        int _startLevel;
+        cv::Mat _templateMask;
+        std::vector<cv::Mat> _templateMasks;
+        std::vector<SelectedPixels> _templatePixels;
+        std::vector<cv::Mat> _targetMasks;
+        HessianType _dampedHessian;
+        AlignStats *_stats;
+        std::vector< StepAccumulator<W> > _partials;
+        std::vector<W> _identity;
+        std::vector<uchar> _levelPrepared;
     };
     
     
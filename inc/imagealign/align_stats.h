@@ -0,0 +1,130 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_ALIGN_STATS_H
+#define IMAGE_ALIGN_ALIGN_STATS_H
+
+#include <imagealign/config.h>
+#include <vector>
+
+/**
+    Define IA_DISABLE_STATS to compile out all statistics recording. AlignBase::setStats 
+    is still available, but attached statistics are left untouched.
+ */
+
+namespace imagealign {
+    
+    /** Level was not visited, because no iterations were left for it. */
+    const int STOP_SKIPPED = 0;
+    
+    /** Iteration budget of level was exhausted. */
+    const int STOP_BUDGET = 1;
+    
+    /** Length of parameter update fell below eps. */
+    const int STOP_EPS = 2;
+    
+    /** Error increased. */
+    const int STOP_ERROR_INCREASE = 3;
+    
+    /** No template pixel mapped into the target. */
+    const int STOP_NO_CONSTRAINTS = 4;
+    
+    /** System to solve was too poorly conditioned. */
+    const int STOP_DEGENERATE = 5;
+    
+    /**
+        Statistics of a single pyramid level recorded during align.
+     */
+    struct LevelStats {
+        /** Number of iterations performed, including the final rejected one. */
+        int iterations;
+        
+        /** Number of accepted steps. */
+        int acceptedSteps;
+        
+        /** Reason for leaving the level. One of the STOP_ constants. */
+        int stopReason;
+        
+        /** Number of interior template pixels of the level, counted once per channel like constraints. */
+        int templatePixels;
+        
+        /** Smallest number of constraints of any iteration. */
+        int minConstraints;
+        
+        /** Number of constraints of the last iteration. */
+        int lastConstraints;
+        
+        /** Seconds spent materializing level data on first use. */
+        double prepareSeconds;
+        
+        /** Seconds spent accumulating the normal equations. */
+        double accumulateSeconds;
+        
+        /** Seconds spent per step besides accumulation, mostly solving and warping. */
+        double solveSeconds;
+        
+        LevelStats()
+            : iterations(0), acceptedSteps(0), stopReason(STOP_SKIPPED), templatePixels(0), 
+              minConstraints(0), lastConstraints(0),
+              prepareSeconds(0), accumulateSeconds(0), solveSeconds(0)
+        {}
+        
+        /** 
+            Interior template pixels not contributing to the last iteration, for example because
+            they mapped outside the target or were not selected. Counted once per channel.
+         */
+        int droppedConstraints() const {
+            return templatePixels - lastConstraints;
+        }
+    };
+    
+    /**
+        Statistics of alignment.
+     
+        Attach to an aligner through AlignBase::setStats. prepare records its time, and each 
+        call to align overwrites the per-level statistics. Recording only reads timers and 
+        counters, so no memory is allocated once levels have been sized.
+     */
+    struct AlignStats {
+        /** Seconds spent in last call to prepare. */
+        double prepareSeconds;
+        
+        /** Seconds spent in last call to align. */
+        double alignSeconds;
+        
+        /** Total number of iterations of last call to align. */
+        int iterations;
+        
+        /** Per-level statistics of last call to align, finest level first. */
+        std::vector<LevelStats> levels;
+        
+        AlignStats()
+            : prepareSeconds(0), alignSeconds(0), iterations(0)
+        {}
+        
+        /** Clear align statistics of n levels. */
+        void resetLevels(int n) {
+            alignSeconds = 0;
+            iterations = 0;
+            levels.assign(n, LevelStats());
+        }
+    };
+}
+
+#endif
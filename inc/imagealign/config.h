@@ -44,5 +44,27 @@
     #define IA_CV_VERSION 3
 #endif
 
+// C++11 standard library facilities such as std::thread.
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1700)
+    #define IA_HAS_CXX11
+#endif
+
+// Instruction sets available for hand-vectorized kernels.
+#if defined(__AVX2__)
+    #define IA_SIMD_AVX2
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define IA_SIMD_SSE2
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define IA_SIMD_NEON
+#endif
+
+#if defined(__F16C__)
+    #define IA_SIMD_F16C
+#endif
+
 
 #endif
\ No newline at end of file
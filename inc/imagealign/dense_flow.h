@@ -0,0 +1,388 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_DENSE_FLOW_H
+#define IMAGE_ALIGN_DENSE_FLOW_H
+
+#include <imagealign/image_pyramid.h>
+#include <imagealign/gradient.h>
+#include <imagealign/sampling.h>
+#include <imagealign/storage.h>
+#include <imagealign/linalg.h>
+#include <imagealign/parallel.h>
+#include <opencv2/core/core.hpp>
+#include <vector>
+#include <limits>
+#include <cmath>
+
+namespace imagealign {
+    
+    /**
+        Dense optical flow on a regular grid of translational windows.
+     
+        Aligning one template per grid cell duplicates pyramids, steepest descent images and 
+        Hessians of overlapping windows. This class instead computes the template pyramid, its 
+        gradients and integral images of the structure tensor gx^2, gx*gy and gy^2 once per level 
+        in prepare. The Hessian of every window is then a box sum of four lookups per entry, the
+        steepest descent images are the gradients themselves.
+     
+        align sweeps over grid rows in parallel and runs inverse compositional iterations per 
+        cell from coarse to fine, like AlignInverseCompositional with WarpTranslationF. Windows 
+        keep their size on every level and are centered on the scaled cell center, so coarse 
+        levels cover a larger part of the image. Samples outside the target are excluded, the 
+        Hessian of such windows is accumulated from the remaining pixels instead.
+     
+        Cell (row, col) is centered at (step / 2 + col * step, step / 2 + row * step) in the 
+        template frame.
+     */
+    class DenseFlow {
+    public:
+        
+        DenseFlow()
+            : _step(1), _radius(1), _executor(&defaultExecutor())
+        {}
+        
+        /** 
+            Set the executor distributing grid rows. The executor must outlive this object.
+         */
+        DenseFlow &setExecutor(const Executor &e) {
+            _executor = &e;
+            return *this;
+        }
+        
+        /**
+            Prepare the template frame.
+         
+            \param tmpl Single channel template frame.
+            \param step Distance of neighbouring grid cells in pixels of the template frame.
+            \param windowRadius Windows span 2 * windowRadius + 1 pixels in each direction on every level.
+            \param pyramidLevels Maximum number of pyramid levels to use.
+         */
+        void prepare(const cv::Mat &tmpl, int step, int windowRadius, int pyramidLevels)
+        {
+            CV_Assert(tmpl.channels() == 1);
+            CV_Assert(step > 0 && windowRadius > 0);
+            
+            const int levels = std::max<int>(1, std::min<int>(pyramidLevels, ImagePyramid::maxLevelsForImageSize(tmpl.size())));
+            
+            _step = step;
+            _radius = windowRadius;
+            _grid = cv::Size(tmpl.cols / step, tmpl.rows / step);
+            _pyramid.create(tmpl, levels, *_executor);
+            
+            _levels.resize(levels);
+            for (int i = 0; i < levels; ++i) {
+                Level &l = _levels[i];
+                l.tmpl = detail::floatImage(_pyramid[i]);
+                gradientImages(l.tmpl, l.gx, l.gy, GRADIENT_CENTRAL, *_executor);
+                integrateStructureTensor(l);
+            }
+            
+            _status.create(_grid, CV_8UC1);
+            _status.setTo(0);
+            _errors.create(_grid, CV_32FC1);
+            _errors.setTo(std::numeric_limits<float>::max());
+        }
+        
+        /**
+            Align all grid cells with target.
+         
+            \param target Pre-built image pyramid of the target frame, of the size of the template frame.
+            \param flow Displacement of cell centers from template to target frame as CV_32FC2 of 
+                   gridSize(). Used as initial guess when of that size and type, zero otherwise. 
+                   Will be modified to hold results.
+            \param maxIterations Maximum number of iterations in all levels per cell.
+            \param eps Minimum length of incremental displacement to continue on current level.
+         */
+        void align(const ImagePyramid &target, cv::Mat &flow, int maxIterations, float eps)
+        {
+            CV_Assert(!_levels.empty());
+            CV_Assert(target.numLevels() > 0 && target[0].size() == _levels[0].tmpl.size());
+            CV_Assert(target[0].channels() == 1);
+            
+            if (flow.size() != _grid || flow.type() != CV_32FC2) {
+                flow.create(_grid, CV_32FC2);
+                flow.setTo(cv::Scalar::all(0));
+            }
+            
+            const int levels = std::min<int>(numLevels(), target.numLevels());
+            
+            _targets.resize(levels);
+            for (int i = 0; i < levels; ++i)
+                _targets[i] = detail::floatImage(target[i]);
+            
+            GridTask task(this, flow, levels, maxIterations, eps);
+            _executor->run(_grid.height, task);
+        }
+        
+        /** Number of grid rows and columns. */
+        cv::Size gridSize() const {
+            return _grid;
+        }
+        
+        /** Center of a grid cell in the template frame. */
+        cv::Point2f cellCenter(int row, int col) const {
+            return cv::Point2f(float(_step / 2 + col * _step), float(_step / 2 + row * _step));
+        }
+        
+        /** Number of prepared pyramid levels. */
+        int numLevels() const {
+            return (int)_levels.size();
+        }
+        
+        /** 
+            Per-cell status of the last call to align as CV_8UC1, non-zero where the finest level 
+            was aligned. Cells with textureless windows or windows leaving the target are zero.
+         */
+        const cv::Mat &status() const {
+            return _status;
+        }
+        
+        /** Per-cell mean squared intensity error on the finest level as CV_32FC1. */
+        const cv::Mat &errors() const {
+            return _errors;
+        }
+        
+    private:
+        
+        DenseFlow(const DenseFlow &);
+        DenseFlow &operator=(const DenseFlow &);
+        
+        struct Level {
+            cv::Mat tmpl, gx, gy;
+            
+            /** Integral images of gx^2, gx*gy and gy^2 with one leading row and column of zeros. */
+            cv::Mat sxx, sxy, syy;
+        };
+        
+        /** Window of radius around c, clipped to inner pixels of the level. */
+        static cv::Rect window(const Level &l, cv::Point c, int radius) {
+            const int x0 = std::max<int>(1, c.x - radius);
+            const int y0 = std::max<int>(1, c.y - radius);
+            const int x1 = std::min<int>(l.tmpl.cols - 2, c.x + radius);
+            const int y1 = std::min<int>(l.tmpl.rows - 2, c.y + radius);
+            
+            return cv::Rect(x0, y0, std::max<int>(0, x1 - x0 + 1), std::max<int>(0, y1 - y0 + 1));
+        }
+        
+        static double boxSum(const cv::Mat &s, const cv::Rect &r) {
+            return s.at<double>(r.y + r.height, r.x + r.width) - s.at<double>(r.y, r.x + r.width) 
+                 - s.at<double>(r.y + r.height, r.x) + s.at<double>(r.y, r.x);
+        }
+        
+        static void integrateStructureTensor(Level &l) {
+            const int rows = l.gx.rows, cols = l.gx.cols;
+            
+            l.sxx.create(rows + 1, cols + 1, CV_64FC1);
+            l.sxy.create(rows + 1, cols + 1, CV_64FC1);
+            l.syy.create(rows + 1, cols + 1, CV_64FC1);
+            l.sxx.row(0).setTo(0);
+            l.sxy.row(0).setTo(0);
+            l.syy.row(0).setTo(0);
+            
+            for (int y = 0; y < rows; ++y) {
+                const float *gx = l.gx.ptr<float>(y);
+                const float *gy = l.gy.ptr<float>(y);
+                
+                const double *pxx = l.sxx.ptr<double>(y), *pxy = l.sxy.ptr<double>(y), *pyy = l.syy.ptr<double>(y);
+                double *xx = l.sxx.ptr<double>(y + 1), *xy = l.sxy.ptr<double>(y + 1), *yy = l.syy.ptr<double>(y + 1);
+                
+                double rxx = 0, rxy = 0, ryy = 0;
+                xx[0] = xy[0] = yy[0] = 0;
+                
+                for (int x = 0; x < cols; ++x) {
+                    rxx += double(gx[x]) * gx[x];
+                    rxy += double(gx[x]) * gy[x];
+                    ryy += double(gy[x]) * gy[x];
+                    
+                    xx[x + 1] = pxx[x + 1] + rxx;
+                    xy[x + 1] = pxy[x + 1] + rxy;
+                    yy[x + 1] = pyy[x + 1] + ryy;
+                }
+            }
+        }
+        
+        /** Same test as AlignBase::isInImage. */
+        static bool isInImage(float x, float y, cv::Size s, int r) {
+            const int ix = (int)std::floor(x - 0.5f);
+            const int iy = (int)std::floor(y - 0.5f);
+            return ix >= r && iy >= r && ix < s.width - r && iy < s.height - r;
+        }
+        
+        class GridTask : public ParallelTask {
+        public:
+            GridTask(DenseFlow *f, cv::Mat &flow, int levels, int maxIterations, float eps)
+                : _f(f), _flow(flow), _levels(levels), _maxIterations(maxIterations), _eps(eps)
+            {}
+            
+            void operator()(int row) const {
+                cv::AutoBuffer<float> buffer(5 * (2 * _f->_radius + 1));
+                
+                for (int col = 0; col < _f->_grid.width; ++col) {
+                    _f->alignCell(row, col, _flow.ptr<cv::Point2f>(row)[col], _levels, _maxIterations, _eps, buffer);
+                }
+            }
+        private:
+            DenseFlow *_f;
+            cv::Mat &_flow;
+            int _levels;
+            int _maxIterations;
+            float _eps;
+        };
+        
+        /**
+            Align a single cell from coarse to fine.
+         
+            Iterations are budgeted across levels as in AlignBase::align. A level ends when the
+            step is shorter than eps, the error increases or the system is degenerate.
+         */
+        void alignCell(int row, int col, cv::Point2f &d, int levels, int maxIterations, float eps, float *buffer)
+        {
+            const cv::Point2f center = cellCenter(row, col);
+            const float minConditioning = std::sqrt(std::numeric_limits<float>::epsilon());
+            const int n = 2 * _radius + 1;
+            
+            float *xs = buffer, *ys = buffer + n, *values = buffer + 2 * n, *errors = buffer + 3 * n, *valid = buffer + 4 * n;
+            
+            Sampler<SAMPLE_BILINEAR> s;
+            
+            int remainingIterations = std::max<int>(0, maxIterations);
+            bool aligned = false;
+            float error = std::numeric_limits<float>::max();
+            
+            // Displacement in pixels of the current level
+            const float scale = 1.f / float(1 << levels);
+            cv::Point2f dl(d.x * scale, d.y * scale);
+            
+            for (int lev = levels - 1; lev >= 0; --lev) {
+                dl.x *= 2.f;
+                dl.y *= 2.f;
+                aligned = false;
+                
+                const int iterationsForLevel = remainingIterations / (lev + 1);
+                if (iterationsForLevel == 0)
+                    continue;
+                
+                const Level &l = _levels[lev];
+                const cv::Mat &target = _targets[lev];
+                const float f = 1.f / float(1 << lev);
+                const cv::Rect r = window(l, cv::Point((int)std::floor(center.x * f + 0.5f), (int)std::floor(center.y * f + 0.5f)), _radius);
+                
+                if (r.width < 3 || r.height < 3)
+                    continue;
+                
+                // Hessian of the full window from box sums
+                cv::Matx22f full(float(boxSum(l.sxx, r)), float(boxSum(l.sxy, r)), 0.f, float(boxSum(l.syy, r)));
+                cv::Matx22f ldlt;
+                const float fullConditioning = detail::factorizeLDLT<float>(full, ldlt);
+                
+                float lastError = std::numeric_limits<float>::max();
+                
+                for (int iter = 0; iter < iterationsForLevel; ++iter) {
+                    --remainingIterations;
+                    
+                    // Translations move the window rigidly, testing its corners covers all samples.
+                    const bool inside = isInImage(float(r.x) + dl.x, float(r.y) + dl.y, target.size(), 2) && 
+                                        isInImage(float(r.x + r.width - 1) + dl.x, float(r.y + r.height - 1) + dl.y, target.size(), 2);
+                    
+                    float b[2] = {0.f, 0.f};
+                    float sumErrors = 0.f;
+                    int numConstraints = 0;
+                    cv::Matx22f partial(0.f, 0.f, 0.f, 0.f);
+                    
+                    for (int y = r.y; y < r.y + r.height; ++y) {
+                        for (int x = 0; x < r.width; ++x) {
+                            xs[x] = float(r.x + x) + dl.x;
+                            ys[x] = float(y) + dl.y;
+                        }
+                        
+                        s.sample<float>(target, xs, ys, r.width, values);
+                        
+                        const float *tplRow = l.tmpl.ptr<float>(y) + r.x;
+                        const float *gxRow = l.gx.ptr<float>(y) + r.x;
+                        const float *gyRow = l.gy.ptr<float>(y) + r.x;
+                        
+                        if (inside) {
+                            for (int x = 0; x < r.width; ++x) {
+                                errors[x] = values[x] - tplRow[x];
+                            }
+                            numConstraints += r.width;
+                        } else {
+                            for (int x = 0; x < r.width; ++x) {
+                                valid[x] = isInImage(xs[x], ys[x], target.size(), 1) ? 1.f : 0.f;
+                                errors[x] = valid[x] * (values[x] - tplRow[x]);
+                                numConstraints += (int)valid[x];
+                                
+                                partial(0, 0) += valid[x] * gxRow[x] * gxRow[x];
+                                partial(0, 1) += valid[x] * gxRow[x] * gyRow[x];
+                                partial(1, 1) += valid[x] * gyRow[x] * gyRow[x];
+                            }
+                        }
+                        
+                        b[0] += detail::dot(gxRow, errors, r.width);
+                        b[1] += detail::dot(gyRow, errors, r.width);
+                        sumErrors += detail::dot(errors, errors, r.width);
+                    }
+                    
+                    float conditioning = fullConditioning;
+                    cv::Matx22f partialLdlt;
+                    if (!inside)
+                        conditioning = detail::factorizeLDLT<float>(partial, partialLdlt);
+                    
+                    if (numConstraints <= 0 || !(conditioning > minConditioning))
+                        break;
+                    
+                    const float newError = sumErrors / float(numConstraints);
+                    if (!(newError <= lastError))
+                        break;
+                    
+                    lastError = newError;
+                    error = newError;
+                    aligned = true;
+                    
+                    cv::Matx21f delta;
+                    detail::solveLDLT<float>(inside ? ldlt : partialLdlt, cv::Matx21f(b[0], b[1]), delta);
+                    
+                    // Inverse compositional update of a translation
+                    dl.x -= delta(0);
+                    dl.y -= delta(1);
+                    
+                    if (iter > 0 && !(std::sqrt(delta(0) * delta(0) + delta(1) * delta(1)) >= eps))
+                        break;
+                }
+            }
+            
+            d = dl;
+            _status.at<uchar>(row, col) = aligned ? 1 : 0;
+            _errors.at<float>(row, col) = aligned ? error : std::numeric_limits<float>::max();
+        }
+        
+        int _step;
+        int _radius;
+        cv::Size _grid;
+        ImagePyramid _pyramid;
+        std::vector<Level> _levels;
+        std::vector<cv::Mat> _targets;
+        cv::Mat _status;
+        cv::Mat _errors;
+        const Executor *_executor;
+    };
+}
+
+#endif
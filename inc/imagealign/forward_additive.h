@@ -24,6 +24,9 @@
 #include <imagealign/warp.h>
 #include <imagealign/sampling.h>
 #include <imagealign/gradient.h>
+#include <imagealign/gradient_pyramid.h>
+#include <imagealign/linalg.h>
+#include <imagealign/robust_loss.h>
 #include <opencv2/core/core.hpp>
 
 namespace imagealign {
@@ -40,6 +43,7 @@ namespace imagealign {
         direction of the warp is forward and warp parameters are summed.
      
         \tparam WarpType Type of warp motion to use during alignment. See EWarpType.
+        \tparam L Loss policy weighting pixels, see robust_loss.h. Defaults to least squares.
      
         ## Based on
      
@@ -52,8 +56,70 @@ namespace imagealign {
         International journal of computer vision 56.3 (2004): 221-255.
 
      */
-    template<class W>
-    class AlignForwardAdditive : public AlignBase< AlignForwardAdditive<W>, W> {
+    template<class W, class L = LossSquared>
+    class AlignForwardAdditive : public AlignBase< AlignForwardAdditive<W, L>, W> {
+    public:
+        
+        typedef AlignBase< AlignForwardAdditive<W, L>, W> BaseType;
+        typedef L LossType;
+        
+        using BaseType::setTarget;
+        
+        AlignForwardAdditive()
+            : _precomputeGradients(false), _sharedGradients(false)
+        {}
+        
+        /**
+            Set loss instance, for example to change its threshold.
+         */
+        AlignForwardAdditive &setLoss(const L &loss) {
+            _loss = loss;
+            return *this;
+        }
+        
+        /**
+            Access loss instance.
+         */
+        const L &loss() const {
+            return _loss;
+        }
+        
+        /**
+            Enable precomputation of target gradients.
+         
+            When enabled, intensities and gradients of each target level are computed once into 
+            an interleaved buffer on first use, and every iteration samples both in a single pass.
+            This pays off when the template covers a substantial part of the target or many 
+            iterations are performed. Disabled by default, in which case gradients are 
+            approximated on the fly.
+         */
+        AlignForwardAdditive &setPrecomputeGradients(bool enable) {
+            _precomputeGradients = enable;
+            return *this;
+        }
+        
+        /**
+            Bind pre-built target image pyramid along with its gradient pyramid.
+         
+            Both pyramids are shared, not copied. This allows computing target gradients once 
+            for all aligners working on the same target.
+         
+            \param target Pre-built image pyramid of target image.
+            \param gradients Gradient pyramid built from target.
+         */
+        void setTarget(const ImagePyramid &target, const GradientPyramid &gradients)
+        {
+            CV_Assert(gradients.numLevels() > 0);
+            CV_Assert(gradients[0].size() == target[0].size());
+            
+            BaseType::setTarget(target);
+            
+            CV_Assert(gradients.numLevels() >= this->numLevels());
+            
+            _gradients = gradients;
+            _sharedGradients = true;
+        }
+        
     protected:
         
         typedef typename W::Traits::ParamType ParamType;
@@ -68,12 +134,25 @@ namespace imagealign {
             Prepare for alignment.
          
             In the forward additive algorithm not much data can be pre-calculated, which is
-            why this algorithm is not the fastest. The only thing that could be calculated
-            beforehand are the gradients of the target image.
+            why this algorithm is not the fastest. The only thing that can be calculated
+            beforehand are the gradients of the target image, see setPrecomputeGradients.
          */
         void prepareImpl(const W &w)
         {
-            // Nothing todo here. Gradient is computed on the fly.
+            // Nothing todo here. Gradient is computed on the fly or per target.
+        }
+        
+        /**
+            Invalidate target gradients of previous target.
+         */
+        void setTargetImpl()
+        {
+            // Never write into a shared gradient pyramid.
+            if (_sharedGradients)
+                _gradients = GradientPyramid();
+            
+            _sharedGradients = false;
+            _gradientsReady.assign(this->numLevels(), 0);
         }
         
         /** 
@@ -85,75 +164,169 @@ namespace imagealign {
             \param w Current state of warp estimation. Will be modified to hold updated warp.
          */
         SingleStepResult<W> alignImpl(const W &w)
+        {
+            _levelGradients = levelGradients();
+            
+            // Accumulate Hessian and b from all template rows
+            StepAccumulator<W> &acc = this->accumulateSteps(w);
+            
+            // 8. Solve Ax = b from the upper triangle of the Hessian
+            SingleStepResult<W> step;
+            step.conditioning = detail::factorizeLDLT<ScalarType>(acc.hessian, _factorizedHessian);
+            detail::solveLDLT<ScalarType>(_factorizedHessian, acc.b, _delta);
+            this->exportSystem(step, acc.hessian, acc.b);
+            
+            step.delta = _delta;
+            step.sumErrors = acc.sumErrors;
+            step.numConstraints = acc.numConstraints;
+            
+            return step;
+        }
+        
+        /**
+            Accumulate Hessian and error terms for template rows [rowBegin, rowEnd).
+         
+            Invoked concurrently on disjoint row ranges. Only the upper triangle of the
+            Hessian is accumulated. With a template mask only pixels taking part are visited.
+         */
+        void accumulateRows(const W &w, int rowBegin, int rowEnd, StepAccumulator<W> &acc) const
         {
             cv::Mat tpl = this->templateImage();
             cv::Mat target = this->targetImage();
+            cv::Mat targetMask = this->targetMask();
+            const SelectedPixels *selected = this->templatePixels();
             
             Sampler<SAMPLE_BILINEAR> s;
             
-            HessianType hessian = W::Traits::zeroHessian(w.numParameters());
-            ParamType b = W::Traits::zeroParam(w.numParameters());
-
-            ScalarType sumErrors = 0;
-            int sumConstraints = 0;
+            const int np = w.numParameters();
+            ScalarType *b = detail::rowPtr<ScalarType>(acc.b, 0);
+            ScalarType *hessian = detail::rowPtr<ScalarType>(acc.hessian, 0);
+            
+            // Row buffers for batched sampling of warped coordinates.
+            const int n = std::max<int>(0, tpl.cols - 2);
+            ScalarType *xs = acc.template scratch<ScalarType>(0, n);
+            ScalarType *ys = acc.template scratch<ScalarType>(1, n);
+            float *targetIntensities = acc.template scratch<float>(2, n);
+            ScalarType *sd = acc.template scratch<ScalarType>(3, np);
+            
+            // Gradients sampled along with intensities when precomputed.
+            const bool useGradients = !_levelGradients.empty();
+            ScalarType *gxs = acc.template scratch<ScalarType>(4, n);
+            ScalarType *gys = acc.template scratch<ScalarType>(5, n);
+            float *tplBuffer = acc.template scratch<float>(6, tpl.cols);
             
-            for (int y = 1; y < tpl.rows - 1; ++y) {
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                
+                const float *tplRow = detail::loadRow(tpl, y, tplBuffer);
+                
+                const int first = selected ? selected->begin(y - 1) : 0;
+                const int count = selected ? selected->begin(y) - first : n;
+                
+                // 1. Warp target pixels of row back to template using w
+                for (int i = 0; i < count; ++i) {
+                    const int x = selected ? selected->col(first + i) + 1 : i + 1;
+                    
+                    PointType ptpl;
+                    ptpl << ScalarType(x), ScalarType(y);
+                    
+                    PointType ptgt = w(ptpl);
+                    xs[i] = ptgt(0);
+                    ys[i] = ptgt(1);
+                }
                 
-                const float *tplRow = tpl.ptr<float>(y);
+                if (useGradients) {
+                    detail::sampleIntensityGradient(_levelGradients, xs, ys, count, targetIntensities, gxs, gys);
+                } else {
+                    s.sample<float>(target, xs, ys, count, targetIntensities);
+                }
                 
-                for (int x = 1; x < tpl.cols - 1; ++x) {
+                for (int i = 0; i < count; ++i) {
+                    const int x = selected ? selected->col(first + i) + 1 : i + 1;
                     const float templateIntensity = tplRow[x];
 
                     PointType ptpl;
                     ptpl << ScalarType(x), ScalarType(y);
                     
-                    // 1. Warp target pixel back to template using w
-                    PointType ptgt = w(ptpl);
+                    const PointType ptgt(xs[i], ys[i]);
                     
-                    if (!this->isInImage(ptgt, target.size(), 1))
+                    if (!this->isInTarget(ptgt, target.size(), targetMask))
                         continue;
                     
-                    const float targetIntensity = s.sample<float>(target, ptgt);
+                    const float targetIntensity = targetIntensities[i];
                     
                     // 2. Compute the error
                     const float err = templateIntensity - targetIntensity;
-                    sumErrors += ScalarType(err * err);
-                    sumConstraints += 1;
+                    acc.sumErrors += ScalarType(_loss.rho(err));
+                    acc.numConstraints += 1;
                     
                     // 3. Compute the target gradient warped back
-                    const GradientType grad = gradient<float, SAMPLE_BILINEAR, typename W::Traits>(target, ptgt);
+                    ScalarType gx, gy;
+                    if (useGradients) {
+                        gx = gxs[i];
+                        gy = gys[i];
+                    } else {
+                        gradient<float, SAMPLE_BILINEAR>(target, ptgt(0), ptgt(1), gx, gy, s);
+                    }
                     
                     // 4. Compute the jacobian for the template pixel position
-                    JacobianType jacobian = w.jacobian(ptpl);
+                    const JacobianType jacobian = w.jacobian(ptpl);
                     
                     // 5. Compute the steepest descent image (SDI) for current pixel location
-                    const PixelSDIType sd = grad * jacobian;
+                    detail::steepestDescent(gx, gy, jacobian, sd, np);
                     
-                    // 6. Update running sum of SDI times error
-                    b += sd.t() * err;
-                    
-                    // 7. Update Hessian
-                    hessian += sd.t() * sd;
+                    // 6. & 7. Update running sum of SDI times error and Hessian
+                    if (L::WEIGHTED) {
+                        detail::accumulateNormalEquations(sd, ScalarType(err), ScalarType(_loss.weight(err)), np, b, hessian);
+                    } else {
+                        detail::accumulateNormalEquations(sd, ScalarType(err), np, b, hessian);
+                    }
                 }
             }
-            
-            // 8. Solve Ax = b
-            ParamType delta = hessian.inv() * b;
-            
-            SingleStepResult<W> step;
-            step.delta = delta;
-            step.sumErrors = sumErrors;
-            step.numConstraints = sumConstraints;
-            
-            return step;
         }
         
         void applyStep(W &w, const SingleStepResult<W> &s) {
             w.updateForwardAdditive(s.delta);
         }
         
+        static int stateTag() {
+            return 3;
+        }
+        
     private:
-        friend class AlignBase< AlignForwardAdditive<W>, W>;
+        friend class AlignBase< AlignForwardAdditive<W, L>, W>;
+        
+        /**
+            Access interleaved gradients of current level, computing them if necessary.
+         
+            \return Empty matrix when gradients are approximated on the fly.
+         */
+        cv::Mat levelGradients()
+        {
+            const int level = this->level();
+            
+            if (_sharedGradients)
+                return _gradients[level];
+            
+            if (!_precomputeGradients)
+                return cv::Mat();
+            
+            if (!_gradientsReady[level]) {
+                _gradients.createLevel(level, this->targetImage(), this->executor());
+                _gradientsReady[level] = 1;
+            }
+            
+            return _gradients[level];
+        }
+        
+        HessianType _factorizedHessian;
+        ParamType _delta;
+        L _loss;
+        
+        bool _precomputeGradients;
+        bool _sharedGradients;
+        GradientPyramid _gradients;
+        std::vector<uchar> _gradientsReady;
+        cv::Mat _levelGradients;
     };
     
     
@@ -23,6 +23,8 @@
 #include <imagealign/align_base.h>
 #include <imagealign/sampling.h>
 #include <imagealign/gradient.h>
+#include <imagealign/linalg.h>
+#include <imagealign/robust_loss.h>
 #include <imagealign/warp_image.h>
 #include <opencv2/core/core.hpp>
 
@@ -58,6 +60,7 @@ namespace imagealign {
             - The way the new warp is calculated is by composition rather than addition of parameters.
      
         \tparam WarpType Type of warp motion to use during alignment. See EWarpType.
+        \tparam L Loss policy weighting pixels, see robust_loss.h. Defaults to least squares.
      
         ## Based on
      
@@ -70,8 +73,27 @@ namespace imagealign {
             Technical Report CMU-RI-TR-02-16, Carnegie Mellon University Robotics Institute, 2002.
 
      */
-    template<class W>
-    class AlignForwardCompositional : public AlignBase< AlignForwardCompositional<W>, W> {
+    template<class W, class L = LossSquared>
+    class AlignForwardCompositional : public AlignBase< AlignForwardCompositional<W, L>, W> {
+    public:
+        
+        typedef L LossType;
+        
+        /**
+            Set loss instance, for example to change its threshold.
+         */
+        AlignForwardCompositional &setLoss(const L &loss) {
+            _loss = loss;
+            return *this;
+        }
+        
+        /**
+            Access loss instance.
+         */
+        const L &loss() const {
+            return _loss;
+        }
+        
     protected:
         
         typedef typename W::Traits::ParamType ParamType;
@@ -85,30 +107,37 @@ namespace imagealign {
         /** 
             Prepare for alignment.
          
-            In the forward compositional algorithm only the Jacobian of the warp can be precomputed.
+            Per-level data is computed on first use of a level, see prepareLevelImpl.
          */
         void prepareImpl(const W &w)
         {
-            W w0(w);
-            w0.setIdentity();
+            (void)w;
             
-            _jacobianPyramid.resize(this->numLevels());
-            
-            for (int i = 0; i < this->numLevels(); ++i) {
-
-                cv::Size s = this->templateImagePyramid()[i].size();
-            
-                _jacobianPyramid[i].resize((s.width-2) * (s.height-2));
-            
-                int idx = 0;
-                for (int y = 1; y < s.height - 1; ++y) {
-                    for (int x = 1; x < s.width - 1; ++x, ++idx) {
-                        _jacobianPyramid[i][idx] = w0.jacobian(PointType(ScalarType(x), ScalarType(y)));
-                    }
+            _jacobianPyramid.assign(this->numLevels(), VecOfJacobians());
+            _jacobianTables.assign(this->numLevels(), cv::Mat());
+        }
+        
+        /**
+            Prepare a single pyramid level.
+         
+            In the forward compositional algorithm only the Jacobian of the warp can be precomputed.
+            Jacobians are stored at the table precision of the storage policy when their values fit.
+         */
+        void prepareLevelImpl(const W &w0, int i)
+        {
+            cv::Size s = this->templateImagePyramid()[i].size();
+        
+            _jacobianPyramid[i].resize((s.width-2) * (s.height-2));
+        
+            int idx = 0;
+            for (int y = 1; y < s.height - 1; ++y) {
+                for (int x = 1; x < s.width - 1; ++x, ++idx) {
+                    _jacobianPyramid[i][idx] = w0.jacobian(PointType(ScalarType(x), ScalarType(y)));
                 }
-
-                w0 = w0.scaled(-1);
             }
+            
+            if (this->storagePolicy().tables != STORAGE_FLOAT32)
+                storeJacobianTable(i, s, w0.numParameters(), this->storagePolicy().tables);
         }
         
         /** 
@@ -120,80 +149,199 @@ namespace imagealign {
             \param w Current state of warp estimation. Will be modified to hold updated warp.
          */
         SingleStepResult<W> alignImpl(W &w)
+        {
+            // Accumulate Hessian and b from all template rows
+            StepAccumulator<W> &acc = this->accumulateSteps(w);
+            
+            // 8. Solve Ax = b from the upper triangle of the Hessian
+            SingleStepResult<W> step;
+            step.conditioning = detail::factorizeLDLT<ScalarType>(acc.hessian, _factorizedHessian);
+            detail::solveLDLT<ScalarType>(_factorizedHessian, acc.b, _delta);
+            this->exportSystem(step, acc.hessian, acc.b);
+            
+            step.delta = _delta;
+            step.sumErrors = acc.sumErrors;
+            step.numConstraints = acc.numConstraints;
+            
+            return step;
+        }
+        
+        /**
+            Accumulate Hessian and error terms for template rows [rowBegin, rowEnd).
+         
+            Computing the gradient happens on the warped image. Since evaluating the gradient 
+            in both directions takes 4 bilinear lookups, the target is warped explicitly, but 
+            only for the rows at hand plus a one row halo for finite differences. Gradients are 
+            then taken a whole tile row at a time. The tile is 
+            consumed while it is still in cache, and no full size warped image is written and 
+            read back per iteration. Invoked concurrently on disjoint row ranges. Only the upper 
+            triangle of the Hessian is accumulated. With a template mask only pixels taking 
+            part are visited, pixels warped outside the target or onto invalid target pixels 
+            are skipped.
+         */
+        void accumulateRows(const W &w, int rowBegin, int rowEnd, StepAccumulator<W> &acc) const
         {
             cv::Mat tpl = this->templateImage();
             cv::Mat target = this->targetImage();
+            cv::Mat targetMask = this->targetMask();
             
-            // Computing the gradient happens on the warped image. Since evaluating the
-            // the gradient in both directions takes 4 bilinear lookups, we are better off
-            // warping the entire target image explicitely here.
-            warpImage<float, SAMPLE_BILINEAR>(target, _warpedTargetImage, tpl.size(), w);
+            const VecOfJacobians &jacobians = _jacobianPyramid[this->level()];
+            const cv::Mat &table = _jacobianTables[this->level()];
+            const SelectedPixels *selected = this->templatePixels();
             
-            HessianType hessian = W::Traits::zeroHessian(w.numParameters());
-            ParamType b = W::Traits::zeroParam(w.numParameters());
+            const int np = w.numParameters();
+            ScalarType *b = detail::rowPtr<ScalarType>(acc.b, 0);
+            ScalarType *hessian = detail::rowPtr<ScalarType>(acc.hessian, 0);
+            ScalarType *sd = acc.template scratch<ScalarType>(0, np);
+            float *tplBuffer = acc.template scratch<float>(1, tpl.cols);
+            float *jacobianBuffer = acc.template scratch<float>(2, table.cols);
             
-            Sampler<SAMPLE_NEAREST> s;
-
-            ScalarType sumErrors = 0;
-            int sumConstraints = 0;
+            // Warp target rows [rowBegin - 1, rowEnd] back onto the template
+            const int tileRows = rowEnd - rowBegin + 2;
+            cv::Mat tile(tileRows, tpl.cols, CV_32FC1, acc.template scratch<float>(3, tileRows * tpl.cols));
+            warpImageRows<float>(target, tile, rowBegin - 1, w, Sampler<SAMPLE_BILINEAR>());
             
-            int idx = 0;
-            for (int y = 1; y < tpl.rows - 1; ++y) {
+            float *gxRow = acc.template scratch<float>(5, tpl.cols);
+            float *gyRow = acc.template scratch<float>(6, tpl.cols);
+            
+            const int n = std::max<int>(0, tpl.cols - 2);
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                
+                // Row of y in tile, and the target gradient on it
+                const int ty = y - rowBegin + 1;
+                const float *tileRow = tile.ptr<float>(ty);
+                detail::gradientRow(tile, ty, GRADIENT_CENTRAL, gxRow, gyRow, 0);
                 
-                const float *tplRow = tpl.ptr<float>(y);
+                const float *tplRow = detail::loadRow(tpl, y, tplBuffer);
+                const float *jacobianRow = table.empty() ? 0 : detail::loadRow(table, y - 1, jacobianBuffer);
                 
-                for (int x = 1; x < tpl.cols - 1; ++x, ++idx) {
+                const int first = selected ? selected->begin(y - 1) : 0;
+                const int count = selected ? selected->begin(y) - first : n;
+                
+                for (int i = 0; i < count; ++i) {
+                    const int x = selected ? selected->col(first + i) + 1 : i + 1;
+                    const int idx = (y - 1) * n + x - 1;
+                    
+                    // Pixels warped off the target or onto invalid target pixels do not constrain
                     PointType ptpl;
                     ptpl << ScalarType(x), ScalarType(y);
+                    
+                    if (!this->isInTarget(w(ptpl), target.size(), targetMask))
+                        continue;
+                    
                     const float templateIntensity = tplRow[x];
                     
-                    // 1. Lookup the target intensity using the already back warped image.
-                    const float targetIntensity = s.sample<float>(_warpedTargetImage, ptpl);
+                    // 1. Lookup the target intensity using the already back warped tile.
+                    const float targetIntensity = tileRow[x];
                     
                     // 2. Compute the error
                     const float err = templateIntensity - targetIntensity;
-                    sumErrors += ScalarType(err * err);
-                    sumConstraints += 1;
+                    acc.sumErrors += ScalarType(_loss.rho(err));
+                    acc.numConstraints += 1;
                     
-                    // 3. Compute the target gradient on the warped image
-                    const GradientType grad = gradient<float, SAMPLE_NEAREST, typename W::Traits>(_warpedTargetImage, ptpl);
+                    // 3. Take the target gradient on the warped image
+                    const ScalarType gx = gxRow[x];
+                    const ScalarType gy = gyRow[x];
                     
                     // 4. Lookup the prec-computed Jacobian for the template pixel position corresponding to finest level.
-                    const JacobianType &jacobian = _jacobianPyramid[this->level()][idx];
-                    
                     // 5. Compute the steepest descent image (SDI) for current pixel location
-                    const PixelSDIType sd = grad * jacobian;
-                    
-                    // 6. Update running sum of SDI times error
-                    b += sd.t() * err;
+                    if (jacobianRow) {
+                        const float *j = jacobianRow + (x - 1) * 2 * np;
+                        detail::steepestDescent(gx, gy, j, j + np, sd, np);
+                    } else {
+                        detail::steepestDescent(gx, gy, jacobians[idx], sd, np);
+                    }
                     
-                    // 7. Update Hessian
-                    hessian += sd.t() * sd;
+                    // 6. & 7. Update running sum of SDI times error and Hessian
+                    if (L::WEIGHTED) {
+                        detail::accumulateNormalEquations(sd, ScalarType(err), ScalarType(_loss.weight(err)), np, b, hessian);
+                    } else {
+                        detail::accumulateNormalEquations(sd, ScalarType(err), np, b, hessian);
+                    }
                 }
             }
-            
-            // 8. Solve Ax = b
-            ParamType delta = hessian.inv() * b;
-            
-            SingleStepResult<W> step;
-            step.delta = delta;
-            step.sumErrors = sumErrors;
-            step.numConstraints = sumConstraints;
-            
-            return step;
         }
         
         void applyStep(W &w, const SingleStepResult<W> &s) {
             w.updateForwardCompositional(s.delta);
         }
         
+        /**
+            Write reduced precision Jacobian tables of all levels.
+         
+            Full precision Jacobians only depend on the warp and the template size, they are
+            recomputed when read back.
+         */
+        void serializeImpl(detail::StateWriter &out) const
+        {
+            for (int i = 0; i < this->templateLevels(); ++i)
+                out.mat(_jacobianTables[i]);
+        }
+        
+        /**
+            Read state written by serializeImpl. Jacobian tables reference the buffer.
+         */
+        void deserializeImpl(detail::StateReader &in)
+        {
+            for (int i = 0; i < this->templateLevels(); ++i) {
+                _jacobianTables[i] = in.mat();
+                
+                if (_jacobianTables[i].empty())
+                    prepareLevelImpl(this->identityWarp(i), i);
+            }
+        }
+        
+        static int stateTag() {
+            return 2;
+        }
+        
     private:
-        friend class AlignBase< AlignForwardCompositional<W>, W>;
+        friend class AlignBase< AlignForwardCompositional<W, L>, W>;
         
         typedef std::vector< typename W::Traits::JacobianType > VecOfJacobians;
+        
+        /**
+            Move Jacobians of level into a reduced precision table, one row per template row.
+         
+            Each pixel holds both Jacobian rows. Levels whose values exceed the storage range 
+            keep their Jacobians at full precision.
+         */
+        void storeJacobianTable(int i, cv::Size s, int np, int storage)
+        {
+            const VecOfJacobians &jacobians = _jacobianPyramid[i];
+            
+            cv::Mat table(std::max<int>(0, s.height - 2), std::max<int>(0, s.width - 2) * 2 * np, CV_32FC1);
+            
+            int idx = 0;
+            float maxAbs = 0.f;
+            for (int y = 0; y < table.rows; ++y) {
+                float *row = table.ptr<float>(y);
+                
+                for (int x = 0; x < s.width - 2; ++x, ++idx) {
+                    const ScalarType *j0 = detail::rowPtr<ScalarType>(jacobians[idx], 0);
+                    const ScalarType *j1 = detail::rowPtr<ScalarType>(jacobians[idx], 1);
+                    
+                    for (int k = 0; k < np; ++k) {
+                        row[2 * x * np + k] = float(j0[k]);
+                        row[(2 * x + 1) * np + k] = float(j1[k]);
+                        maxAbs = std::max<float>(maxAbs, std::max<float>(std::abs(row[2 * x * np + k]), std::abs(row[(2 * x + 1) * np + k])));
+                    }
+                }
+            }
+            
+            if (maxAbs > detail::HALF_MAX)
+                return;
+            
+            detail::convertToStorage(table, _jacobianTables[i], storage);
+            VecOfJacobians().swap(_jacobianPyramid[i]);
+        }
+        
         std::vector<VecOfJacobians> _jacobianPyramid;
+        std::vector<cv::Mat> _jacobianTables;
         
-        cv::Mat _warpedTargetImage;
+        HessianType _factorizedHessian;
+        ParamType _delta;
+        L _loss;
     };
     
     
@@ -0,0 +1,220 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_GRADIENT_PYRAMID_H
+#define IMAGE_ALIGN_GRADIENT_PYRAMID_H
+
+#include <imagealign/config.h>
+#include <imagealign/parallel.h>
+#include <imagealign/image_pyramid.h>
+#include <imagealign/gradient.h>
+#include <imagealign/sampling.h>
+#include <opencv2/core/core.hpp>
+#include <vector>
+
+namespace imagealign {
+    
+    namespace detail {
+        
+        /**
+            Interleave intensities and gradients of rows [rowBegin, rowEnd).
+         
+            Each destination pixel holds intensity, x-derivative and y-derivative. Borders are 
+            handled through BORDER_REFLECT_101, matching the bilinear sampler.
+         */
+        inline void interleaveGradientRows(const cv::Mat &src, cv::Mat &dst, int rowBegin, int rowEnd, int kernel)
+        {
+            const int cols = src.cols;
+            
+            std::vector<float> buffer(4 * cols);
+            float *gx = &buffer[0];
+            float *gy = gx + cols;
+            
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                gradientRow(src, y, kernel, gx, gy, gy + cols);
+                
+                const float *r = src.ptr<float>(y);
+                float *d = dst.ptr<float>(y);
+                
+                for (int x = 0; x < cols; ++x) {
+                    d[3 * x + 0] = r[x];
+                    d[3 * x + 1] = gx[x];
+                    d[3 * x + 2] = gy[x];
+                }
+            }
+        }
+        
+        class InterleaveGradientTask : public ParallelTask {
+        public:
+            InterleaveGradientTask(const cv::Mat &src, cv::Mat &dst, int kernel)
+                : _src(src), _dst(dst), _kernel(kernel)
+            {}
+            
+            void operator()(int task) const {
+                const int b = task * GRADIENT_BAND_ROWS;
+                const int e = std::min<int>(_src.rows, b + GRADIENT_BAND_ROWS);
+                interleaveGradientRows(_src, _dst, b, e, _kernel);
+            }
+            
+        private:
+            const cv::Mat &_src;
+            cv::Mat &_dst;
+            int _kernel;
+        };
+        
+        /**
+            Compute interleaved intensity and gradient image of single precision image src in parallel row bands.
+         */
+        inline void interleaveGradients(const cv::Mat &src, cv::Mat &dst, const Executor &e, int kernel = GRADIENT_CENTRAL)
+        {
+            CV_Assert(src.type() == CV_32FC1);
+            
+            dst.create(src.size(), CV_32FC3);
+            
+            InterleaveGradientTask task(src, dst, kernel);
+            e.run((src.rows + GRADIENT_BAND_ROWS - 1) / GRADIENT_BAND_ROWS, task);
+        }
+        
+        /**
+            Bilinear sampling of a span of locations in an interleaved gradient image.
+         
+            Intensity and both derivatives share the four taps of each location, so each location
+            touches memory once. Blocks whose locations all lie inside the image skip border handling.
+            Intensities equal those of Sampler<SAMPLE_BILINEAR>, including 0 for non-finite coordinates.
+         */
+        template<class Scalar>
+        inline void sampleIntensityGradient(const cv::Mat &ig, const Scalar *xs, const Scalar *ys, int n,
+                                            float *intensities, Scalar *gx, Scalar *gy)
+        {
+            for (int i = 0; i < n; i += SAMPLE_BLOCK_SIZE) {
+                const int count = std::min<int>(SAMPLE_BLOCK_SIZE, n - i);
+                const bool interior = spanIsInterior(ig, xs + i, ys + i, count);
+                
+                for (int k = i; k < i + count; ++k) {
+                    if (!interior && !isFinite(xs[k], ys[k])) {
+                        intensities[k] = 0.f;
+                        gx[k] = gy[k] = Scalar(0);
+                        continue;
+                    }
+                    
+                    const Scalar x = interior ? xs[k] : foldReflect101(xs[k], ig.cols);
+                    const Scalar y = interior ? ys[k] : foldReflect101(ys[k], ig.rows);
+                    
+                    const int ix = static_cast<int>(std::floor(x));
+                    const int iy = static_cast<int>(std::floor(y));
+                    
+                    int x0 = ix, x1 = ix + 1, y0 = iy, y1 = iy + 1;
+                    if (!interior) {
+                        x0 = cv::borderInterpolate(x0, ig.cols, cv::BORDER_REFLECT_101);
+                        x1 = cv::borderInterpolate(x1, ig.cols, cv::BORDER_REFLECT_101);
+                        y0 = cv::borderInterpolate(y0, ig.rows, cv::BORDER_REFLECT_101);
+                        y1 = cv::borderInterpolate(y1, ig.rows, cv::BORDER_REFLECT_101);
+                    }
+                    
+                    const Scalar a = x - (Scalar)ix;
+                    const Scalar b = y - (Scalar)iy;
+                    
+                    const float *f0 = ig.ptr<float>(y0) + 3 * x0;
+                    const float *f1 = ig.ptr<float>(y0) + 3 * x1;
+                    const float *f2 = ig.ptr<float>(y1) + 3 * x0;
+                    const float *f3 = ig.ptr<float>(y1) + 3 * x1;
+                    
+                    Scalar v[3];
+                    for (int c = 0; c < 3; ++c) {
+                        v[c] = (f0[c] * (Scalar(1) - a) + f1[c] * a) * (Scalar(1) - b) +
+                               (f2[c] * (Scalar(1) - a) + f3[c] * a) * b;
+                    }
+                    
+                    intensities[k] = cv::saturate_cast<float>(v[0]);
+                    gx[k] = v[1];
+                    gy[k] = v[2];
+                }
+            }
+        }
+    }
+    
+    /**
+        Hierarchical pyramid of image gradients.
+     
+        Each level is a three channel single precision image holding intensity, x-derivative and 
+        y-derivative of the corresponding ImagePyramid level. Derivatives are central differences
+        by default, see gradientImages for the kernels available.
+        Interleaving allows sampling intensity and gradient of a location in a single pass.
+     
+        Like ImagePyramid, copies share level data. A gradient pyramid built once from a target 
+        pyramid can thus be shared among all aligners working on the same target.
+     */
+    class GradientPyramid {
+    public:
+        
+        /**
+            Create gradient pyramid for all levels of image pyramid.
+         
+            Existing level buffers are reused when their size matches.
+         
+            \param pyr Image pyramid of single precision levels.
+            \param e Executor to parallelize computation with.
+            \param kernel Derivative kernel, see gradientImages.
+         */
+        inline void create(const ImagePyramid &pyr, const Executor &e = defaultExecutor(), int kernel = GRADIENT_CENTRAL) {
+            _pyr.resize(pyr.numLevels());
+            
+            for (int i = 0; i < pyr.numLevels(); ++i) {
+                detail::interleaveGradients(pyr[i], _pyr[i], e, kernel);
+            }
+        }
+        
+        /**
+            Compute a single level.
+         
+            Grows the pyramid as necessary. Levels added in between remain empty until computed.
+         
+            \param level Level to compute.
+            \param img Single precision image of level.
+            \param e Executor to parallelize computation with.
+            \param kernel Derivative kernel, see gradientImages.
+         */
+        inline void createLevel(int level, const cv::Mat &img, const Executor &e = defaultExecutor(), int kernel = GRADIENT_CENTRAL) {
+            if (numLevels() <= level)
+                _pyr.resize(level + 1);
+            
+            detail::interleaveGradients(img, _pyr[level], e, kernel);
+        }
+        
+        /**
+            Access the number of levels in the pyramid
+         */
+        inline int numLevels() const {
+            return (int)_pyr.size();
+        }
+        
+        /**
+            Return the interleaved gradient image corresponding to the i-th level.
+         */
+        inline cv::Mat operator[](size_t level) const {
+            return _pyr[level];
+        }
+        
+    private:
+        std::vector<cv::Mat> _pyr;
+    };
+    
+}
+
+#endif
@@ -21,6 +21,8 @@
 #define IMAGE_IMAGE_PYRAMID_H
 
 #include <imagealign/config.h>
+#include <imagealign/parallel.h>
+#include <imagealign/storage.h>
 #include <vector>
 
 IA_DISABLE_PRAGMA_WARN(4190)
@@ -32,35 +34,380 @@ IA_DISABLE_PRAGMA_WARN_END
 
 namespace imagealign {
     
+    /**
+        Strategy to compute the levels of an ImagePyramid.
+     
+        Implement this interface to plug a custom downsampling scheme into ImagePyramid.
+        Implementations should write through create() to reuse buffers of existing levels.
+     */
+    class PyramidBuilder {
+    public:
+        virtual ~PyramidBuilder() {}
+        
+        /**
+            Compute all levels from image.
+         
+            The default implementation converts the image and downsamples level by level.
+         
+            \param img Source image.
+            \param levels Levels to fill, already sized to the number of requested levels. Level 0 
+                   needs to be a single precision image of the same size as img.
+            \param e Executor to parallelize work with.
+         */
+        virtual void build(const cv::Mat &img, std::vector<cv::Mat> &levels, const Executor &e) const {
+            if (levels.empty())
+                return;
+            
+            img.convertTo(levels[0], CV_32F);
+            
+            for (size_t i = 1; i < levels.size(); ++i) {
+                downsample(levels[i-1], levels[i], e);
+            }
+        }
+        
+        /**
+            Compute the next coarser level.
+         
+            \param finer Finer level.
+            \param coarser Level to fill.
+            \param e Executor to parallelize work with.
+         */
+        virtual void downsample(const cv::Mat &finer, cv::Mat &coarser, const Executor &e) const = 0;
+    };
+    
+    namespace detail {
+        
+        /** Number of destination rows per task when downsampling. */
+        const int PYRAMID_BAND_ROWS = 32;
+        
+        /** Reflect index into [0, len) without repeating the border pixel. */
+        inline int reflect101(int p, int len) {
+            if (len == 1)
+                return 0;
+            if (p < 0)
+                p = -p;
+            if (p >= len)
+                p = 2 * len - 2 - p;
+            return p;
+        }
+        
+        /**
+            Gaussian 5-tap downsampling of destination rows [rowBegin, rowEnd).
+         
+            Matches cv::pyrDown with BORDER_REFLECT_101. Source rows are converted to float 
+            once and filtered horizontally into a ring buffer of five rows. When base is
+            given, converted source rows covered by this band are also written to base, which
+            fuses type conversion of the base level with building the next level. Channels
+            are interleaved and filtered independently.
+         
+            \tparam CN Number of channels.
+         */
+        template<class T, int CN>
+        void pyrDownRows(const cv::Mat &src, cv::Mat &dst, int rowBegin, int rowEnd, cv::Mat *base)
+        {
+            const int cols = src.cols;
+            const int rows = src.rows;
+            const int dcols = dst.cols;
+            
+            // Base rows written by this band
+            const int ownBegin = 2 * rowBegin;
+            const int ownEnd = (rowEnd == dst.rows) ? rows : 2 * rowEnd;
+            
+            cv::AutoBuffer<float> ringBuffer(5 * dcols * CN);
+            cv::AutoBuffer<float> converted(cols * CN);
+            int ringRow[5] = {-1, -1, -1, -1, -1};
+            
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                
+                const float *r[5];
+                
+                for (int k = 0; k < 5; ++k) {
+                    const int sy = reflect101(2 * y + k - 2, rows);
+                    const int slot = sy % 5;
+                    float *h = (float*)ringBuffer + slot * dcols * CN;
+                    
+                    if (ringRow[slot] != sy) {
+                        // Convert source row
+                        const T *srow = src.ptr<T>(sy);
+                        float *c = (base && sy >= ownBegin && sy < ownEnd) ? base->ptr<float>(sy) : (float*)converted;
+                        
+                        for (int x = 0; x < cols * CN; ++x) {
+                            c[x] = float(srow[x]);
+                        }
+                        
+                        // Horizontal pass
+                        int x = 0;
+                        for (; x < dcols && 2 * x - 2 < 0; ++x) {
+                            for (int ch = 0; ch < CN; ++ch) {
+                                h[x * CN + ch] = c[reflect101(2 * x - 2, cols) * CN + ch] + c[reflect101(2 * x + 2, cols) * CN + ch] +
+                                                 (c[reflect101(2 * x - 1, cols) * CN + ch] + c[reflect101(2 * x + 1, cols) * CN + ch]) * 4.f + c[reflect101(2 * x, cols) * CN + ch] * 6.f;
+                            }
+                        }
+                        
+                        for (; x < dcols && 2 * x + 2 < cols; ++x) {
+                            for (int ch = 0; ch < CN; ++ch) {
+                                const float *cc = c + 2 * x * CN + ch;
+                                h[x * CN + ch] = cc[-2 * CN] + cc[2 * CN] + (cc[-CN] + cc[CN]) * 4.f + cc[0] * 6.f;
+                            }
+                        }
+                        
+                        for (; x < dcols; ++x) {
+                            for (int ch = 0; ch < CN; ++ch) {
+                                h[x * CN + ch] = c[reflect101(2 * x - 2, cols) * CN + ch] + c[reflect101(2 * x + 2, cols) * CN + ch] +
+                                                 (c[reflect101(2 * x - 1, cols) * CN + ch] + c[reflect101(2 * x + 1, cols) * CN + ch]) * 4.f + c[reflect101(2 * x, cols) * CN + ch] * 6.f;
+                            }
+                        }
+                        
+                        ringRow[slot] = sy;
+                    }
+                    
+                    r[k] = h;
+                }
+                
+                // Vertical pass
+                float *drow = dst.ptr<float>(y);
+                for (int x = 0; x < dcols * CN; ++x) {
+                    drow[x] = (r[0][x] + r[4][x] + (r[1][x] + r[3][x]) * 4.f + r[2][x] * 6.f) * (1.f / 256.f);
+                }
+            }
+        }
+        
+        template<class T, int CN>
+        class PyrDownTask : public ParallelTask {
+        public:
+            PyrDownTask(const cv::Mat &src, cv::Mat &dst, cv::Mat *base)
+                : _src(src), _dst(dst), _base(base)
+            {}
+            
+            void operator()(int task) const {
+                const int b = task * PYRAMID_BAND_ROWS;
+                const int e = std::min<int>(_dst.rows, b + PYRAMID_BAND_ROWS);
+                pyrDownRows<T, CN>(_src, _dst, b, e, _base);
+            }
+            
+        private:
+            const cv::Mat &_src;
+            cv::Mat &_dst;
+            cv::Mat *_base;
+        };
+        
+        /** True when pyrDown supports the number of channels of img. */
+        inline bool pyrDownSupports(const cv::Mat &img) {
+            return img.channels() == 1 || img.channels() == 3 || img.channels() == 4;
+        }
+        
+        /**
+            Downsample src into dst in parallel row bands. Optionally writes src converted to float into base.
+         
+            Supports 1, 3 and 4 interleaved channels, see pyrDownSupports.
+         */
+        template<class T>
+        void pyrDown(const cv::Mat &src, cv::Mat &dst, cv::Mat *base, const Executor &e)
+        {
+            const int cn = src.channels();
+            
+            if (base)
+                base->create(src.size(), CV_MAKETYPE(CV_32F, cn));
+            
+            dst.create(cv::Size((src.cols + 1) / 2, (src.rows + 1) / 2), CV_MAKETYPE(CV_32F, cn));
+            
+            const int numTasks = (dst.rows + PYRAMID_BAND_ROWS - 1) / PYRAMID_BAND_ROWS;
+            if (cn == 3) {
+                PyrDownTask<T, 3> task(src, dst, base);
+                e.run(numTasks, task);
+            } else if (cn == 4) {
+                PyrDownTask<T, 4> task(src, dst, base);
+                e.run(numTasks, task);
+            } else {
+                CV_Assert(cn == 1);
+                PyrDownTask<T, 1> task(src, dst, base);
+                e.run(numTasks, task);
+            }
+        }
+    }
+    
+    /**
+        Default pyramid builder.
+     
+        Smoothes with a 5x5 Gaussian and drops every other row and column, equivalent to 
+        cv::pyrDown. For 8-bit and float images with 1, 3 or 4 interleaved channels the 
+        conversion of the base level is fused with building the first coarser level into a 
+        single pass over the input, and each level is computed in parallel row bands.
+     */
+    class GaussianPyramidBuilder : public PyramidBuilder {
+    public:
+        void build(const cv::Mat &img, std::vector<cv::Mat> &levels, const Executor &e) const {
+            if (levels.empty())
+                return;
+            
+            const bool fused = (img.depth() == CV_8U || img.depth() == CV_32F) && detail::pyrDownSupports(img) && img.data != levels[0].data;
+            
+            if (fused && levels.size() > 1) {
+                if (img.depth() == CV_8U) {
+                    detail::pyrDown<uchar>(img, levels[1], &levels[0], e);
+                } else {
+                    detail::pyrDown<float>(img, levels[1], &levels[0], e);
+                }
+            } else {
+                img.convertTo(levels[0], CV_32F);
+                
+                if (levels.size() > 1)
+                    downsample(levels[0], levels[1], e);
+            }
+            
+            for (size_t i = 2; i < levels.size(); ++i) {
+                downsample(levels[i-1], levels[i], e);
+            }
+        }
+        
+        void downsample(const cv::Mat &src, cv::Mat &dst, const Executor &e) const {
+            if (detail::pyrDownSupports(src)) {
+                detail::pyrDown<float>(src, dst, 0, e);
+            } else {
+                cv::pyrDown(src, dst);
+            }
+        }
+    };
+    
+    /**
+        Access the default pyramid builder.
+     */
+    inline const PyramidBuilder &defaultPyramidBuilder() {
+        static GaussianPyramidBuilder b;
+        return b;
+    }
+    
     /** 
         Hierarchical image pyramid.
      
         Lower levels correspond to coarser images. Levels are generated recursively,
         by smoothing and shrinking parent levels successively.
+     
+        Buffers of levels dropped by creating fewer levels are retained and reused when the 
+        pyramid grows again. Copies share level data, but not retained buffers.
+     
+        Levels are single precision by default and keep the channels of the image interleaved. 
+        Pyramids can be stored at reduced precision, see setStorage. Levels are then converted 
+        while being built, and consumers read them through detail::loadRow.
     */
     class ImagePyramid {
     public:
 
         inline ImagePyramid()
+            : _builder(&defaultPyramidBuilder()), _storage(STORAGE_FLOAT32)
         {}
 
         inline explicit ImagePyramid(const std::vector<cv::Mat> &imgs) 
-            :_pyr(imgs)
+            :_pyr(imgs), _builder(&defaultPyramidBuilder()), _storage(STORAGE_FLOAT32)
+        {
+            if (!imgs.empty())
+                _storage = detail::storageOf(imgs[0]);
+        }
+        
+        inline ImagePyramid(const ImagePyramid &other)
+            :_pyr(other._pyr), _builder(other._builder), _storage(other._storage)
         {}
         
-        /** Create image pyramid from image. */
-        inline void create(cv::InputArray img, int levels) {
+        inline ImagePyramid &operator=(const ImagePyramid &other) {
+            if (this != &other) {
+                _pyr = other._pyr;
+                _spare.clear();
+                _scratch.clear();
+                _builder = other._builder;
+                _storage = other._storage;
+            }
+            return *this;
+        }
+        
+        /**
+            Set storage precision of levels built by subsequent calls to create and extend.
+         
+            STORAGE_UINT8 and STORAGE_UINT16 require intensities in [0, 255].
+         
+            \param storage One of the storage constants, see storage.h.
+         */
+        inline ImagePyramid &setStorage(int storage) {
+            _storage = storage;
+            return *this;
+        }
+        
+        /**
+            Access storage precision of levels.
+         */
+        inline int storage() const {
+            return _storage;
+        }
+        
+        /** 
+            Create image pyramid from image. 
+         
+            Existing level buffers are reused when their size and type match. Like cv::Mat::create 
+            this overwrites data seen through headers previously returned by operator[].
+         
+            \param img Source image. Converted to floating point for level 0.
+            \param levels Number of levels to generate.
+            \param e Executor to parallelize level construction with.
+            \param builder Strategy to compute levels. Must outlive this object when extend is used.
+         */
+        inline void create(cv::InputArray img, int levels, 
+                           const Executor &e = defaultExecutor(), 
+                           const PyramidBuilder &builder = defaultPyramidBuilder()) 
+        {
+            resizeLevels(std::max<int>(levels, 1));
+            _builder = &builder;
             
-            levels = std::max<int>(levels, 1);
-            _pyr.resize(levels);
+            if (_storage == STORAGE_FLOAT32) {
+                // All images are floating point
+                builder.build(img.getMat(), _pyr, e);
+                _scratch.clear();
+                return;
+            }
             
-            // All images are floating point
-            img.getMat().convertTo(_pyr[0], CV_32F);
+            // Build in single precision, then convert to storage
+            _scratch.resize(_pyr.size());
+            builder.build(img.getMat(), _scratch, e);
             
-            for (int i = 1; i < levels; ++i) {
-                cv::pyrDown(_pyr[i-1], _pyr[i]);
+            for (size_t i = 0; i < _pyr.size(); ++i) {
+                detail::convertToStorage(_scratch[i], _pyr[i], _storage);
+            }
+        }
+        
+        /**
+            Add coarser levels until the pyramid has the given number of levels.
+         
+            Allows creating a pyramid with few levels upfront and materializing coarser 
+            levels on demand. Uses the builder of the last call to create. Reduced storage 
+            levels are downsampled from single precision versions of the finer levels, so 
+            results equal creating all levels at once.
+         
+            \param levels Total number of levels requested.
+            \param e Executor to parallelize level construction with.
+         */
+        inline void extend(int levels, const Executor &e = defaultExecutor()) {
+            CV_Assert(numLevels() > 0);
+            
+            int i = numLevels();
+            resizeLevels(std::max<int>(levels, i));
+            
+            if (detail::storageOf(_pyr[i-1]) == STORAGE_FLOAT32 && _storage == STORAGE_FLOAT32) {
+                for (; i < numLevels(); ++i) {
+                    _builder->downsample(_pyr[i-1], _pyr[i], e);
+                }
+                return;
+            }
+            
+            // Single precision levels are kept from create and previous extends. Pyramids 
+            // copied or constructed from images start from the stored finest level.
+            if ((int)_scratch.size() != i) {
+                _scratch.resize(i);
+                detail::convertFromStorage(_pyr[i-1], _scratch[i-1]);
             }
             
+            _scratch.resize(numLevels());
+            for (; i < numLevels(); ++i) {
+                _builder->downsample(_scratch[i-1], _scratch[i], e);
+                detail::convertToStorage(_scratch[i], _pyr[i], _storage);
+            }
         }
 
         inline ImagePyramid slice(int startLevel, int numLevels) const {
@@ -85,6 +432,17 @@ namespace imagealign {
             return _pyr[level];
         }
         
+        /**
+            Number of bytes occupied by level data.
+         */
+        inline size_t memoryUsage() const {
+            size_t bytes = 0;
+            for (size_t i = 0; i < _pyr.size(); ++i) {
+                bytes += _pyr[i].total() * _pyr[i].elemSize();
+            }
+            return bytes;
+        }
+        
         /** 
             Return the maximum number of levels for image size.
         */
@@ -99,7 +457,32 @@ namespace imagealign {
         }
         
     private:
+        
+        inline void resizeLevels(int levels) {
+            while ((int)_pyr.size() > levels) {
+                _spare.insert(_spare.begin(), _pyr.back());
+                _pyr.pop_back();
+            }
+            
+            while ((int)_pyr.size() < levels) {
+                if (_spare.empty()) {
+                    _pyr.push_back(cv::Mat());
+                } else {
+                    _pyr.push_back(_spare.front());
+                    _spare.erase(_spare.begin());
+                }
+            }
+        }
+        
         std::vector<cv::Mat> _pyr;
+        std::vector<cv::Mat> _spare;
+        /** 
+            Single precision levels reduced storage pyramids are built into, kept for the leading 
+            levels of _pyr to extend from. Never shared with copies.
+         */
+        std::vector<cv::Mat> _scratch;
+        const PyramidBuilder *_builder;
+        int _storage;
     };
     
 }
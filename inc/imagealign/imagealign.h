@@ -24,5 +24,9 @@
 #include <imagealign/forward_additive.h>
 #include <imagealign/forward_compositional.h>
 #include <imagealign/inverse_compositional.h>
+#include <imagealign/inverse_compositional_patch.h>
+#include <imagealign/multi_template_tracker.h>
+#include <imagealign/dense_flow.h>
+#include <imagealign/streaming_tracker.h>
 
 #endif
\ No newline at end of file
@@ -23,6 +23,10 @@
 #include <imagealign/align_base.h>
 #include <imagealign/sampling.h>
 #include <imagealign/gradient.h>
+#include <imagealign/steepest_descent.h>
+#include <imagealign/pixel_selection.h>
+#include <imagealign/robust_loss.h>
+#include <imagealign/linalg.h>
 #include <opencv2/core/core.hpp>
 #include <iostream>
 
@@ -57,6 +61,9 @@ namespace imagealign {
             - The Hessian is computed from the SDI above.
      
         \tparam WarpType Type of warp motion to use during alignment. See EWarpType.
+        \tparam L Loss policy weighting pixels, see robust_loss.h. Defaults to least squares.
+                 With a weighted loss the Hessian depends on the errors and is accumulated per 
+                 iteration from the precomputed steepest descent images.
      
         ## Based on
      
@@ -69,8 +76,71 @@ namespace imagealign {
             Technical Report CMU-RI-TR-02-16, Carnegie Mellon University Robotics Institute, 2002.
 
      */
-    template<class W>
-    class AlignInverseCompositional : public AlignBase< AlignInverseCompositional<W>, W > {
+    template<class W, class L = LossSquared>
+    class AlignInverseCompositional : public AlignBase< AlignInverseCompositional<W, L>, W > {
+    public:
+        
+        typedef L LossType;
+        
+        AlignInverseCompositional()
+            : _gradientKernel(GRADIENT_CENTRAL), _levelGradientKernel(GRADIENT_CENTRAL)
+        {}
+        
+        /**
+            Set loss instance, for example to change its threshold.
+         */
+        AlignInverseCompositional &setLoss(const L &loss) {
+            _loss = loss;
+            return *this;
+        }
+        
+        /**
+            Access loss instance.
+         */
+        const L &loss() const {
+            return _loss;
+        }
+        
+        /**
+            Restrict alignment to selected template pixels.
+         
+            Pixels are selected per level by template gradient magnitude when the level is 
+            prepared. Only selected pixels contribute to the Hessian and are visited per iteration, 
+            and their steepest descent images are stored compactly. Takes effect with the next 
+            call to prepare. By default all pixels are used.
+         */
+        AlignInverseCompositional &setPixelSelection(const PixelSelection &s) {
+            _pixelSelection = s;
+            return *this;
+        }
+        
+        /**
+            Access pixel selection criteria.
+         */
+        const PixelSelection &pixelSelection() const {
+            return _pixelSelection;
+        }
+        
+        /**
+            Set derivative kernel of template gradients, see gradientImages.
+         
+            Smoothing kernels such as GRADIENT_SOBEL make steepest descent images less 
+            sensitive to noise in the template. Takes effect with the next call to prepare. 
+            Defaults to GRADIENT_CENTRAL.
+         */
+        AlignInverseCompositional &setGradientKernel(int kernel) {
+            CV_Assert(kernel == GRADIENT_CENTRAL || kernel == GRADIENT_SOBEL || kernel == GRADIENT_SCHARR);
+            _gradientKernel = kernel;
+            return *this;
+        }
+        
+        /**
+            Access derivative kernel of template gradients.
+         */
+        int gradientKernel() const {
+            return _gradientKernel;
+        }
+        
     protected:
         
         typedef typename W::Traits::ParamType ParamType;
@@ -84,56 +154,143 @@ namespace imagealign {
         /**
             Prepare for alignment.
          
-            In the forward compositional algorithm only the Jacobian of the warp can be precomputed.
+            Per-level data is computed on first use of a level, see prepareLevelImpl.
          */
         void prepareImpl(const W &w)
         {
-            W w0(w);
-            w0.setIdentity();
+            (void)w;
             
             _sdiPyramid.resize(this->numLevels());
-            _invHessians.resize(this->numLevels());
+            _factorizedHessians.resize(this->numLevels());
+            _hessians.resize(this->numLevels());
+            _conditioning.assign(this->numLevels(), ScalarType(0));
+            _selectedPixels.assign(this->numLevels(), SelectedPixels());
+            _selectedIntensities.assign(this->numLevels(), std::vector<float>());
+            _levelSelection = _pixelSelection;
+            _levelGradientKernel = _gradientKernel;
+        }
+        
+        /**
+            Prepare a single pyramid level.
+         
+            In the inverse compositional algorithm the steepest descent images and the factorized
+            Hessian are precomputed from the template. Steepest descent images are stored at the
+            table precision of the storage policy when their values fit. When pixels are selected
+            or masked, steepest descent images and intensities of remaining pixels are stored in 
+            a single row, ordered as in SelectedPixels.
+         
+            Multi-channel templates contribute one steepest descent image per channel and pixel. 
+            Values of all channels of a pixel are stored next to each other, so rows of planes 
+            line up with interleaved template and target rows, and all channels are stacked 
+            into a single Hessian. Pixel selection ranks pixels by gradient magnitude over all 
+            channels.
+         */
+        void prepareLevelImpl(const W &w0, int i)
+        {
+            cv::Mat tpl = detail::floatImage(this->templateImagePyramid()[i]);
+            cv::Size s = tpl.size();
+            const int cn = tpl.channels();
             
-            for (int i = 0; i < this->numLevels(); ++i) {
-                
-                cv::Mat tpl = this->templateImagePyramid()[i];
-                cv::Size s = tpl.size();
+            // 1. Compute the gradient of the template in a single pass
+            cv::Mat gxs, gys;
+            gradientImages(tpl, gxs, gys, _levelGradientKernel, this->executor());
+            
+            const cv::Mat templateMask = this->templateMask(i);
+            const bool sparse = _levelSelection.enabled() || !templateMask.empty();
+            SelectedPixels &selected = _selectedPixels[i];
+            
+            if (sparse) {
+                cv::Mat magnitudes(std::max<int>(0, s.height - 2), std::max<int>(0, s.width - 2), CV_32FC1);
+                for (int y = 1; y < tpl.rows - 1 ; ++y) {
+                    const float *gxRow = gxs.ptr<float>(y);
+                    const float *gyRow = gys.ptr<float>(y);
+                    float *m = magnitudes.ptr<float>(y - 1);
+                    
+                    for (int x = 1; x < tpl.cols - 1; ++x) {
+                        float sum = 0.f;
+                        for (int c = x * cn; c < (x + 1) * cn; ++c) {
+                            sum += gxRow[c] * gxRow[c] + gyRow[c] * gyRow[c];
+                        }
+                        m[x - 1] = std::sqrt(sum);
+                    }
+                }
                 
-                _sdiPyramid[i].resize((s.width-2) * (s.height-2));
+                cv::Mat valid;
+                if (!templateMask.empty())
+                    valid = templateMask(cv::Rect(1, 1, magnitudes.cols, magnitudes.rows));
                 
-                HessianType hessian = W::Traits::zeroHessian(w.numParameters());
+                cv::Mat mask;
+                detail::selectPixels(magnitudes, _levelSelection, mask, valid);
+                selected.create(mask);
+                _selectedIntensities[i].resize(selected.size() * cn);
+            }
+            
+            const bool reduced = this->storagePolicy().tables != STORAGE_FLOAT32;
+            
+            SteepestDescentPlanes floatPlanes;
+            SteepestDescentPlanes &planes = reduced ? floatPlanes : _sdiPyramid[i];
+            if (sparse) {
+                planes.create(w0.numParameters(), 1, selected.size() * cn);
+            } else {
+                planes.create(w0.numParameters(), s.height - 2, (s.width - 2) * cn);
+            }
+            float maxAbs = 0.f;
+            
+            const int np = w0.numParameters();
+            HessianType hessian = W::Traits::zeroHessian(np);
+            ScalarType *h = detail::rowPtr<ScalarType>(hessian, 0);
+            
+            std::vector<ScalarType> sd(np);
+            
+            for (int y = 1; y < tpl.rows - 1 ; ++y) {
+                const int count = sparse ? selected.begin(y) - selected.begin(y - 1) : tpl.cols - 2;
+                const float *gxRow = gxs.ptr<float>(y);
+                const float *gyRow = gys.ptr<float>(y);
                 
-                int idx = 0;
-                for (int y = 1; y < tpl.rows - 1 ; ++y) {
-                    for (int x = 1; x < tpl.cols - 1; ++x, ++idx) {
-                        PointType p;
-                        p << ScalarType(x), ScalarType(y);
-                        
-                        // 1. Compute the gradient of the template
-                        const GradientType grad = gradient<float, SAMPLE_NEAREST, typename W::Traits>(tpl, p);
-                        
-                        // 2. Evaluate the Jacobian of image location.
-                        // Note: Jacobians are computed with pixel positions corresponding
-                        // to the finest pyramid level.
-                        JacobianType jacobian = w0.jacobian(p);
-                        
+                for (int j = 0; j < count; ++j) {
+                    // Position of pixel in template and in planes
+                    const int x = sparse ? selected.col(selected.begin(y - 1) + j) + 1 : j + 1;
+                    const int planeRow = sparse ? 0 : y - 1;
+                    const int planeCol = sparse ? selected.begin(y - 1) + j : j;
+                    
+                    PointType p;
+                    p << ScalarType(x), ScalarType(y);
+                    
+                    // 2. Evaluate the Jacobian of image location.
+                    // Note: Jacobians are computed with pixel positions corresponding
+                    // to the finest pyramid level.
+                    JacobianType jacobian = w0.jacobian(p);
+                    
+                    for (int c = 0; c < cn; ++c) {
+                        if (sparse)
+                            _selectedIntensities[i][planeCol * cn + c] = tpl.ptr<float>(y)[x * cn + c];
+                    
+                        const ScalarType gx = gxRow[x * cn + c];
+                        const ScalarType gy = gyRow[x * cn + c];
+                    
                         // 3. Compute steepest descent images
-                        PixelSDIType sdi = grad * jacobian;
+                        detail::steepestDescent(gx, gy, jacobian, &sd[0], np);
                         
-                        // 4. Update inverse Hessian
-                        hessian += sdi.t() * sdi;
+                        // 4. Update upper triangle of Hessian
+                        detail::accumulateHessian(&sd[0], np, h);
                         
-                        // 5. Store steepest descent images
-                        _sdiPyramid[i][idx] = sdi;
+                        // 5. Store steepest descent images, one plane per parameter
+                        for (int k = 0; k < planes.numPlanes(); ++k) {
+                            planes.ptr(k, planeRow)[planeCol * cn + c] = float(sd[k]);
+                            maxAbs = std::max<float>(maxAbs, std::abs(float(sd[k])));
+                        }
                     }
                 }
-
-                // 6. Store inverse Hessian
-                _invHessians[i] = hessian.inv();
-
-                w0 = w0.scaled(-1);
-                
             }
+            
+            if (reduced) {
+                const int storage = (maxAbs <= detail::HALF_MAX) ? this->storagePolicy().tables : STORAGE_FLOAT32;
+                floatPlanes.convertTo(_sdiPyramid[i], storage);
+            }
+
+            // 6. Store factorized Hessian, and the Hessian itself for damped steps
+            _conditioning[i] = detail::factorizeLDLT<ScalarType>(hessian, _factorizedHessians[i]);
+            _hessians[i] = hessian;
         }
         
         /** 
@@ -146,70 +303,313 @@ namespace imagealign {
          */
         SingleStepResult<W>  alignImpl(W &w)
         {
+            // Accumulate b from all template rows, and the Hessian for weighted losses
+            StepAccumulator<W> &acc = this->accumulateSteps(w);
+            
+            // 4. Solve Ax = b
+            SingleStepResult<W> step;
+            
+            if (L::WEIGHTED) {
+                step.conditioning = detail::factorizeLDLT<ScalarType>(acc.hessian, _factorizedHessian);
+                detail::solveLDLT<ScalarType>(_factorizedHessian, acc.b, _delta);
+            } else {
+                step.conditioning = _conditioning[this->level()];
+                detail::solveLDLT<ScalarType>(_factorizedHessians[this->level()], acc.b, _delta);
+            }
+            
+            this->exportSystem(step, L::WEIGHTED ? acc.hessian : _hessians[this->level()], acc.b);
+            
+            step.delta = _delta;
+            step.sumErrors = acc.sumErrors;
+            step.numConstraints = acc.numConstraints;
+            
+            return step;
+        }
+        
+        /**
+            Accumulate error terms for template rows [rowBegin, rowEnd).
+         
+            Invoked concurrently on disjoint row ranges.
+         */
+        void accumulateRows(const W &w, int rowBegin, int rowEnd, StepAccumulator<W> &acc) const
+        {
+            if (_selectedPixels[this->level()].rows() > 0) {
+                accumulateSelected(w, rowBegin, rowEnd, acc);
+                return;
+            }
+            
             cv::Mat tpl = this->templateImage();
             cv::Mat target = this->targetImage();
+            cv::Mat targetMask = this->targetMask();
             
-            const VecOfSDI &sdi = _sdiPyramid[this->level()];
+            const SteepestDescentPlanes &sdi = _sdiPyramid[this->level()];
             
             Sampler<SAMPLE_BILINEAR> s;
             
-            ParamType b = W::Traits::zeroParam(w.numParameters());
-            ScalarType sumErrors = 0;
-            int sumConstraints = 0;
+            // Row buffers for batched sampling of warped coordinates. Intensities, errors and 
+            // weights hold cn interleaved values per pixel.
+            const int cn = tpl.channels();
+            const int n = std::max<int>(0, tpl.cols - 2);
+            ScalarType *xs = acc.template scratch<ScalarType>(0, n);
+            ScalarType *ys = acc.template scratch<ScalarType>(1, n);
+            float *targetIntensities = acc.template scratch<float>(2, n * cn);
+            float *errors = acc.template scratch<float>(3, n * cn);
+            float *tplBuffer = acc.template scratch<float>(4, tpl.cols * cn);
+            float *weights = acc.template scratch<float>(6, n * cn);
             
-            int idx = 0;
-            for (int y = 1; y < tpl.rows - 1; ++y) {
+            for (int y = rowBegin; y < rowEnd; ++y) {
                 
-                const float *tplRow = tpl.ptr<float>(y);
+                const float *tplRow = detail::loadRow(tpl, y, tplBuffer);
                 
-                for (int x = 1; x < tpl.cols - 1; ++x, ++idx) {
-                    const float templateIntensity = tplRow[x];
-
+                // 1. Warp target pixels of row back to template using w
+                for (int x = 1; x < tpl.cols - 1; ++x) {
                     PointType ptpl;
                     ptpl << ScalarType(x), ScalarType(y);
                     
-                    // 1. Warp target pixel back to template using w
                     PointType ptgt = w(ptpl);
+                    xs[x - 1] = ptgt(0);
+                    ys[x - 1] = ptgt(1);
+                }
+                
+                s.sample<float>(target, xs, ys, n, targetIntensities);
+                
+                for (int x = 1; x < tpl.cols - 1; ++x) {
+                    const bool inside = this->isInTarget(PointType(xs[x - 1], ys[x - 1]), target.size(), targetMask);
                     
-                    if (!this->isInImage(ptgt, target.size(), 1))
-                        continue;
+                    for (int c = (x - 1) * cn; c < x * cn; ++c) {
+                        if (!inside) {
+                            errors[c] = 0.f;
+                            weights[c] = 0.f;
+                            continue;
+                        }
+                        
+                        // 2. Compute the error. Roles reverse compared to forward additive / compositional
+                        const float err = targetIntensities[c] - tplRow[c + cn];
+                        acc.sumErrors += ScalarType(_loss.rho(err));
+                        acc.numConstraints += 1;
+                        
+                        errors[c] = err;
+                        weights[c] = _loss.weight(err);
+                    }
+                }
+                
+                // 3. Update b with one dot product of error row and SDI row per parameter
+                accumulateSpan(sdi, y - 1, 0, n * cn, errors, weights, acc);
+            }
+        }
+        
+        /**
+            Accumulate error terms for selected pixels in template rows [rowBegin, rowEnd).
+         
+            Selected pixels of the row range are contiguous, so they are warped and sampled
+            in one batch followed by one dot product per parameter.
+         */
+        void accumulateSelected(const W &w, int rowBegin, int rowEnd, StepAccumulator<W> &acc) const
+        {
+            cv::Mat target = this->targetImage();
+            cv::Mat targetMask = this->targetMask();
+            
+            const int level = this->level();
+            const SelectedPixels &selected = _selectedPixels[level];
+            const SteepestDescentPlanes &sdi = _sdiPyramid[level];
+            
+            const int cn = target.channels();
+            const int begin = selected.begin(rowBegin - 1);
+            const int n = selected.begin(rowEnd - 1) - begin;
+            
+            if (n == 0)
+                return;
+            
+            const float *tplIntensities = &_selectedIntensities[level][begin * cn];
+            
+            Sampler<SAMPLE_BILINEAR> s;
+            
+            ScalarType *xs = acc.template scratch<ScalarType>(0, n);
+            ScalarType *ys = acc.template scratch<ScalarType>(1, n);
+            float *targetIntensities = acc.template scratch<float>(2, n * cn);
+            float *errors = acc.template scratch<float>(3, n * cn);
+            float *weights = acc.template scratch<float>(6, n * cn);
+            
+            // 1. Warp selected template pixels of rows
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                for (int i = selected.begin(y - 1); i < selected.begin(y); ++i) {
+                    PointType ptpl;
+                    ptpl << ScalarType(selected.col(i) + 1), ScalarType(y);
                     
-                    const float targetIntensity = s.sample<float>(target, ptgt);
+                    PointType ptgt = w(ptpl);
+                    xs[i - begin] = ptgt(0);
+                    ys[i - begin] = ptgt(1);
+                }
+            }
+            
+            s.sample<float>(target, xs, ys, n, targetIntensities);
+            
+            // 2. Compute the errors
+            for (int i = 0; i < n; ++i) {
+                const bool inside = this->isInTarget(PointType(xs[i], ys[i]), target.size(), targetMask);
+                
+                for (int c = i * cn; c < (i + 1) * cn; ++c) {
+                    if (!inside) {
+                        errors[c] = 0.f;
+                        weights[c] = 0.f;
+                        continue;
+                    }
                     
-                    // 2. Compute the error. Roles reverse compared to forward additive / compositional
-                    const float err = targetIntensity - templateIntensity;
-                    sumErrors += ScalarType(err * err);
-                    sumConstraints += 1;
+                    const float err = targetIntensities[c] - tplIntensities[c];
+                    acc.sumErrors += ScalarType(_loss.rho(err));
+                    acc.numConstraints += 1;
                     
-                    // 3. Update b using SDI lookup
-                    b += sdi[idx].t() * err;
+                    errors[c] = err;
+                    weights[c] = _loss.weight(err);
                 }
             }
             
-            // 4. Solve Ax = b
-            ParamType delta = _invHessians[this->level()] * b;
+            // 3. Update b
+            accumulateSpan(sdi, 0, begin * cn, n * cn, errors, weights, acc);
+        }
+        
+        /**
+            Accumulate b from n consecutive steepest descent values of a plane row.
+         
+            For weighted losses, the upper triangle of the Hessian is accumulated as well, from 
+            weighted outer products of the precomputed steepest descent images. Errors and 
+            weights need to be zero for pixels not taking part.
+         */
+        void accumulateSpan(const SteepestDescentPlanes &sdi, int row, int begin, int n, 
+                            const float *errors, const float *weights, StepAccumulator<W> &acc) const
+        {
+            ScalarType *b = detail::rowPtr<ScalarType>(acc.b, 0);
+            float *sdiBuffer = acc.template scratch<float>(5, n);
             
-            SingleStepResult<W> step;
-            step.delta = delta;
-            step.sumErrors = sumErrors;
-            step.numConstraints = sumConstraints;
+            const int np = sdi.numPlanes();
             
-            return step;
+            if (!L::WEIGHTED) {
+                for (int k = 0; k < np; ++k) {
+                    b[k] += ScalarType(detail::dot(sdi.loadSpan(k, row, begin, n, sdiBuffer), errors, n));
+                }
+                return;
+            }
+            
+            ScalarType *h = detail::rowPtr<ScalarType>(acc.hessian, 0);
+            float *weighted = acc.template scratch<float>(7, n);
+            
+            for (int i = 0; i < np; ++i) {
+                const float *sdi_i = sdi.loadSpan(i, row, begin, n, sdiBuffer);
+                for (int x = 0; x < n; ++x) {
+                    weighted[x] = weights[x] * sdi_i[x];
+                }
+                
+                b[i] += ScalarType(detail::dot(weighted, errors, n));
+                
+                for (int j = i; j < np; ++j) {
+                    h[i * np + j] += ScalarType(detail::dot(weighted, sdi.loadSpan(j, row, begin, n, sdiBuffer), n));
+                }
+            }
         }
         
-        
         void applyStep(W &w, const SingleStepResult<W> &s) {
             w.updateInverseCompositional(s.delta);
         }
         
+        /**
+            Write steepest descent images, Hessians and selected pixels of all levels.
+         */
+        void serializeImpl(detail::StateWriter &out) const
+        {
+            out.value<float>(_levelSelection.fraction);
+            out.value<float>(_levelSelection.minGradient);
+            out.value<int>(_levelGradientKernel);
+            
+            const int np = this->numParameters();
+            for (int i = 0; i < this->templateLevels(); ++i) {
+                const SteepestDescentPlanes &planes = _sdiPyramid[i];
+                out.value<int>(planes.numPlanes());
+                out.value<int>(planes.rows());
+                out.value<int>(planes.cols());
+                out.value<int>(planes.storage());
+                out.array(planes.data(), planes.dataSize());
+                
+                out.array(detail::rowPtr<ScalarType>(_factorizedHessians[i], 0), np * np);
+                out.array(detail::rowPtr<ScalarType>(_hessians[i], 0), np * np);
+                out.value<ScalarType>(_conditioning[i]);
+                
+                out.array(_selectedPixels[i].rowOffsets());
+                out.array(_selectedPixels[i].columns());
+                out.array(_selectedIntensities[i]);
+            }
+        }
+        
+        /**
+            Read state written by serializeImpl. Steepest descent images reference the buffer.
+         */
+        void deserializeImpl(detail::StateReader &in)
+        {
+            _levelSelection.fraction = in.value<float>();
+            _levelSelection.minGradient = in.value<float>();
+            _levelGradientKernel = in.value<int>();
+            
+            const int np = this->numParameters();
+            std::vector<int> rowOffsets, columns;
+            for (int i = 0; i < this->templateLevels(); ++i) {
+                const int numPlanes = in.value<int>();
+                const int rows = in.value<int>();
+                const int cols = in.value<int>();
+                const int storage = in.value<int>();
+                
+                size_t n;
+                const uchar *data = in.array<uchar>(n);
+                _sdiPyramid[i].wrap(numPlanes, rows, cols, storage, data);
+                CV_Assert(numPlanes == np && _sdiPyramid[i].dataSize() == n);
+                
+                readHessian(in, np, _factorizedHessians[i]);
+                readHessian(in, np, _hessians[i]);
+                _conditioning[i] = in.value<ScalarType>();
+                
+                in.array(rowOffsets);
+                in.array(columns);
+                _selectedPixels[i].assign(rowOffsets, columns);
+                in.array(_selectedIntensities[i]);
+            }
+        }
+        
+        static int stateTag() {
+            return 1;
+        }
+        
+        /** Templates and targets may hold up to four interleaved channels. */
+        static bool supportsChannels(int cn) {
+            return cn >= 1 && cn <= 4;
+        }
+        
     private:
-        friend class AlignBase< AlignInverseCompositional<W>, W >;
+        friend class AlignBase< AlignInverseCompositional<W, L>, W >;
+        
+        static void readHessian(detail::StateReader &in, int np, HessianType &h)
+        {
+            size_t n;
+            const ScalarType *v = in.array<ScalarType>(n);
+            CV_Assert(n == size_t(np * np));
+            
+            h = W::Traits::zeroHessian(np);
+            std::copy(v, v + n, detail::rowPtr<ScalarType>(h, 0));
+        }
         
-        typedef std::vector< typename W::Traits::PixelSDIType > VecOfSDI;
         typedef std::vector< typename W::Traits::HessianType > VecOfHessian;
     
-        std::vector<VecOfSDI> _sdiPyramid;
-        VecOfHessian _invHessians;
+        std::vector<SteepestDescentPlanes> _sdiPyramid;
+        VecOfHessian _factorizedHessians;
+        VecOfHessian _hessians;
+        std::vector<ScalarType> _conditioning;
+        HessianType _factorizedHessian;
+        ParamType _delta;
+        L _loss;
+        
+        PixelSelection _pixelSelection;
+        PixelSelection _levelSelection;
+        int _gradientKernel;
+        int _levelGradientKernel;
+        std::vector<SelectedPixels> _selectedPixels;
+        std::vector< std::vector<float> > _selectedIntensities;
         
     };
     
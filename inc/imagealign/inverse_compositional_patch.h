@@ -0,0 +1,366 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_INVERSE_COMPOSITIONAL_PATCH_H
+#define IMAGE_ALIGN_INVERSE_COMPOSITIONAL_PATCH_H
+
+#include <imagealign/align_base.h>
+#include <imagealign/sampling.h>
+#include <imagealign/gradient.h>
+#include <imagealign/robust_loss.h>
+#include <imagealign/linalg.h>
+#include <opencv2/core/core.hpp>
+
+namespace imagealign {
+    
+    namespace detail {
+        
+        /** Pyramid levels of a square template of size S, as ImagePyramid::maxLevelsForImageSize. */
+        template<int S, bool Halve = (S >= 10)>
+        struct PatchLevels {
+            enum { value = 1 + PatchLevels<S / 2>::value };
+        };
+        
+        template<int S>
+        struct PatchLevels<S, false> {
+            enum { value = 0 };
+        };
+        
+        /** Inner pixels of L levels of a square template of size S. Levels shrink as in ImagePyramid. */
+        template<int S, int L>
+        struct PatchPixels {
+            enum { value = (S > 2 ? (S - 2) * (S - 2) : 0) + PatchPixels<(S + 1) / 2, L - 1>::value };
+        };
+        
+        template<int S>
+        struct PatchPixels<S, 0> {
+            enum { value = 0 };
+        };
+        
+        /** 
+            Invoke op.template apply<S>() with the compile-time size S of a run-time level.
+         
+            Level 0 has size S, every further level (S + 1) / 2. L is the number of levels.
+         */
+        template<int S, int L>
+        struct PatchLevelDispatch {
+            template<class Op>
+            static void run(int level, Op &op) {
+                if (level == 0)
+                    op.template apply<S>();
+                else
+                    PatchLevelDispatch<(S + 1) / 2, L - 1>::run(level - 1, op);
+            }
+        };
+        
+        template<int S>
+        struct PatchLevelDispatch<S, 0> {
+            template<class Op>
+            static void run(int, Op &) {}
+        };
+    }
+    
+    /** 
+        Inverse-compositional alignment of square templates of a compile-time size.
+     
+        Behaves like AlignInverseCompositional with least squares loss, specialized for the 
+        small patches of sparse feature tracking, where per-template overhead dominates. The 
+        template intensities, steepest descent images and Hessians of all levels live inside 
+        the aligner object, so preparing a template of a reused aligner never allocates. 
+        Alignment loops run over compile-time template sizes on every level, which lets the 
+        compiler unroll them. For affine and simpler warps the target bounds are tested once 
+        per iteration on the warped template corners instead of once per pixel; the per-pixel 
+        test is used only when the patch overlaps the target border or a target mask is set.
+     
+        Only single channel templates of size Size x Size without template mask are accepted, 
+        see supportsTemplateSize. Storage policies apply to the template pyramid only, steepest 
+        descent images are always kept at full precision.
+     
+        \tparam W Warp type with a compile-time number of parameters.
+        \tparam Size Width and height of templates in pixels.
+     */
+    template<class W, int Size>
+    class AlignInverseCompositionalPatch : public AlignBase< AlignInverseCompositionalPatch<W, Size>, W > {
+    public:
+        
+        enum {
+            /** Number of pyramid levels of a template at most. */
+            MAX_LEVELS = detail::PatchLevels<Size>::value > 0 ? (int)detail::PatchLevels<Size>::value : 1,
+            
+            /** Number of warp parameters. */
+            NUM_PARAMETERS = W::Traits::ParametersAtCompileTime,
+            
+            /** Inner template pixels of all levels. */
+            MAX_PIXELS = detail::PatchPixels<Size, MAX_LEVELS>::value
+        };
+        
+        AlignInverseCompositionalPatch() {
+            for (int i = 0; i < MAX_LEVELS; ++i) {
+                _conditioning[i] = ScalarType(0);
+                _offsets[i] = 0;
+            }
+        }
+        
+        /** Only templates of Size x Size pixels are supported. */
+        static bool supportsTemplateSize(cv::Size s) {
+            return s.width == Size && s.height == Size;
+        }
+        
+    protected:
+        
+        typedef typename W::Traits::ParamType ParamType;
+        typedef typename W::Traits::HessianType HessianType;
+        typedef typename W::Traits::JacobianType JacobianType;
+        typedef typename W::Traits::PointType PointType;
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        /**
+            Prepare for alignment.
+         
+            Assigns each level its range of inline storage. Per-level data is computed on first 
+            use of a level, see prepareLevelImpl.
+         */
+        void prepareImpl(const W &w)
+        {
+            (void)w;
+            CV_Assert(this->numLevels() <= MAX_LEVELS);
+            
+            int offset = 0;
+            for (int i = 0, s = Size; i < this->numLevels(); ++i, s = (s + 1) / 2) {
+                _offsets[i] = offset;
+                offset += (s - 2) * (s - 2);
+            }
+        }
+        
+        /**
+            Prepare a single pyramid level.
+         
+            Computes template intensities, steepest descent images and the factorized Hessian of 
+            inner template pixels in row-major order.
+         */
+        void prepareLevelImpl(const W &w0, int i)
+        {
+            cv::Mat tpl = detail::floatImage(this->templateImagePyramid()[i]);
+            
+            CV_Assert(tpl.channels() == 1 && tpl.size() == levelSize(i));
+            CV_Assert(this->templateMask(i).empty());
+            
+            cv::Mat gxs, gys;
+            gradientImages(tpl, gxs, gys, GRADIENT_CENTRAL, this->executor());
+            
+            HessianType hessian = W::Traits::zeroHessian(NUM_PARAMETERS);
+            ScalarType *h = detail::rowPtr<ScalarType>(hessian, 0);
+            ScalarType sd[NUM_PARAMETERS];
+            
+            int j = _offsets[i];
+            
+            for (int y = 1; y < tpl.rows - 1; ++y) {
+                const float *tplRow = tpl.ptr<float>(y);
+                const float *gxRow = gxs.ptr<float>(y);
+                const float *gyRow = gys.ptr<float>(y);
+                
+                for (int x = 1; x < tpl.cols - 1; ++x, ++j) {
+                    PointType p;
+                    p << ScalarType(x), ScalarType(y);
+                    
+                    JacobianType jacobian = w0.jacobian(p);
+                    detail::steepestDescent(ScalarType(gxRow[x]), ScalarType(gyRow[x]), jacobian, sd, NUM_PARAMETERS);
+                    detail::accumulateHessian(sd, NUM_PARAMETERS, h);
+                    
+                    for (int k = 0; k < NUM_PARAMETERS; ++k) {
+                        _sdi[k][j] = float(sd[k]);
+                    }
+                    _intensities[j] = tplRow[x];
+                }
+            }
+            
+            _conditioning[i] = detail::factorizeLDLT<ScalarType>(hessian, _factorizedHessians[i]);
+            _hessians[i] = hessian;
+        }
+        
+        /** 
+            Perform a single alignment step.
+         
+            Errors of the current level are accumulated on the calling thread, templates are 
+            too small to benefit from parallel reduction.
+         
+            \param w Current state of warp estimation.
+         */
+        SingleStepResult<W> alignImpl(W &w)
+        {
+            const int level = this->level();
+            
+            SingleStepResult<W> step;
+            ParamType b = W::Traits::zeroParam(NUM_PARAMETERS);
+            
+            Accumulate op(this, w, b, step);
+            detail::PatchLevelDispatch<Size, MAX_LEVELS>::run(level, op);
+            
+            detail::solveLDLT<ScalarType>(_factorizedHessians[level], b, _delta);
+            this->exportSystem(step, _hessians[level], b);
+            
+            step.delta = _delta;
+            step.conditioning = _conditioning[level];
+            
+            return step;
+        }
+        
+        /**
+            Accumulate b and the error over inner pixels of the current level of size S.
+         */
+        template<int S>
+        void accumulateLevel(const W &w, ParamType &bp, SingleStepResult<W> &step) const
+        {
+            enum { 
+                N = S > 2 ? S - 2 : 0,
+                BUFFER = N > 0 ? N : 1
+            };
+            
+            step.sumErrors = ScalarType(0);
+            step.numConstraints = 0;
+            
+            if (N == 0)
+                return;
+            
+            cv::Mat target = this->targetImage();
+            cv::Mat targetMask = this->targetMask();
+            
+            // The warped inner pixels of planar motions without perspective lie within the 
+            // parallelogram of warped corners. Corners at a safety margin of one pixel to the 
+            // sampling border cover rounding of individual warped positions.
+            bool inside = W::Traits::WarpMode < WARP_PERSPECTIVE && targetMask.empty();
+            for (int c = 0; c < 4 && inside; ++c) {
+                PointType p;
+                p << ScalarType((c & 1) ? N : 1), ScalarType((c & 2) ? N : 1);
+                inside = this->isInImage(w(p), target.size(), 2);
+            }
+            
+            ScalarType *b = detail::rowPtr<ScalarType>(bp, 0);
+            const float *intensities = &_intensities[_offsets[this->level()]];
+            
+            Sampler<SAMPLE_BILINEAR> s;
+            ScalarType xs[BUFFER], ys[BUFFER];
+            float values[BUFFER], errors[BUFFER];
+            
+            for (int y = 1; y <= N; ++y) {
+                for (int x = 0; x < N; ++x) {
+                    PointType ptpl;
+                    ptpl << ScalarType(x + 1), ScalarType(y);
+                    
+                    PointType ptgt = w(ptpl);
+                    xs[x] = ptgt(0);
+                    ys[x] = ptgt(1);
+                }
+                
+                s.sample<float>(target, xs, ys, N, values);
+                
+                const float *tplRow = intensities + (y - 1) * N;
+                
+                if (inside) {
+                    for (int x = 0; x < N; ++x) {
+                        errors[x] = values[x] - tplRow[x];
+                    }
+                    step.numConstraints += N;
+                } else {
+                    for (int x = 0; x < N; ++x) {
+                        const bool valid = this->isInTarget(PointType(xs[x], ys[x]), target.size(), targetMask);
+                        errors[x] = valid ? values[x] - tplRow[x] : 0.f;
+                        step.numConstraints += valid ? 1 : 0;
+                    }
+                }
+                
+                step.sumErrors += ScalarType(detail::dot(errors, errors, N));
+                
+                const int row = _offsets[this->level()] + (y - 1) * N;
+                for (int k = 0; k < NUM_PARAMETERS; ++k) {
+                    b[k] += ScalarType(detail::dot(&_sdi[k][row], errors, N));
+                }
+            }
+        }
+        
+        void applyStep(W &w, const SingleStepResult<W> &s) {
+            w.updateInverseCompositional(s.delta);
+        }
+        
+        /**
+            Inline state is cheap to recompute, nothing is written besides the template pyramid.
+         */
+        void serializeImpl(detail::StateWriter &out) const
+        {
+            (void)out;
+        }
+        
+        /**
+            Recompute per-level state from the restored template pyramid.
+         */
+        void deserializeImpl(detail::StateReader &in)
+        {
+            (void)in;
+            for (int i = 0; i < this->numLevels(); ++i)
+                prepareLevelImpl(this->identityWarp(i), i);
+        }
+        
+        static int stateTag() {
+            return 4;
+        }
+        
+    private:
+        friend class AlignBase< AlignInverseCompositionalPatch<W, Size>, W >;
+        
+        /** Binds accumulateLevel to the compile-time size of the current level. */
+        struct Accumulate {
+            Accumulate(const AlignInverseCompositionalPatch *a, const W &w, ParamType &b, SingleStepResult<W> &step)
+                : _a(a), _w(w), _b(b), _step(step)
+            {}
+            
+            template<int S>
+            void apply() {
+                _a->template accumulateLevel<S>(_w, _b, _step);
+            }
+            
+            const AlignInverseCompositionalPatch *_a;
+            const W &_w;
+            ParamType &_b;
+            SingleStepResult<W> &_step;
+        };
+        
+        enum {
+            PIXEL_STORAGE = MAX_PIXELS > 0 ? (int)MAX_PIXELS : 1
+        };
+        
+        static cv::Size levelSize(int level) {
+            int s = Size;
+            for (int i = 0; i < level; ++i)
+                s = (s + 1) / 2;
+            return cv::Size(s, s);
+        }
+        
+        float _sdi[NUM_PARAMETERS][PIXEL_STORAGE];
+        float _intensities[PIXEL_STORAGE];
+        int _offsets[MAX_LEVELS];
+        HessianType _factorizedHessians[MAX_LEVELS];
+        HessianType _hessians[MAX_LEVELS];
+        ScalarType _conditioning[MAX_LEVELS];
+        ParamType _delta;
+    };
+    
+    
+}
+
+#endif
@@ -0,0 +1,330 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_LINALG_H
+#define IMAGE_ALIGN_LINALG_H
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <limits>
+
+namespace imagealign {
+    
+    /**
+        Small linear algebra helpers operating uniformly on the matrix types used by warp traits.
+     
+        Warp traits either use cv::Matx for parameter counts known at compile time or cv::Mat 
+        otherwise. The helpers below avoid the temporaries matrix expressions create, so inner 
+        loops do not allocate for cv::Mat based traits. cv::Mat arguments are assumed to be 
+        continuous and of ScalarType depth.
+     */
+    namespace detail {
+        
+        /** Element access for cv::Matx based traits types. */
+        template<class Scalar, int M, int N>
+        inline Scalar &elementAt(cv::Matx<Scalar, M, N> &m, int i, int j) {
+            return m(i, j);
+        }
+        
+        /** Element access for cv::Matx based traits types. */
+        template<class Scalar, int M, int N>
+        inline Scalar elementAt(const cv::Matx<Scalar, M, N> &m, int i, int j) {
+            return m(i, j);
+        }
+        
+        /** Element access for cv::Mat based traits types. */
+        template<class Scalar>
+        inline Scalar &elementAt(cv::Mat &m, int i, int j) {
+            return m.at<Scalar>(i, j);
+        }
+        
+        /** Element access for cv::Mat based traits types. */
+        template<class Scalar>
+        inline Scalar elementAt(const cv::Mat &m, int i, int j) {
+            return m.at<Scalar>(i, j);
+        }
+        
+        /** Pointer to row of cv::Matx based traits types. */
+        template<class Scalar, int M, int N>
+        inline Scalar *rowPtr(cv::Matx<Scalar, M, N> &m, int i) {
+            return m.val + i * N;
+        }
+        
+        /** Pointer to row of cv::Matx based traits types. */
+        template<class Scalar, int M, int N>
+        inline const Scalar *rowPtr(const cv::Matx<Scalar, M, N> &m, int i) {
+            return m.val + i * N;
+        }
+        
+        /** Pointer to row of cv::Mat based traits types. */
+        template<class Scalar>
+        inline Scalar *rowPtr(cv::Mat &m, int i) {
+            return m.ptr<Scalar>(i);
+        }
+        
+        /** Pointer to row of cv::Mat based traits types. */
+        template<class Scalar>
+        inline const Scalar *rowPtr(const cv::Mat &m, int i) {
+            return m.ptr<Scalar>(i);
+        }
+        
+        /** Set all elements to zero without reallocation. */
+        template<class Scalar, int M, int N>
+        inline void setZero(cv::Matx<Scalar, M, N> &m) {
+            m = cv::Matx<Scalar, M, N>::zeros();
+        }
+        
+        /** Set all elements to zero without reallocation. */
+        inline void setZero(cv::Mat &m) {
+            m.setTo(cv::Scalar::all(0));
+        }
+        
+        /** Deep copy for cv::Matx based traits types. */
+        template<class Scalar, int M, int N>
+        inline void copyTo(const cv::Matx<Scalar, M, N> &src, cv::Matx<Scalar, M, N> &dst) {
+            dst = src;
+        }
+        
+        /** Deep copy for cv::Mat based traits types. Reuses storage of dst. */
+        inline void copyTo(const cv::Mat &src, cv::Mat &dst) {
+            src.copyTo(dst);
+        }
+        
+        /** Multiply the diagonal of a row-major n x n matrix by f. */
+        template<class Scalar>
+        inline void scaleDiagonal(Scalar *m, int n, Scalar f) {
+            for (int i = 0; i < n; ++i) {
+                m[i * n + i] *= f;
+            }
+        }
+        
+        /**
+            Steepest descent row of a single pixel.
+         
+            Computes sd = [gx gy] * J for a 2xN Jacobian J.
+         */
+        template<class Scalar, class JacobianType>
+        inline void steepestDescent(Scalar gx, Scalar gy, const JacobianType &jacobian, Scalar *sd, int n) {
+            const Scalar *j0 = rowPtr<Scalar>(jacobian, 0);
+            const Scalar *j1 = rowPtr<Scalar>(jacobian, 1);
+            
+            for (int k = 0; k < n; ++k) {
+                sd[k] = gx * j0[k] + gy * j1[k];
+            }
+        }
+        
+        /**
+            Steepest descent row of a single pixel from separate Jacobian rows.
+         
+            Computes sd = gx * j0 + gy * j1 for Jacobian rows of any precision.
+         */
+        template<class Scalar, class T>
+        inline void steepestDescent(Scalar gx, Scalar gy, const T *j0, const T *j1, Scalar *sd, int n) {
+            for (int k = 0; k < n; ++k) {
+                sd[k] = gx * Scalar(j0[k]) + gy * Scalar(j1[k]);
+            }
+        }
+        
+        /**
+            Add contribution of a single pixel to the normal equations.
+         
+            Updates b += sd^T * err and the upper triangle of H += sd^T * sd, which is all 
+            factorizeLDLT reads.
+         */
+        template<class Scalar>
+        inline void accumulateNormalEquations(const Scalar *sd, Scalar err, int n, Scalar *b, Scalar *hessian) {
+            for (int i = 0; i < n; ++i) {
+                b[i] += sd[i] * err;
+                
+                Scalar *hrow = hessian + i * n;
+                for (int j = i; j < n; ++j) {
+                    hrow[j] += sd[i] * sd[j];
+                }
+            }
+        }
+        
+        /**
+            Add weighted contribution of a single pixel to the normal equations.
+         
+            Updates b += weight * sd^T * err and the upper triangle of H += weight * sd^T * sd.
+         */
+        template<class Scalar>
+        inline void accumulateNormalEquations(const Scalar *sd, Scalar err, Scalar weight, int n, Scalar *b, Scalar *hessian) {
+            for (int i = 0; i < n; ++i) {
+                const Scalar wsd = weight * sd[i];
+                b[i] += wsd * err;
+                
+                Scalar *hrow = hessian + i * n;
+                for (int j = i; j < n; ++j) {
+                    hrow[j] += wsd * sd[j];
+                }
+            }
+        }
+        
+        /**
+            LDL^T factorization kernel shared by all overloads of factorizeLDLT. 
+         
+            For N > 0 the matrix size is a compile time constant, so loop bounds are known 
+            to the compiler and loops over the small Hessians of planar warps can be fully 
+            unrolled. N = 0 uses the run-time size dynamicN.
+         */
+        template<int N, class Scalar>
+        inline Scalar factorizeLDLTImpl(const Scalar *upper, Scalar *ldlt, int dynamicN) {
+            const int n = N > 0 ? N : dynamicN;
+            Scalar conditioning = Scalar(1);
+            
+            for (int j = 0; j < n; ++j) {
+                const Scalar ajj = upper[j * n + j];
+                
+                Scalar d = ajj;
+                for (int k = 0; k < j; ++k) {
+                    const Scalar ljk = ldlt[j * n + k];
+                    d -= ljk * ljk * ldlt[k * n + k];
+                }
+                
+                if (!(ajj > Scalar(0)) || !(d > ajj * std::numeric_limits<Scalar>::epsilon())) {
+                    // Not positive definite. Zero pivots make solveLDLT ignore these directions.
+                    for (int i = j; i < n; ++i) {
+                        for (int k = 0; k <= i; ++k) {
+                            ldlt[i * n + k] = Scalar(0);
+                        }
+                    }
+                    return Scalar(0);
+                }
+                
+                ldlt[j * n + j] = d;
+                conditioning = std::min<Scalar>(conditioning, d / ajj);
+                
+                const Scalar invD = Scalar(1) / d;
+                for (int i = j + 1; i < n; ++i) {
+                    Scalar v = upper[j * n + i];
+                    for (int k = 0; k < j; ++k) {
+                        v -= ldlt[i * n + k] * ldlt[j * n + k] * ldlt[k * n + k];
+                    }
+                    ldlt[i * n + j] = v * invD;
+                }
+            }
+            
+            return conditioning;
+        }
+        
+        /**
+            LDL^T factorization of a symmetric positive definite row-major n x n matrix.
+         
+            Only the upper triangle of upper is read. On return the strict lower triangle of 
+            ldlt holds the unit lower triangular factor L and the diagonal holds D. The upper 
+            triangle of ldlt is not touched, so factorizing in place is supported.
+         
+            Returns min_i D_i / A_ii as an estimate of conditioning. It is invariant to scaling 
+            of parameters and becomes zero when a parameter direction is (numerically) a linear 
+            combination of the others, such as for textureless templates. When the matrix is 
+            not positive definite, zero is returned and the remaining pivots are set to zero.
+         */
+        template<class Scalar>
+        inline Scalar factorizeLDLT(const Scalar *upper, Scalar *ldlt, int n) {
+            return factorizeLDLTImpl<0>(upper, ldlt, n);
+        }
+        
+        /** Solve kernel shared by all overloads of solveLDLT, see factorizeLDLTImpl for N. */
+        template<int N, class Scalar>
+        inline void solveLDLTImpl(const Scalar *ldlt, int dynamicN, const Scalar *b, Scalar *x) {
+            const int n = N > 0 ? N : dynamicN;
+            
+            // L y = b
+            for (int i = 0; i < n; ++i) {
+                Scalar v = b[i];
+                for (int k = 0; k < i; ++k) {
+                    v -= ldlt[i * n + k] * x[k];
+                }
+                x[i] = v;
+            }
+            
+            // D z = y
+            for (int i = 0; i < n; ++i) {
+                const Scalar d = ldlt[i * n + i];
+                x[i] = (d > Scalar(0)) ? x[i] / d : Scalar(0);
+            }
+            
+            // L^T x = z
+            for (int i = n - 1; i >= 0; --i) {
+                Scalar v = x[i];
+                for (int k = i + 1; k < n; ++k) {
+                    v -= ldlt[k * n + i] * x[k];
+                }
+                x[i] = v;
+            }
+        }
+        
+        /**
+            Solve A x = b given the LDL^T factorization of A computed by factorizeLDLT.
+         
+            Directions with zero pivots are assigned zero. b and x may alias.
+         */
+        template<class Scalar>
+        inline void solveLDLT(const Scalar *ldlt, int n, const Scalar *b, Scalar *x) {
+            solveLDLTImpl<0>(ldlt, n, b, x);
+        }
+        
+        /** 
+            LDL^T factorization for cv::Matx based traits types. 
+         
+            Instantiates the kernel for the compile time parameter count N, so loop bounds 
+            are constant for the fixed-size Hessians of planar warps.
+         */
+        template<class Scalar, int N>
+        inline Scalar factorizeLDLT(const cv::Matx<Scalar, N, N> &upper, cv::Matx<Scalar, N, N> &ldlt) {
+            return factorizeLDLTImpl<N>(upper.val, ldlt.val, N);
+        }
+        
+        /** LDL^T factorization for cv::Mat based traits types. Reuses storage of ldlt. */
+        template<class Scalar>
+        inline Scalar factorizeLDLT(const cv::Mat &upper, cv::Mat &ldlt) {
+            ldlt.create(upper.size(), upper.type());
+            return factorizeLDLT(upper.ptr<Scalar>(0), ldlt.ptr<Scalar>(0), upper.rows);
+        }
+        
+        /** Solve using LDL^T factorization for cv::Matx based traits types, sized at compile time. */
+        template<class Scalar, int N>
+        inline void solveLDLT(const cv::Matx<Scalar, N, N> &ldlt, const cv::Matx<Scalar, N, 1> &b, cv::Matx<Scalar, N, 1> &x) {
+            solveLDLTImpl<N>(ldlt.val, N, b.val, x.val);
+        }
+        
+        /** Solve using LDL^T factorization for cv::Mat based traits types. Reuses storage of x. */
+        template<class Scalar>
+        inline void solveLDLT(const cv::Mat &ldlt, const cv::Mat &b, cv::Mat &x) {
+            x.create(ldlt.rows, 1, ldlt.type());
+            solveLDLT(ldlt.ptr<Scalar>(0), ldlt.rows, b.ptr<Scalar>(0), x.ptr<Scalar>(0));
+        }
+        
+        /**
+            Add contribution of a single pixel to the upper triangle of H += sd^T * sd.
+         */
+        template<class Scalar>
+        inline void accumulateHessian(const Scalar *sd, int n, Scalar *hessian) {
+            for (int i = 0; i < n; ++i) {
+                Scalar *hrow = hessian + i * n;
+                for (int j = i; j < n; ++j) {
+                    hrow[j] += sd[i] * sd[j];
+                }
+            }
+        }
+    }
+}
+
+#endif
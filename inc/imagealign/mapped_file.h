@@ -0,0 +1,146 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_MAPPED_FILE_H
+#define IMAGE_ALIGN_MAPPED_FILE_H
+
+#include <imagealign/config.h>
+#include <string>
+
+#if defined(_WIN32)
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+namespace imagealign {
+    
+    /**
+        Read-only memory mapping of a file.
+     
+        Pages are loaded on first access and shared through the page cache among all processes 
+        mapping the same file. Prepared state deserialized from a mapping references it, so
+        a single copy of a template catalog serves all workers on a machine.
+     
+        Kept apart from serialization.h, so platform headers are only included where files 
+        are mapped.
+     */
+    class MappedFile {
+    public:
+        MappedFile()
+            : _data(0), _size(0)
+        {}
+        
+        ~MappedFile() {
+            close();
+        }
+        
+        /**
+            Map file at path, unmapping any file mapped before.
+         
+            \return True on success.
+         */
+        bool open(const std::string &path) {
+            close();
+            
+#if defined(_WIN32)
+            HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, 0, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, 0);
+            if (file == INVALID_HANDLE_VALUE)
+                return false;
+            
+            LARGE_INTEGER size;
+            if (!GetFileSizeEx(file, &size) || size.QuadPart == 0) {
+                CloseHandle(file);
+                return false;
+            }
+            
+            HANDLE mapping = CreateFileMappingA(file, 0, PAGE_READONLY, 0, 0, 0);
+            CloseHandle(file);
+            if (!mapping)
+                return false;
+            
+            _data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+            CloseHandle(mapping);
+            if (!_data)
+                return false;
+            
+            _size = (size_t)size.QuadPart;
+#else
+            const int fd = ::open(path.c_str(), O_RDONLY);
+            if (fd < 0)
+                return false;
+            
+            struct stat st;
+            if (fstat(fd, &st) != 0 || st.st_size == 0) {
+                ::close(fd);
+                return false;
+            }
+            
+            void *p = mmap(0, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+            ::close(fd);
+            if (p == MAP_FAILED)
+                return false;
+            
+            _data = p;
+            _size = (size_t)st.st_size;
+#endif
+            return true;
+        }
+        
+        /** Unmap file. Prepared state referencing the mapping must not be used afterwards. */
+        void close() {
+            if (!_data)
+                return;
+            
+#if defined(_WIN32)
+            UnmapViewOfFile(_data);
+#else
+            munmap(_data, _size);
+#endif
+            _data = 0;
+            _size = 0;
+        }
+        
+        /** Start of mapped bytes, or 0 when no file is mapped. */
+        const void *data() const {
+            return _data;
+        }
+        
+        /** Number of mapped bytes. */
+        size_t size() const {
+            return _size;
+        }
+        
+    private:
+        // Mappings are not copyable.
+        MappedFile(const MappedFile &);
+        MappedFile &operator=(const MappedFile &);
+        
+        void *_data;
+        size_t _size;
+    };
+}
+
+#endif
@@ -0,0 +1,130 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_MASK_H
+#define IMAGE_ALIGN_MASK_H
+
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <vector>
+
+namespace imagealign {
+    
+    namespace detail {
+        
+        /**
+            Erode a binary mask by a square of given radius.
+         
+            A pixel stays valid when all pixels within radius are valid, so finite differences 
+            and bilinear lookups around valid pixels never touch invalid ones. Pixels outside 
+            the mask count as valid, borders are handled by the image checks of the aligners.
+         */
+        inline void erodeMask(const cv::Mat &src, cv::Mat &dst, int radius) {
+            CV_Assert(src.type() == CV_8UC1);
+            
+            // Horizontal pass followed by vertical pass
+            cv::Mat tmp(src.size(), CV_8UC1);
+            for (int y = 0; y < src.rows; ++y) {
+                const uchar *s = src.ptr<uchar>(y);
+                uchar *t = tmp.ptr<uchar>(y);
+                
+                for (int x = 0; x < src.cols; ++x) {
+                    uchar v = 255;
+                    for (int k = std::max<int>(0, x - radius); k <= std::min<int>(src.cols - 1, x + radius); ++k) {
+                        v = std::min<uchar>(v, s[k]);
+                    }
+                    t[x] = v;
+                }
+            }
+            
+            dst.create(src.size(), CV_8UC1);
+            for (int y = 0; y < src.rows; ++y) {
+                uchar *d = dst.ptr<uchar>(y);
+                std::fill(d, d + src.cols, uchar(255));
+                
+                for (int k = std::max<int>(0, y - radius); k <= std::min<int>(src.rows - 1, y + radius); ++k) {
+                    const uchar *t = tmp.ptr<uchar>(k);
+                    for (int x = 0; x < src.cols; ++x) {
+                        d[x] = std::min<uchar>(d[x], t[x]);
+                    }
+                }
+            }
+        }
+        
+        /**
+            Halve a binary mask like ImagePyramid halves images.
+         
+            A coarse pixel is valid when all fine pixels within the 5x5 support of the pyramid 
+            filter are valid.
+         */
+        inline void downsampleMask(const cv::Mat &src, cv::Mat &dst) {
+            cv::Mat eroded;
+            erodeMask(src, eroded, 2);
+            
+            dst.create(cv::Size((src.cols + 1) / 2, (src.rows + 1) / 2), CV_8UC1);
+            for (int y = 0; y < dst.rows; ++y) {
+                const uchar *e = eroded.ptr<uchar>(2 * y);
+                uchar *d = dst.ptr<uchar>(y);
+                
+                for (int x = 0; x < dst.cols; ++x) {
+                    d[x] = e[2 * x];
+                }
+            }
+        }
+        
+        /**
+            Build per-level masks of a mask pyramid.
+         
+            Input pixels are valid when non-zero. Each level is eroded by radius, accounting for 
+            the pixels the aligners read around a valid pixel.
+         
+            \param mask Single channel 8-bit mask of finest level.
+            \param levels Number of levels to build.
+            \param radius Erosion radius applied to every level.
+            \param dst Receives masks with valid pixels set to 255.
+         */
+        inline void buildMaskLevels(cv::InputArray mask, int levels, int radius, std::vector<cv::Mat> &dst) {
+            cv::Mat m = mask.getMat();
+            CV_Assert(m.type() == CV_8UC1);
+            
+            dst.resize(levels);
+            
+            cv::Mat level(m.size(), CV_8UC1);
+            for (int y = 0; y < m.rows; ++y) {
+                const uchar *s = m.ptr<uchar>(y);
+                uchar *l = level.ptr<uchar>(y);
+                
+                for (int x = 0; x < m.cols; ++x) {
+                    l[x] = s[x] ? 255 : 0;
+                }
+            }
+            
+            for (int i = 0; i < levels; ++i) {
+                if (i > 0) {
+                    cv::Mat coarse;
+                    downsampleMask(level, coarse);
+                    level = coarse;
+                }
+                erodeMask(level, dst[i], radius);
+            }
+        }
+    }
+}
+
+#endif
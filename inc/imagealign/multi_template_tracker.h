@@ -0,0 +1,476 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_MULTI_TEMPLATE_TRACKER_H
+#define IMAGE_ALIGN_MULTI_TEMPLATE_TRACKER_H
+
+#include <imagealign/image_pyramid.h>
+#include <imagealign/parallel.h>
+#include <imagealign/storage.h>
+#include <opencv2/core/core.hpp>
+#include <vector>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+
+namespace imagealign {
+    
+    /** Track was aligned successfully. */
+    const int TRACK_OK = 0;
+    
+    /** Template region was too small, outside the template image or not supported by the aligner. */
+    const int TRACK_INVALID_ROI = 1;
+    
+    /** Alignment did not converge or exceeded the maximum error. */
+    const int TRACK_LOST = 2;
+    
+    /**
+        Constant velocity prediction of track warps across frames.
+     
+        The motion of a track in the previous frame, the aligned warp composed with the inverse 
+        of its initial warp, is applied to the initial warp of the next frame. Alignment then 
+        starts at the finest level able to handle the correction observed in the previous frame, 
+        so coarse levels are skipped while predictions are good.
+     */
+    struct Prediction {
+        /** Predict warps from the motion of the previous frame. Disabled by default. */
+        bool enabled;
+        
+        /** Correction in pixels a single level handles. Level l handles tolerance * 2^l pixels. */
+        float tolerance;
+        
+        Prediction(bool enabled_ = false, float tolerance_ = 1.f)
+            : enabled(enabled_), tolerance(tolerance_)
+        {}
+    };
+    
+    /**
+        Aligns many templates against one shared target pyramid.
+     
+        Typical use is sparse feature tracking, where small template regions of the 
+        previous frame are aligned with the current frame. The tracker keeps one aligner 
+        per track in a contiguous array that is reused across frames, so template data 
+        of a previous frame is overwritten in place instead of being reallocated.
+     
+        Tracks are prepared and aligned in parallel passes distributed by the executor.
+        The aligners themselves run serially to avoid nested parallelism. Use track for 
+        templates that change every frame, or prepare once and align per frame for fixed
+        templates.
+     
+        Alignment costs vary strongly between tracks, depending on region size and the 
+        number of iterations until convergence. The time spent per track is measured and 
+        tracks are handed to the executor in decreasing order of their cost in the previous
+        pass, so expensive tracks start first and cheap ones fill the gaps at the end. This 
+        pairs well with executors that take tasks in increasing order, such as ThreadExecutor, 
+        or deal them round robin to their threads, such as WorkStealingExecutor. Executors 
+        splitting tasks into contiguous blocks per thread would instead pile the expensive 
+        tracks onto the first thread.
+     
+        \tparam A Aligner type, e.g. AlignInverseCompositional<WarpTranslationF>.
+     */
+    template<class A>
+    class MultiTemplateTracker {
+    public:
+        
+        typedef typename A::WarpType WarpType;
+        typedef typename WarpType::Traits::ScalarType ScalarType;
+        typedef typename WarpType::Traits::PointType PointType;
+        typedef cv::Matx<ScalarType, 3, 3> MatrixType;
+        
+        MultiTemplateTracker()
+            : _rois(0), _target(0), _templateWarps(0), _warps(0), _levels(1), _maxIterations(0), _eps(0),
+              _maxError(std::numeric_limits<ScalarType>::max()),
+              _executor(&defaultExecutor())
+        {}
+        
+        /** 
+            Set the executor distributing tracks. The executor must outlive this object.
+         */
+        MultiTemplateTracker &setExecutor(const Executor &e) {
+            _executor = &e;
+            return *this;
+        }
+        
+        /**
+            Set the maximum error of an aligned track. Tracks with a larger error are TRACK_LOST.
+         */
+        MultiTemplateTracker &setMaxError(ScalarType maxError) {
+            _maxError = maxError;
+            return *this;
+        }
+        
+        /**
+            Set storage precision of template data used by all tracks. Takes effect with the next prepare.
+         
+            Reduced precision lowers the memory per track, see AlignBase::setStoragePolicy.
+         */
+        MultiTemplateTracker &setStoragePolicy(const StoragePolicy &p) {
+            _storagePolicy = p;
+            return *this;
+        }
+        
+        /**
+            Set damping of alignment steps used by all tracks, see AlignBase::setDamping.
+         */
+        MultiTemplateTracker &setDamping(const Damping &d) {
+            _damping = d;
+            return *this;
+        }
+        
+        /**
+            Set prediction of warps from previous frames, see Prediction. Requires warps providing 
+            matrix and setMatrix.
+         
+            Motion is kept per track index, tracks need to keep their index between frames. Tracks 
+            that are lost or change in number restart without prediction.
+         */
+        MultiTemplateTracker &setPrediction(const Prediction &p) {
+            CV_Assert(!p.enabled || p.tolerance > 0.f);
+            _prediction = p;
+            return *this;
+        }
+        
+        /**
+            Forget the motion of all tracks, for example after tracks were replaced.
+         */
+        void resetPrediction() {
+            _hasMotion.assign(_hasMotion.size(), 0);
+        }
+        
+        /**
+            Drop tracks, keeping the order and the aligner, motion and cost state of the remaining ones.
+         
+            Useful when lost tracks are removed between frames. Prepared templates are dropped as 
+            well, remaining tracks are TRACK_INVALID_ROI until prepared again or tracked.
+         
+            \param keep Non-zero for tracks to keep, one per track.
+         */
+        void keepTracks(const std::vector<uchar> &keep) {
+            CV_Assert((int)keep.size() == numTracks());
+            
+            int k = 0;
+            for (int i = 0; i < numTracks(); ++i) {
+                if (!keep[i])
+                    continue;
+                
+                // Swapping keeps buffers of dropped aligners for reuse
+                if (k != i)
+                    std::swap(_aligners[k], _aligners[i]);
+                
+                _costs[k] = _costs[i];
+                _motion[k] = _motion[i];
+                _hasMotion[k] = _hasMotion[i];
+                _corrections[k] = _corrections[i];
+                _centers[k] = _centers[i];
+                ++k;
+            }
+            
+            _costs.resize(k);
+            _motion.resize(k);
+            _hasMotion.resize(k);
+            _corrections.resize(k);
+            _centers.resize(k);
+            _status.assign(k, TRACK_INVALID_ROI);
+            _errors.assign(k, std::numeric_limits<ScalarType>::max());
+        }
+        
+        /**
+            Prepare templates of all tracks.
+         
+            Template data is computed once and reused by subsequent calls to align, which 
+            is useful when fixed templates are tracked over many frames.
+         
+            \param tmpl Single channel image containing all template regions.
+            \param rois Template regions in tmpl, one per track.
+            \param warps Warp per track. Only used to determine the number of parameters.
+            \param pyramidLevels Maximum number of pyramid levels to use.
+         */
+        void prepare(const cv::Mat &tmpl, 
+                     const std::vector<cv::Rect> &rois, 
+                     const std::vector<WarpType> &warps,
+                     int pyramidLevels)
+        {
+            CV_Assert(rois.size() == warps.size());
+            CV_Assert(tmpl.channels() == 1);
+            
+            resize((int)rois.size());
+            
+            _tmpl = tmpl;
+            _rois = &rois;
+            _templateWarps = &warps;
+            _levels = pyramidLevels;
+            
+            run(PREPARE);
+        }
+        
+        /**
+            Align all prepared tracks with target.
+         
+            \param target Pre-built image pyramid of target image.
+            \param warps Initial warp per track. Will be modified to hold results.
+            \param maxIterations Maximum number of iterations in all levels per track.
+            \param eps Minimum length of incremental parameter vector to continue on current level.
+         */
+        void align(const ImagePyramid &target,
+                   std::vector<WarpType> &warps,
+                   int maxIterations,
+                   ScalarType eps)
+        {
+            CV_Assert((int)warps.size() == numTracks());
+            CV_Assert(target.numLevels() > 0);
+            
+            _target = &target;
+            _warps = &warps;
+            _maxIterations = maxIterations;
+            _eps = eps;
+            
+            run(ALIGN);
+        }
+        
+        /**
+            Prepare and align all tracks in a single pass.
+         
+            \param tmpl Single channel image containing all template regions.
+            \param rois Template regions in tmpl, one per track.
+            \param target Pre-built image pyramid of target image.
+            \param warps Initial warp per track. Will be modified to hold results.
+            \param pyramidLevels Maximum number of pyramid levels to use.
+            \param maxIterations Maximum number of iterations in all levels per track.
+            \param eps Minimum length of incremental parameter vector to continue on current level.
+         */
+        void track(const cv::Mat &tmpl, 
+                   const std::vector<cv::Rect> &rois, 
+                   const ImagePyramid &target, 
+                   std::vector<WarpType> &warps,
+                   int pyramidLevels,
+                   int maxIterations, 
+                   ScalarType eps)
+        {
+            CV_Assert(rois.size() == warps.size());
+            CV_Assert(tmpl.channels() == 1);
+            CV_Assert(target.numLevels() > 0);
+            
+            resize((int)rois.size());
+            
+            _tmpl = tmpl;
+            _rois = &rois;
+            _target = &target;
+            _templateWarps = &warps;
+            _warps = &warps;
+            _levels = std::min<int>(pyramidLevels, target.numLevels());
+            _maxIterations = maxIterations;
+            _eps = eps;
+            
+            run(PREPARE | ALIGN);
+        }
+        
+        /** Number of tracks of last call to prepare or track. */
+        int numTracks() const {
+            return (int)_status.size();
+        }
+        
+        /** Status of i-th track. One of TRACK_OK, TRACK_INVALID_ROI, TRACK_LOST. */
+        int status(int i) const {
+            return _status[i];
+        }
+        
+        /** Error of i-th track after alignment. */
+        ScalarType error(int i) const {
+            return _errors[i];
+        }
+        
+        /** Level alignment of the i-th track started at in the last pass, -1 for the coarsest. */
+        int startLevel(int i) const {
+            return _aligners[i].startLevel();
+        }
+        
+        /** Access aligner of i-th track. */
+        const A &aligner(int i) const {
+            return _aligners[i];
+        }
+        
+    private:
+        
+        MultiTemplateTracker(const MultiTemplateTracker &);
+        MultiTemplateTracker &operator=(const MultiTemplateTracker &);
+        
+        enum {
+            PREPARE = 1,
+            ALIGN = 2
+        };
+        
+        class TrackTask : public ParallelTask {
+        public:
+            TrackTask(MultiTemplateTracker *t, int mode)
+                : _t(t), _mode(mode)
+            {}
+            
+            void operator()(int task) const {
+                const int i = _t->_order[task];
+                const int64 start = cv::getTickCount();
+                
+                if (_mode & PREPARE)
+                    _t->prepareOne(i);
+                if (_mode & ALIGN)
+                    _t->alignOne(i);
+                
+                _t->_costs[i] = cv::getTickCount() - start;
+            }
+        private:
+            MultiTemplateTracker *_t;
+            int _mode;
+        };
+        
+        /** Orders track indices by decreasing cost, ties by index. */
+        class CostGreater {
+        public:
+            explicit CostGreater(const std::vector<int64> &costs)
+                : _costs(costs)
+            {}
+            
+            bool operator()(int a, int b) const {
+                return _costs[a] > _costs[b] || (_costs[a] == _costs[b] && a < b);
+            }
+        private:
+            const std::vector<int64> &_costs;
+        };
+        
+        void resize(int n) {
+            if ((int)_aligners.size() < n)
+                _aligners.resize(n);
+            
+            // Costs and motion of a previous pass remain valid as long as the tracks stay the same.
+            if ((int)_costs.size() != n) {
+                _costs.assign(n, 0);
+                _motion.assign(n, MatrixType::eye());
+                _hasMotion.assign(n, 0);
+                _corrections.assign(n, ScalarType(0));
+                _centers.assign(n, PointType(0, 0));
+            }
+            
+            _status.assign(n, TRACK_INVALID_ROI);
+            _errors.assign(n, std::numeric_limits<ScalarType>::max());
+        }
+        
+        void run(int mode) {
+            _order.resize(_costs.size());
+            for (size_t i = 0; i < _order.size(); ++i)
+                _order[i] = (int)i;
+            std::sort(_order.begin(), _order.end(), CostGreater(_costs));
+            
+            TrackTask task(this, mode);
+            _executor->run(numTracks(), task);
+            
+            _tmpl = cv::Mat();
+            _rois = 0;
+            _target = 0;
+            _templateWarps = 0;
+            _warps = 0;
+        }
+        
+        void prepareOne(int i) {
+            const cv::Rect roi = (*_rois)[i];
+            const cv::Rect bounds(0, 0, _tmpl.cols, _tmpl.rows);
+            
+            _errors[i] = std::numeric_limits<ScalarType>::max();
+            
+            if (roi.width < 3 || roi.height < 3 || (roi & bounds) != roi || !A::supportsTemplateSize(roi.size())) {
+                _status[i] = TRACK_INVALID_ROI;
+                return;
+            }
+            
+            _centers[i] = PointType(ScalarType(roi.width) / 2, ScalarType(roi.height) / 2);
+            
+            A &a = _aligners[i];
+            a.setExecutor(_serial);
+            a.setStoragePolicy(_storagePolicy);
+            a.setDamping(_damping);
+            a.prepare(_tmpl(roi), (*_templateWarps)[i], _levels);
+            
+            _status[i] = TRACK_OK;
+        }
+        
+        void alignOne(int i) {
+            if (_status[i] == TRACK_INVALID_ROI)
+                return;
+            
+            A &a = _aligners[i];
+            WarpType &w = (*_warps)[i];
+            const WarpType initial = w;
+            
+            int startLevel = -1;
+            if (_prediction.enabled && _hasMotion[i]) {
+                w.setMatrix(_motion[i] * w.matrix());
+                startLevel = levelForCorrection(_corrections[i]);
+            }
+            const WarpType predicted = w;
+            
+            a.setTarget(*_target);
+            a.setStartLevel(startLevel);
+            a.align(w, _maxIterations, _eps);
+            
+            _errors[i] = a.lastError();
+            _status[i] = (_errors[i] < _maxError && _errors[i] < std::numeric_limits<ScalarType>::max()) ? TRACK_OK : TRACK_LOST;
+            
+            if (_prediction.enabled) {
+                _hasMotion[i] = (_status[i] == TRACK_OK);
+                _motion[i] = w.matrix() * initial.invMatrix();
+                
+                PointType d = w(_centers[i]) - predicted(_centers[i]);
+                _corrections[i] = std::sqrt(d(0) * d(0) + d(1) * d(1));
+            }
+        }
+        
+        /** Finest level handling a correction of the given length in pixels. */
+        int levelForCorrection(ScalarType c) const {
+            int level = 0;
+            for (ScalarType handled = ScalarType(_prediction.tolerance); handled < c && level < _levels - 1; handled *= 2)
+                ++level;
+            return level;
+        }
+        
+        std::vector<A> _aligners;
+        std::vector<int> _status;
+        std::vector<ScalarType> _errors;
+        std::vector<int64> _costs;
+        std::vector<int> _order;
+        std::vector<MatrixType> _motion;
+        std::vector<uchar> _hasMotion;
+        std::vector<ScalarType> _corrections;
+        std::vector<PointType> _centers;
+        
+        cv::Mat _tmpl;
+        const std::vector<cv::Rect> *_rois;
+        const ImagePyramid *_target;
+        const std::vector<WarpType> *_templateWarps;
+        std::vector<WarpType> *_warps;
+        int _levels;
+        int _maxIterations;
+        ScalarType _eps;
+        ScalarType _maxError;
+        StoragePolicy _storagePolicy;
+        Damping _damping;
+        Prediction _prediction;
+        
+        SerialExecutor _serial;
+        const Executor *_executor;
+    };
+}
+
+#endif
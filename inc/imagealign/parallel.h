@@ -0,0 +1,624 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_PARALLEL_H
+#define IMAGE_ALIGN_PARALLEL_H
+
+#include <imagealign/config.h>
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <vector>
+#include <stdexcept>
+
+#ifdef _OPENMP
+    #include <omp.h>
+#endif
+
+#ifdef IA_HAS_CXX11
+    #include <atomic>
+    #include <condition_variable>
+    #include <exception>
+    #include <memory>
+    #include <mutex>
+    #include <thread>
+#endif
+
+namespace imagealign {
+    
+    /** 
+        A set of independent tasks identified by index.
+     */
+    class ParallelTask {
+    public:
+        virtual ~ParallelTask() {}
+        
+        /** Execute the task with the given index. */
+        virtual void operator()(int task) const = 0;
+    };
+    
+    /**
+        Interface for executing independent tasks.
+     
+        Implementations may run tasks in any order and on any thread, but return
+        only after all tasks have completed. Implement this interface to plug a
+        custom thread pool into the library.
+     */
+    class Executor {
+    public:
+        virtual ~Executor() {}
+        
+        /** Run tasks [0, numTasks) and wait for their completion. */
+        virtual void run(int numTasks, const ParallelTask &task) const = 0;
+    };
+    
+    /**
+        Executes all tasks in order on the calling thread.
+     */
+    class SerialExecutor : public Executor {
+    public:
+        void run(int numTasks, const ParallelTask &task) const {
+            for (int i = 0; i < numTasks; ++i) {
+                task(i);
+            }
+        }
+    };
+    
+    /**
+        Executes tasks through OpenCV's parallel framework.
+     
+        Uses whichever backend OpenCV was built with (TBB, OpenMP, GCD, ...).
+     */
+    class OpenCVExecutor : public Executor {
+    public:
+        void run(int numTasks, const ParallelTask &task) const {
+            if (numTasks <= 1) {
+                SerialExecutor().run(numTasks, task);
+                return;
+            }
+            
+            Body b(task);
+            cv::parallel_for_(cv::Range(0, numTasks), b);
+        }
+        
+    private:
+        class Body : public cv::ParallelLoopBody {
+        public:
+            explicit Body(const ParallelTask &task) : _task(task) {}
+            
+            void operator()(const cv::Range &r) const {
+                for (int i = r.start; i < r.end; ++i) {
+                    _task(i);
+                }
+            }
+        private:
+            const ParallelTask &_task;
+        };
+    };
+    
+#ifdef _OPENMP
+    
+    /**
+        Executes tasks using OpenMP.
+     
+        Available when compiled with IMAGEALIGN_USE_OPENMP. When invoked from within an
+        active parallel region, tasks run on the calling thread.
+     */
+    class OpenMPExecutor : public Executor {
+    public:
+        void run(int numTasks, const ParallelTask &task) const {
+            if (numTasks <= 1 || omp_in_parallel()) {
+                SerialExecutor().run(numTasks, task);
+                return;
+            }
+            
+            // Exceptions must not escape the parallel region.
+            bool failed = false;
+            cv::Exception error;
+            
+            #pragma omp parallel for schedule(dynamic)
+            for (int i = 0; i < numTasks; ++i) {
+                try {
+                    task(i);
+                } catch (const cv::Exception &e) {
+                    #pragma omp critical(imagealign_executor)
+                    {
+                        if (!failed) {
+                            failed = true;
+                            error = e;
+                        }
+                    }
+                } catch (...) {
+                    #pragma omp critical(imagealign_executor)
+                    {
+                        if (!failed) {
+                            failed = true;
+                            error = cv::Exception(cv::Error::StsError, "Task failed", "OpenMPExecutor::run", __FILE__, __LINE__);
+                        }
+                    }
+                }
+            }
+            
+            if (failed)
+                throw error;
+        }
+    };
+    
+#endif
+    
+#ifdef IA_HAS_CXX11
+    
+    /**
+        Executes tasks on a persistent pool of std::thread workers.
+     
+        The calling thread participates in the work. Only one batch of tasks is
+        processed at a time, concurrent callers run their batch on their own thread.
+     */
+    class ThreadExecutor : public Executor {
+    public:
+        
+        /** 
+            Create pool.
+         
+            \param numThreads Total number of threads including the caller. When zero
+                   std::thread::hardware_concurrency() is used.
+         */
+        explicit ThreadExecutor(int numThreads = 0)
+            : _task(0), _numTasks(0), _next(0), _busy(0), _generation(0), _stop(false)
+        {
+            if (numThreads <= 0)
+                numThreads = std::max<int>(1, (int)std::thread::hardware_concurrency());
+            
+            for (int i = 1; i < numThreads; ++i) {
+                _threads.push_back(std::thread(&ThreadExecutor::workerLoop, this));
+            }
+        }
+        
+        ~ThreadExecutor() {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _wake.notify_all();
+            
+            for (size_t i = 0; i < _threads.size(); ++i) {
+                _threads[i].join();
+            }
+        }
+        
+        /** Total number of threads including the caller. */
+        int numThreads() const {
+            return (int)_threads.size() + 1;
+        }
+        
+        void run(int numTasks, const ParallelTask &task) const {
+            std::unique_lock<std::mutex> runLock(_runMutex, std::try_to_lock);
+            
+            if (numTasks <= 1 || _threads.empty() || !runLock.owns_lock()) {
+                SerialExecutor().run(numTasks, task);
+                return;
+            }
+            
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _task = &task;
+                _numTasks = numTasks;
+                _next = 0;
+                _error = std::exception_ptr();
+                _busy = (int)_threads.size();
+                ++_generation;
+            }
+            _wake.notify_all();
+            
+            drain();
+            
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_busy > 0)
+                _done.wait(lock);
+            
+            _task = 0;
+            
+            if (_error)
+                std::rethrow_exception(_error);
+        }
+        
+    private:
+        ThreadExecutor(const ThreadExecutor &);
+        ThreadExecutor &operator=(const ThreadExecutor &);
+        
+        void drain() const {
+            for (int i = _next++; i < _numTasks; i = _next++) {
+                try {
+                    (*_task)(i);
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!_error)
+                        _error = std::current_exception();
+                }
+            }
+        }
+        
+        void workerLoop() {
+            unsigned seen = 0;
+            
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    while (!_stop && _generation == seen)
+                        _wake.wait(lock);
+                    
+                    if (_stop)
+                        return;
+                    
+                    seen = _generation;
+                }
+                
+                drain();
+                
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (--_busy == 0)
+                    _done.notify_all();
+            }
+        }
+        
+        mutable std::mutex _runMutex;
+        mutable std::mutex _mutex;
+        mutable std::condition_variable _wake;
+        mutable std::condition_variable _done;
+        
+        mutable const ParallelTask *_task;
+        mutable int _numTasks;
+        mutable std::atomic<int> _next;
+        mutable int _busy;
+        mutable unsigned _generation;
+        mutable std::exception_ptr _error;
+        bool _stop;
+        
+        std::vector<std::thread> _threads;
+    };
+    
+    /**
+        Executes tasks on a persistent pool of workers balancing load by work stealing.
+     
+        Tasks are dealt round robin, thread i of T starts with tasks i, i + T, i + 2T and so on. 
+        Each thread processes its own share in increasing task order and, once exhausted, steals 
+        the back half of the remaining share of another thread. Callers that order tasks by 
+        decreasing cost thus start the T most expensive tasks concurrently and leave the cheapest 
+        ones for stealing, for example when some tracks converge after few iterations while 
+        others use their full budget. The calling thread participates in the work. Only one 
+        batch of tasks is processed at a time, concurrent callers run their batch on their own 
+        thread.
+     */
+    class WorkStealingExecutor : public Executor {
+    public:
+        
+        /** 
+            Create pool.
+         
+            \param numThreads Total number of threads including the caller. When zero
+                   std::thread::hardware_concurrency() is used.
+         */
+        explicit WorkStealingExecutor(int numThreads = 0)
+            : _task(0), _numTasks(0), _busy(0), _generation(0), _stop(false)
+        {
+            if (numThreads <= 0)
+                numThreads = std::max<int>(1, (int)std::thread::hardware_concurrency());
+            
+            _ranges.reset(new Range[numThreads]);
+            
+            for (int i = 1; i < numThreads; ++i) {
+                _threads.push_back(std::thread(&WorkStealingExecutor::workerLoop, this, i));
+            }
+        }
+        
+        ~WorkStealingExecutor() {
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _stop = true;
+            }
+            _wake.notify_all();
+            
+            for (size_t i = 0; i < _threads.size(); ++i) {
+                _threads[i].join();
+            }
+        }
+        
+        /** Total number of threads including the caller. */
+        int numThreads() const {
+            return (int)_threads.size() + 1;
+        }
+        
+        void run(int numTasks, const ParallelTask &task) const {
+            std::unique_lock<std::mutex> runLock(_runMutex, std::try_to_lock);
+            
+            if (numTasks <= 1 || _threads.empty() || !runLock.owns_lock()) {
+                SerialExecutor().run(numTasks, task);
+                return;
+            }
+            
+            {
+                std::lock_guard<std::mutex> lock(_mutex);
+                
+                // Ranges hold slots, see taskAt() for the mapping to tasks.
+                const int n = numThreads();
+                const int q = numTasks / n, r = numTasks % n;
+                for (int i = 0; i < n; ++i) {
+                    const int b = i * q + std::min(i, r);
+                    const int e = b + q + (i < r ? 1 : 0);
+                    _ranges[i].bounds.store(pack(b, e), std::memory_order_relaxed);
+                }
+                
+                _task = &task;
+                _numTasks = numTasks;
+                _error = std::exception_ptr();
+                _busy = (int)_threads.size();
+                ++_generation;
+            }
+            _wake.notify_all();
+            
+            drain(0);
+            
+            std::unique_lock<std::mutex> lock(_mutex);
+            while (_busy > 0)
+                _done.wait(lock);
+            
+            _task = 0;
+            
+            if (_error)
+                std::rethrow_exception(_error);
+        }
+        
+    private:
+        WorkStealingExecutor(const WorkStealingExecutor &);
+        WorkStealingExecutor &operator=(const WorkStealingExecutor &);
+        
+        /** Remaining slots [begin, end) of a thread packed into one word, padded to a cache line. */
+        struct Range {
+            Range() : bounds(0) {}
+            
+            std::atomic<unsigned long long> bounds;
+            char padding[64 - sizeof(std::atomic<unsigned long long>)];
+        };
+        
+        static unsigned long long pack(int b, int e) {
+            return ((unsigned long long)(unsigned)b << 32) | (unsigned long long)(unsigned)e;
+        }
+        
+        static int begin(unsigned long long v) {
+            return (int)(unsigned)(v >> 32);
+        }
+        
+        static int end(unsigned long long v) {
+            return (int)(unsigned)(v & 0xffffffffull);
+        }
+        
+        /** 
+            Task of a slot. Thread i initially owns the i-th contiguous block of slots, 
+            the k-th slot of that block is task i + k * T. Stolen slots keep their task.
+         */
+        int taskAt(int slot) const {
+            const int n = numThreads();
+            const int q = _numTasks / n, r = _numTasks % n;
+            const int head = r * (q + 1);
+            
+            if (slot < head)
+                return slot / (q + 1) + (slot % (q + 1)) * n;
+            
+            const int s = slot - head;
+            return r + s / q + (s % q) * n;
+        }
+        
+        /** Take the front slot of own range, -1 when empty. */
+        int pop(int self) const {
+            std::atomic<unsigned long long> &r = _ranges[self].bounds;
+            unsigned long long v = r.load();
+            
+            while (begin(v) < end(v)) {
+                if (r.compare_exchange_weak(v, pack(begin(v) + 1, end(v))))
+                    return begin(v);
+            }
+            return -1;
+        }
+        
+        /** Move the back half of a victim range to own range and return its first slot, -1 when nothing left. */
+        int steal(int self) const {
+            const int n = numThreads();
+            
+            for (int k = 1; k < n; ++k) {
+                std::atomic<unsigned long long> &r = _ranges[(self + k) % n].bounds;
+                unsigned long long v = r.load();
+                
+                while (begin(v) < end(v)) {
+                    const int b = begin(v), e = end(v);
+                    const int m = b + (e - b) / 2;
+                    
+                    if (r.compare_exchange_weak(v, pack(b, m))) {
+                        // Own range is empty, so nobody else modifies it.
+                        _ranges[self].bounds.store(pack(m + 1, e));
+                        return m;
+                    }
+                }
+            }
+            return -1;
+        }
+        
+        void drain(int self) const {
+            for (int i = pop(self); i >= 0 || (i = steal(self)) >= 0; i = pop(self)) {
+                try {
+                    (*_task)(taskAt(i));
+                } catch (...) {
+                    std::lock_guard<std::mutex> lock(_mutex);
+                    if (!_error)
+                        _error = std::current_exception();
+                }
+            }
+        }
+        
+        void workerLoop(int self) {
+            unsigned seen = 0;
+            
+            for (;;) {
+                {
+                    std::unique_lock<std::mutex> lock(_mutex);
+                    while (!_stop && _generation == seen)
+                        _wake.wait(lock);
+                    
+                    if (_stop)
+                        return;
+                    
+                    seen = _generation;
+                }
+                
+                drain(self);
+                
+                std::lock_guard<std::mutex> lock(_mutex);
+                if (--_busy == 0)
+                    _done.notify_all();
+            }
+        }
+        
+        mutable std::mutex _runMutex;
+        mutable std::mutex _mutex;
+        mutable std::condition_variable _wake;
+        mutable std::condition_variable _done;
+        
+        mutable const ParallelTask *_task;
+        mutable int _numTasks;
+        mutable int _busy;
+        mutable unsigned _generation;
+        mutable std::exception_ptr _error;
+        bool _stop;
+        
+        std::unique_ptr<Range[]> _ranges;
+        std::vector<std::thread> _threads;
+    };
+    
+#endif
+    
+    /**
+        Access the default executor.
+     
+        Returns an OpenMP executor when compiled with OpenMP support, a serial
+        executor otherwise.
+     */
+    inline const Executor &defaultExecutor() {
+#ifdef _OPENMP
+        static OpenMPExecutor e;
+#else
+        static SerialExecutor e;
+#endif
+        return e;
+    }
+    
+    /** Number of template rows processed by a single reduction task. */
+    const int REDUCTION_TILE_ROWS = 16;
+    
+    namespace detail {
+        
+        template<class Kernel>
+        class ReduceTask : public ParallelTask {
+        public:
+            typedef typename Kernel::AccumulatorType AccumulatorType;
+            
+            ReduceTask(const Kernel &kernel, std::vector<AccumulatorType> &partials, int begin, int end, int grain)
+                : _kernel(kernel), _partials(partials), _begin(begin), _end(end), _grain(grain)
+            {}
+            
+            void operator()(int task) const {
+                const int b = _begin + task * _grain;
+                const int e = std::min<int>(_end, b + _grain);
+                _kernel(b, e, _partials[task]);
+            }
+            
+        private:
+            const Kernel &_kernel;
+            std::vector<AccumulatorType> &_partials;
+            int _begin, _end, _grain;
+        };
+    }
+    
+    /**
+        Deterministic parallel reduction over a range.
+     
+        Splits [begin, end) into tiles of grain elements. Each tile is reduced into its
+        own accumulator, tiles run through the given executor. Partial results are merged 
+        in tile order afterwards, so the result does not depend on the executor or the 
+        number of threads used.
+     
+        The kernel needs to provide
+            - a typedef AccumulatorType, which offers reset() and merge(const AccumulatorType&),
+            - AccumulatorType accumulator() const, returning a new zeroed accumulator,
+            - void operator()(int begin, int end, AccumulatorType &acc) const.
+     
+        Accumulators are kept in partials and reused by subsequent invocations, so no 
+        allocation happens once partials holds enough tiles.
+     
+        \param begin First element of range.
+        \param end One past the last element of range.
+        \param grain Number of elements per tile.
+        \param kernel Reduction kernel.
+        \param e Executor to run tiles.
+        \param partials Per-tile accumulators retained across invocations.
+        \return Reference to merged result stored in partials.
+     */
+    template<class Kernel>
+    typename Kernel::AccumulatorType &parallelReduce(int begin, int end, int grain, 
+                                                     const Kernel &kernel, const Executor &e,
+                                                     std::vector<typename Kernel::AccumulatorType> &partials)
+    {
+        grain = std::max<int>(1, grain);
+        const int numTiles = std::max<int>(1, (end - begin + grain - 1) / grain);
+        
+        while ((int)partials.size() < numTiles) {
+            partials.push_back(kernel.accumulator());
+        }
+        
+        for (int i = 0; i < numTiles; ++i) {
+            partials[i].reset();
+        }
+        
+        if (numTiles == 1) {
+            if (end > begin)
+                kernel(begin, end, partials[0]);
+            return partials[0];
+        }
+        
+        detail::ReduceTask<Kernel> task(kernel, partials, begin, end, grain);
+        e.run(numTiles, task);
+        
+        for (int i = 1; i < numTiles; ++i) {
+            partials[0].merge(partials[i]);
+        }
+        
+        return partials[0];
+    }
+    
+    /**
+        Deterministic parallel reduction over a range.
+     
+        Same as above, but uses temporary accumulators.
+     */
+    template<class Kernel>
+    typename Kernel::AccumulatorType parallelReduce(int begin, int end, int grain, const Kernel &kernel, const Executor &e)
+    {
+        std::vector<typename Kernel::AccumulatorType> partials;
+        return parallelReduce(begin, end, grain, kernel, e, partials);
+    }
+}
+
+#endif
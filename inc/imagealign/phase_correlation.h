@@ -0,0 +1,423 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_PHASE_CORRELATION_H
+#define IMAGE_ALIGN_PHASE_CORRELATION_H
+
+#include <imagealign/warp.h>
+#include <imagealign/sampling.h>
+#include <imagealign/storage.h>
+#include <opencv2/core/core.hpp>
+#include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+namespace imagealign {
+    
+    /**
+        Similarity between template and target estimated by phase correlation.
+     
+        Maps template coordinates p to target coordinates scale * R(rotation) * p + translation.
+     */
+    struct PhaseCorrelationResult {
+        PhaseCorrelationResult()
+            : translation(0, 0), rotation(0), scale(1), response(0)
+        {}
+        
+        /** Target position of the template origin. */
+        cv::Point2d translation;
+        
+        /** Rotation in radians. */
+        double rotation;
+        
+        /** Isotropic scale. */
+        double scale;
+        
+        /** Peak of the translational correlation. Higher values indicate more reliable estimates. */
+        double response;
+    };
+    
+    namespace detail {
+        
+        /** 
+            Single precision copy of an image of any supported storage with its mean removed. 
+            Channels of multi-channel images are averaged.
+         */
+        inline cv::Mat zeroMeanFloat(const cv::Mat &img) {
+            const int cn = img.channels();
+            cv::Mat dst(img.size(), CV_32FC1);
+            
+            if (img.type() == CV_8UC1) {
+                img.convertTo(dst, CV_32F);
+            } else if (cn == 1) {
+                for (int y = 0; y < img.rows; ++y) {
+                    float *row = dst.ptr<float>(y);
+                    const float *src = loadRow(img, y, row);
+                    if (src != row)
+                        std::copy(src, src + img.cols, row);
+                }
+            } else {
+                std::vector<float> buf(img.cols * cn);
+                for (int y = 0; y < img.rows; ++y) {
+                    float *row = dst.ptr<float>(y);
+                    const float *src = loadRow(img, y, &buf[0]);
+                    
+                    for (int x = 0; x < img.cols; ++x) {
+                        float sum = 0.f;
+                        for (int c = 0; c < cn; ++c)
+                            sum += src[x * cn + c];
+                        row[x] = sum * (1.f / float(cn));
+                    }
+                }
+            }
+            
+            const float mean = float(cv::mean(dst)[0]);
+            for (int y = 0; y < dst.rows; ++y) {
+                float *row = dst.ptr<float>(y);
+                for (int x = 0; x < dst.cols; ++x) {
+                    row[x] -= mean;
+                }
+            }
+            
+            return dst;
+        }
+        
+        /**
+            Zero mean template apodized by a Hanning window.
+         
+            The window fades the template to zero towards its border, so zero padding does not
+            introduce edges correlating with target structures.
+         */
+        inline cv::Mat apodizedTemplate(const cv::Mat &tpl) {
+            cv::Mat t = zeroMeanFloat(tpl);
+            
+            if (t.rows > 1 && t.cols > 1) {
+                cv::Mat window;
+                cv::createHanningWindow(window, t.size(), CV_32F);
+                t = t.mul(window);
+            }
+            
+            return t;
+        }
+        
+        /** Copy img to the origin of a zero canvas of given size. */
+        inline cv::Mat embed(const cv::Mat &img, cv::Size canvas) {
+            cv::Mat dst = cv::Mat::zeros(canvas, CV_32FC1);
+            cv::Mat roi = dst(cv::Rect(0, 0, img.cols, img.rows));
+            img.copyTo(roi);
+            return dst;
+        }
+        
+        /** Element of an image repeating periodically. */
+        inline float periodicAt(const cv::Mat &m, int x, int y) {
+            return m.at<float>((y % m.rows + m.rows) % m.rows, (x % m.cols + m.cols) % m.cols);
+        }
+        
+        /** Sub-sample offset of a peak from its neighbors by fitting a parabola. */
+        inline double refinePeak(double left, double center, double right) {
+            const double d = left - 2 * center + right;
+            return d < 0 ? std::max<double>(-0.5, std::min<double>(0.5, 0.5 * (left - right) / d)) : 0;
+        }
+        
+        /**
+            Target position of the template origin by phase correlation.
+         
+            Both images are zero padded to a common canvas large enough that no partial overlap 
+            of template and target wraps around, so all offsets placing the template at least 
+            partially onto the target are distinguishable. 
+         
+            Optionally only placements fully inside the target are searched where the template
+            fits, as Lucas-Kanade ignores template pixels outside the target anyway. This 
+            suppresses spurious peaks of placements overlapping the target by a few pixels only, 
+            which are frequent for the small images of coarse pyramid levels.
+         
+            \param tpl Apodized template, see apodizedTemplate.
+            \param target Zero mean target, see zeroMeanFloat.
+            \param inside Whether to search placements fully inside the target only.
+            \param response Receives the correlation peak.
+         */
+        inline cv::Point2d correlateTranslation(const cv::Mat &tpl, const cv::Mat &target, bool inside, double &response) {
+            const cv::Size canvas(cv::getOptimalDFTSize(target.cols + tpl.cols), cv::getOptimalDFTSize(target.rows + tpl.rows));
+            
+            cv::Mat ft, fg, cross;
+            cv::dft(embed(tpl, canvas), ft, cv::DFT_COMPLEX_OUTPUT);
+            cv::dft(embed(target, canvas), fg, cv::DFT_COMPLEX_OUTPUT);
+            cv::mulSpectrums(fg, ft, cross, 0, true);
+            
+            // Keep phase only
+            for (int y = 0; y < cross.rows; ++y) {
+                float *c = cross.ptr<float>(y);
+                
+                for (int x = 0; x < cross.cols; ++x, c += 2) {
+                    const float m = std::sqrt(c[0] * c[0] + c[1] * c[1]);
+                    const float s = m > std::numeric_limits<float>::min() ? 1.f / m : 0.f;
+                    c[0] *= s;
+                    c[1] *= s;
+                }
+            }
+            
+            cv::Mat surface;
+            cv::idft(cross, surface, cv::DFT_SCALE);
+            
+            std::vector<cv::Mat> parts;
+            cv::split(surface, parts);
+            const cv::Mat &corr = parts[0];
+            
+            const bool insideX = inside && tpl.cols <= target.cols;
+            const bool insideY = inside && tpl.rows <= target.rows;
+            const int x0 = insideX ? 0 : 1 - tpl.cols;
+            const int x1 = insideX ? target.cols - tpl.cols : target.cols - 1;
+            const int y0 = insideY ? 0 : 1 - tpl.rows;
+            const int y1 = insideY ? target.rows - tpl.rows : target.rows - 1;
+            
+            int bx = x0, by = y0;
+            float best = -std::numeric_limits<float>::max();
+            for (int dy = y0; dy <= y1; ++dy) {
+                for (int dx = x0; dx <= x1; ++dx) {
+                    const float v = periodicAt(corr, dx, dy);
+                    if (v > best) {
+                        best = v;
+                        bx = dx;
+                        by = dy;
+                    }
+                }
+            }
+            
+            response = best;
+            
+            const cv::Point2d t(
+                bx + refinePeak(periodicAt(corr, bx - 1, by), best, periodicAt(corr, bx + 1, by)),
+                by + refinePeak(periodicAt(corr, bx, by - 1), best, periodicAt(corr, bx, by + 1)));
+            
+            return t;
+        }
+        
+        /**
+            High-pass filtered magnitude spectrum resampled to log-polar coordinates.
+         
+            The magnitude spectrum does not depend on translation, and rotations and scalings of 
+            the image become shifts in log-polar coordinates. Rows sample angles in [0, pi), which 
+            suffices because magnitude spectra of real images are point symmetric. Columns sample 
+            radii logarithmically from 1 to size / 2.
+         
+            \param img Apodized image. Needs to fit into size x size.
+            \param size Side length of the square frequency domain.
+         */
+        inline cv::Mat logPolarSpectrum(const cv::Mat &img, int size) {
+            cv::Mat spectrum;
+            cv::dft(embed(img, cv::Size(size, size)), spectrum, cv::DFT_COMPLEX_OUTPUT);
+            
+            std::vector<cv::Mat> parts;
+            cv::split(spectrum, parts);
+            
+            cv::Mat magnitude;
+            cv::magnitude(parts[0], parts[1], magnitude);
+            
+            // Swap quadrants so the zero frequency is centered, and suppress low frequencies
+            // which are dominated by image borders and illumination.
+            const int h = size / 2;
+            cv::Mat centered(size, size, CV_32FC1);
+            for (int y = 0; y < size; ++y) {
+                const float cy = std::cos(float(CV_PI) * float(y - h) / float(size));
+                const float *src = magnitude.ptr<float>((y + h) % size);
+                float *dst = centered.ptr<float>(y);
+                
+                for (int x = 0; x < size; ++x) {
+                    const float c = cy * std::cos(float(CV_PI) * float(x - h) / float(size));
+                    dst[x] = src[(x + h) % size] * (1.f - c) * (2.f - c);
+                }
+            }
+            
+            const int angles = size;
+            const int radii = std::max<int>(1, h);
+            const double logBase = std::log(double(h)) / double(radii);
+            
+            Sampler<SAMPLE_BILINEAR> s;
+            cv::Mat lp(angles, radii, CV_32FC1);
+            
+            for (int i = 0; i < angles; ++i) {
+                const double phi = CV_PI * double(i) / double(angles);
+                const double c = std::cos(phi);
+                const double sn = std::sin(phi);
+                float *dst = lp.ptr<float>(i);
+                
+                for (int j = 0; j < radii; ++j) {
+                    const double r = std::exp(double(j) * logBase);
+                    dst[j] = s.sample<float>(centered, float(h + r * c), float(h + r * sn));
+                }
+            }
+            
+            return lp;
+        }
+        
+        /**
+            Resample img by the linear map a into a canvas holding all of its image.
+         
+            Pixels not covered by img are zero.
+         
+            \param offset Receives the canvas position of the origin of img.
+         */
+        inline cv::Mat transformLinear(const cv::Mat &img, const cv::Matx22d &a, cv::Point2d &offset) {
+            const cv::Matx22d ia = a.inv();
+            
+            const cv::Vec2d corners[4] = {
+                a * cv::Vec2d(0, 0), 
+                a * cv::Vec2d(img.cols - 1, 0), 
+                a * cv::Vec2d(0, img.rows - 1), 
+                a * cv::Vec2d(img.cols - 1, img.rows - 1)
+            };
+            
+            double minX = corners[0][0], minY = corners[0][1], maxX = minX, maxY = minY;
+            for (int i = 1; i < 4; ++i) {
+                minX = std::min<double>(minX, corners[i][0]);
+                minY = std::min<double>(minY, corners[i][1]);
+                maxX = std::max<double>(maxX, corners[i][0]);
+                maxY = std::max<double>(maxY, corners[i][1]);
+            }
+            
+            offset = cv::Point2d(-std::floor(minX), -std::floor(minY));
+            const int cols = (int)std::ceil(maxX + offset.x) + 1;
+            const int rows = (int)std::ceil(maxY + offset.y) + 1;
+            
+            Sampler<SAMPLE_BILINEAR> s;
+            cv::Mat dst(rows, cols, CV_32FC1);
+            
+            for (int y = 0; y < rows; ++y) {
+                float *row = dst.ptr<float>(y);
+                
+                for (int x = 0; x < cols; ++x) {
+                    const cv::Vec2d p = ia * cv::Vec2d(x - offset.x, y - offset.y);
+                    const bool inside = p[0] >= 0 && p[1] >= 0 && p[0] <= img.cols - 1 && p[1] <= img.rows - 1;
+                    row[x] = inside ? s.sample<float>(img, float(p[0]), float(p[1])) : 0.f;
+                }
+            }
+            
+            return dst;
+        }
+        
+        /** Linear part scale * R(rotation). */
+        inline cv::Matx22d similarityMatrix(double rotation, double scale) {
+            const double c = scale * std::cos(rotation);
+            const double s = scale * std::sin(rotation);
+            return cv::Matx22d(c, -s, s, c);
+        }
+        
+        /** Set warp to the similarity estimated, dropping what the motion cannot represent. */
+        template<int WarpMode, class Scalar>
+        inline void assignSimilarity(Warp<WarpMode, Scalar> &w, const PhaseCorrelationResult &r) {
+            const cv::Matx22d a = similarityMatrix(r.rotation, r.scale);
+            
+            w.setMatrix(cv::Matx<Scalar, 3, 3>(
+                Scalar(a(0, 0)), Scalar(a(0, 1)), Scalar(r.translation.x),
+                Scalar(a(1, 0)), Scalar(a(1, 1)), Scalar(r.translation.y),
+                Scalar(0), Scalar(0), Scalar(1)));
+        }
+        
+        /** Set warp to the similarity estimated, dropping what the motion cannot represent. */
+        template<class Scalar>
+        inline void assignSimilarity(Warp<WARP_TRANSLATION, Scalar> &w, const PhaseCorrelationResult &r) {
+            typename Warp<WARP_TRANSLATION, Scalar>::Traits::ParamType p;
+            p << Scalar(r.translation.x), Scalar(r.translation.y);
+            w.setParameters(p);
+        }
+        
+        /** Set warp to the similarity estimated, dropping what the motion cannot represent. */
+        template<class Scalar>
+        inline void assignSimilarity(Warp<WARP_EUCLIDEAN, Scalar> &w, const PhaseCorrelationResult &r) {
+            typename Warp<WARP_EUCLIDEAN, Scalar>::Traits::ParamType p;
+            p << Scalar(r.translation.x), Scalar(r.translation.y), Scalar(r.rotation);
+            w.setParameters(p);
+        }
+    }
+    
+    /**
+        Estimate the similarity between a template and a target by phase correlation.
+     
+        Phase correlation finds the translation maximizing the correlation of whitened spectra 
+        in a single pass over the frequency domain, regardless of how far the template is 
+        displaced. This makes it a good initializer for Lucas-Kanade, which converges only 
+        from nearby estimates. Templates fitting into the target are placed fully inside.
+     
+        Rotation and scale are optionally recovered first from log-polar magnitude spectra
+        following Reddy and Chatterji. This works best when template and target largely show 
+        the same scene, such as overlapping images being stitched. The inherent ambiguity of 
+        rotations by pi is resolved by the higher translational response.
+     
+        Channels of multi-channel images are averaged before correlating.
+     
+        \param tpl Template of any supported storage.
+        \param target Target of any supported storage.
+        \param estimateRotationScale Whether to estimate rotation and scale in addition to translation.
+     
+        ## Based on
+     
+        [1] Reddy, B. Srinivasa, and Biswanath N. Chatterji.
+        "An FFT-based technique for translation, rotation, and scale-invariant image registration."
+        IEEE Transactions on Image Processing 5.8 (1996): 1266-1271.
+     */
+    inline PhaseCorrelationResult phaseCorrelation(const cv::Mat &tpl, const cv::Mat &target, bool estimateRotationScale = false)
+    {
+        CV_Assert(!tpl.empty() && !target.empty());
+        
+        PhaseCorrelationResult r;
+        
+        const cv::Mat t = detail::apodizedTemplate(tpl);
+        const cv::Mat g = detail::zeroMeanFloat(target);
+        
+        if (!estimateRotationScale) {
+            r.translation = detail::correlateTranslation(t, g, true, r.response);
+            return r;
+        }
+        
+        // Rotation and scale from spectra of equally sized, equally windowed images.
+        const int size = cv::getOptimalDFTSize(std::max<int>(std::max<int>(tpl.cols, tpl.rows), std::max<int>(target.cols, target.rows)));
+        const cv::Mat lpt = detail::logPolarSpectrum(t, size);
+        const cv::Mat lpg = detail::logPolarSpectrum(detail::apodizedTemplate(target), size);
+        
+        cv::Point2d shift = cv::phaseCorrelate(lpt, lpg);
+        
+        const double logBase = std::log(double(size / 2)) / double(lpt.cols);
+        const double rotation = CV_PI * shift.y / double(lpt.rows);
+        r.scale = std::exp(-shift.x * logBase);
+        
+        // Translation of the transformed template for both rotation candidates. Its canvas 
+        // has empty corners, so placements partially outside the target are searched as well.
+        for (int k = 0; k < 2; ++k) {
+            const double theta = rotation + k * CV_PI;
+            
+            cv::Point2d offset;
+            const cv::Mat tt = detail::transformLinear(t, detail::similarityMatrix(theta, r.scale), offset);
+            
+            double response;
+            const cv::Point2d translation = detail::correlateTranslation(tt, g, false, response) + offset;
+            
+            if (k == 0 || response > r.response) {
+                r.rotation = std::atan2(std::sin(theta), std::cos(theta));
+                r.translation = translation;
+                r.response = response;
+            }
+        }
+        
+        return r;
+    }
+}
+
+#endif
@@ -0,0 +1,215 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_PIXEL_SELECTION_H
+#define IMAGE_ALIGN_PIXEL_SELECTION_H
+
+#include <imagealign/config.h>
+#include <opencv2/core/core.hpp>
+#include <algorithm>
+#include <functional>
+#include <limits>
+#include <vector>
+
+namespace imagealign {
+    
+    /**
+        Criteria to select the template pixels taking part in alignment.
+     
+        Pixels in flat regions barely constrain the warp but cost as much as textured ones. 
+        Selecting pixels of high gradient magnitude reduces the work per iteration, which pays 
+        off for templates with little texture on large parts of their area. Selection is applied 
+        per pyramid level. Pixels need to pass the gradient threshold, of which the ones with the 
+        largest gradient magnitudes are kept up to the given fraction of all pixels of the level.
+     */
+    struct PixelSelection {
+        /** Maximum fraction of the pixels of a level to keep, in (0, 1]. */
+        float fraction;
+        
+        /** Minimum gradient magnitude of a pixel to keep. */
+        float minGradient;
+        
+        PixelSelection(float fraction_ = 1.f, float minGradient_ = 0.f)
+            : fraction(fraction_), minGradient(minGradient_)
+        {}
+        
+        /** True when pixels are dropped at all. */
+        bool enabled() const {
+            return fraction < 1.f || minGradient > 0.f;
+        }
+    };
+    
+    /**
+        Compact list of selected pixels, ordered row by row.
+     
+        Pixels of row y are stored at indices [begin(y), begin(y + 1)). This allows processing 
+        selected pixels in row ranges, just like dense templates.
+     */
+    class SelectedPixels {
+    public:
+        
+        /**
+            Collect pixels from mask.
+         
+            \param mask Single channel 8-bit mask. Non-zero pixels are selected.
+         */
+        void create(const cv::Mat &mask) {
+            CV_Assert(mask.type() == CV_8UC1);
+            
+            _rowBegin.assign(mask.rows + 1, 0);
+            _cols.clear();
+            
+            for (int y = 0; y < mask.rows; ++y) {
+                const uchar *m = mask.ptr<uchar>(y);
+                
+                for (int x = 0; x < mask.cols; ++x) {
+                    if (m[x])
+                        _cols.push_back(x);
+                }
+                
+                _rowBegin[y + 1] = (int)_cols.size();
+            }
+        }
+        
+        /** Total number of selected pixels. */
+        int size() const {
+            return (int)_cols.size();
+        }
+        
+        /** Number of rows covered. */
+        int rows() const {
+            return _rowBegin.empty() ? 0 : (int)_rowBegin.size() - 1;
+        }
+        
+        /** Index of first selected pixel in row y. Valid for y in [0, rows()]. */
+        int begin(int y) const {
+            return _rowBegin[y];
+        }
+        
+        /** Column of i-th selected pixel. */
+        int col(int i) const {
+            return _cols[i];
+        }
+        
+        /** Row offsets, rows() + 1 entries. */
+        const std::vector<int> &rowOffsets() const {
+            return _rowBegin;
+        }
+        
+        /** Columns of all selected pixels. */
+        const std::vector<int> &columns() const {
+            return _cols;
+        }
+        
+        /** Restore from row offsets and columns as returned by rowOffsets and columns. */
+        void assign(const std::vector<int> &rowOffsets, const std::vector<int> &columns) {
+            CV_Assert(rowOffsets.empty() || (rowOffsets.front() == 0 && rowOffsets.back() == (int)columns.size()));
+            _rowBegin = rowOffsets;
+            _cols = columns;
+        }
+        
+    private:
+        std::vector<int> _rowBegin;
+        std::vector<int> _cols;
+    };
+    
+    namespace detail {
+        
+        /**
+            Select pixels by gradient magnitude.
+         
+            \param magnitudes Single precision gradient magnitudes.
+            \param s Selection criteria.
+            \param mask Receives the selection, non-zero for selected pixels. 
+            \param valid Optional 8-bit mask of pixels eligible for selection. The fraction 
+            relates to the number of eligible pixels.
+         */
+        inline void selectPixels(const cv::Mat &magnitudes, const PixelSelection &s, cv::Mat &mask, const cv::Mat &valid = cv::Mat()) {
+            CV_Assert(magnitudes.type() == CV_32FC1);
+            CV_Assert(valid.empty() || (valid.type() == CV_8UC1 && valid.size() == magnitudes.size()));
+            
+            // Ineligible pixels never pass the threshold
+            cv::Mat g = magnitudes;
+            if (!valid.empty()) {
+                g = magnitudes.clone();
+                for (int y = 0; y < g.rows; ++y) {
+                    float *r = g.ptr<float>(y);
+                    const uchar *v = valid.ptr<uchar>(y);
+                    for (int x = 0; x < g.cols; ++x) {
+                        if (!v[x])
+                            r[x] = -std::numeric_limits<float>::infinity();
+                    }
+                }
+            }
+            
+            mask.create(g.size(), CV_8UC1);
+            
+            std::vector<float> candidates;
+            candidates.reserve(g.total());
+            
+            size_t eligible = 0;
+            for (int y = 0; y < g.rows; ++y) {
+                const float *r = g.ptr<float>(y);
+                for (int x = 0; x < g.cols; ++x) {
+                    eligible += (r[x] > -std::numeric_limits<float>::infinity()) ? 1 : 0;
+                    if (r[x] >= s.minGradient)
+                        candidates.push_back(r[x]);
+                }
+            }
+            
+            // Magnitude of the weakest pixel to keep
+            const double budget = std::floor(double(s.fraction) * double(eligible) + 0.5);
+            const size_t maxPixels = (s.fraction > 0.f && eligible > 0) ? (size_t)std::max<double>(1., budget) : 0;
+            float threshold = s.minGradient;
+            
+            if (maxPixels == 0) {
+                threshold = std::numeric_limits<float>::infinity();
+            } else if (candidates.size() > maxPixels) {
+                std::nth_element(candidates.begin(), candidates.begin() + (maxPixels - 1), candidates.end(), std::greater<float>());
+                threshold = std::max<float>(threshold, candidates[maxPixels - 1]);
+            }
+            
+            // Keep pixels above threshold, then ties at the threshold in scan order until the budget is exhausted
+            size_t kept = 0;
+            for (int y = 0; y < g.rows; ++y) {
+                const float *r = g.ptr<float>(y);
+                uchar *m = mask.ptr<uchar>(y);
+                
+                for (int x = 0; x < g.cols; ++x) {
+                    m[x] = (r[x] > threshold) ? 255 : 0;
+                    kept += m[x] ? 1 : 0;
+                }
+            }
+            
+            for (int y = 0; y < g.rows && kept < maxPixels; ++y) {
+                const float *r = g.ptr<float>(y);
+                uchar *m = mask.ptr<uchar>(y);
+                
+                for (int x = 0; x < g.cols && kept < maxPixels; ++x) {
+                    if (r[x] == threshold) {
+                        m[x] = 255;
+                        ++kept;
+                    }
+                }
+            }
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,122 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_ROBUST_LOSS_H
+#define IMAGE_ALIGN_ROBUST_LOSS_H
+
+#include <imagealign/config.h>
+#include <cmath>
+
+namespace imagealign {
+    
+    /**
+        Loss policies weighting the contribution of each pixel to the normal equations.
+     
+        Aligners take a loss as template parameter and minimize the sum of rho over all 
+        intensity errors by iteratively reweighted least squares. Each error contributes 
+        with weight(err) to b and the Hessian. Losses are scaled such that rho(err) behaves 
+        like err^2 for small errors, so errors reported by aligners remain comparable.
+     
+        A loss provides
+            - float rho(float err) const
+            - float weight(float err) const, which is rho'(err) / (2 err)
+            - enum WEIGHTED, zero when weights are constant one
+     */
+    
+    /**
+        Squared error loss. Standard least squares.
+     */
+    struct LossSquared {
+        enum { WEIGHTED = 0 };
+        
+        inline float rho(float err) const {
+            return err * err;
+        }
+        
+        inline float weight(float err) const {
+            (void)err;
+            return 1.f;
+        }
+    };
+    
+    /**
+        Huber loss.
+     
+        Quadratic for errors up to the threshold and linear beyond, which bounds the 
+        influence of outliers such as occluded pixels.
+     */
+    struct LossHuber {
+        enum { WEIGHTED = 1 };
+        
+        /** \param k Threshold in intensity units. */
+        explicit LossHuber(float k = 10.f)
+            : _k(k)
+        {}
+        
+        inline float rho(float err) const {
+            const float a = std::abs(err);
+            return a <= _k ? err * err : 2.f * _k * a - _k * _k;
+        }
+        
+        inline float weight(float err) const {
+            const float a = std::abs(err);
+            return a <= _k ? 1.f : _k / a;
+        }
+        
+    private:
+        float _k;
+    };
+    
+    /**
+        Tukey biweight loss.
+     
+        Errors beyond the threshold have no influence at all, which makes this loss 
+        robust against large occlusions, provided the initial warp is reasonably close.
+     */
+    struct LossTukey {
+        enum { WEIGHTED = 1 };
+        
+        /** \param k Threshold in intensity units. */
+        explicit LossTukey(float k = 20.f)
+            : _k(k)
+        {}
+        
+        inline float rho(float err) const {
+            const float k2 = _k * _k;
+            if (std::abs(err) > _k)
+                return k2 / 3.f;
+            
+            const float u = 1.f - err * err / k2;
+            return k2 / 3.f * (1.f - u * u * u);
+        }
+        
+        inline float weight(float err) const {
+            if (std::abs(err) > _k)
+                return 0.f;
+            
+            const float u = 1.f - err * err / (_k * _k);
+            return u * u;
+        }
+        
+    private:
+        float _k;
+    };
+}
+
+#endif
@@ -20,9 +20,21 @@
 #ifndef IMAGE_ALIGN_SAMPLING_H
 #define IMAGE_ALIGN_SAMPLING_H
 
+#include <imagealign/config.h>
 #include <opencv2/core/core.hpp>
 #include <opencv2/core/core_c.h>
 #include <opencv2/imgproc/imgproc.hpp>
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+#if defined(IA_SIMD_AVX2) || defined(IA_SIMD_SSE2)
+    #include <immintrin.h>
+#endif
+
+#if defined(IA_SIMD_NEON)
+    #include <arm_neon.h>
+#endif
 
 namespace imagealign {
     
@@ -50,6 +62,18 @@ namespace imagealign {
          */
         template<class ChannelType>
         inline ChannelType sample(const cv::Mat &img, const cv::Point2f &p) const;
+        
+        /**
+            Be able to sample a span of image locations at once.
+         
+            \param img Image to sample. Channels are interleaved.
+            \param xs x-coordinates of locations to sample.
+            \param ys y-coordinates of locations to sample.
+            \param n Number of locations.
+            \param dst Receives n * img.channels() sampled values, channels interleaved.
+         */
+        template<class ChannelType, class Scalar, class ResultType>
+        inline void sample(const cv::Mat &img, const Scalar *xs, const Scalar *ys, int n, ResultType *dst) const;
     };
     
     
@@ -59,11 +83,265 @@ namespace imagealign {
     const int SAMPLE_NEAREST = 1;
     
     
+    namespace detail {
+        
+        /** Number of locations that share a single interior test in batched sampling. */
+        const int SAMPLE_BLOCK_SIZE = 64;
+        
+        /**
+            Test if all locations of a span can be bilinearly sampled without border handling.
+         
+            Every location is compared individually, so NaN coordinates, which fail all 
+            comparisons, make the span take the border handling path.
+         */
+        template<class Scalar>
+        inline bool spanIsInterior(const cv::Mat &img, const Scalar *xs, const Scalar *ys, int n)
+        {
+            // Both taps in each direction need to be inside the image.
+            const Scalar maxX = Scalar(img.cols - 1);
+            const Scalar maxY = Scalar(img.rows - 1);
+            
+            bool inside = true;
+            for (int i = 0; i < n; ++i) {
+                inside &= (xs[i] >= Scalar(0)) & (xs[i] < maxX) & (ys[i] >= Scalar(0)) & (ys[i] < maxY);
+            }
+            
+            return inside;
+        }
+        
+        /**
+            Test if both coordinates of a location are finite.
+         
+            Samplers return 0 for NaN and infinite coordinates, which have no reflected pixel.
+         */
+        template<class Scalar>
+        inline bool isFinite(Scalar x, Scalar y)
+        {
+            return std::abs(x) <= std::numeric_limits<Scalar>::max() && std::abs(y) <= std::numeric_limits<Scalar>::max();
+        }
+        
+        /**
+            Move a finite coordinate by whole periods of BORDER_REFLECT_101 along an axis of len pixels.
+         
+            Coordinates within one pixel of the axis are returned unchanged. Coordinates further 
+            out are moved into [0, 2 * (len - 1)], where pixel taps reflect to the same pixels 
+            as before, so border interpolation takes constant time. std::fmod is exact, so the 
+            fractional part and therefore the sampled value does not change.
+         */
+        template<class Scalar>
+        inline Scalar foldReflect101(Scalar x, int len)
+        {
+            if (len < 2 || (x >= Scalar(-1) && x <= Scalar(len)))
+                return x;
+            
+            const Scalar period = Scalar(2 * (len - 1));
+            const Scalar r = std::fmod(x, period);
+            return (r < Scalar(0)) ? r + period : r;
+        }
+        
+        /**
+            Bilinear sampling of locations known to be inside the image.
+         
+            Since all coordinates are non-negative, truncation equals std::floor.
+         */
+        template<class ChannelType, class Scalar, class ResultType>
+        inline void sampleBilinearInterior(const cv::Mat &img, const Scalar *xs, const Scalar *ys, int n, ResultType *dst)
+        {
+            const size_t stride = img.step / sizeof(ChannelType);
+            
+            for (int i = 0; i < n; ++i) {
+                const int ix = static_cast<int>(xs[i]);
+                const int iy = static_cast<int>(ys[i]);
+                
+                const Scalar a = xs[i] - (Scalar)ix;
+                const Scalar b = ys[i] - (Scalar)iy;
+                
+                const ChannelType *ptrY0 = img.ptr<ChannelType>(iy) + ix;
+                const ChannelType *ptrY1 = ptrY0 + stride;
+                
+                dst[i] = cv::saturate_cast<ResultType>((ptrY0[0] * (Scalar(1) - a) + ptrY0[1] * a) * (Scalar(1) - b) +
+                                                       (ptrY1[0] * (Scalar(1) - a) + ptrY1[1] * a) * b);
+            }
+        }
+        
+#if defined(IA_SIMD_AVX2) || defined(IA_SIMD_SSE2) || defined(IA_SIMD_NEON)
+        
+        /**
+            Vectorized bilinear sampling of single precision locations in single precision images.
+         
+            Operations are carried out in the same order as in the scalar version, so results are
+            identical up to rounding. Builds contracting the scalar version into fused multiply-adds
+            may differ in the last bit.
+         */
+        template<>
+        inline void sampleBilinearInterior<float, float, float>(const cv::Mat &img, const float *xs, const float *ys, int n, float *dst)
+        {
+            const float *base = img.ptr<float>(0);
+            const int stride = static_cast<int>(img.step / sizeof(float));
+            
+            int i = 0;
+            
+#if defined(IA_SIMD_AVX2)
+            const __m256 one8 = _mm256_set1_ps(1.f);
+            const __m256i stride8 = _mm256_set1_epi32(stride);
+            const __m256i inc8 = _mm256_set1_epi32(1);
+            
+            for (; i + 8 <= n; i += 8) {
+                const __m256 x = _mm256_loadu_ps(xs + i);
+                const __m256 y = _mm256_loadu_ps(ys + i);
+                
+                const __m256i ix = _mm256_cvttps_epi32(x);
+                const __m256i iy = _mm256_cvttps_epi32(y);
+                
+                const __m256 a = _mm256_sub_ps(x, _mm256_cvtepi32_ps(ix));
+                const __m256 b = _mm256_sub_ps(y, _mm256_cvtepi32_ps(iy));
+                const __m256 ia = _mm256_sub_ps(one8, a);
+                const __m256 ib = _mm256_sub_ps(one8, b);
+                
+                const __m256i i0 = _mm256_add_epi32(_mm256_mullo_epi32(iy, stride8), ix);
+                const __m256i i2 = _mm256_add_epi32(i0, stride8);
+                
+                const __m256 f0 = _mm256_i32gather_ps(base, i0, 4);
+                const __m256 f1 = _mm256_i32gather_ps(base, _mm256_add_epi32(i0, inc8), 4);
+                const __m256 f2 = _mm256_i32gather_ps(base, i2, 4);
+                const __m256 f3 = _mm256_i32gather_ps(base, _mm256_add_epi32(i2, inc8), 4);
+                
+                const __m256 top = _mm256_add_ps(_mm256_mul_ps(f0, ia), _mm256_mul_ps(f1, a));
+                const __m256 bottom = _mm256_add_ps(_mm256_mul_ps(f2, ia), _mm256_mul_ps(f3, a));
+                
+                _mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_mul_ps(top, ib), _mm256_mul_ps(bottom, b)));
+            }
+#endif
+            
+#if defined(IA_SIMD_SSE2) || defined(IA_SIMD_NEON)
+            // Neither SSE2 nor NEON offer gather instructions. Coordinates and weights are
+            // computed four at a time, taps are gathered through a small index buffer.
+            int idx[4];
+            float f[4][4];
+            
+            for (; i + 4 <= n; i += 4) {
+#if defined(IA_SIMD_SSE2)
+                const __m128 x = _mm_loadu_ps(xs + i);
+                const __m128 y = _mm_loadu_ps(ys + i);
+                
+                const __m128i ix = _mm_cvttps_epi32(x);
+                const __m128i iy = _mm_cvttps_epi32(y);
+                
+                const __m128 a = _mm_sub_ps(x, _mm_cvtepi32_ps(ix));
+                const __m128 b = _mm_sub_ps(y, _mm_cvtepi32_ps(iy));
+                
+                int ixs[4], iys[4];
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(ixs), ix);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(iys), iy);
+#else
+                const float32x4_t x = vld1q_f32(xs + i);
+                const float32x4_t y = vld1q_f32(ys + i);
+                
+                const int32x4_t ix = vcvtq_s32_f32(x);
+                const int32x4_t iy = vcvtq_s32_f32(y);
+                
+                const float32x4_t a = vsubq_f32(x, vcvtq_f32_s32(ix));
+                const float32x4_t b = vsubq_f32(y, vcvtq_f32_s32(iy));
+                
+                int ixs[4], iys[4];
+                vst1q_s32(ixs, ix);
+                vst1q_s32(iys, iy);
+#endif
+                for (int k = 0; k < 4; ++k) {
+                    idx[k] = iys[k] * stride + ixs[k];
+                    f[0][k] = base[idx[k]];
+                    f[1][k] = base[idx[k] + 1];
+                    f[2][k] = base[idx[k] + stride];
+                    f[3][k] = base[idx[k] + stride + 1];
+                }
+                
+#if defined(IA_SIMD_SSE2)
+                const __m128 one4 = _mm_set1_ps(1.f);
+                const __m128 ia = _mm_sub_ps(one4, a);
+                const __m128 ib = _mm_sub_ps(one4, b);
+                
+                const __m128 top = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(f[0]), ia), _mm_mul_ps(_mm_loadu_ps(f[1]), a));
+                const __m128 bottom = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(f[2]), ia), _mm_mul_ps(_mm_loadu_ps(f[3]), a));
+                
+                _mm_storeu_ps(dst + i, _mm_add_ps(_mm_mul_ps(top, ib), _mm_mul_ps(bottom, b)));
+#else
+                const float32x4_t one4 = vdupq_n_f32(1.f);
+                const float32x4_t ia = vsubq_f32(one4, a);
+                const float32x4_t ib = vsubq_f32(one4, b);
+                
+                const float32x4_t top = vaddq_f32(vmulq_f32(vld1q_f32(f[0]), ia), vmulq_f32(vld1q_f32(f[1]), a));
+                const float32x4_t bottom = vaddq_f32(vmulq_f32(vld1q_f32(f[2]), ia), vmulq_f32(vld1q_f32(f[3]), a));
+                
+                vst1q_f32(dst + i, vaddq_f32(vmulq_f32(top, ib), vmulq_f32(bottom, b)));
+#endif
+            }
+#endif
+            
+            // Remainder
+            for (; i < n; ++i) {
+                const int ix = static_cast<int>(xs[i]);
+                const int iy = static_cast<int>(ys[i]);
+                
+                const float a = xs[i] - (float)ix;
+                const float b = ys[i] - (float)iy;
+                
+                const float *ptrY0 = base + iy * stride + ix;
+                const float *ptrY1 = ptrY0 + stride;
+                
+                dst[i] = (ptrY0[0] * (1.f - a) + ptrY0[1] * a) * (1.f - b) +
+                         (ptrY1[0] * (1.f - a) + ptrY1[1] * a) * b;
+            }
+        }
+#endif
+        
+        /**
+            Bilinear sampling of multi-channel images.
+         
+            Tap positions and weights of each location are computed once and shared by all 
+            interleaved channels. Channels are interpolated like single channel images. Locations
+            with non-finite coordinates receive 0 in all channels.
+         */
+        template<class ChannelType, class Scalar, class ResultType>
+        inline void sampleBilinearChannels(const cv::Mat &img, const Scalar *xs, const Scalar *ys, int n, ResultType *dst)
+        {
+            const int cn = img.channels();
+            
+            for (int i = 0; i < n; ++i) {
+                if (!isFinite(xs[i], ys[i])) {
+                    std::fill(dst + i * cn, dst + (i + 1) * cn, ResultType(0));
+                    continue;
+                }
+                
+                const Scalar x = foldReflect101(xs[i], img.cols);
+                const Scalar y = foldReflect101(ys[i], img.rows);
+                
+                const int ix = static_cast<int>(std::floor(x));
+                const int iy = static_cast<int>(std::floor(y));
+                
+                const Scalar a = x - (Scalar)ix;
+                const Scalar b = y - (Scalar)iy;
+                
+                const int x0 = cv::borderInterpolate(ix, img.cols, cv::BORDER_REFLECT_101) * cn;
+                const int x1 = cv::borderInterpolate(ix + 1, img.cols, cv::BORDER_REFLECT_101) * cn;
+                const ChannelType *ptrY0 = img.ptr<ChannelType>(cv::borderInterpolate(iy, img.rows, cv::BORDER_REFLECT_101));
+                const ChannelType *ptrY1 = img.ptr<ChannelType>(cv::borderInterpolate(iy + 1, img.rows, cv::BORDER_REFLECT_101));
+                
+                ResultType *d = dst + i * cn;
+                for (int c = 0; c < cn; ++c) {
+                    d[c] = cv::saturate_cast<ResultType>((ptrY0[x0 + c] * (Scalar(1) - a) + ptrY0[x1 + c] * a) * (Scalar(1) - b) +
+                                                         (ptrY1[x0 + c] * (Scalar(1) - a) + ptrY1[x1 + c] * a) * b);
+                }
+            }
+        }
+    }
+    
     /**
-        Bilinear image interpolation for single channel images.
+        Bilinear image interpolation.
      
         This library assumes pixel origins at pixel centers, hence the half-pixel
-        offset in the beginning.
+        offset in the beginning. Sampling of single locations assumes single channel images.
+        Locations outside the image are reflected as by BORDER_REFLECT_101, locations with 
+        NaN or infinite coordinates sample as 0.
      */
     template<>
     class Sampler<SAMPLE_BILINEAR> {
@@ -75,6 +353,66 @@ namespace imagealign {
         template<class ChannelType, class Scalar>
         inline ChannelType sample(const cv::Mat &img, Scalar x, Scalar y) const
         {
+            return cv::saturate_cast<ChannelType>(interpolate<ChannelType>(img, x, y));
+        }
+        
+        /**
+            Bilinear sampling at image coordinates.
+         */
+        template<class ChannelType, class Scalar>
+        inline ChannelType sample(const cv::Mat &img, const cv::Matx<Scalar, 2, 1> &p) const
+        {
+            return sample<ChannelType>(img, p(0), p(1));
+        }
+        
+        /**
+            Bilinear sampling of a span of image coordinates.
+         
+            Samples the n locations given by xs and ys and writes the interpolated values to dst. 
+            The span is processed in blocks. Blocks whose locations all lie inside the image are 
+            sampled without border handling, single precision images and coordinates use a 
+            vectorized kernel. Results equal sampling each location individually up to rounding.
+         
+            Multi-channel images receive n * img.channels() values with channels interleaved.
+            Weights are computed once per location and shared by all channels.
+         */
+        template<class ChannelType, class Scalar, class ResultType>
+        inline void sample(const cv::Mat &img, const Scalar *xs, const Scalar *ys, int n, ResultType *dst) const
+        {
+            if (img.channels() > 1) {
+                detail::sampleBilinearChannels<ChannelType>(img, xs, ys, n, dst);
+                return;
+            }
+            
+            for (int i = 0; i < n; i += detail::SAMPLE_BLOCK_SIZE) {
+                const int count = std::min<int>(detail::SAMPLE_BLOCK_SIZE, n - i);
+                
+                if (detail::spanIsInterior(img, xs + i, ys + i, count)) {
+                    detail::sampleBilinearInterior<ChannelType>(img, xs + i, ys + i, count, dst + i);
+                } else {
+                    for (int k = i; k < i + count; ++k) {
+                        dst[k] = cv::saturate_cast<ResultType>(interpolate<ChannelType>(img, xs[k], ys[k]));
+                    }
+                }
+            }
+        }
+        
+    private:
+        
+        /**
+            Bilinear interpolation at image coordinates without rounding the result.
+         
+            Locations outside the image are reflected, locations with non-finite coordinates 
+            evaluate to 0.
+         */
+        template<class ChannelType, class Scalar>
+        inline Scalar interpolate(const cv::Mat &img, Scalar x, Scalar y) const
+        {
+            if (!detail::isFinite(x, y))
+                return Scalar(0);
+            
+            x = detail::foldReflect101(x, img.cols);
+            y = detail::foldReflect101(y, img.rows);
             
             const int ix = static_cast<int>(std::floor(x));
             const int iy = static_cast<int>(std::floor(y));
@@ -95,25 +433,18 @@ namespace imagealign {
             const ChannelType f2 = ptrY1[x0];
             const ChannelType f3 = ptrY1[x1];
             
-            return cv::saturate_cast<ChannelType>((f0 * (Scalar(1) - a) + f1 * a) * (Scalar(1) - b) +
-                                                  (f2 * (Scalar(1) - a) + f3 * a) * b);
-        }
-        
-        /**
-            Bilinear sampling at image coordinates.
-         */
-        template<class ChannelType, class Scalar>
-        inline ChannelType sample(const cv::Mat &img, const cv::Matx<Scalar, 2, 1> &p) const
-        {
-            return sample<ChannelType>(img, p(0), p(1));
+            return (f0 * (Scalar(1) - a) + f1 * a) * (Scalar(1) - b) +
+                   (f2 * (Scalar(1) - a) + f3 * a) * b;
         }
     };
     
     /**
-        Nearest neighbor image interpolation for single channel images.
+        Nearest neighbor image interpolation.
      
         This library assumes pixel origins at pixel centers, hence the half-pixel
-        offset in the beginning.
+        offset in the beginning. Sampling of single locations assumes single channel images.
+        Locations outside the image are reflected as by BORDER_REFLECT_101, locations with 
+        NaN or infinite coordinates sample as 0.
      */
     template<>
     class Sampler<SAMPLE_NEAREST> {
@@ -125,8 +456,11 @@ namespace imagealign {
         template<class ChannelType, class Scalar>
         inline ChannelType sample(const cv::Mat &img, Scalar x, Scalar y) const
         {
-            const int ix = static_cast<int>(std::floor(x));
-            const int iy = static_cast<int>(std::floor(y));
+            if (!detail::isFinite(x, y))
+                return ChannelType(0);
+            
+            const int ix = static_cast<int>(std::floor(detail::foldReflect101(x, img.cols)));
+            const int iy = static_cast<int>(std::floor(detail::foldReflect101(y, img.rows)));
             
             int x0 = cv::borderInterpolate(ix, img.cols, cv::BORDER_REFLECT_101);
             int y0 = cv::borderInterpolate(iy, img.rows, cv::BORDER_REFLECT_101);
@@ -142,6 +476,39 @@ namespace imagealign {
         {
             return sample<ChannelType>(img, p(0), p(1));
         }
+        
+        /**
+            Nearest sampling of a span of image coordinates.
+         
+            Multi-channel images receive n * img.channels() values with channels interleaved.
+         */
+        template<class ChannelType, class Scalar, class ResultType>
+        inline void sample(const cv::Mat &img, const Scalar *xs, const Scalar *ys, int n, ResultType *dst) const
+        {
+            const int cn = img.channels();
+            
+            if (cn == 1) {
+                for (int i = 0; i < n; ++i) {
+                    dst[i] = cv::saturate_cast<ResultType>(sample<ChannelType>(img, xs[i], ys[i]));
+                }
+                return;
+            }
+            
+            for (int i = 0; i < n; ++i) {
+                if (!detail::isFinite(xs[i], ys[i])) {
+                    std::fill(dst + i * cn, dst + (i + 1) * cn, ResultType(0));
+                    continue;
+                }
+                
+                const int x0 = cv::borderInterpolate(static_cast<int>(std::floor(detail::foldReflect101(xs[i], img.cols))), img.cols, cv::BORDER_REFLECT_101);
+                const int y0 = cv::borderInterpolate(static_cast<int>(std::floor(detail::foldReflect101(ys[i], img.rows))), img.rows, cv::BORDER_REFLECT_101);
+                
+                const ChannelType *p = img.ptr<ChannelType>(y0) + x0 * cn;
+                for (int c = 0; c < cn; ++c) {
+                    dst[i * cn + c] = cv::saturate_cast<ResultType>(p[c]);
+                }
+            }
+        }
     };
 }
 
@@ -0,0 +1,209 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_SERIALIZATION_H
+#define IMAGE_ALIGN_SERIALIZATION_H
+
+#include <imagealign/config.h>
+#include <opencv2/core/core.hpp>
+#include <cstring>
+#include <string>
+#include <vector>
+
+namespace imagealign {
+    
+    /** 
+        Version of the binary format of prepared aligner state. 
+     
+        Incremented on every incompatible change. State of other versions is rejected.
+     */
+    const int STATE_FORMAT_VERSION = 1;
+    
+    namespace detail {
+        
+        /** File signature of prepared aligner state, 'IAPS' in little endian byte order. */
+        const unsigned int STATE_MAGIC = 0x53504149u;
+        
+        /** 
+            Alignment of arrays within serialized state. 
+         
+            Offsets are relative to the start of the buffer. Mapped files start on page 
+            boundaries, so arrays of mapped state are aligned in memory as well.
+         */
+        const size_t STATE_ALIGNMENT = 64;
+        
+        /**
+            Appends prepared state to a byte buffer.
+         
+            Scalars are written in native byte order, arrays start at STATE_ALIGNMENT boundaries.
+         */
+        class StateWriter {
+        public:
+            explicit StateWriter(std::vector<uchar> &dst)
+                : _dst(dst)
+            {}
+            
+            /** Current offset in buffer. */
+            size_t offset() const {
+                return _dst.size();
+            }
+            
+            /** Write value of plain old data type. */
+            template<class T>
+            void value(const T &v) {
+                bytes(&v, sizeof(T));
+            }
+            
+            /** Overwrite value previously written at offset. */
+            template<class T>
+            void patch(size_t offset, const T &v) {
+                CV_Assert(offset + sizeof(T) <= _dst.size());
+                std::memcpy(&_dst[offset], &v, sizeof(T));
+            }
+            
+            /** Write count followed by an aligned array of values. */
+            template<class T>
+            void array(const T *v, size_t n) {
+                value<unsigned long long>(n);
+                align();
+                bytes(v, n * sizeof(T));
+            }
+            
+            /** Write vector as array. */
+            template<class T>
+            void array(const std::vector<T> &v) {
+                array(v.empty() ? (const T*)0 : &v[0], v.size());
+            }
+            
+            /** Write matrix header followed by its continuous, aligned data. */
+            void mat(const cv::Mat &m) {
+                value<int>(m.rows);
+                value<int>(m.cols);
+                value<int>(m.type());
+                align();
+                
+                const size_t rowBytes = m.cols * m.elemSize();
+                for (int y = 0; y < m.rows; ++y) {
+                    bytes(m.ptr(y), rowBytes);
+                }
+            }
+            
+            /** Pad with zeros up to the next STATE_ALIGNMENT boundary. */
+            void align() {
+                _dst.resize(cv::alignSize(_dst.size(), (int)STATE_ALIGNMENT), 0);
+            }
+            
+        private:
+            void bytes(const void *src, size_t n) {
+                const uchar *p = static_cast<const uchar*>(src);
+                _dst.insert(_dst.end(), p, p + n);
+            }
+            
+            std::vector<uchar> &_dst;
+        };
+        
+        /**
+            Reads prepared state written by StateWriter.
+         
+            Matrices and arrays are returned in place, pointing into the buffer read from. 
+            Reading past the end of the buffer raises an exception.
+         */
+        class StateReader {
+        public:
+            StateReader(const void *src, size_t size)
+                : _src(static_cast<const uchar*>(src)), _size(size), _offset(0)
+            {}
+            
+            /** Current offset in buffer. */
+            size_t offset() const {
+                return _offset;
+            }
+            
+            /** Read value of plain old data type. */
+            template<class T>
+            T value() {
+                T v;
+                std::memcpy(&v, take(sizeof(T)), sizeof(T));
+                return v;
+            }
+            
+            /** Read aligned array, returning a pointer into the buffer. */
+            template<class T>
+            const T *array(size_t &n) {
+                const unsigned long long count = value<unsigned long long>();
+                CV_Assert(count <= (_size - _offset) / sizeof(T));
+                
+                n = (size_t)count;
+                align();
+                return reinterpret_cast<const T*>(take(n * sizeof(T)));
+            }
+            
+            /** Read array into vector. */
+            template<class T>
+            void array(std::vector<T> &v) {
+                size_t n;
+                const T *p = array<T>(n);
+                v.assign(p, p + n);
+            }
+            
+            /** 
+                Read matrix header referencing the data in the buffer. 
+             
+                No data is copied. The buffer needs to outlive the matrix, and the matrix must 
+                not be written to, as mapped buffers are read-only.
+             */
+            cv::Mat mat() {
+                const int rows = value<int>();
+                const int cols = value<int>();
+                const int type = value<int>();
+                CV_Assert(rows >= 0 && cols >= 0);
+                
+                align();
+                const size_t rowBytes = (size_t)cols * cv::Mat(0, 0, type).elemSize();
+                CV_Assert(rowBytes == 0 || (size_t)rows <= (_size - _offset) / rowBytes);
+                
+                const uchar *data = take(rows * rowBytes);
+                if (rows == 0 || cols == 0)
+                    return cv::Mat(rows, cols, type);
+                
+                return cv::Mat(rows, cols, type, const_cast<uchar*>(data));
+            }
+            
+            /** Skip padding up to the next STATE_ALIGNMENT boundary. */
+            void align() {
+                const size_t aligned = cv::alignSize(_offset, (int)STATE_ALIGNMENT);
+                take(aligned - _offset);
+            }
+            
+        private:
+            const uchar *take(size_t n) {
+                CV_Assert(n <= _size - _offset);
+                const uchar *p = _src + _offset;
+                _offset += n;
+                return p;
+            }
+            
+            const uchar *_src;
+            size_t _size;
+            size_t _offset;
+        };
+    }
+}
+
+#endif
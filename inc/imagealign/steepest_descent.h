@@ -0,0 +1,242 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_STEEPEST_DESCENT_H
+#define IMAGE_ALIGN_STEEPEST_DESCENT_H
+
+#include <imagealign/config.h>
+#include <imagealign/storage.h>
+#include <opencv2/core/core.hpp>
+
+#if defined(IA_SIMD_AVX2) || defined(IA_SIMD_SSE2)
+    #include <immintrin.h>
+#endif
+
+#if defined(IA_SIMD_NEON)
+    #include <arm_neon.h>
+#endif
+
+namespace imagealign {
+    
+    /**
+        Steepest descent images stored in structure-of-arrays layout.
+     
+        Holds one plane per warp parameter. Each plane covers rows x cols pixels. Planes and 
+        rows start at 32 byte boundaries, so a row of a single parameter can be streamed with 
+        vector loads. Planes are single precision by default and may be stored as half precision
+        to halve their memory, in which case rows are accessed through storeRow and loadRow.
+     */
+    class SteepestDescentPlanes {
+    public:
+        
+        enum {
+            ALIGNMENT = 32
+        };
+        
+        SteepestDescentPlanes()
+            : _numPlanes(0), _rows(0), _cols(0), _storage(STORAGE_FLOAT32), _elemSize(sizeof(float)), _rowStride(0), _planeStride(0), _data(0)
+        {}
+        
+        /**
+            Allocate planes. Contents are zero initialized.
+         
+            \param numPlanes Number of planes, usually the number of warp parameters.
+            \param rows Number of rows per plane.
+            \param cols Number of columns per plane.
+            \param storage Either STORAGE_FLOAT32 or STORAGE_FLOAT16.
+         */
+        void create(int numPlanes, int rows, int cols, int storage = STORAGE_FLOAT32) {
+            CV_Assert(storage == STORAGE_FLOAT32 || storage == STORAGE_FLOAT16);
+            
+            _storage = storage;
+            _elemSize = (storage == STORAGE_FLOAT16) ? (int)sizeof(ushort) : (int)sizeof(float);
+            
+            _numPlanes = std::max<int>(0, numPlanes);
+            _rows = std::max<int>(0, rows);
+            _cols = std::max<int>(0, cols);
+            _rowStride = (int)cv::alignSize(_cols * _elemSize, ALIGNMENT);
+            _planeStride = _rowStride * _rows;
+            
+            _buffer.create(1, _numPlanes * _planeStride + ALIGNMENT, CV_8UC1);
+            _buffer.setTo(0);
+            _data = cv::alignPtr(_buffer.ptr<uchar>(), ALIGNMENT);
+        }
+        
+        int numPlanes() const { return _numPlanes; }
+        int rows() const { return _rows; }
+        int cols() const { return _cols; }
+        int storage() const { return _storage; }
+        
+        /** Number of bytes occupied by planes. */
+        size_t memoryUsage() const { return _buffer.total(); }
+        
+        /** Start of plane data, laid out as described above. */
+        const uchar *data() const { return _data; }
+        
+        /** Number of bytes of plane data starting at data(). */
+        size_t dataSize() const { return (size_t)_numPlanes * _planeStride; }
+        
+        /**
+            Reference plane data laid out as by create without copying it.
+         
+            Used to restore serialized planes in place. The memory needs to hold dataSize() 
+            bytes and to outlive the planes. It is not owned, so memoryUsage reports zero and 
+            a subsequent create allocates instead of writing into it.
+         */
+        void wrap(int numPlanes, int rows, int cols, int storage, const uchar *data) {
+            CV_Assert(storage == STORAGE_FLOAT32 || storage == STORAGE_FLOAT16);
+            
+            _storage = storage;
+            _elemSize = (storage == STORAGE_FLOAT16) ? (int)sizeof(ushort) : (int)sizeof(float);
+            
+            _numPlanes = std::max<int>(0, numPlanes);
+            _rows = std::max<int>(0, rows);
+            _cols = std::max<int>(0, cols);
+            _rowStride = (int)cv::alignSize(_cols * _elemSize, ALIGNMENT);
+            _planeStride = _rowStride * _rows;
+            
+            _buffer.release();
+            _data = const_cast<uchar*>(data);
+        }
+        
+        /** Access row of single precision plane. */
+        inline float *ptr(int plane, int row) {
+            CV_DbgAssert(_storage == STORAGE_FLOAT32);
+            return reinterpret_cast<float*>(rawPtr(plane, row));
+        }
+        
+        /** Access row of single precision plane. */
+        inline const float *ptr(int plane, int row) const {
+            CV_DbgAssert(_storage == STORAGE_FLOAT32);
+            return reinterpret_cast<const float*>(rawPtr(plane, row));
+        }
+        
+        /** Write row of plane from cols() single precision values. */
+        inline void storeRow(int plane, int row, const float *values) {
+            detail::storeValues(values, rawPtr(plane, row), _storage, _cols);
+        }
+        
+        /**
+            Read row of plane in single precision.
+         
+            Returns a pointer into the planes for single precision storage, and converts 
+            into buf, which needs to hold cols() values, otherwise.
+         */
+        inline const float *loadRow(int plane, int row, float *buf) const {
+            return loadSpan(plane, row, 0, _cols, buf);
+        }
+        
+        /**
+            Read columns [begin, begin + count) of row of plane in single precision.
+         
+            Like loadRow, buf needs to hold count values unless storage is single precision.
+         */
+        inline const float *loadSpan(int plane, int row, int begin, int count, float *buf) const {
+            const uchar *src = rawPtr(plane, row) + (size_t)begin * _elemSize;
+            
+            if (_storage == STORAGE_FLOAT32)
+                return reinterpret_cast<const float*>(src);
+            
+            detail::loadValues(src, _storage, count, buf);
+            return buf;
+        }
+        
+        /**
+            Copy planes converting to storage. Reuses storage of dst.
+         */
+        void convertTo(SteepestDescentPlanes &dst, int storage) const {
+            dst.create(_numPlanes, _rows, _cols, storage);
+            
+            cv::AutoBuffer<float> buf(std::max<int>(1, _cols));
+            for (int k = 0; k < _numPlanes; ++k) {
+                for (int y = 0; y < _rows; ++y) {
+                    dst.storeRow(k, y, loadRow(k, y, buf));
+                }
+            }
+        }
+        
+    private:
+        
+        inline uchar *rawPtr(int plane, int row) {
+            return _data + (size_t)plane * _planeStride + (size_t)row * _rowStride;
+        }
+        
+        inline const uchar *rawPtr(int plane, int row) const {
+            return _data + (size_t)plane * _planeStride + (size_t)row * _rowStride;
+        }
+        
+        cv::Mat _buffer;
+        int _numPlanes, _rows, _cols;
+        int _storage, _elemSize;
+        int _rowStride, _planeStride;
+        uchar *_data;
+    };
+    
+    namespace detail {
+        
+        /**
+            Dot product of two float arrays.
+         
+            The order of summation is fixed for a given build, so repeated invocations 
+            produce identical results.
+         */
+        inline float dot(const float *a, const float *b, int n) {
+            int i = 0;
+            float sum = 0.f;
+            
+#if defined(IA_SIMD_AVX2)
+            __m256 acc8 = _mm256_setzero_ps();
+            for (; i + 8 <= n; i += 8) {
+                acc8 = _mm256_add_ps(acc8, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+            }
+            
+            __m128 acc4 = _mm_add_ps(_mm256_castps256_ps128(acc8), _mm256_extractf128_ps(acc8, 1));
+#elif defined(IA_SIMD_SSE2)
+            __m128 acc4 = _mm_setzero_ps();
+#endif
+            
+#if defined(IA_SIMD_AVX2) || defined(IA_SIMD_SSE2)
+            for (; i + 4 <= n; i += 4) {
+                acc4 = _mm_add_ps(acc4, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+            }
+            
+            float lanes[4];
+            _mm_storeu_ps(lanes, acc4);
+            sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#elif defined(IA_SIMD_NEON)
+            float32x4_t acc4 = vdupq_n_f32(0.f);
+            for (; i + 4 <= n; i += 4) {
+                acc4 = vmlaq_f32(acc4, vld1q_f32(a + i), vld1q_f32(b + i));
+            }
+            
+            float lanes[4];
+            vst1q_f32(lanes, acc4);
+            sum = (lanes[0] + lanes[1]) + (lanes[2] + lanes[3]);
+#endif
+            
+            for (; i < n; ++i) {
+                sum += a[i] * b[i];
+            }
+            
+            return sum;
+        }
+    }
+}
+
+#endif
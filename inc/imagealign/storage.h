@@ -0,0 +1,286 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_STORAGE_H
+#define IMAGE_ALIGN_STORAGE_H
+
+#include <imagealign/config.h>
+#include <opencv2/core/core.hpp>
+
+#if defined(IA_SIMD_F16C)
+    #include <immintrin.h>
+#endif
+
+namespace imagealign {
+    
+    /**
+        Storage precisions for pyramid levels and precomputed tables.
+     
+        Storage precision is independent of the warp scalar type. Data is converted to 
+        single precision when read, and all arithmetic is carried out in at least single 
+        precision.
+     */
+    
+    /** Store as 32 bit floating point. */
+    const int STORAGE_FLOAT32 = 0;
+    
+    /** Store as 16 bit floating point. Matrices use depth CV_16S to hold the bit patterns. */
+    const int STORAGE_FLOAT16 = 1;
+    
+    /** Store as 16 bit unsigned fixed point with 8 fractional bits. Intensity images in [0, 255] only. */
+    const int STORAGE_UINT16 = 2;
+    
+    /** Store as 8 bit unsigned integers. Intensity images in [0, 255] only, rounds to integers. */
+    const int STORAGE_UINT8 = 3;
+    
+    /**
+        Storage precisions used by an aligner.
+     
+        Reducing precision cuts the memory needed per prepared template 2-4x, which matters 
+        when many templates are kept resident.
+     */
+    struct StoragePolicy {
+        /** Storage of template pyramid levels. Any of the storage constants. */
+        int pyramid;
+        
+        /** 
+            Storage of precomputed per-pixel tables such as steepest descent images and Jacobians. 
+            Either STORAGE_FLOAT32 or STORAGE_FLOAT16. 
+         */
+        int tables;
+        
+        StoragePolicy(int pyramid_ = STORAGE_FLOAT32, int tables_ = STORAGE_FLOAT32)
+            : pyramid(pyramid_), tables(tables_)
+        {}
+    };
+    
+    namespace detail {
+        
+        /** Scale of STORAGE_UINT16 fixed point values. */
+        const float UINT16_STORAGE_SCALE = 256.f;
+        
+        /** Largest finite half precision value. */
+        const float HALF_MAX = 65504.f;
+        
+        union FloatBits {
+            float f;
+            unsigned int u;
+        };
+        
+        /** Convert to half precision, rounding to nearest even. */
+        inline ushort floatToHalf(float value) {
+            FloatBits f;
+            f.f = value;
+            
+            const unsigned int sign = f.u & 0x80000000u;
+            f.u ^= sign;
+            
+            ushort h;
+            if (f.u >= (127u + 16u) << 23) {
+                // Overflow to infinity, NaN stays NaN
+                h = (f.u > 255u << 23) ? 0x7e00 : 0x7c00;
+            } else if (f.u < 113u << 23) {
+                // Subnormal or zero, let float addition do the rounding
+                FloatBits magic;
+                magic.u = ((127u - 15u) + (23u - 10u) + 1u) << 23;
+                f.f += magic.f;
+                h = (ushort)(f.u - magic.u);
+            } else {
+                const unsigned int odd = (f.u >> 13) & 1u;
+                f.u = f.u - ((127u - 15u) << 23) + 0xfffu + odd;
+                h = (ushort)(f.u >> 13);
+            }
+            
+            return (ushort)(h | (sign >> 16));
+        }
+        
+        /** Convert from half precision. Exact. */
+        inline float halfToFloat(ushort h) {
+            const unsigned int shiftedExp = 0x7c00u << 13;
+            
+            FloatBits o;
+            o.u = (h & 0x7fffu) << 13;
+            const unsigned int exp = shiftedExp & o.u;
+            o.u += (127u - 15u) << 23;
+            
+            if (exp == shiftedExp) {
+                // Infinity or NaN
+                o.u += (128u - 16u) << 23;
+            } else if (exp == 0) {
+                // Zero or subnormal
+                FloatBits magic;
+                magic.u = 113u << 23;
+                o.u += 1u << 23;
+                o.f -= magic.f;
+            }
+            
+            o.u |= (unsigned int)(h & 0x8000u) << 16;
+            return o.f;
+        }
+        
+        /** Convert n values to half precision. */
+        inline void floatToHalf(const float *src, ushort *dst, int n) {
+            int i = 0;
+#if defined(IA_SIMD_F16C)
+            for (; i + 8 <= n; i += 8) {
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), 0));
+            }
+#endif
+            for (; i < n; ++i) {
+                dst[i] = floatToHalf(src[i]);
+            }
+        }
+        
+        /** Convert n values from half precision. */
+        inline void halfToFloat(const ushort *src, float *dst, int n) {
+            int i = 0;
+#if defined(IA_SIMD_F16C)
+            for (; i + 8 <= n; i += 8) {
+                _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+            }
+#endif
+            for (; i < n; ++i) {
+                dst[i] = halfToFloat(src[i]);
+            }
+        }
+        
+        /** Matrix depth used for storage. */
+        inline int storageDepth(int storage) {
+            switch (storage) {
+                case STORAGE_FLOAT16: return CV_16S;
+                case STORAGE_UINT16: return CV_16U;
+                case STORAGE_UINT8: return CV_8U;
+                default: return CV_32F;
+            }
+        }
+        
+        /** Convert n single precision values to storage. */
+        inline void storeValues(const float *src, void *dst, int storage, int n) {
+            switch (storage) {
+                case STORAGE_FLOAT16:
+                    floatToHalf(src, static_cast<ushort*>(dst), n);
+                    break;
+                case STORAGE_UINT16:
+                    for (int i = 0; i < n; ++i) {
+                        static_cast<ushort*>(dst)[i] = cv::saturate_cast<ushort>(src[i] * UINT16_STORAGE_SCALE);
+                    }
+                    break;
+                case STORAGE_UINT8:
+                    for (int i = 0; i < n; ++i) {
+                        static_cast<uchar*>(dst)[i] = cv::saturate_cast<uchar>(src[i]);
+                    }
+                    break;
+                default:
+                    std::copy(src, src + n, static_cast<float*>(dst));
+            }
+        }
+        
+        /** Convert n stored values to single precision. */
+        inline void loadValues(const void *src, int storage, int n, float *dst) {
+            switch (storage) {
+                case STORAGE_FLOAT16:
+                    halfToFloat(static_cast<const ushort*>(src), dst, n);
+                    break;
+                case STORAGE_UINT16:
+                    for (int i = 0; i < n; ++i) {
+                        dst[i] = float(static_cast<const ushort*>(src)[i]) * (1.f / UINT16_STORAGE_SCALE);
+                    }
+                    break;
+                case STORAGE_UINT8:
+                    for (int i = 0; i < n; ++i) {
+                        dst[i] = float(static_cast<const uchar*>(src)[i]);
+                    }
+                    break;
+                default:
+                    std::copy(static_cast<const float*>(src), static_cast<const float*>(src) + n, dst);
+            }
+        }
+        
+        /** Storage of matrix, inferred from its depth. */
+        inline int storageOf(const cv::Mat &m) {
+            switch (m.depth()) {
+                case CV_16S: return STORAGE_FLOAT16;
+                case CV_16U: return STORAGE_UINT16;
+                case CV_8U: return STORAGE_UINT8;
+                default: return STORAGE_FLOAT32;
+            }
+        }
+        
+        /** Convert single precision image to storage. Channels stay interleaved. Reuses storage of dst. */
+        inline void convertToStorage(const cv::Mat &src, cv::Mat &dst, int storage) {
+            CV_Assert(src.depth() == CV_32F);
+            
+            if (storage == STORAGE_FLOAT32) {
+                src.copyTo(dst);
+                return;
+            }
+            
+            dst.create(src.size(), CV_MAKETYPE(storageDepth(storage), src.channels()));
+            for (int y = 0; y < src.rows; ++y) {
+                storeValues(src.ptr<float>(y), dst.ptr(y), storage, src.cols * src.channels());
+            }
+        }
+        
+        /** Convert stored image to single precision. Reuses storage of dst. */
+        inline void convertFromStorage(const cv::Mat &src, cv::Mat &dst) {
+            const int storage = storageOf(src);
+            
+            if (storage == STORAGE_FLOAT32) {
+                src.copyTo(dst);
+                return;
+            }
+            
+            dst.create(src.size(), CV_MAKETYPE(CV_32F, src.channels()));
+            for (int y = 0; y < src.rows; ++y) {
+                loadValues(src.ptr(y), storage, src.cols * src.channels(), dst.ptr<float>(y));
+            }
+        }
+        
+        /** 
+            Single precision version of stored image. Shares data for single precision storage.
+         */
+        inline cv::Mat floatImage(const cv::Mat &img) {
+            if (storageOf(img) == STORAGE_FLOAT32)
+                return img;
+            
+            cv::Mat f;
+            convertFromStorage(img, f);
+            return f;
+        }
+        
+        /**
+            Access row of stored image in single precision.
+         
+            Returns a pointer into the image for single precision storage, and converts 
+            into buf, which needs to hold img.cols * img.channels() values, otherwise. 
+            Channels are interleaved.
+         */
+        inline const float *loadRow(const cv::Mat &img, int y, float *buf) {
+            const int storage = storageOf(img);
+            
+            if (storage == STORAGE_FLOAT32)
+                return img.ptr<float>(y);
+            
+            loadValues(img.ptr(y), storage, img.cols * img.channels(), buf);
+            return buf;
+        }
+    }
+}
+
+#endif
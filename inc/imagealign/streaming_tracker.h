@@ -0,0 +1,388 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef IMAGE_ALIGN_STREAMING_TRACKER_H
+#define IMAGE_ALIGN_STREAMING_TRACKER_H
+
+#include <imagealign/config.h>
+#include <imagealign/image_pyramid.h>
+#include <imagealign/multi_template_tracker.h>
+#include <imagealign/parallel.h>
+#include <opencv2/core/core.hpp>
+#include <deque>
+#include <vector>
+
+#ifdef IA_HAS_CXX11
+    #include <condition_variable>
+    #include <exception>
+    #include <mutex>
+    #include <thread>
+#endif
+
+namespace imagealign {
+    
+#ifdef IA_HAS_CXX11
+    
+    namespace detail {
+        
+        /**
+            Blocking first-in first-out queue of bounded capacity.
+         
+            Once closed, push fails and pop returns the remaining elements before failing.
+         */
+        template<class T>
+        class BoundedQueue {
+        public:
+            explicit BoundedQueue(size_t capacity)
+                : _capacity(std::max<size_t>(1, capacity)), _closed(false)
+            {}
+            
+            /** Append v, waiting while the queue is full. Returns false when closed. */
+            bool push(const T &v) {
+                std::unique_lock<std::mutex> lock(_mutex);
+                while (!_closed && _items.size() >= _capacity)
+                    _notFull.wait(lock);
+                
+                if (_closed)
+                    return false;
+                
+                _items.push_back(v);
+                _notEmpty.notify_one();
+                return true;
+            }
+            
+            /** Remove first element, waiting while the queue is empty. Returns false when closed and drained. */
+            bool pop(T &v) {
+                std::unique_lock<std::mutex> lock(_mutex);
+                while (!_closed && _items.empty())
+                    _notEmpty.wait(lock);
+                
+                if (_items.empty())
+                    return false;
+                
+                v = _items.front();
+                _items.pop_front();
+                _notFull.notify_one();
+                return true;
+            }
+            
+            void close() {
+                std::lock_guard<std::mutex> lock(_mutex);
+                _closed = true;
+                _notFull.notify_all();
+                _notEmpty.notify_all();
+            }
+            
+        private:
+            size_t _capacity;
+            bool _closed;
+            std::deque<T> _items;
+            std::mutex _mutex;
+            std::condition_variable _notFull;
+            std::condition_variable _notEmpty;
+        };
+    }
+    
+    /**
+        Result of aligning one frame in a StreamingTracker.
+     */
+    template<class W>
+    struct StreamingResult {
+        typedef typename W::Traits::ScalarType ScalarType;
+        
+        /** Index of frame in order of StreamingTracker::push, starting at zero. */
+        int64 frame;
+        
+        /** Warp, status and error per track. See MultiTemplateTracker. */
+        std::vector<W> warps;
+        std::vector<int> status;
+        std::vector<ScalarType> errors;
+        
+        /** Seconds between pushing the frame and its result becoming available. */
+        double latencySeconds;
+        
+        StreamingResult()
+            : frame(-1), latencySeconds(0)
+        {}
+    };
+    
+    /**
+        Aligns prepared templates with a stream of frames, overlapping pyramid construction 
+        and alignment.
+     
+        Frames pushed are handed through bounded queues to two stage threads. The first builds 
+        target pyramids, the second aligns all tracks of a MultiTemplateTracker with them. So 
+        the pyramid of frame N + 1 is built while frame N is aligned. Pyramids are recycled 
+        from a fixed pool, which avoids allocations once the pool is warm. Each frame starts 
+        from the warps found in the previous frame. 
+     
+        When a queue is full, push waits, which bounds memory and latency for sources faster 
+        than alignment. To overlap stages, keep up to capacity frames in flight before popping 
+        results:
+     
+            StreamingTracker<A> s(tracker);
+            s.start(warps, 3, 20, 0.03f);
+            for each frame:
+                s.push(frame);
+                if (s.inFlight() > 2) s.pop(r);
+            s.finish();
+            while (s.pop(r)) ...
+     
+        The tracker needs to be prepared with fixed templates before start, and must not be 
+        used otherwise until the stream is finished. Each object runs a single stream. Only 
+        available with C++11 support.
+     
+        \tparam A Aligner type, e.g. AlignInverseCompositional<WarpTranslationF>.
+     */
+    template<class A>
+    class StreamingTracker {
+    public:
+        
+        typedef typename A::WarpType WarpType;
+        typedef typename WarpType::Traits::ScalarType ScalarType;
+        typedef StreamingResult<WarpType> ResultType;
+        
+        /**
+            Create pipeline.
+         
+            \param tracker Prepared tracker. Must outlive this object.
+            \param capacity Capacity of each queue between stages.
+         */
+        explicit StreamingTracker(MultiTemplateTracker<A> &tracker, int capacity = 2)
+            : _tracker(tracker), _capacity(std::max<int>(1, capacity)), _levels(1), _maxIterations(0), _eps(0),
+              _pushed(0), _popped(0), _pyramidExecutor(&_serial),
+              _frames(_capacity), _pyramids(_capacity), _results(_capacity), _free(_capacity + 2)
+        {}
+        
+        /** Stop stage threads, discarding frames not aligned yet. */
+        ~StreamingTracker() {
+            closeAll();
+            join();
+        }
+        
+        /**
+            Set the executor used to build pyramids on the pyramid stage. Defaults to serial. 
+            The executor must outlive this object.
+         */
+        StreamingTracker &setPyramidExecutor(const Executor &e) {
+            _pyramidExecutor = &e;
+            return *this;
+        }
+        
+        /**
+            Start stage threads.
+         
+            \param warps Initial warp per prepared track.
+            \param pyramidLevels Number of target pyramid levels to build.
+            \param maxIterations Maximum number of iterations in all levels per track.
+            \param eps Minimum length of incremental parameter vector to continue on current level.
+         */
+        void start(const std::vector<WarpType> &warps, int pyramidLevels, int maxIterations, ScalarType eps) {
+            CV_Assert(_threads.empty());
+            CV_Assert((int)warps.size() == _tracker.numTracks());
+            
+            _warps = warps;
+            _levels = std::max<int>(1, pyramidLevels);
+            _maxIterations = maxIterations;
+            _eps = eps;
+            
+            _pool.assign(_capacity + 2, ImagePyramid());
+            for (int i = 0; i < (int)_pool.size(); ++i) {
+                _free.push(i);
+            }
+            
+            _threads.push_back(std::thread(&StreamingTracker::runStage, this, &StreamingTracker::pyramidStage));
+            _threads.push_back(std::thread(&StreamingTracker::runStage, this, &StreamingTracker::alignStage));
+        }
+        
+        /**
+            Enqueue a single channel frame, waiting while the pipeline is full.
+         
+            The frame is copied, so the caller may reuse its buffer right away.
+            \return False when the stream was finished or a stage failed.
+         */
+        bool push(const cv::Mat &frame) {
+            CV_Assert(!_threads.empty());
+            CV_Assert(frame.channels() == 1);
+            
+            Frame f;
+            f.image = frame.clone();
+            f.index = _pushed;
+            f.pushed = cv::getTickCount();
+            
+            if (!_frames.push(f))
+                return false;
+            
+            ++_pushed;
+            return true;
+        }
+        
+        /**
+            Wait for the result of the next frame.
+         
+            \return False when all frames pushed before finish have been returned. Rethrows
+            the first error of a stage.
+         */
+        bool pop(ResultType &r) {
+            const bool ok = _results.pop(r);
+            if (ok) {
+                ++_popped;
+            } else {
+                join();
+                rethrow();
+            }
+            return ok;
+        }
+        
+        /** Number of frames pushed whose results have not been popped. */
+        int64 inFlight() const {
+            return _pushed - _popped;
+        }
+        
+        /**
+            Signal the end of the stream. Results of frames already pushed can still be popped.
+         */
+        void finish() {
+            _frames.close();
+        }
+        
+    private:
+        StreamingTracker(const StreamingTracker &);
+        StreamingTracker &operator=(const StreamingTracker &);
+        
+        struct Frame {
+            cv::Mat image;
+            int64 index;
+            int64 pushed;
+        };
+        
+        struct Job {
+            int pyramid;
+            int64 index;
+            int64 pushed;
+        };
+        
+        typedef void (StreamingTracker::*StageType)();
+        
+        /** Run stage, closing all queues on failure so the other stage and the caller wake up. */
+        void runStage(StageType stage) {
+            try {
+                (this->*stage)();
+            } catch (...) {
+                {
+                    std::lock_guard<std::mutex> lock(_errorMutex);
+                    if (!_error)
+                        _error = std::current_exception();
+                }
+                closeAll();
+            }
+        }
+        
+        void pyramidStage() {
+            Frame f;
+            while (_frames.pop(f)) {
+                Job j;
+                if (!_free.pop(j.pyramid))
+                    break;
+                
+                _pool[j.pyramid].create(f.image, _levels, *_pyramidExecutor);
+                j.index = f.index;
+                j.pushed = f.pushed;
+                
+                if (!_pyramids.push(j))
+                    break;
+            }
+            _pyramids.close();
+        }
+        
+        void alignStage() {
+            Job j;
+            while (_pyramids.pop(j)) {
+                _tracker.align(_pool[j.pyramid], _warps, _maxIterations, _eps);
+                _free.push(j.pyramid);
+                
+                ResultType r;
+                r.frame = j.index;
+                r.warps = _warps;
+                r.status.resize(_warps.size());
+                r.errors.resize(_warps.size());
+                for (int i = 0; i < (int)_warps.size(); ++i) {
+                    r.status[i] = _tracker.status(i);
+                    r.errors[i] = _tracker.error(i);
+                }
+                r.latencySeconds = double(cv::getTickCount() - j.pushed) / cv::getTickFrequency();
+                
+                if (!_results.push(r))
+                    break;
+            }
+            _results.close();
+        }
+        
+        void closeAll() {
+            _frames.close();
+            _pyramids.close();
+            _results.close();
+            _free.close();
+        }
+        
+        void join() {
+            for (size_t i = 0; i < _threads.size(); ++i) {
+                if (_threads[i].joinable())
+                    _threads[i].join();
+            }
+        }
+        
+        void rethrow() {
+            std::lock_guard<std::mutex> lock(_errorMutex);
+            if (_error) {
+                std::exception_ptr e = _error;
+                _error = std::exception_ptr();
+                std::rethrow_exception(e);
+            }
+        }
+        
+        MultiTemplateTracker<A> &_tracker;
+        int _capacity;
+        int _levels;
+        int _maxIterations;
+        ScalarType _eps;
+        int64 _pushed;
+        int64 _popped;
+        
+        SerialExecutor _serial;
+        const Executor *_pyramidExecutor;
+        
+        std::vector<WarpType> _warps;
+        std::vector<ImagePyramid> _pool;
+        
+        detail::BoundedQueue<Frame> _frames;
+        detail::BoundedQueue<Job> _pyramids;
+        detail::BoundedQueue<ResultType> _results;
+        detail::BoundedQueue<int> _free;
+        
+        std::vector<std::thread> _threads;
+        std::mutex _errorMutex;
+        std::exception_ptr _error;
+    };
+    
+#endif
+    
+}
+
+#endif
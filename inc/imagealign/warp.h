@@ -223,6 +223,18 @@ namespace imagealign {
     template<class Scalar>
     struct WarpTraits<WARP_SIMILARITY, Scalar> : WarpTraitsForCompileTimeKnownParameterCount<WARP_SIMILARITY, 4, Scalar> {};
     
+    /**
+        Warp traits for Affine motion.
+     */
+    template<class Scalar>
+    struct WarpTraits<WARP_AFFINE, Scalar> : WarpTraitsForCompileTimeKnownParameterCount<WARP_AFFINE, 6, Scalar> {};
+    
+    /**
+        Warp traits for Perspective motion.
+     */
+    template<class Scalar>
+    struct WarpTraits<WARP_PERSPECTIVE, Scalar> : WarpTraitsForCompileTimeKnownParameterCount<WARP_PERSPECTIVE, 8, Scalar> {};
+    
     /**
         Interface declaration for warps.
      
@@ -471,7 +483,7 @@ namespace imagealign {
         
         /** Get warp parameters */
         ParamType parameters() const {
-            return ParamType(_m(0, 2), _m(1, 2), std::acos(_m(0,0)));
+            return ParamType(_m(0, 2), _m(1, 2), std::atan2(_m(1, 0), _m(0, 0)));
         }
         
         /** Set warp parameters */
@@ -705,6 +717,253 @@ namespace imagealign {
         
     };
     
+    /**
+        Warp implementation for Affine motion.
+     
+        An affine transform consists of a linear transform and translation. It preserves 
+        parallel lines and straight lines.
+     
+        The warp is parametrized with 6 parameters (tx, ty, a, b, c, d). In matrix notation
+     
+            (1 + a)    c     tx
+               b    (1 + d)  ty
+     
+        so that the identity transform corresponds to all parameters being zero.
+     */
+    template<class Scalar>
+    class Warp<WARP_AFFINE, Scalar> : public PlanarWarp<WARP_AFFINE, Scalar> {
+    private:
+        using PlanarWarp<WARP_AFFINE, Scalar>::_m;
+    public:
+        
+        using PlanarWarp<WARP_AFFINE, Scalar>::matrix;
+        using PlanarWarp<WARP_AFFINE, Scalar>::setMatrix;
+        
+        typedef WarpTraits<WARP_AFFINE, Scalar> Traits;
+        typedef typename Traits::PointType PointType;
+        typedef typename Traits::ParamType ParamType;
+        typedef typename Traits::JacobianType JacobianType;
+        
+        /** Get warp parameters */
+        ParamType parameters() const {
+            return ParamType(_m(0, 2), _m(1, 2), _m(0, 0) - Scalar(1), _m(1, 0), _m(0, 1), _m(1, 1) - Scalar(1));
+        }
+        
+        /** Set warp parameters */
+        void setParameters(const ParamType &p) {
+            _m(0, 2) = p(0, 0);
+            _m(1, 2) = p(1, 0);
+            
+            _m(0, 0) = Scalar(1) + p(2, 0);
+            _m(1, 0) = p(3, 0);
+            _m(0, 1) = p(4, 0);
+            _m(1, 1) = Scalar(1) + p(5, 0);
+        }
+        
+        /** Scale the parameters of the warp. */
+        Warp<WARP_AFFINE, Scalar> scaled(int numLevels) const
+        {
+            ParamType p = this->parameters();
+            Scalar s = std::pow(Scalar(2), numLevels);
+            p(0, 0) *= s;
+            p(1, 0) *= s;
+            
+            Warp<WARP_AFFINE, Scalar> w;
+            w.setParameters(p);
+            
+            return w;
+        }
+        
+        /**
+            Compute the jacobian of the warp.
+         
+            The Jacobian matrix contains the partial derivatives of the warp parameters
+            with respect to x and y coordinates. It does not depend on the current value 
+            of parameters. In this case:
+         
+                    tx   ty  a   b   c   d
+                x   1    0   x   0   y   0
+                y   0    1   0   x   0   y
+         
+         */
+        JacobianType jacobian(const PointType &p) const {
+            JacobianType j = JacobianType::zeros();
+            j(0, 0) = Scalar(1);
+            j(1, 1) = Scalar(1);
+            
+            j(0, 2) = p(0);
+            j(1, 3) = p(0);
+            
+            j(0, 4) = p(1);
+            j(1, 5) = p(1);
+            
+            return j;
+        }
+        
+        /** Forward additive step. */
+        void updateForwardAdditive(const ParamType &delta) {
+            setParameters(parameters() + delta);
+        }
+        
+        /** Forward compositional step. */
+        void updateForwardCompositional(const ParamType &delta) {
+            Warp<WARP_AFFINE, Scalar> wDelta;
+            wDelta.setParameters(delta);
+            setMatrix(matrix() * wDelta.matrix());
+        }
+        
+        /** Inverse compositional step. */
+        void updateInverseCompositional(const ParamType &delta) {
+            Warp<WARP_AFFINE, Scalar> wDelta;
+            wDelta.setParameters(delta);
+            setMatrix(matrix() * wDelta.invMatrix());
+        }
+    };
+    
+    /**
+        Warp implementation for Perspective motion.
+     
+        A perspective transform, also known as homography, preserves straight lines. It
+        describes the motion of a planar scene, such as a document, seen by a pinhole camera.
+     
+        The warp is parametrized with 8 parameters (tx, ty, a, b, c, d, e, f). In matrix notation
+     
+            (1 + a)    c     tx
+               b    (1 + d)  ty
+               e       f      1
+     
+        Matrices are normalized to a unit lower right element, so that the identity transform 
+        corresponds to all parameters being zero.
+     */
+    template<class Scalar>
+    class Warp<WARP_PERSPECTIVE, Scalar> : public PlanarWarp<WARP_PERSPECTIVE, Scalar> {
+    private:
+        using PlanarWarp<WARP_PERSPECTIVE, Scalar>::_m;
+    public:
+        
+        using PlanarWarp<WARP_PERSPECTIVE, Scalar>::matrix;
+        
+        typedef WarpTraits<WARP_PERSPECTIVE, Scalar> Traits;
+        typedef typename Traits::PointType PointType;
+        typedef typename Traits::ParamType ParamType;
+        typedef typename Traits::JacobianType JacobianType;
+        typedef typename PlanarWarp<WARP_PERSPECTIVE, Scalar>::MType MType;
+        
+        /** Set warp matrix. Normalizes to unit lower right element. */
+        void setMatrix(const MType &m) {
+            _m = m * (Scalar(1) / m(2, 2));
+        }
+        
+        /** Get warp parameters */
+        ParamType parameters() const {
+            ParamType p;
+            p(0, 0) = _m(0, 2);
+            p(1, 0) = _m(1, 2);
+            p(2, 0) = _m(0, 0) - Scalar(1);
+            p(3, 0) = _m(1, 0);
+            p(4, 0) = _m(0, 1);
+            p(5, 0) = _m(1, 1) - Scalar(1);
+            p(6, 0) = _m(2, 0);
+            p(7, 0) = _m(2, 1);
+            return p;
+        }
+        
+        /** Set warp parameters */
+        void setParameters(const ParamType &p) {
+            _m(0, 2) = p(0, 0);
+            _m(1, 2) = p(1, 0);
+            
+            _m(0, 0) = Scalar(1) + p(2, 0);
+            _m(1, 0) = p(3, 0);
+            _m(0, 1) = p(4, 0);
+            _m(1, 1) = Scalar(1) + p(5, 0);
+            
+            _m(2, 0) = p(6, 0);
+            _m(2, 1) = p(7, 0);
+            _m(2, 2) = Scalar(1);
+        }
+        
+        /** 
+            Scale the parameters of the warp. 
+         
+            Scaling image coordinates by s transforms the matrix into S * M * S^-1 with 
+            S = diag(s, s, 1). Translation is multiplied by s, the projective terms are divided by s.
+         */
+        Warp<WARP_PERSPECTIVE, Scalar> scaled(int numLevels) const
+        {
+            ParamType p = this->parameters();
+            Scalar s = std::pow(Scalar(2), numLevels);
+            p(0, 0) *= s;
+            p(1, 0) *= s;
+            p(6, 0) /= s;
+            p(7, 0) /= s;
+            
+            Warp<WARP_PERSPECTIVE, Scalar> w;
+            w.setParameters(p);
+            
+            return w;
+        }
+        
+        /**
+            Compute the jacobian of the warp.
+         
+            The Jacobian matrix contains the partial derivatives of the warp parameters
+            with respect to x and y coordinates, evaluated at the current value of parameters.
+            In this case:
+         
+                    tx    ty    a     b     c     d     e          f
+                x   1/z   0     x/z   0     y/z   0    -x * u/z   -y * u/z
+                y   0     1/z   0     x/z   0     y/z  -x * v/z   -y * v/z
+         
+            with (u, v) being the warped point and z = e * x + f * y + 1.
+         */
+        JacobianType jacobian(const PointType &p) const {
+            const Scalar x = p(0);
+            const Scalar y = p(1);
+            
+            const Scalar iz = Scalar(1) / (_m(2, 0) * x + _m(2, 1) * y + Scalar(1));
+            const Scalar u = (_m(0, 0) * x + _m(0, 1) * y + _m(0, 2)) * iz;
+            const Scalar v = (_m(1, 0) * x + _m(1, 1) * y + _m(1, 2)) * iz;
+            
+            JacobianType j = JacobianType::zeros();
+            j(0, 0) = iz;
+            j(1, 1) = iz;
+            
+            j(0, 2) = x * iz;
+            j(1, 3) = x * iz;
+            
+            j(0, 4) = y * iz;
+            j(1, 5) = y * iz;
+            
+            j(0, 6) = -x * u * iz;
+            j(1, 6) = -x * v * iz;
+            
+            j(0, 7) = -y * u * iz;
+            j(1, 7) = -y * v * iz;
+            
+            return j;
+        }
+        
+        /** Forward additive step. */
+        void updateForwardAdditive(const ParamType &delta) {
+            setParameters(parameters() + delta);
+        }
+        
+        /** Forward compositional step. */
+        void updateForwardCompositional(const ParamType &delta) {
+            Warp<WARP_PERSPECTIVE, Scalar> wDelta;
+            wDelta.setParameters(delta);
+            setMatrix(matrix() * wDelta.matrix());
+        }
+        
+        /** Inverse compositional step. */
+        void updateInverseCompositional(const ParamType &delta) {
+            Warp<WARP_PERSPECTIVE, Scalar> wDelta;
+            wDelta.setParameters(delta);
+            setMatrix(matrix() * wDelta.invMatrix());
+        }
+    };
+    
     typedef Warp<WARP_TRANSLATION, float> WarpTranslationF;
     typedef Warp<WARP_TRANSLATION, double> WarpTranslationD;
     
@@ -714,6 +973,12 @@ namespace imagealign {
     typedef Warp<WARP_SIMILARITY, float> WarpSimilarityF;
     typedef Warp<WARP_SIMILARITY, double> WarpSimilarityD;
     
+    typedef Warp<WARP_AFFINE, float> WarpAffineF;
+    typedef Warp<WARP_AFFINE, double> WarpAffineD;
+    
+    typedef Warp<WARP_PERSPECTIVE, float> WarpPerspectiveF;
+    typedef Warp<WARP_PERSPECTIVE, double> WarpPerspectiveD;
+    
 }
 
 #endif
\ No newline at end of file
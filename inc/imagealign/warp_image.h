@@ -25,6 +25,80 @@
 #include <opencv2/core/core.hpp>
 
 namespace imagealign {
+    
+    namespace detail {
+        
+        /**
+            Warp image rows for generic warps.
+         
+            Every destination pixel is warped individually, sampling happens row-wise. Row y of
+            dst receives destination row y0 + y.
+         */
+        template<class ChannelType, int SampleMethod, int WarpType, class Scalar>
+        void warpImageRows(const cv::Mat &src, cv::Mat &dst, int y0, const Warp<WarpType, Scalar> &w, const void *, const Sampler<SampleMethod> &s)
+        {
+            typedef typename Warp<WarpType, Scalar>::Traits::PointType PointType;
+            
+            cv::AutoBuffer<Scalar> xs(dst.cols), ys(dst.cols);
+            
+            for (int y = 0; y < dst.rows; ++y) {
+                for (int x = 0; x < dst.cols; ++x) {
+                    PointType wp = w(PointType(Scalar(x), Scalar(y0 + y)));
+                    xs[x] = wp(0);
+                    ys[x] = wp(1);
+                }
+                
+                s.template sample<ChannelType>(src, (const Scalar*)xs, (const Scalar*)ys, dst.cols, dst.ptr<ChannelType>(y));
+            }
+        }
+        
+        /**
+            Warp image rows for planar warps.
+         
+            For planar motions the warped location of (x, y) is an affine function of x
+            along a row. The start point and per-column increment are computed once per row
+            from the warp matrix, locations are then generated by stepping. Perspective
+            motions step along the homogeneous coordinates and normalize per pixel. Row y of
+            dst receives destination row y0 + y.
+         */
+        template<class ChannelType, int SampleMethod, int WarpType, class Scalar>
+        void warpImageRows(const cv::Mat &src, cv::Mat &dst, int y0, const Warp<WarpType, Scalar> &w, const PlanarWarp<WarpType, Scalar> *, const Sampler<SampleMethod> &s)
+        {
+            const cv::Matx<Scalar, 3, 3> m = w.matrix();
+            
+            cv::AutoBuffer<Scalar> xs(dst.cols), ys(dst.cols);
+            
+            for (int y = 0; y < dst.rows; ++y) {
+                const Scalar yd = Scalar(y0 + y);
+                
+                // Warped location of (0, yd) and increment per column.
+                const Scalar rx = m(0, 1) * yd + m(0, 2);
+                const Scalar ry = m(1, 1) * yd + m(1, 2);
+                const Scalar dx = m(0, 0);
+                const Scalar dy = m(1, 0);
+                
+                if (WarpType < WARP_PERSPECTIVE) {
+                    // Positions are computed from the row start rather than accumulated
+                    // to avoid drift on wide images.
+                    for (int x = 0; x < dst.cols; ++x) {
+                        xs[x] = rx + dx * Scalar(x);
+                        ys[x] = ry + dy * Scalar(x);
+                    }
+                } else {
+                    const Scalar z0 = m(2, 1) * yd + m(2, 2);
+                    const Scalar dz = m(2, 0);
+                    
+                    for (int x = 0; x < dst.cols; ++x) {
+                        const Scalar iz = Scalar(1) / (z0 + dz * Scalar(x));
+                        xs[x] = (rx + dx * Scalar(x)) * iz;
+                        ys[x] = (ry + dy * Scalar(x)) * iz;
+                    }
+                }
+                
+                s.template sample<ChannelType>(src, (const Scalar*)xs, (const Scalar*)ys, dst.cols, dst.ptr<ChannelType>(y));
+            }
+        }
+    }
 
     /**
         Warp an image using bilinear interpolation.
@@ -33,6 +107,10 @@ namespace imagealign {
         of the warp is such that for given pixel in the destination image, the warp reports the corresponding
         pixel in the source image.
      
+        Warps derived from PlanarWarp are evaluated incrementally along destination rows, all other
+        warps are evaluated per pixel. Multi-channel images are warped with all channels at once,
+        ChannelType denotes the type of a single channel value.
+     
         This method will call create on the destination image.
      
         \param src_ Source image
@@ -44,28 +122,34 @@ namespace imagealign {
     template<class ChannelType, int SampleMethod, int WarpType, class Scalar>
     void warpImage(cv::InputArray src_, cv::OutputArray dst_, cv::Size dstSize, const Warp<WarpType, Scalar> &w, const Sampler<SampleMethod> &s = Sampler<SampleMethod>())
     {
-        CV_Assert(src_.channels() == 1);
-        
-        typedef typename Warp<WarpType, Scalar>::Traits::PointType PointType;
-        
         dst_.create(dstSize, src_.type());
         
         cv::Mat src = src_.getMat();
         cv::Mat dst = dst_.getMat();
         
-        for (int y = 0; y < dstSize.height; ++y) {
-            ChannelType *r = dst.ptr<ChannelType>(y);
-            
-            for (int x = 0; x < dstSize.width; ++x) {
-                PointType wp = w(PointType(Scalar(x), Scalar(y)));
-                r[x] = s.template sample<ChannelType>(src, wp);
-            }
-        }
+        // Overload resolution picks the planar variant for warps derived from PlanarWarp.
+        detail::warpImageRows<ChannelType>(src, dst, 0, w, &w, s);
     }
     
-    
-    
-    
+    /**
+        Warp a band of destination rows into a buffer.
+     
+        Row y of dst receives destination row y0 + y, computed exactly as warpImage would. dst
+        needs to be allocated by the caller, which allows warping into preallocated scratch memory.
+     
+        \param src Source image
+        \param dst Destination rows
+        \param y0 Destination row of first row of dst.
+        \param w Warp function
+        \param s Sampler to use.
+     */
+    template<class ChannelType, int SampleMethod, int WarpType, class Scalar>
+    void warpImageRows(const cv::Mat &src, cv::Mat &dst, int y0, const Warp<WarpType, Scalar> &w, const Sampler<SampleMethod> &s = Sampler<SampleMethod>())
+    {
+        CV_Assert(dst.type() == src.type());
+        
+        detail::warpImageRows<ChannelType>(src, dst, y0, w, &w, s);
+    }
     
 }
 
@@ -22,8 +22,16 @@
 #include <imagealign/forward_additive.h>
 #include <imagealign/forward_compositional.h>
 #include <imagealign/inverse_compositional.h>
+#include <imagealign/inverse_compositional_patch.h>
+#include <imagealign/multi_template_tracker.h>
+#include <imagealign/dense_flow.h>
+#include <imagealign/streaming_tracker.h>
+#include <imagealign/mapped_file.h>
 #include <imagealign/warp_image.h>
 #include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <map>
 
 template< class A, class W >
 W testAlgorithm(cv::Mat tpl, cv::Mat target, W w, int levels, const typename W::Traits::ParamType &expected, double tolerance = 0.01)
@@ -207,6 +215,551 @@ TEST_CASE("algorithm-similarity")
     }
 }
 
+TEST_CASE("algorithm-affine")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    typedef ia::WarpAffineD W;
+    
+    W w;
+    w.setParameters(W::Traits::ParamType(20, 25, 0.1, 0.05, -0.08, -0.05));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    W::Traits::ParamType expected = w.parameters();
+    
+    w.setParameters(expected + W::Traits::ParamType(0.8, -0.7, 0.01, -0.01, 0.01, 0.02));
+    
+    testAlgorithm< ia::AlignForwardAdditive<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignForwardAdditive<W> >(tmpl, target, w, 2, expected, 0.02);
+    
+    testAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 2, expected, 0.02);
+    
+    testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected, 0.02);
+}
+
+TEST_CASE("algorithm-perspective")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    typedef ia::WarpPerspectiveD W;
+    
+    W::Traits::ParamType expected;
+    expected << 20, 25, 0.05, 0.02, -0.03, -0.05, 0.001, -0.0015;
+    
+    W w;
+    w.setParameters(expected);
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    W::Traits::ParamType noise;
+    noise << 0.7, -0.6, 0.01, 0, 0, 0.01, 0, 0;
+    w.setParameters(expected + noise);
+    
+    testAlgorithm< ia::AlignForwardAdditive<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignForwardCompositional<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 1, expected, 0.02);
+    testAlgorithm< ia::AlignInverseCompositional<W> >(tmpl, target, w, 2, expected, 0.02);
+}
+
+template< class A, class W >
+W alignWithExecutor(cv::Mat tpl, cv::Mat target, W w, int levels, const imagealign::Executor &e)
+{
+    typedef typename W::Traits::ScalarType S;
+    
+    A a;
+    a.setExecutor(e);
+    a.prepare(tpl, target, w, levels);
+    a.align(w, 100, S(0));
+    
+    return w;
+}
+
+template< class A, class W >
+void testExecutorsAgree(cv::Mat tpl, cv::Mat target, const W &w)
+{
+    namespace ia = imagealign;
+    
+    ia::SerialExecutor serial;
+    ia::OpenCVExecutor opencv;
+    
+    W ws = alignWithExecutor<A>(tpl, target, w, 2, serial);
+    W wo = alignWithExecutor<A>(tpl, target, w, 2, opencv);
+    
+    REQUIRE(cv::norm(ws.parameters() - wo.parameters(), cv::NORM_INF) == 0);
+    
+#ifdef IA_HAS_CXX11
+    ia::ThreadExecutor threads(4);
+    W wt = alignWithExecutor<A>(tpl, target, w, 2, threads);
+    
+    REQUIRE(cv::norm(ws.parameters() - wt.parameters(), cv::NORM_INF) == 0);
+    
+    ia::WorkStealingExecutor stealing(4);
+    W wst = alignWithExecutor<A>(tpl, target, w, 2, stealing);
+    
+    REQUIRE(cv::norm(ws.parameters() - wst.parameters(), cv::NORM_INF) == 0);
+#endif
+}
+
+TEST_CASE("algorithm-parallel")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(200, 200, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    typedef ia::WarpSimilarityD W;
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(40, 50, 0.1, 1.0));
+    
+    // Template spans several reduction tiles
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(100, 100), w);
+    
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(41, 49, 0.12, 1.01));
+    
+    testExecutorsAgree< ia::AlignForwardAdditive<W> >(tmpl, target, w);
+    testExecutorsAgree< ia::AlignForwardCompositional<W> >(tmpl, target, w);
+    testExecutorsAgree< ia::AlignInverseCompositional<W> >(tmpl, target, w);
+}
+
+#ifdef IA_HAS_CXX11
+
+/** Records the first task run on each thread and how often each task ran. Task i takes longer than task i + 1. */
+class FirstTaskRecorder : public imagealign::ParallelTask {
+public:
+    explicit FirstTaskRecorder(int numTasks)
+        : _runs(numTasks, 0)
+    {}
+    
+    void operator()(int task) const {
+        std::this_thread::sleep_for(std::chrono::microseconds(50 * ((int)_runs.size() - task)));
+        
+        std::lock_guard<std::mutex> lock(_mutex);
+        ++_runs[task];
+        if (_first.find(std::this_thread::get_id()) == _first.end())
+            _first[std::this_thread::get_id()] = task;
+    }
+    
+    mutable std::mutex _mutex;
+    mutable std::vector<int> _runs;
+    mutable std::map<std::thread::id, int> _first;
+};
+
+TEST_CASE("algorithm-work-stealing")
+{
+    namespace ia = imagealign;
+    
+    ia::WorkStealingExecutor stealing(4);
+    
+    // Tasks ordered by decreasing cost, the four most expensive ones start on different threads.
+    FirstTaskRecorder r(64);
+    stealing.run(64, r);
+    
+    for (int i = 0; i < 64; ++i) {
+        REQUIRE(r._runs[i] == 1);
+    }
+    
+    REQUIRE(r._first.size() == 4);
+    
+    std::vector<int> first;
+    for (std::map<std::thread::id, int>::const_iterator i = r._first.begin(); i != r._first.end(); ++i) {
+        first.push_back(i->second);
+    }
+    std::sort(first.begin(), first.end());
+    
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(first[i] == i);
+    }
+    
+    // Fewer tasks than threads.
+    FirstTaskRecorder few(3);
+    stealing.run(3, few);
+    
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(few._runs[i] == 1);
+    }
+}
+
+#endif
+
+TEST_CASE("algorithm-multi-template")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpTranslationF W;
+    typedef ia::AlignInverseCompositional<W> A;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    ia::ImagePyramid targetPyramid;
+    targetPyramid.create(target, 2);
+    
+    std::vector<cv::Rect> rois;
+    rois.push_back(cv::Rect(20, 20, 15, 15));
+    rois.push_back(cv::Rect(60, 30, 15, 15));
+    rois.push_back(cv::Rect(40, 70, 15, 15));
+    rois.push_back(cv::Rect(95, 95, 15, 15)); // Outside of template image
+    
+    std::vector<W> warps(rois.size());
+    for (size_t i = 0; i < rois.size(); ++i) {
+        warps[i].setParameters(W::Traits::ParamType(float(rois[i].x) - 1.5f, float(rois[i].y) + 1.f));
+    }
+    
+    std::vector<W> expected(warps);
+    
+    ia::MultiTemplateTracker<A> tracker;
+    tracker.track(target, rois, targetPyramid, warps, 2, 50, 0.f);
+    
+    REQUIRE(tracker.numTracks() == 4);
+    REQUIRE(tracker.status(3) == ia::TRACK_INVALID_ROI);
+    
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(tracker.status(i) == ia::TRACK_OK);
+        
+        W::Traits::ParamType p = warps[i].parameters();
+        REQUIRE(p(0) == Catch::Detail::Approx(rois[i].x).epsilon(0.01));
+        REQUIRE(p(1) == Catch::Detail::Approx(rois[i].y).epsilon(0.01));
+        
+        // Same result as a single aligner
+        A a;
+        a.prepare(target(rois[i]), targetPyramid, expected[i], 2);
+        a.align(expected[i], 50, 0.f);
+        
+        REQUIRE(cv::norm(expected[i].parameters() - p, cv::NORM_INF) == 0);
+        REQUIRE(tracker.error(i) == a.lastError());
+    }
+    
+#ifdef IA_HAS_CXX11
+    // Second pass is dispatched by cost of the first, results do not depend on order.
+    ia::WorkStealingExecutor stealing(3);
+    tracker.setExecutor(stealing);
+    
+    std::vector<W> again(rois.size());
+    for (size_t i = 0; i < rois.size(); ++i) {
+        again[i].setParameters(W::Traits::ParamType(float(rois[i].x) - 1.5f, float(rois[i].y) + 1.f));
+    }
+    
+    for (int pass = 0; pass < 2; ++pass) {
+        std::vector<W> ws(again);
+        tracker.track(target, rois, targetPyramid, ws, 2, 50, 0.f);
+        
+        for (int i = 0; i < 3; ++i) {
+            REQUIRE(tracker.status(i) == ia::TRACK_OK);
+            REQUIRE(cv::norm(ws[i].parameters() - warps[i].parameters(), cv::NORM_INF) == 0);
+        }
+    }
+#endif
+}
+
+TEST_CASE("algorithm-prediction")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpTranslationF W;
+    typedef ia::AlignInverseCompositional<W> A;
+    
+    cv::RNG rng(7);
+    cv::Mat base(160, 160, CV_8UC1);
+    rng.fill(base, cv::RNG::UNIFORM, 0, 255);
+    cv::blur(base, base, cv::Size(5,5));
+    
+    // Features move by constant velocity between frames.
+    const cv::Point2f v(-2.5f, 1.5f);
+    const int LEVELS = 3;
+    
+    std::vector<cv::Point2f> points;
+    points.push_back(cv::Point2f(50, 50));
+    points.push_back(cv::Point2f(100, 60));
+    points.push_back(cv::Point2f(70, 100));
+    
+    const std::vector<cv::Point2f> initialPoints(points);
+    
+    std::vector<cv::Mat> frames(1, base);
+    for (int f = 1; f < 6; ++f) {
+        W m;
+        m.setParameters(W::Traits::ParamType(-v.x * f, -v.y * f));
+        
+        frames.push_back(cv::Mat());
+        ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(base, frames.back(), base.size(), m);
+    }
+    
+    ia::MultiTemplateTracker<A> tracker;
+    tracker.setPrediction(ia::Prediction(true));
+    
+    cv::Mat prev = base;
+    
+    for (int f = 1; f < 6; ++f) {
+        const cv::Mat &frame = frames[f];
+        
+        ia::ImagePyramid target;
+        target.create(frame, LEVELS);
+        
+        std::vector<cv::Rect> rois;
+        std::vector<W> warps(points.size());
+        for (size_t i = 0; i < points.size(); ++i) {
+            rois.push_back(cv::Rect((int)points[i].x - 10, (int)points[i].y - 10, 21, 21));
+            warps[i].setParameters(W::Traits::ParamType(float(rois[i].x), float(rois[i].y)));
+        }
+        
+        tracker.track(prev, rois, target, warps, LEVELS, 30, 0.001f);
+        
+        for (size_t i = 0; i < points.size(); ++i) {
+            REQUIRE(tracker.status((int)i) == ia::TRACK_OK);
+            
+            // First frame has no motion, the second corrects by the full motion.
+            if (f == 1)
+                REQUIRE(tracker.startLevel((int)i) == -1);
+            else if (f > 2)
+                REQUIRE(tracker.startLevel((int)i) == 0);
+            
+            W::Traits::ParamType p = warps[i].parameters();
+            REQUIRE(std::abs(p(0) - (rois[i].x + v.x)) < 0.05f);
+            REQUIRE(std::abs(p(1) - (rois[i].y + v.y)) < 0.05f);
+            
+            points[i] = points[i] + v;
+        }
+        
+        prev = frame;
+    }
+    
+    // Track 0 starts a frame late, so it corrects by the full motion one frame after the others
+    ia::MultiTemplateTracker<A> late;
+    late.setPrediction(ia::Prediction(true));
+    
+    points = initialPoints;
+    
+    for (int f = 1; f < 5; ++f) {
+        ia::ImagePyramid target;
+        target.create(frames[f], LEVELS);
+        
+        std::vector<cv::Rect> rois;
+        std::vector<W> warps(points.size());
+        for (size_t i = 0; i < points.size(); ++i) {
+            rois.push_back(cv::Rect((int)points[i].x - 10, (int)points[i].y - 10, 21, 21));
+            warps[i].setParameters(W::Traits::ParamType(float(rois[i].x), float(rois[i].y)));
+        }
+        
+        if (f == 1)
+            rois[0].width = 0;
+        
+        late.track(frames[f - 1], rois, target, warps, LEVELS, 30, 0.001f);
+        
+        for (size_t i = 0; i < points.size(); ++i) {
+            points[i] = points[i] + v;
+        }
+        
+        if (f == 3) {
+            REQUIRE(late.startLevel(0) == LEVELS - 1);
+            REQUIRE(late.startLevel(1) == 0);
+            REQUIRE(late.startLevel(2) == 0);
+            
+            const float error1 = late.error(1);
+            const float error2 = late.error(2);
+            
+            // Remaining tracks keep their aligners and motion
+            std::vector<uchar> keep(points.size(), 1);
+            keep[0] = 0;
+            late.keepTracks(keep);
+            points.erase(points.begin());
+            
+            REQUIRE(late.numTracks() == 2);
+            REQUIRE(late.startLevel(0) == 0);
+            REQUIRE(late.startLevel(1) == 0);
+            REQUIRE(late.aligner(0).lastError() == error1);
+            REQUIRE(late.aligner(1).lastError() == error2);
+        }
+    }
+    
+    for (int i = 0; i < late.numTracks(); ++i) {
+        REQUIRE(late.status(i) == ia::TRACK_OK);
+        REQUIRE(late.startLevel(i) == 0);
+    }
+}
+
+template< class W >
+void testPatchAgreesWithGeneric(cv::Mat target, const W &truth, const W &initial)
+{
+    namespace ia = imagealign;
+    
+    typedef typename W::Traits::ScalarType S;
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(31, 31), truth);
+    
+    W wg = initial;
+    ia::AlignInverseCompositional<W> g;
+    g.prepare(tmpl, target, wg, 2);
+    g.align(wg, 30, S(0.001));
+    
+    W wp = initial;
+    ia::AlignInverseCompositionalPatch<W, 31> a;
+    a.prepare(tmpl, target, wp, 2);
+    a.align(wp, 30, S(0.001));
+    
+    REQUIRE(a.numLevels() == 2);
+    REQUIRE(cv::norm(wg.parameters() - wp.parameters(), cv::NORM_INF) < 1e-3);
+    REQUIRE(a.lastError() == Catch::Detail::Approx(g.lastError()).epsilon(1e-3));
+}
+
+TEST_CASE("algorithm-patch")
+{
+    namespace ia = imagealign;
+    
+    cv::RNG rng(11);
+    cv::Mat target(120, 120, CV_8UC1);
+    rng.fill(target, cv::RNG::UNIFORM, 0, 255);
+    cv::blur(target, target, cv::Size(5,5));
+    
+    typedef ia::WarpTranslationF WT;
+    typedef ia::WarpAffineF WA;
+    typedef ia::AlignInverseCompositionalPatch<WT, 31> A;
+    
+    REQUIRE(A::supportsTemplateSize(cv::Size(31, 31)));
+    REQUIRE(!A::supportsTemplateSize(cv::Size(31, 30)));
+    
+    // Inside the target, and overlapping its border where bounds are tested per pixel
+    WT t0, t1, i0, i1;
+    t0.setParameters(WT::Traits::ParamType(40.f, 50.f));
+    i0.setParameters(WT::Traits::ParamType(41.5f, 48.8f));
+    t1.setParameters(WT::Traits::ParamType(1.f, 92.f));
+    i1.setParameters(WT::Traits::ParamType(-1.f, 93.f));
+    
+    testPatchAgreesWithGeneric(target, t0, i0);
+    testPatchAgreesWithGeneric(target, t1, i1);
+    
+    WA a0, ia0;
+    WA::Traits::ParamType p;
+    p << 45.f, 40.f, 0.05f, -0.03f, 0.02f, 0.04f;
+    a0.setParameters(p);
+    p(0) += 1.f;
+    p(1) -= 0.7f;
+    ia0.setParameters(p);
+    
+    testPatchAgreesWithGeneric(target, a0, ia0);
+    
+    // Tracks of a different size are rejected
+    ia::ImagePyramid targetPyramid;
+    targetPyramid.create(target, 2);
+    
+    std::vector<cv::Rect> rois;
+    rois.push_back(cv::Rect(30, 30, 31, 31));
+    rois.push_back(cv::Rect(70, 60, 25, 31));
+    
+    std::vector<WT> warps(rois.size());
+    for (size_t i = 0; i < rois.size(); ++i) {
+        warps[i].setParameters(WT::Traits::ParamType(float(rois[i].x) + 1.f, float(rois[i].y) - 1.f));
+    }
+    
+    ia::MultiTemplateTracker<A> tracker;
+    tracker.track(target, rois, targetPyramid, warps, 2, 30, 0.001f);
+    
+    REQUIRE(tracker.status(0) == ia::TRACK_OK);
+    REQUIRE(tracker.status(1) == ia::TRACK_INVALID_ROI);
+    REQUIRE(std::abs(warps[0].parameters()(0) - 30.f) < 0.05f);
+    REQUIRE(std::abs(warps[0].parameters()(1) - 30.f) < 0.05f);
+}
+
+TEST_CASE("algorithm-set-target")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpEuclideanD W;
+    typedef ia::AlignInverseCompositional<W> A;
+    
+    cv::Mat image(120, 120, CV_8UC1);
+    cv::randu(image, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(image, image, cv::Size(5,5));
+    
+    cv::Mat tmpl = image(cv::Rect(30, 30, 30, 30)).clone();
+    
+    W w0;
+    w0.setParameters(W::Traits::ParamType(29, 31, 0.02));
+    
+    // Template prepared once, bound to several targets
+    A a;
+    a.prepare(tmpl, w0, 2);
+    
+    for (int i = 0; i < 3; ++i) {
+        cv::Mat target = image(cv::Rect(i, 2 * i, 100, 100));
+        
+        W w(w0);
+        a.setTarget(target);
+        a.align(w, 50, 0);
+        
+        W expected(w0);
+        A b;
+        b.prepare(tmpl, target, expected, 2);
+        b.align(expected, 50, 0);
+        
+        REQUIRE(a.numLevels() == b.numLevels());
+        REQUIRE(cv::norm(expected.parameters() - w.parameters(), cv::NORM_INF) == 0);
+        REQUIRE(a.lastError() == b.lastError());
+    }
+    
+    // Same for tracker
+    typedef ia::WarpTranslationF WT;
+    
+    std::vector<cv::Rect> rois(1, cv::Rect(30, 30, 30, 30));
+    std::vector<WT> warps(1);
+    
+    ia::MultiTemplateTracker< ia::AlignInverseCompositional<WT> > tracker;
+    tracker.prepare(image, rois, warps, 2);
+    
+    for (int i = 0; i < 3; ++i) {
+        ia::ImagePyramid target;
+        target.create(image(cv::Rect(i, 2 * i, 100, 100)), 2);
+        
+        warps[0].setParameters(WT::Traits::ParamType(29.f - i, 31.f - 2 * i));
+        tracker.align(target, warps, 50, 0.f);
+        
+        REQUIRE(tracker.status(0) == ia::TRACK_OK);
+        REQUIRE(warps[0].parameters()(0) == Catch::Detail::Approx(30.f - i).epsilon(0.01));
+        REQUIRE(warps[0].parameters()(1) == Catch::Detail::Approx(30.f - 2 * i).epsilon(0.01));
+    }
+}
+
+TEST_CASE("algorithm-iteration-budget")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpTranslationF W;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    cv::Mat tmpl = target(cv::Rect(20, 20, 40, 40));
+    
+    W w;
+    w.setParameters(W::Traits::ParamType(19.5f, 20.5f));
+    
+    // Fewer iterations than levels: coarse levels are skipped, finer ones still refine.
+    ia::AlignInverseCompositional<W> a;
+    a.prepare(tmpl, target, w, 3);
+    REQUIRE(a.numLevels() == 3);
+    
+    std::vector<W> steps;
+    a.align(w, 2, 0.f, &steps);
+    
+    REQUIRE(steps.size() == 2);
+    REQUIRE(cv::norm(w.parameters() - W::Traits::ParamType(20, 20)) < 0.2);
+}
+
 // Test dummy dynamic warp;
 
 namespace ia = imagealign;
@@ -343,3 +896,1022 @@ TEST_CASE("algorithm-dynamic-warp")
     }
 
 }
+
+TEST_CASE("algorithm-precomputed-gradients")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityD W;
+    typedef ia::AlignForwardAdditive<W> A;
+    
+    cv::Mat target(120, 120, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(30, 35, 0.05, 1.0));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    W w0;
+    w0.setParametersInCanonicalRepresentation(W::Traits::ParamType(31, 34, 0.07, 1.01));
+    
+    W onTheFly(w0), owned(w0), shared(w0);
+    
+    A a;
+    a.prepare(tmpl, target, onTheFly, 3);
+    a.align(onTheFly, 100, 0);
+    
+    A b;
+    b.setPrecomputeGradients(true);
+    b.prepare(tmpl, target, owned, 3);
+    b.align(owned, 100, 0);
+    
+    ia::ImagePyramid targetPyramid;
+    targetPyramid.create(target, 3);
+    ia::GradientPyramid gradientPyramid;
+    gradientPyramid.create(targetPyramid);
+    
+    A c;
+    c.prepare(tmpl, w0, 3);
+    c.setTarget(targetPyramid, gradientPyramid);
+    c.align(shared, 100, 0);
+    
+    REQUIRE(cv::norm(onTheFly.parameters() - w.parameters(), cv::NORM_INF) < 0.05);
+    REQUIRE(cv::norm(owned.parameters() - w.parameters(), cv::NORM_INF) < 0.05);
+    REQUIRE(cv::norm(owned.parameters() - shared.parameters(), cv::NORM_INF) == 0);
+    REQUIRE(b.lastError() == c.lastError());
+    
+    // Rebinding a plain target falls back to owned gradients
+    W rebound(w0);
+    c.setPrecomputeGradients(true);
+    c.setTarget(target);
+    c.align(rebound, 100, 0);
+    
+    REQUIRE(cv::norm(owned.parameters() - rebound.parameters(), cv::NORM_INF) == 0);
+}
+
+TEST_CASE("algorithm-degenerate-template")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityD W;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    // Textureless template does not constrain any parameter
+    cv::Mat tmpl(20, 20, CV_8UC1, cv::Scalar::all(128));
+    
+    W w0;
+    w0.setParameters(W::Traits::ParamType(30, 30, 0, 0));
+    
+    W w(w0);
+    ia::AlignInverseCompositional<W> ic;
+    ic.prepare(tmpl, target, w, 1);
+    ic.align(w, 20, 0);
+    
+    REQUIRE(ic.lastConditioning() == 0);
+    REQUIRE(cv::norm(w.parameters() - w0.parameters(), cv::NORM_INF) == 0);
+    
+    w = w0;
+    ia::AlignForwardAdditive<W> fa;
+    fa.prepare(target(cv::Rect(30, 30, 20, 20)), target, w, 1);
+    fa.align(w, 20, 0);
+    
+    REQUIRE(fa.lastConditioning() > W::Traits::ScalarType(0.01));
+}
+
+TEST_CASE("algorithm-storage-policy")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityD W;
+    
+    cv::Mat target(120, 120, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(30, 35, 0.05, 1.0));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    W w0;
+    w0.setParametersInCanonicalRepresentation(W::Traits::ParamType(31, 34, 0.07, 1.01));
+    
+    const ia::StoragePolicy policies[] = {
+        ia::StoragePolicy(ia::STORAGE_UINT8, ia::STORAGE_FLOAT16),
+        ia::StoragePolicy(ia::STORAGE_UINT16, ia::STORAGE_FLOAT16),
+        ia::StoragePolicy(ia::STORAGE_FLOAT16, ia::STORAGE_FLOAT32)
+    };
+    
+    for (int i = 0; i < 3; ++i) {
+        W fa(w0), fc(w0), ic(w0);
+        
+        ia::AlignForwardAdditive<W> a;
+        a.setStoragePolicy(policies[i]);
+        a.prepare(tmpl, target, fa, 3);
+        a.align(fa, 100, 0);
+        
+        ia::AlignForwardCompositional<W> b;
+        b.setStoragePolicy(policies[i]);
+        b.prepare(tmpl, target, fc, 3);
+        b.align(fc, 100, 0);
+        
+        ia::AlignInverseCompositional<W> c;
+        c.setStoragePolicy(policies[i]);
+        c.prepare(tmpl, target, ic, 3);
+        c.align(ic, 100, 0);
+        
+        REQUIRE(cv::norm(fa.parameters() - w.parameters(), cv::NORM_INF) < 0.05);
+        REQUIRE(cv::norm(fc.parameters() - w.parameters(), cv::NORM_INF) < 0.05);
+        REQUIRE(cv::norm(ic.parameters() - w.parameters(), cv::NORM_INF) < 0.05);
+    }
+}
+
+TEST_CASE("algorithm-pixel-selection")
+{
+    namespace ia = imagealign;
+    
+    // Selection keeps the strongest pixels up to the budget
+    cv::Mat magnitudes(4, 5, CV_32FC1, cv::Scalar::all(1));
+    magnitudes.at<float>(1, 2) = 5;
+    magnitudes.at<float>(3, 4) = 3;
+    magnitudes.at<float>(0, 0) = 0;
+    
+    cv::Mat mask;
+    ia::detail::selectPixels(magnitudes, ia::PixelSelection(0.1f), mask);
+    REQUIRE(cv::countNonZero(mask) == 2);
+    REQUIRE(mask.at<uchar>(1, 2) != 0);
+    REQUIRE(mask.at<uchar>(3, 4) != 0);
+    
+    ia::detail::selectPixels(magnitudes, ia::PixelSelection(1.f, 0.5f), mask);
+    REQUIRE(cv::countNonZero(mask) == 19);
+    
+    ia::SelectedPixels selected;
+    selected.create(mask);
+    REQUIRE(selected.size() == 19);
+    REQUIRE(selected.rows() == 4);
+    REQUIRE(selected.begin(1) == 4);
+    REQUIRE(selected.col(0) == 1);
+    
+    // Textured patch on a flat background
+    typedef ia::WarpSimilarityD W;
+    
+    cv::Mat target(120, 120, CV_8UC1, cv::Scalar::all(100));
+    cv::Mat patch = target(cv::Rect(40, 45, 24, 20));
+    cv::randu(patch, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(25, 30, 0.05, 1.0));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(60, 60), w);
+    
+    W w0;
+    w0.setParametersInCanonicalRepresentation(W::Traits::ParamType(26, 29, 0.07, 1.01));
+    
+    W dense(w0), sparse(w0);
+    
+    ia::AlignInverseCompositional<W> a;
+    a.prepare(tmpl, target, dense, 2);
+    a.align(dense, 100, 0);
+    
+    ia::AlignInverseCompositional<W> b;
+    b.setPixelSelection(ia::PixelSelection(0.25f, 1.f));
+    b.prepare(tmpl, target, sparse, 2);
+    b.align(sparse, 100, 0);
+    
+    REQUIRE(cv::norm(dense.parameters() - w.parameters(), cv::NORM_INF) < 0.05);
+    REQUIRE(cv::norm(sparse.parameters() - w.parameters(), cv::NORM_INF) < 0.05);
+}
+
+TEST_CASE("algorithm-stats")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityD W;
+    
+    cv::Mat target(120, 120, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(30, 35, 0.05, 1.0));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    W w0;
+    w0.setParametersInCanonicalRepresentation(W::Traits::ParamType(31, 34, 0.07, 1.01));
+    
+    W plain(w0), recorded(w0);
+    
+    ia::AlignInverseCompositional<W> a;
+    a.prepare(tmpl, target, plain, 3);
+    a.align(plain, 50, 0.001);
+    
+    ia::AlignStats stats;
+    ia::AlignInverseCompositional<W> b;
+    b.setStats(&stats);
+    b.prepare(tmpl, target, recorded, 3);
+    b.align(recorded, 50, 0.001);
+    
+    // Recording does not change results
+    REQUIRE(cv::norm(plain.parameters() - recorded.parameters(), cv::NORM_INF) == 0);
+    
+    REQUIRE(stats.levels.size() == 3);
+    REQUIRE(stats.prepareSeconds >= 0);
+    REQUIRE(stats.alignSeconds > 0);
+    
+    int iterations = 0;
+    for (int i = 0; i < 3; ++i) {
+        const ia::LevelStats &l = stats.levels[i];
+        iterations += l.iterations;
+        
+        REQUIRE(l.iterations > 0);
+        REQUIRE(l.acceptedSteps <= l.iterations);
+        REQUIRE(l.stopReason != ia::STOP_SKIPPED);
+        REQUIRE(l.minConstraints > 0);
+        REQUIRE(l.minConstraints <= l.lastConstraints);
+        REQUIRE(l.droppedConstraints() >= 0);
+        REQUIRE(l.accumulateSeconds <= stats.alignSeconds);
+    }
+    
+    REQUIRE(stats.iterations == iterations);
+    REQUIRE(stats.levels[0].templatePixels == 38 * 38);
+    
+    // Levels without budget are skipped, and a single iteration exhausts the budget
+    recorded = w0;
+    b.align(recorded, 1, 0.001);
+    
+    REQUIRE(stats.iterations == 1);
+    REQUIRE(stats.levels[2].stopReason == ia::STOP_SKIPPED);
+    REQUIRE(stats.levels[1].stopReason == ia::STOP_SKIPPED);
+    REQUIRE(stats.levels[0].stopReason == ia::STOP_BUDGET);
+    REQUIRE(stats.levels[0].acceptedSteps == 1);
+}
+
+template< class A, class L, class W >
+W alignOccluded(const cv::Mat &tmpl, const cv::Mat &target, const W &w0, const L &loss)
+{
+    W w(w0);
+    
+    A a;
+    a.setLoss(loss);
+    a.prepare(tmpl, target, w, 3);
+    a.align(w, 100, 0);
+    
+    return w;
+}
+
+TEST_CASE("algorithm-robust-loss")
+{
+    namespace ia = imagealign;
+    
+    // Weights are consistent with the derivative of rho
+    const ia::LossHuber huber(10.f);
+    const ia::LossTukey tukey(20.f);
+    const float errs[] = {-30.f, -15.f, -3.f, 0.5f, 7.f, 12.f, 19.f, 25.f};
+    
+    for (int i = 0; i < 8; ++i) {
+        const float e = errs[i];
+        const float h = 1e-2f;
+        
+        REQUIRE(huber.weight(e) * 2.f * e == Catch::Detail::Approx((huber.rho(e + h) - huber.rho(e - h)) / (2.f * h)).epsilon(1e-2));
+        const float dtukey = (tukey.rho(e + h) - tukey.rho(e - h)) / (2.f * h);
+        REQUIRE(std::abs(tukey.weight(e) * 2.f * e - dtukey) < 1e-2f * (1.f + std::abs(dtukey)));
+    }
+    REQUIRE(ia::LossSquared().rho(3.f) == 9.f);
+    REQUIRE(huber.rho(2.f) == 4.f);
+    
+    // Template partially occluded in target. Huber is not redescending and
+    // may still be dragged off by a bright occluder, so only Tukey is tested.
+    typedef ia::WarpSimilarityD W;
+    
+    cv::Mat target(120, 120, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(30, 35, 0.05, 1.0));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    target(cv::Rect(45, 50, 14, 14)).setTo(cv::Scalar::all(255));
+    
+    W w0;
+    w0.setParametersInCanonicalRepresentation(W::Traits::ParamType(31, 34, 0.07, 1.01));
+    
+    const W fa = alignOccluded< ia::AlignForwardAdditive<W, ia::LossTukey> >(tmpl, target, w0, tukey);
+    const W fc = alignOccluded< ia::AlignForwardCompositional<W, ia::LossTukey> >(tmpl, target, w0, tukey);
+    const W ic = alignOccluded< ia::AlignInverseCompositional<W, ia::LossTukey> >(tmpl, target, w0, tukey);
+    const W ls = alignOccluded< ia::AlignInverseCompositional<W> >(tmpl, target, w0, ia::LossSquared());
+    
+    const double errLs = cv::norm(ls.parameters() - w.parameters(), cv::NORM_INF);
+    const double errIc = cv::norm(ic.parameters() - w.parameters(), cv::NORM_INF);
+    
+    REQUIRE(cv::norm(fa.parameters() - w.parameters(), cv::NORM_INF) < 0.05);
+    REQUIRE(cv::norm(fc.parameters() - w.parameters(), cv::NORM_INF) < 0.05);
+    REQUIRE(errIc < 0.02);
+    REQUIRE(errIc < errLs);
+}
+
+template< class A, class W >
+void testDamping(const cv::Mat &tmpl, const cv::Mat &target, const W &w0, const W &expected)
+{
+    namespace ia = imagealign;
+    typedef typename W::Traits::ScalarType S;
+    
+    W w(w0);
+    
+    A a;
+    a.setDamping(ia::Damping(1e-3f));
+    a.prepare(tmpl, target, w, 3);
+    a.align(w, 100, S(0.0001));
+    
+    REQUIRE(cv::norm(w.parameters() - expected.parameters(), cv::NORM_INF) < 0.02);
+    
+    // Rejected steps are never applied, so the error does not increase with the budget
+    A b;
+    b.setDamping(ia::Damping(1e-3f));
+    b.prepare(tmpl, target, w0, 1);
+    
+    S last = std::numeric_limits<S>::max();
+    for (int i = 1; i <= 15; ++i) {
+        W wi(w0);
+        b.align(wi, i, S(0));
+        
+        REQUIRE(b.lastError() <= last);
+        last = b.lastError();
+    }
+}
+
+TEST_CASE("algorithm-damping")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityD W;
+    
+    cv::Mat target(120, 120, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(30, 35, 0.05, 1.0));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    W w0;
+    w0.setParametersInCanonicalRepresentation(W::Traits::ParamType(33, 32, 0.1, 1.03));
+    
+    testDamping< ia::AlignForwardAdditive<W> >(tmpl, target, w0, w);
+    testDamping< ia::AlignForwardCompositional<W> >(tmpl, target, w0, w);
+    testDamping< ia::AlignInverseCompositional<W> >(tmpl, target, w0, w);
+    testDamping< ia::AlignInverseCompositional<W, ia::LossHuber> >(tmpl, target, w0, w);
+    
+    // Statistics account for rejected steps
+    ia::AlignStats stats;
+    ia::AlignInverseCompositional<W> a;
+    a.setStats(&stats);
+    a.setDamping(ia::Damping(1e-3f));
+    
+    W wa(w0);
+    a.prepare(tmpl, target, wa, 3);
+    a.align(wa, 100, 0.0001);
+    
+    for (int i = 0; i < 3; ++i) {
+        REQUIRE(stats.levels[i].acceptedSteps < stats.levels[i].iterations);
+        REQUIRE(stats.levels[i].stopReason != ia::STOP_DEGENERATE);
+    }
+}
+
+TEST_CASE("algorithm-damping-degenerate")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpTranslationF W;
+    typedef ia::AlignInverseCompositional<W> A;
+    
+    // Intensities vary along the diagonal only, so both translations are linearly dependent
+    cv::Mat target(100, 100, CV_32FC1);
+    for (int y = 0; y < target.rows; ++y) {
+        for (int x = 0; x < target.cols; ++x) {
+            target.at<float>(y, x) = 100.f + 80.f * std::sin(0.2f * float(x + y));
+        }
+    }
+    cv::Mat tmpl = target(cv::Rect(30, 30, 40, 40));
+    
+    W w0;
+    w0.setParameters(W::Traits::ParamType(32.f, 31.f));
+    
+    ia::AlignStats stats;
+    
+    // Gauss-Newton rejects the singular system right away
+    A plain;
+    plain.setStats(&stats);
+    plain.prepare(tmpl, target, w0, 1);
+    
+    W wp(w0);
+    plain.align(wp, 50, 0.0001f);
+    
+    REQUIRE(stats.levels[0].stopReason == ia::STOP_DEGENERATE);
+    REQUIRE(cv::norm(wp.parameters() - w0.parameters(), cv::NORM_INF) == 0);
+    
+    // Damping regularizes the system and recovers the observable diagonal component
+    A damped;
+    damped.setStats(&stats);
+    damped.setDamping(ia::Damping(1e-3f));
+    damped.prepare(tmpl, target, w0, 1);
+    
+    W wd(w0);
+    damped.align(wd, 50, 0.0001f);
+    
+    REQUIRE(stats.levels[0].stopReason != ia::STOP_DEGENERATE);
+    REQUIRE(stats.levels[0].acceptedSteps > 0);
+    REQUIRE(damped.lastConditioning() > 0.f);
+    REQUIRE(std::abs(wd.parameters()(0) + wd.parameters()(1) - 60.f) < 0.05f);
+    REQUIRE(damped.lastError() < 1.f);
+}
+
+template< class A, class W >
+W alignMasked(const cv::Mat &tmpl, const cv::Mat &target, const W &w0, const cv::Mat &templateMask, const cv::Mat &targetMask, ia::AlignStats *stats = 0)
+{
+    W w(w0);
+    
+    A a;
+    a.setStats(stats);
+    a.setTemplateMask(templateMask);
+    a.setTargetMask(targetMask);
+    a.prepare(tmpl, target, w, 3);
+    a.align(w, 100, 0.0001);
+    
+    return w;
+}
+
+template< class A, class W >
+void testMasks(const cv::Mat &tmpl, const cv::Mat &target, const W &w0, const W &expected, double tolerance)
+{
+    namespace ia = imagealign;
+    
+    // Overlay on the top third of the template
+    cv::Mat overlaid = tmpl.clone();
+    overlaid(cv::Rect(0, 0, tmpl.cols, tmpl.rows / 3)).setTo(cv::Scalar::all(255));
+    
+    cv::Mat templateMask(tmpl.size(), CV_8UC1, cv::Scalar::all(255));
+    templateMask(cv::Rect(0, 0, tmpl.cols, tmpl.rows / 3)).setTo(cv::Scalar::all(0));
+    
+    ia::AlignStats stats;
+    W w = alignMasked<A>(overlaid, target, w0, templateMask, cv::Mat(), &stats);
+    
+    REQUIRE(cv::norm(w.parameters() - expected.parameters(), cv::NORM_INF) < tolerance);
+    REQUIRE(stats.levels[0].templatePixels < (tmpl.rows - 2) * (tmpl.cols - 2) * 3 / 4);
+    REQUIRE(stats.levels[0].lastConstraints <= stats.levels[0].templatePixels);
+    
+    // Overlay on target
+    cv::Mat occluded = target.clone();
+    occluded(cv::Rect(45, 50, 14, 14)).setTo(cv::Scalar::all(255));
+    
+    cv::Mat targetMask(target.size(), CV_8UC1, cv::Scalar::all(255));
+    targetMask(cv::Rect(45, 50, 14, 14)).setTo(cv::Scalar::all(0));
+    
+    w = alignMasked<A>(tmpl, occluded, w0, cv::Mat(), targetMask);
+    REQUIRE(cv::norm(w.parameters() - expected.parameters(), cv::NORM_INF) < tolerance);
+    
+    // A mask not matching the bound target is rejected and the previous mask stays in effect
+    A a;
+    a.setTargetMask(targetMask);
+    a.prepare(tmpl, occluded, w0, 3);
+    REQUIRE_THROWS(a.setTargetMask(cv::Mat(target.rows / 2, target.cols / 2, CV_8UC1, cv::Scalar::all(255))));
+    
+    w = w0;
+    a.align(w, 100, 0.0001);
+    REQUIRE(cv::norm(w.parameters() - expected.parameters(), cv::NORM_INF) < tolerance);
+    
+    // Masks keeping all pixels reproduce unmasked results
+    cv::Mat all(tmpl.size(), CV_8UC1, cv::Scalar::all(1));
+    cv::Mat allTarget(target.size(), CV_8UC1, cv::Scalar::all(1));
+    
+    const W plain = alignMasked<A>(tmpl, target, w0, cv::Mat(), cv::Mat());
+    const W masked = alignMasked<A>(tmpl, target, w0, all, allTarget);
+    REQUIRE(cv::norm(plain.parameters() - masked.parameters(), cv::NORM_INF) < 1e-6);
+}
+
+TEST_CASE("algorithm-masks")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityD W;
+    
+    cv::Mat target(120, 120, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(30, 35, 0.05, 1.0));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    W w0;
+    w0.setParametersInCanonicalRepresentation(W::Traits::ParamType(31, 34, 0.07, 1.01));
+    
+    testMasks< ia::AlignForwardAdditive<W> >(tmpl, target, w0, w, 0.01);
+    testMasks< ia::AlignForwardCompositional<W> >(tmpl, target, w0, w, 0.05);
+    testMasks< ia::AlignInverseCompositional<W> >(tmpl, target, w0, w, 0.01);
+    
+    // Masks shrink towards coarser levels, so finite differences never read masked pixels
+    cv::Mat mask(16, 16, CV_8UC1, cv::Scalar::all(255));
+    mask.at<uchar>(8, 8) = 0;
+    
+    std::vector<cv::Mat> levels;
+    ia::detail::buildMaskLevels(mask, 2, 1, levels);
+    
+    REQUIRE(levels.size() == 2);
+    REQUIRE(levels[1].size() == cv::Size(8, 8));
+    REQUIRE(cv::countNonZero(levels[0]) == 16 * 16 - 9);
+    REQUIRE(levels[1].at<uchar>(4, 4) == 0);
+    REQUIRE(levels[1].at<uchar>(3, 3) == 0);
+    REQUIRE(levels[1].at<uchar>(0, 0) == 255);
+}
+
+TEST_CASE("algorithm-target-border")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpTranslationF W;
+    
+    cv::Mat target(100, 100, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    // Left part of the template lies outside the target and does not constrain alignment
+    W w;
+    w.setParameters(W::Traits::ParamType(-10.f, 30.f));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    W w0;
+    w0.setParameters(W::Traits::ParamType(-8.5f, 31.f));
+    
+    ia::AlignStats stats;
+    ia::AlignForwardCompositional<W> a;
+    a.setStats(&stats);
+    a.prepare(tmpl, target, w0, 1);
+    a.align(w0, 50, 0.001f);
+    
+    REQUIRE(stats.levels[0].lastConstraints > 0);
+    REQUIRE(stats.levels[0].lastConstraints < stats.levels[0].templatePixels);
+    REQUIRE(cv::norm(w0.parameters() - w.parameters(), cv::NORM_INF) < 0.05);
+}
+
+TEST_CASE("algorithm-gradient-kernel")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityD W;
+    typedef ia::AlignInverseCompositional<W> A;
+    
+    cv::Mat target(120, 120, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(30, 35, 0.05, 1.0));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(50, 50), w);
+    
+    const int kernels[] = {ia::GRADIENT_CENTRAL, ia::GRADIENT_SOBEL, ia::GRADIENT_SCHARR};
+    for (int k = 0; k < 3; ++k) {
+        W w0;
+        w0.setParametersInCanonicalRepresentation(W::Traits::ParamType(32, 33, 0.08, 1.02));
+        
+        A a;
+        REQUIRE(a.setGradientKernel(kernels[k]).gradientKernel() == kernels[k]);
+        a.prepare(tmpl, target, w0, 2);
+        a.align(w0, 50, 0.0001);
+        
+        REQUIRE(cv::norm(w0.parameters() - w.parameters()) < 0.01);
+    }
+}
+
+TEST_CASE("algorithm-phase-correlation")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat target(128, 128, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    // Translation far outside the convergence range of Lucas-Kanade
+    {
+        typedef ia::WarpTranslationF W;
+        
+        W w;
+        w.setParameters(W::Traits::ParamType(75.f, 60.f));
+        
+        cv::Mat tmpl;
+        ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(32, 32), w);
+        
+        ia::AlignForwardCompositional<W> a;
+        a.prepare(tmpl, target, W(), 2);
+        
+        W w0;
+        a.align(w0, 30, 0.001f);
+        REQUIRE(cv::norm(w0.parameters() - w.parameters()) > 10);
+        
+        W wi;
+        REQUIRE(a.initialize(wi));
+        REQUIRE(cv::norm(wi.parameters() - w.parameters()) < 2.5);
+        
+        a.align(wi, 30, 0.001f);
+        REQUIRE(cv::norm(wi.parameters() - w.parameters()) < 0.05);
+        
+        // Rejected estimates leave the warp unchanged
+        W wr;
+        REQUIRE(!a.initialize(wr, false, 1.0));
+        REQUIRE(cv::norm(wr.parameters()) == 0);
+    }
+    
+    // Rotation and scale from log-polar spectra
+    {
+        typedef ia::WarpSimilarityD W;
+        
+        const double theta = 0.4, scale = 1.1;
+        const cv::Matx22d r = ia::detail::similarityMatrix(theta, scale);
+        const cv::Vec2d t = cv::Vec2d(64, 64) - r * cv::Vec2d(40, 40);
+        
+        W w;
+        w.setParametersInCanonicalRepresentation(W::Traits::ParamType(t[0], t[1], theta, scale));
+        
+        cv::Mat tmpl;
+        ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(80, 80), w);
+        
+        ia::AlignForwardCompositional<W> a;
+        a.prepare(tmpl, target, W(), 2);
+        
+        W wi;
+        REQUIRE(a.initialize(wi, true));
+        
+        W::Traits::ParamType p = wi.parametersInCanonicalRepresentation();
+        REQUIRE(std::abs(p(2) - theta) < 0.05);
+        REQUIRE(std::abs(p(3) - scale) < 0.05);
+        
+        a.align(wi, 50, 0.0001);
+        REQUIRE(cv::norm(wi.parameters() - w.parameters()) < 0.05);
+    }
+}
+
+template< class A, class W >
+void testSerialization(const cv::Mat &tmpl, const cv::Mat &target, const W &w0, const imagealign::StoragePolicy &policy, const cv::Mat &mask)
+{
+    A a;
+    a.setStoragePolicy(policy);
+    a.setTemplateMask(mask);
+    a.prepare(tmpl, w0, 3);
+    
+    // Catalog of two records, the second prepared from a shifted template
+    cv::Mat shifted = tmpl.clone();
+    for (int y = 0; y < tmpl.rows; ++y)
+        for (int x = 0; x < tmpl.cols; ++x)
+            shifted.at<uchar>(y, x) = tmpl.at<uchar>(y, std::min<int>(x + 1, tmpl.cols - 1));
+    
+    A b;
+    b.prepare(shifted, w0, 3);
+    
+    std::vector<uchar> catalog;
+    a.serialize(catalog);
+    b.serialize(catalog);
+    
+    A c, d;
+    const size_t first = c.deserialize(&catalog[0], catalog.size());
+    REQUIRE(first % imagealign::detail::STATE_ALIGNMENT == 0);
+    REQUIRE(d.deserialize(&catalog[first], catalog.size() - first) == catalog.size() - first);
+    
+    W wa(w0), wb(w0), wc(w0), wd(w0);
+    a.setTarget(target);
+    a.align(wa, 50, 0);
+    b.setTarget(target);
+    b.align(wb, 50, 0);
+    c.setTarget(target);
+    c.align(wc, 50, 0);
+    d.setTarget(target);
+    d.align(wd, 50, 0);
+    
+    REQUIRE(cv::norm(wa.parameters() - wc.parameters(), cv::NORM_INF) == 0);
+    REQUIRE(cv::norm(wb.parameters() - wd.parameters(), cv::NORM_INF) == 0);
+    
+    // Records hold all template levels, also while a shallower target is bound
+    A shallow;
+    shallow.setStoragePolicy(policy);
+    shallow.setTemplateMask(mask);
+    shallow.prepare(tmpl, w0, 3);
+    shallow.setTarget(target(cv::Rect(0, 0, 12, 12)));
+    REQUIRE(shallow.numLevels() == 1);
+    
+    std::vector<uchar> shallowRecord;
+    shallow.serialize(shallowRecord);
+    
+    A restored;
+    REQUIRE(restored.deserialize(&shallowRecord[0], shallowRecord.size()) == shallowRecord.size());
+    
+    W wr(w0);
+    restored.setTarget(target);
+    restored.align(wr, 50, 0);
+    REQUIRE(cv::norm(wa.parameters() - wr.parameters(), cv::NORM_INF) == 0);
+    
+    // Restored from a read-only mapping of the catalog
+    const char *path = "imagealign_state.bin";
+    {
+        std::ofstream f(path, std::ios::binary);
+        f.write((const char*)&catalog[0], catalog.size());
+    }
+    
+    imagealign::MappedFile file;
+    REQUIRE(file.open(path));
+    REQUIRE(file.size() == catalog.size());
+    
+    A e;
+    e.deserialize(file.data(), file.size());
+    
+    W we(w0);
+    e.setTarget(target);
+    e.align(we, 50, 0);
+    REQUIRE(cv::norm(wa.parameters() - we.parameters(), cv::NORM_INF) == 0);
+    
+    // Preparing again never writes into the mapping, storage policy and mask are restored
+    e.prepare(tmpl, w0, 3);
+    e.setTarget(target);
+    we = w0;
+    e.align(we, 50, 0);
+    REQUIRE(cv::norm(wa.parameters() - we.parameters(), cv::NORM_INF) == 0);
+    
+    file.close();
+    std::remove(path);
+    
+    // Records of other algorithms, versions or corrupted records are rejected
+    std::vector<uchar> corrupted(catalog.begin(), catalog.begin() + first);
+    corrupted[0] ^= 1;
+    REQUIRE_THROWS(e.deserialize(&corrupted[0], corrupted.size()));
+    REQUIRE_THROWS(e.deserialize(&catalog[0], first / 2));
+    
+    imagealign::AlignForwardAdditive<W> other;
+    REQUIRE_THROWS(other.deserialize(&catalog[0], catalog.size()));
+}
+
+TEST_CASE("algorithm-serialization")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityD W;
+    
+    cv::Mat target(120, 120, CV_8UC1);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(30, 35, 0.05, 1.0));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    
+    W w0;
+    w0.setParametersInCanonicalRepresentation(W::Traits::ParamType(31, 34, 0.07, 1.01));
+    
+    cv::Mat mask(tmpl.size(), CV_8UC1, cv::Scalar::all(255));
+    mask(cv::Rect(5, 5, 10, 10)).setTo(cv::Scalar::all(0));
+    
+    const ia::StoragePolicy reduced(ia::STORAGE_UINT16, ia::STORAGE_FLOAT16);
+    
+    testSerialization< ia::AlignInverseCompositional<W> >(tmpl, target, w0, ia::StoragePolicy(), cv::Mat());
+    testSerialization< ia::AlignInverseCompositional<W> >(tmpl, target, w0, reduced, mask);
+    testSerialization< ia::AlignForwardCompositional<W> >(tmpl, target, w0, ia::StoragePolicy(), cv::Mat());
+    testSerialization< ia::AlignForwardCompositional<W> >(tmpl, target, w0, reduced, mask);
+}
+
+TEST_CASE("algorithm-multi-channel")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityD W;
+    typedef ia::AlignInverseCompositional<W> A;
+    
+    cv::Mat target(120, 120, CV_8UC3);
+    cv::randu(target, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(target, target, cv::Size(5,5));
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(30, 35, 0.05, 1.0));
+    
+    cv::Mat tmpl;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(target, tmpl, cv::Size(40, 40), w);
+    REQUIRE(tmpl.type() == CV_8UC3);
+    
+    W w0;
+    w0.setParametersInCanonicalRepresentation(W::Traits::ParamType(31, 34, 0.07, 1.01));
+    
+    // All channels are stacked into a single system
+    std::vector<cv::Mat> channels;
+    cv::split(tmpl, channels);
+    
+    W wc(w0), wg(w0);
+    
+    ia::AlignStats stats;
+    
+    A a;
+    a.setStats(&stats);
+    a.prepare(tmpl, target, wc, 3);
+    REQUIRE(a.channels() == 3);
+    a.align(wc, 100, 0);
+    REQUIRE(cv::norm(wc.parameters() - w.parameters(), cv::NORM_INF) < 0.01);
+    
+    // Pixels and constraints are both counted per channel
+    REQUIRE(stats.levels[0].templatePixels == 3 * 38 * 38);
+    for (size_t i = 0; i < stats.levels.size(); ++i) {
+        REQUIRE(stats.levels[i].lastConstraints > 0);
+        REQUIRE(stats.levels[i].droppedConstraints() >= 0);
+    }
+    
+    // Reduced precision tables and pixel selection
+    W ws(w0);
+    
+    A b;
+    b.setStoragePolicy(ia::StoragePolicy(ia::STORAGE_UINT8, ia::STORAGE_FLOAT16));
+    b.setPixelSelection(ia::PixelSelection(0.5f));
+    b.prepare(tmpl, target, ws, 3);
+    b.align(ws, 100, 0);
+    REQUIRE(cv::norm(ws.parameters() - w.parameters(), cv::NORM_INF) < 0.05);
+    
+    // Targets need to match the channels of the template
+    std::vector<cv::Mat> targetChannels;
+    cv::split(target, targetChannels);
+    REQUIRE_THROWS(a.setTarget(targetChannels[0]));
+    
+    // Algorithms without multi-channel support reject color templates
+    ia::AlignForwardCompositional<W> fc;
+    REQUIRE_THROWS(fc.prepare(tmpl, target, wg, 3));
+}
+
+TEST_CASE("algorithm-dense-flow")
+{
+    namespace ia = imagealign;
+    
+    cv::RNG rng(5);
+    cv::Mat tmpl(120, 160, CV_8UC1);
+    rng.fill(tmpl, cv::RNG::UNIFORM, 0, 255);
+    cv::blur(tmpl, tmpl, cv::Size(5,5));
+    
+    // Textureless region around the first cell
+    tmpl(cv::Rect(0, 0, 40, 40)).setTo(cv::Scalar::all(128));
+    
+    // Target moved by constant translation
+    ia::WarpTranslationF m;
+    m.setParameters(ia::WarpTranslationF::Traits::ParamType(1.7f, -2.3f));
+    
+    cv::Mat target;
+    ia::warpImage<uchar, ia::SAMPLE_BILINEAR>(tmpl, target, tmpl.size(), m);
+    
+    ia::ImagePyramid targetPyramid;
+    targetPyramid.create(target, 3);
+    
+    ia::DenseFlow flow;
+    flow.prepare(tmpl, 16, 7, 3);
+    
+    REQUIRE(flow.numLevels() == 3);
+    REQUIRE(flow.gridSize() == cv::Size(10, 7));
+    REQUIRE(flow.cellCenter(1, 2).x == 40.f);
+    REQUIRE(flow.cellCenter(1, 2).y == 24.f);
+    
+    cv::Mat f;
+    flow.align(targetPyramid, f, 30, 0.001f);
+    
+    REQUIRE(f.size() == flow.gridSize());
+    REQUIRE(flow.status().at<uchar>(0, 0) == 0);
+    
+    // Windows away from the textureless region and the border of the target
+    for (int r = 1; r < flow.gridSize().height - 1; ++r) {
+        for (int c = 3; c < flow.gridSize().width - 1; ++c) {
+            REQUIRE(flow.status().at<uchar>(r, c) != 0);
+            
+            const cv::Point2f d = f.at<cv::Point2f>(r, c);
+            REQUIRE(std::abs(d.x + 1.7f) < 0.05f);
+            REQUIRE(std::abs(d.y - 2.3f) < 0.05f);
+        }
+    }
+    
+    // Results are used as initial guess
+    flow.align(targetPyramid, f, 2, 0.001f);
+    
+    const cv::Point2f d = f.at<cv::Point2f>(3, 5);
+    REQUIRE(std::abs(d.x + 1.7f) < 0.05f);
+    REQUIRE(std::abs(d.y - 2.3f) < 0.05f);
+}
+
+#ifdef IA_HAS_CXX11
+
+TEST_CASE("algorithm-streaming-tracker")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpTranslationF W;
+    typedef ia::AlignInverseCompositional<W> A;
+    
+    cv::Mat scene(140, 140, CV_8UC1);
+    cv::randu(scene, cv::Scalar::all(0), cv::Scalar::all(255));
+    cv::blur(scene, scene, cv::Size(5,5));
+    
+    // Content moves by one pixel in x and y per frame
+    const int numFrames = 12;
+    std::vector<cv::Mat> frames;
+    for (int i = 0; i < numFrames; ++i) {
+        frames.push_back(scene(cv::Rect(20 - i, 20 - i, 100, 100)).clone());
+    }
+    
+    std::vector<cv::Rect> rois;
+    rois.push_back(cv::Rect(20, 20, 15, 15));
+    rois.push_back(cv::Rect(50, 30, 15, 15));
+    rois.push_back(cv::Rect(30, 50, 15, 15));
+    
+    std::vector<W> warps(rois.size());
+    for (size_t i = 0; i < rois.size(); ++i) {
+        warps[i].setParameters(W::Traits::ParamType(float(rois[i].x), float(rois[i].y)));
+    }
+    
+    ia::MultiTemplateTracker<A> tracker;
+    tracker.prepare(frames[0], rois, warps, 2);
+    
+    // Serial reference feeding warps of previous frame
+    std::vector< std::vector<W> > expected;
+    {
+        ia::MultiTemplateTracker<A> serial;
+        serial.prepare(frames[0], rois, warps, 2);
+        
+        std::vector<W> w(warps);
+        for (int i = 1; i < numFrames; ++i) {
+            ia::ImagePyramid p;
+            p.create(frames[i], 2);
+            serial.align(p, w, 30, 0.001f);
+            expected.push_back(w);
+        }
+    }
+    
+    ia::StreamingTracker<A> stream(tracker, 2);
+    stream.start(warps, 2, 30, 0.001f);
+    
+    std::vector< ia::StreamingResult<W> > results;
+    ia::StreamingResult<W> r;
+    
+    for (int i = 1; i < numFrames; ++i) {
+        REQUIRE(stream.push(frames[i]));
+        
+        if (stream.inFlight() > 2) {
+            REQUIRE(stream.pop(r));
+            results.push_back(r);
+        }
+    }
+    
+    stream.finish();
+    REQUIRE(!stream.push(frames[0]));
+    
+    while (stream.pop(r)) {
+        results.push_back(r);
+    }
+    
+    REQUIRE(results.size() == expected.size());
+    REQUIRE(stream.inFlight() == 0);
+    
+    for (size_t f = 0; f < results.size(); ++f) {
+        REQUIRE(results[f].frame == (int64)f);
+        REQUIRE(results[f].latencySeconds >= 0);
+        
+        for (size_t i = 0; i < rois.size(); ++i) {
+            REQUIRE(results[f].status[i] == ia::TRACK_OK);
+            REQUIRE(cv::norm(results[f].warps[i].parameters() - expected[f][i].parameters(), cv::NORM_INF) == 0);
+        }
+    }
+    
+    // Motion is tracked over all frames
+    for (size_t i = 0; i < rois.size(); ++i) {
+        const W::Traits::ParamType p = results.back().warps[i].parameters();
+        REQUIRE(std::abs(p(0) - float(rois[i].x + numFrames - 1)) < 0.05f);
+        REQUIRE(std::abs(p(1) - float(rois[i].y + numFrames - 1)) < 0.05f);
+    }
+    
+    // Destroying a running stream does not block
+    {
+        ia::StreamingTracker<A> aborted(tracker, 1);
+        aborted.start(warps, 2, 30, 0.001f);
+        aborted.push(frames[1]);
+        aborted.push(frames[2]);
+    }
+}
+
+#endif
@@ -0,0 +1,323 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "catch.hpp"
+
+#include <imagealign/image_pyramid.h>
+#include <imagealign/gradient_pyramid.h>
+#include <imagealign/gradient.h>
+
+namespace ia = imagealign;
+
+TEST_CASE("image-pyramid-matches-pyrdown")
+{
+    cv::Mat img(97, 130, CV_8UC1);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    cv::Mat imgf;
+    img.convertTo(imgf, CV_32F);
+    
+    std::vector<cv::Mat> expected(4);
+    expected[0] = imgf;
+    for (int i = 1; i < 4; ++i) {
+        cv::pyrDown(expected[i-1], expected[i]);
+    }
+    
+    ia::SerialExecutor serial;
+    ia::ImagePyramid fromUchar, fromFloat, parallel;
+    fromUchar.create(img, 4, serial);
+    fromFloat.create(imgf, 4, serial);
+    parallel.create(img, 4, ia::OpenCVExecutor());
+    
+    REQUIRE(fromUchar.numLevels() == 4);
+    
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(fromUchar[i].type() == CV_32FC1);
+        REQUIRE(fromUchar[i].size() == expected[i].size());
+        REQUIRE(cv::norm(fromUchar[i], expected[i], cv::NORM_INF) < 1e-3);
+        REQUIRE(cv::norm(fromFloat[i], expected[i], cv::NORM_INF) < 1e-3);
+        REQUIRE(cv::norm(parallel[i], fromUchar[i], cv::NORM_INF) == 0);
+    }
+}
+
+TEST_CASE("image-pyramid-reuses-buffers")
+{
+    cv::Mat img(64, 64, CV_8UC1);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    ia::ImagePyramid p;
+    p.create(img, 3);
+    
+    const uchar *data0 = p[0].data;
+    const uchar *data2 = p[2].data;
+    
+    cv::Mat img2(64, 64, CV_8UC1);
+    cv::randu(img2, cv::Scalar::all(0), cv::Scalar::all(255));
+    p.create(img2, 3);
+    
+    REQUIRE(p[0].data == data0);
+    REQUIRE(p[2].data == data2);
+    REQUIRE(p[0].at<float>(10, 10) == float(img2.at<uchar>(10, 10)));
+}
+
+TEST_CASE("image-pyramid-extend")
+{
+    cv::Mat img(80, 90, CV_8UC1);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    ia::ImagePyramid eager, lazy;
+    eager.create(img, 4);
+    lazy.create(img, 1);
+    
+    REQUIRE(lazy.numLevels() == 1);
+    
+    lazy.extend(4);
+    REQUIRE(lazy.numLevels() == 4);
+    
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(cv::norm(eager[i], lazy[i], cv::NORM_INF) == 0);
+    }
+}
+
+TEST_CASE("gradient-pyramid-matches-gradient")
+{
+    cv::Mat img(50, 61, CV_8UC1);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    ia::ImagePyramid pyr;
+    pyr.create(img, 2);
+    
+    ia::GradientPyramid gpyr;
+    gpyr.create(pyr, ia::SerialExecutor());
+    
+    REQUIRE(gpyr.numLevels() == 2);
+    
+    ia::Sampler<ia::SAMPLE_BILINEAR> s;
+    
+    for (int i = 0; i < 2; ++i) {
+        const cv::Mat ig = gpyr[i];
+        REQUIRE(ig.type() == CV_32FC3);
+        REQUIRE(ig.size() == pyr[i].size());
+        
+        // Sampling interleaved buffer agrees with sampling intensities and differencing
+        std::vector<float> xs, ys;
+        for (float y = 1.f; y < float(ig.rows - 2); y += 0.7f) {
+            for (float x = 1.f; x < float(ig.cols - 2); x += 0.9f) {
+                xs.push_back(x);
+                ys.push_back(y);
+            }
+        }
+        
+        const int n = (int)xs.size();
+        std::vector<float> intensities(n), gx(n), gy(n);
+        ia::detail::sampleIntensityGradient(ig, &xs[0], &ys[0], n, &intensities[0], &gx[0], &gy[0]);
+        
+        for (int k = 0; k < n; ++k) {
+            float ex, ey;
+            ia::gradient<float, ia::SAMPLE_BILINEAR>(pyr[i], xs[k], ys[k], ex, ey, s);
+            
+            REQUIRE(intensities[k] == s.sample<float>(pyr[i], xs[k], ys[k]));
+            REQUIRE(gx[k] == Catch::Detail::Approx(ex).epsilon(1e-4));
+            REQUIRE(gy[k] == Catch::Detail::Approx(ey).epsilon(1e-4));
+        }
+    }
+}
+
+/** Largest absolute difference of equally sized single precision images. */
+static float maxAbsDifference(const cv::Mat &a, const cv::Mat &b)
+{
+    float d = 0.f;
+    for (int y = 0; y < a.rows; ++y) {
+        for (int x = 0; x < a.cols; ++x) {
+            d = std::max<float>(d, std::abs(a.at<float>(y, x) - b.at<float>(y, x)));
+        }
+    }
+    return d;
+}
+
+TEST_CASE("gradient-images")
+{
+    cv::Mat img8(41, 37, CV_8UC1);
+    cv::randu(img8, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    cv::Mat img;
+    img8.convertTo(img, CV_32F);
+    
+    cv::Mat gx, gy;
+    ia::gradientImages(img, gx, gy, ia::GRADIENT_CENTRAL, ia::SerialExecutor());
+    REQUIRE(gx.type() == CV_32FC1);
+    REQUIRE(gy.size() == img.size());
+    
+    // Inner pixels match per pixel approximation exactly
+    ia::Sampler<ia::SAMPLE_NEAREST> s;
+    for (int y = 1; y < img.rows - 1; ++y) {
+        for (int x = 1; x < img.cols - 1; ++x) {
+            float ex, ey;
+            ia::gradient<float, ia::SAMPLE_NEAREST>(img, float(x), float(y), ex, ey, s);
+            REQUIRE(gx.at<float>(y, x) == ex);
+            REQUIRE(gy.at<float>(y, x) == ey);
+        }
+    }
+    
+    // All pixels match interleaved gradient levels
+    ia::ImagePyramid pyr;
+    pyr.create(img8, 1);
+    
+    ia::GradientPyramid gpyr;
+    gpyr.create(pyr);
+    
+    std::vector<cv::Mat> channels;
+    cv::split(gpyr[0], channels);
+    REQUIRE(maxAbsDifference(channels[1], gx) == 0.f);
+    REQUIRE(maxAbsDifference(channels[2], gy) == 0.f);
+    
+    // Smoothing kernels match their OpenCV counterparts normalized to unit gain
+    cv::Mat ex, ey;
+    ia::gradientImages(img, gx, gy, ia::GRADIENT_SOBEL);
+    cv::Sobel(img, ex, CV_32F, 1, 0, 3, 1. / 8., 0, cv::BORDER_REFLECT_101);
+    cv::Sobel(img, ey, CV_32F, 0, 1, 3, 1. / 8., 0, cv::BORDER_REFLECT_101);
+    REQUIRE(maxAbsDifference(gx, ex) < 1e-3f);
+    REQUIRE(maxAbsDifference(gy, ey) < 1e-3f);
+    
+    ia::gradientImages(img, gx, gy, ia::GRADIENT_SCHARR);
+    cv::Scharr(img, ex, CV_32F, 1, 0, 1. / 32., 0, cv::BORDER_REFLECT_101);
+    cv::Scharr(img, ey, CV_32F, 0, 1, 1. / 32., 0, cv::BORDER_REFLECT_101);
+    REQUIRE(maxAbsDifference(gx, ex) < 1e-3f);
+    REQUIRE(maxAbsDifference(gy, ey) < 1e-3f);
+    
+    // Degenerate sizes
+    cv::Mat tiny(1, 2, CV_32FC1, cv::Scalar::all(1));
+    ia::gradientImages(tiny, gx, gy, ia::GRADIENT_SCHARR);
+    REQUIRE(cv::countNonZero(gx) == 0);
+    REQUIRE(cv::countNonZero(gy) == 0);
+}
+
+TEST_CASE("image-pyramid-storage")
+{
+    // Half precision conversion round trips representable values and rounds to nearest
+    REQUIRE(ia::detail::halfToFloat(ia::detail::floatToHalf(1.f)) == 1.f);
+    REQUIRE(ia::detail::halfToFloat(ia::detail::floatToHalf(-2.5f)) == -2.5f);
+    REQUIRE(ia::detail::halfToFloat(ia::detail::floatToHalf(65504.f)) == 65504.f);
+    REQUIRE(ia::detail::halfToFloat(ia::detail::floatToHalf(1e-7f)) == Catch::Detail::Approx(1e-7f).epsilon(0.05));
+    REQUIRE(ia::detail::halfToFloat(ia::detail::floatToHalf(1.f + 1.f / 4096.f)) == 1.f);
+    
+    cv::Mat img(80, 90, CV_8UC1);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    ia::ImagePyramid reference;
+    reference.create(img, 3);
+    
+    const int storages[] = {ia::STORAGE_FLOAT16, ia::STORAGE_UINT16, ia::STORAGE_UINT8};
+    const float tolerances[] = {0.125f, 0.5f / 256.f, 0.5f};
+    
+    for (int s = 0; s < 3; ++s) {
+        ia::ImagePyramid pyr;
+        pyr.setStorage(storages[s]);
+        pyr.create(img, 2);
+        pyr.extend(3);
+        
+        REQUIRE(pyr.numLevels() == 3);
+        REQUIRE(pyr.memoryUsage() * 2 <= reference.memoryUsage());
+        
+        for (int i = 0; i < 3; ++i) {
+            REQUIRE(pyr[i].depth() == ia::detail::storageDepth(storages[s]));
+            
+            cv::Mat f;
+            ia::detail::convertFromStorage(pyr[i], f);
+            
+            // Coarser levels are built from single precision finer levels, each level is rounded once
+            REQUIRE(cv::norm(f, reference[i], cv::NORM_INF) <= tolerances[s]);
+        }
+        
+        std::vector<float> buf(img.cols);
+        REQUIRE(ia::detail::loadRow(pyr[0], 5, &buf[0])[7] == Catch::Detail::Approx(reference[0].at<float>(5, 7)).epsilon(1e-3));
+    }
+}
+
+TEST_CASE("image-pyramid-storage-extend")
+{
+    cv::Mat img(80, 90, CV_8UC1);
+    cv::randu(img, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    const int storages[] = {ia::STORAGE_FLOAT16, ia::STORAGE_UINT16, ia::STORAGE_UINT8};
+    
+    for (int s = 0; s < 3; ++s) {
+        ia::ImagePyramid eager, lazy;
+        eager.setStorage(storages[s]);
+        eager.create(img, 4);
+        
+        // Templates materialize one level at a time
+        lazy.setStorage(storages[s]);
+        lazy.create(img, 1);
+        lazy.extend(2);
+        lazy.extend(4);
+        
+        REQUIRE(lazy.numLevels() == 4);
+        
+        for (int i = 0; i < 4; ++i) {
+            REQUIRE(lazy[i].type() == eager[i].type());
+            REQUIRE(cv::norm(eager[i], lazy[i], cv::NORM_INF) == 0);
+        }
+    }
+}
+
+TEST_CASE("image-pyramid-multi-channel")
+{
+    cv::Mat img(61, 83, CV_8UC3);
+    cv::RNG(7).fill(img, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    std::vector<cv::Mat> channels;
+    cv::split(img, channels);
+    
+    ia::ImagePyramid color, half;
+    color.create(img, 3);
+    half.setStorage(ia::STORAGE_FLOAT16);
+    half.create(img, 2);
+    half.extend(3);
+    
+    for (int c = 0; c < 3; ++c) {
+        ia::ImagePyramid single;
+        single.create(channels[c], 3);
+        
+        for (int i = 0; i < 3; ++i) {
+            REQUIRE(color[i].type() == CV_32FC3);
+            REQUIRE(half[i].channels() == 3);
+            
+            std::vector<cv::Mat> levelChannels;
+            cv::split(color[i], levelChannels);
+            REQUIRE(maxAbsDifference(levelChannels[c], single[i]) == 0.f);
+            
+            cv::Mat f;
+            ia::detail::convertFromStorage(half[i], f);
+            cv::split(f, levelChannels);
+            REQUIRE(maxAbsDifference(levelChannels[c], single[i]) <= 0.125f * float(i + 1));
+        }
+        
+        // Gradients of channels are computed independently
+        cv::Mat gx, gy, ex, ey;
+        ia::gradientImages(color[1], gx, gy, ia::GRADIENT_SOBEL);
+        ia::gradientImages(single[1], ex, ey, ia::GRADIENT_SOBEL);
+        
+        std::vector<cv::Mat> gxs, gys;
+        cv::split(gx, gxs);
+        cv::split(gy, gys);
+        REQUIRE(maxAbsDifference(gxs[c], ex) == 0.f);
+        REQUIRE(maxAbsDifference(gys[c], ey) == 0.f);
+    }
+}
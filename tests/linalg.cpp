@@ -0,0 +1,88 @@
+/**
+ This file is part of Image Alignment.
+ 
+ Copyright Christoph Heindl 2015
+ 
+ Image Alignment is free software: you can redistribute it and/or modify
+ it under the terms of the GNU General Public License as published by
+ the Free Software Foundation, either version 3 of the License, or
+ (at your option) any later version.
+ 
+ Image Alignment is distributed in the hope that it will be useful,
+ but WITHOUT ANY WARRANTY; without even the implied warranty of
+ MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ GNU General Public License for more details.
+ 
+ You should have received a copy of the GNU General Public License
+ along with Image Alignment.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include "catch.hpp"
+
+#include <imagealign/linalg.h>
+
+namespace ia = imagealign;
+
+template<int N>
+void testSolveLDLT()
+{
+    cv::Mat r(2 * N + 1, N, CV_64FC1);
+    cv::randu(r, cv::Scalar::all(-1), cv::Scalar::all(1));
+    
+    const cv::Matx<double, N, N> a(r.ptr<double>(0));
+    
+    // Symmetric positive definite
+    cv::Matx<double, N, N> h = a.t() * a + cv::Matx<double, N, N>::eye() * 0.1;
+    
+    const cv::Matx<double, N, 1> b(r.ptr<double>(2 * N));
+    
+    // Lower triangle is not read
+    cv::Matx<double, N, N> upper = h;
+    for (int i = 1; i < N; ++i) {
+        for (int j = 0; j < i; ++j) {
+            upper(i, j) = 1000.0;
+        }
+    }
+    
+    cv::Matx<double, N, N> ldlt;
+    cv::Matx<double, N, 1> x;
+    
+    const double conditioning = ia::detail::factorizeLDLT<double>(upper, ldlt);
+    ia::detail::solveLDLT<double>(ldlt, b, x);
+    
+    REQUIRE(conditioning > 0);
+    REQUIRE(conditioning <= 1);
+    REQUIRE(cv::norm(h * x - b, cv::NORM_INF) < 1e-9);
+    
+    // Same for run-time sized matrices, the fixed-size kernel gives identical results
+    cv::Mat ldltMat, xMat;
+    ia::detail::factorizeLDLT<double>(cv::Mat(upper), ldltMat);
+    ia::detail::solveLDLT<double>(ldltMat, cv::Mat(b), xMat);
+    
+    REQUIRE(cv::norm(cv::Mat(x), xMat, cv::NORM_INF) == 0);
+}
+
+TEST_CASE("linalg-ldlt")
+{
+    testSolveLDLT<2>();
+    testSolveLDLT<3>();
+    testSolveLDLT<4>();
+    testSolveLDLT<6>();
+    testSolveLDLT<8>();
+    
+    // Degenerate systems report zero conditioning and solve to zero in dependent directions
+    cv::Matx22d h(1, 1,
+                  1, 1);
+    cv::Matx21d b(1, 1);
+    
+    cv::Matx22d ldlt;
+    cv::Matx21d x;
+    
+    REQUIRE(ia::detail::factorizeLDLT<double>(h, ldlt) == 0);
+    ia::detail::solveLDLT<double>(ldlt, b, x);
+    
+    REQUIRE(x(0) == 1);
+    REQUIRE(x(1) == 0);
+    
+    REQUIRE(ia::detail::factorizeLDLT<double>(cv::Matx22d::zeros(), ldlt) == 0);
+}
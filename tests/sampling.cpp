@@ -20,6 +20,9 @@ along with AMM.  If not, see <http://www.gnu.org/licenses/>.
 
 #include "catch.hpp"
 #include <imagealign/sampling.h>
+#include <limits>
+#include <cmath>
+#include <cstdlib>
 
 
 TEST_CASE("sampling-bilinear")
@@ -74,4 +77,183 @@ TEST_CASE("sampling-nearest")
     REQUIRE(s.sample<uchar>(img, PointType(0.5, 0.5)) == 0);
     REQUIRE(s.sample<uchar>(img, PointType(1.1, 0.0)) == 64);
 
-}
\ No newline at end of file
+}
+TEST_CASE("sampling-bilinear-batched")
+{
+    namespace ia = imagealign;
+    
+    ia::Sampler<ia::SAMPLE_BILINEAR> s;
+    
+    cv::Mat img8(40, 50, CV_8UC1);
+    cv::randu(img8, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    cv::Mat img;
+    img8.convertTo(img, CV_32F);
+    
+    // Interior locations and locations requiring border handling
+    const int n = 203;
+    std::vector<float> xs(n), ys(n);
+    for (int i = 0; i < n; ++i) {
+        const bool interior = (i / 64) % 2 == 0;
+        xs[i] = interior ? cv::theRNG().uniform(0.f, 48.9f) : cv::theRNG().uniform(-3.f, 52.f);
+        ys[i] = interior ? cv::theRNG().uniform(0.f, 38.9f) : cv::theRNG().uniform(-3.f, 42.f);
+    }
+    
+    std::vector<float> batched(n);
+    s.sample<float>(img, &xs[0], &ys[0], n, &batched[0]);
+    
+    std::vector<uchar> batched8(n);
+    s.sample<uchar>(img8, &xs[0], &ys[0], n, &batched8[0]);
+    
+    std::vector<double> xsd(xs.begin(), xs.end()), ysd(ys.begin(), ys.end());
+    std::vector<float> batchedd(n);
+    s.sample<float>(img, &xsd[0], &ysd[0], n, &batchedd[0]);
+    
+    // Kernels agree up to rounding, scalar code may be contracted into fused multiply-adds
+    for (int i = 0; i < n; ++i) {
+        REQUIRE(std::abs(batched[i] - s.sample<float>(img, xs[i], ys[i])) < 1e-3f);
+        REQUIRE(std::abs(int(batched8[i]) - int(s.sample<uchar>(img8, xs[i], ys[i]))) <= 1);
+        REQUIRE(std::abs(batchedd[i] - s.sample<float>(img, xsd[i], ysd[i])) < 1e-3f);
+    }
+}
+
+TEST_CASE("sampling-interior-test")
+{
+    namespace ia = imagealign;
+    
+    cv::Mat img(40, 50, CV_32FC1, cv::Scalar::all(0));
+    
+    std::vector<float> xs(ia::detail::SAMPLE_BLOCK_SIZE, 10.f), ys(ia::detail::SAMPLE_BLOCK_SIZE, 10.f);
+    REQUIRE(ia::detail::spanIsInterior(img, &xs[0], &ys[0], (int)xs.size()));
+    
+    // Non-finite coordinates after the first location force border handling
+    xs[5] = std::numeric_limits<float>::quiet_NaN();
+    REQUIRE(!ia::detail::spanIsInterior(img, &xs[0], &ys[0], (int)xs.size()));
+    
+    xs[5] = 10.f;
+    ys[17] = std::numeric_limits<float>::quiet_NaN();
+    REQUIRE(!ia::detail::spanIsInterior(img, &xs[0], &ys[0], (int)xs.size()));
+    
+    ys[17] = std::numeric_limits<float>::infinity();
+    REQUIRE(!ia::detail::spanIsInterior(img, &xs[0], &ys[0], (int)xs.size()));
+}
+
+TEST_CASE("sampling-far-outside")
+{
+    namespace ia = imagealign;
+    
+    cv::RNG rng(3);
+    cv::Mat img(40, 50, CV_32FC3);
+    rng.fill(img, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    std::vector<cv::Mat> channels;
+    cv::split(img, channels);
+    
+    ia::Sampler<ia::SAMPLE_BILINEAR> bilinear;
+    ia::Sampler<ia::SAMPLE_NEAREST> nearest;
+    
+    // Reflection repeats every 2 * (len - 1) pixels, far locations match their folded counterparts
+    const float px = 2.f * 49.f, py = 2.f * 39.f;
+    const float near[] = {10.25f, -2.5f, 51.75f};
+    
+    std::vector<float> xs, ys;
+    for (int i = 0; i < 3; ++i) {
+        xs.push_back(near[i] + 1000.f * px); ys.push_back(17.5f);
+        xs.push_back(near[i] - 1000.f * px); ys.push_back(17.5f);
+        xs.push_back(3.5f);                  ys.push_back(near[i] - 70.f * py);
+    }
+    
+    std::vector<float> b(xs.size() * 3), nn(xs.size() * 3);
+    bilinear.sample<float>(img, &xs[0], &ys[0], (int)xs.size(), &b[0]);
+    nearest.sample<float>(img, &xs[0], &ys[0], (int)xs.size(), &nn[0]);
+    
+    for (size_t i = 0; i < xs.size(); ++i) {
+        const float x = (i % 3 == 2) ? 3.5f : near[i / 3];
+        const float y = (i % 3 == 2) ? near[i / 3] : 17.5f;
+        
+        for (int c = 0; c < 3; ++c) {
+            REQUIRE(bilinear.sample<float>(channels[c], xs[i], ys[i]) == bilinear.sample<float>(channels[c], x, y));
+            REQUIRE(nearest.sample<float>(channels[c], xs[i], ys[i]) == nearest.sample<float>(channels[c], x, y));
+            REQUIRE(b[i * 3 + c] == bilinear.sample<float>(channels[c], x, y));
+            REQUIRE(nn[i * 3 + c] == nearest.sample<float>(channels[c], x, y));
+        }
+    }
+    
+    // Folding keeps the taps of BORDER_REFLECT_101, x = -2.5 interpolates columns 3 and 2
+    const cv::Mat &c0 = channels[0];
+    const float reflected = (c0.at<float>(17, 3) * 0.5f + c0.at<float>(17, 2) * 0.5f) * 0.5f + 
+                            (c0.at<float>(18, 3) * 0.5f + c0.at<float>(18, 2) * 0.5f) * 0.5f;
+    REQUIRE(std::abs(bilinear.sample<float>(c0, -2.5f, 17.5f) - reflected) < 1e-3f);
+    
+    // Huge coordinates terminate, spans agree with single locations
+    std::vector<float> hx(4, 1e9f), hy(4, -3e7f);
+    std::vector<float> h(4);
+    bilinear.sample<float>(channels[0], &hx[0], &hy[0], 4, &h[0]);
+    REQUIRE(h[0] == bilinear.sample<float>(channels[0], 1e9f, -3e7f));
+    
+    // Non-finite coordinates have no reflected pixel and sample as 0
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    const float inf = std::numeric_limits<float>::infinity();
+    const float bad[] = {nan, inf, -inf};
+    
+    std::vector<float> bx, by;
+    for (int i = 0; i < 3; ++i) {
+        bx.push_back(bad[i]); by.push_back(10.f);
+        bx.push_back(10.f);   by.push_back(bad[i]);
+    }
+    
+    const int n = (int)bx.size();
+    std::vector<float> v(n), v3(n * 3, 1.f), vn(n * 3, 1.f);
+    bilinear.sample<float>(channels[0], &bx[0], &by[0], n, &v[0]);
+    bilinear.sample<float>(img, &bx[0], &by[0], n, &v3[0]);
+    nearest.sample<float>(img, &bx[0], &by[0], n, &vn[0]);
+    
+    for (int i = 0; i < n; ++i) {
+        REQUIRE(v[i] == 0.f);
+        REQUIRE(bilinear.sample<float>(channels[0], bx[i], by[i]) == 0.f);
+        REQUIRE(nearest.sample<float>(channels[0], bx[i], by[i]) == 0.f);
+        for (int c = 0; c < 3; ++c) {
+            REQUIRE(v3[i * 3 + c] == 0.f);
+            REQUIRE(vn[i * 3 + c] == 0.f);
+        }
+    }
+}
+
+TEST_CASE("sampling-multi-channel")
+{
+    namespace ia = imagealign;
+    
+    // Private generator, leaves the sequence of cv::theRNG untouched for later tests
+    cv::RNG rng(42);
+    
+    cv::Mat img8(30, 40, CV_8UC3);
+    rng.fill(img8, cv::RNG::UNIFORM, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    cv::Mat img;
+    img8.convertTo(img, CV_32F);
+    
+    std::vector<cv::Mat> channels;
+    cv::split(img, channels);
+    
+    const int n = 100;
+    std::vector<float> xs(n), ys(n);
+    for (int i = 0; i < n; ++i) {
+        xs[i] = rng.uniform(-3.f, 42.f);
+        ys[i] = rng.uniform(-3.f, 32.f);
+    }
+    
+    ia::Sampler<ia::SAMPLE_BILINEAR> bilinear;
+    ia::Sampler<ia::SAMPLE_NEAREST> nearest;
+    
+    std::vector<float> b(n * 3), nn(n * 3);
+    bilinear.sample<float>(img, &xs[0], &ys[0], n, &b[0]);
+    nearest.sample<float>(img, &xs[0], &ys[0], n, &nn[0]);
+    
+    // Channels are interpolated exactly like single channel images
+    for (int i = 0; i < n; ++i) {
+        for (int c = 0; c < 3; ++c) {
+            REQUIRE(b[i * 3 + c] == bilinear.sample<float>(channels[c], xs[i], ys[i]));
+            REQUIRE(nn[i * 3 + c] == nearest.sample<float>(channels[c], xs[i], ys[i]));
+        }
+    }
+}
@@ -21,6 +21,7 @@
 #include "catch.hpp"
 
 #include <imagealign/warp.h>
+#include <imagealign/warp_image.h>
 
 TEST_CASE("warp-translational")
 {
@@ -121,4 +122,82 @@ TEST_CASE("warp-similarity")
     
     REQUIRE(wx(0) == Catch::Detail::Approx(-20.f + 5.f).epsilon(0.01));
     REQUIRE(wx(1) == Catch::Detail::Approx(-30.f + 5.f).epsilon(0.01));
-}
\ No newline at end of file
+}
+
+TEST_CASE("warp-perspective")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpPerspectiveD W;
+    
+    W w;
+    w.setIdentity();
+    
+    REQUIRE(w.numParameters() == 8);
+    REQUIRE(cv::norm(w.parameters(), cv::NORM_INF) == 0);
+    
+    W::Traits::ParamType p;
+    p << 5, -3, 0.1, 0.05, -0.02, 0.2, 0.001, -0.002;
+    w.setParameters(p);
+    
+    REQUIRE(cv::norm(w.parameters() - p, cv::NORM_INF) < 1e-12);
+    
+    // Jacobian agrees with central differences
+    const W::Traits::PointType x(12, -7);
+    const W::Traits::JacobianType j = w.jacobian(x);
+    
+    for (int i = 0; i < 8; ++i) {
+        W wp, wm;
+        W::Traits::ParamType d = W::Traits::ParamType::zeros();
+        d(i) = 1e-6;
+        wp.setParameters(p + d);
+        wm.setParameters(p - d);
+        
+        const W::Traits::PointType fd = (wp(x) - wm(x)) * (1.0 / 2e-6);
+        REQUIRE(fd(0) == Catch::Detail::Approx(j(0, i)).epsilon(1e-4));
+        REQUIRE(fd(1) == Catch::Detail::Approx(j(1, i)).epsilon(1e-4));
+    }
+    
+    // Scaling coordinates commutes with warping
+    const W ws = w.scaled(-1);
+    const W::Traits::PointType wx = w(x);
+    const W::Traits::PointType wsx = ws(x * 0.5);
+    REQUIRE(wsx(0) == Catch::Detail::Approx(wx(0) * 0.5));
+    REQUIRE(wsx(1) == Catch::Detail::Approx(wx(1) * 0.5));
+    
+    // Compositional updates keep the matrix normalized
+    W wc(w);
+    wc.updateInverseCompositional(p);
+    REQUIRE(wc.matrix()(2, 2) == Catch::Detail::Approx(1));
+    
+    wc.updateForwardCompositional(p);
+    REQUIRE(cv::norm(wc.parameters() - w.parameters(), cv::NORM_INF) < 1e-9);
+}
+
+TEST_CASE("warp-image-planar")
+{
+    namespace ia = imagealign;
+    
+    typedef ia::WarpSimilarityF W;
+    
+    cv::Mat src(60, 60, CV_32FC1);
+    cv::randu(src, cv::Scalar::all(0), cv::Scalar::all(255));
+    
+    W w;
+    w.setParametersInCanonicalRepresentation(W::Traits::ParamType(10.f, 12.f, 0.3f, 1.2f));
+    
+    cv::Mat dst;
+    ia::warpImage<float, ia::SAMPLE_BILINEAR>(src, dst, cv::Size(30, 25), w);
+    
+    REQUIRE(dst.rows == 25);
+    REQUIRE(dst.cols == 30);
+    
+    // Row stepping must agree with warping every pixel individually.
+    ia::Sampler<ia::SAMPLE_BILINEAR> s;
+    for (int y = 0; y < dst.rows; ++y) {
+        for (int x = 0; x < dst.cols; ++x) {
+            const float expected = s.sample<float>(src, w(W::Traits::PointType(float(x), float(y))));
+            REQUIRE(dst.at<float>(y, x) == Catch::Detail::Approx(expected).epsilon(0.001));
+        }
+    }
+}